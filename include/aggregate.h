@@ -0,0 +1,32 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <hdf5.h>
+
+/* Datasets in /Perturb that hold one value per time, which differ between
+ * cosmologies, and the grids that all files must share */
+#define AGGREGATE_BACKGROUND_COUNT 8
+#define AGGREGATE_GRID_COUNT 2
+
+int aggregateOutputFiles(const char *out_fname, int n_files, char **fnames);
+
+#endif
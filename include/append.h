@@ -0,0 +1,51 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef APPEND_H
+#define APPEND_H
+
+#include <hdf5.h>
+
+#include "input.h"
+#include "class_transfer.h"
+
+/* Relative tolerance when comparing the grids and the cosmology of the new
+ * functions with those of the existing file */
+#define APPEND_TOLERANCE 1e-10
+
+/* Names under which replaced datasets are written before they are swapped in,
+ * and under which the old ones are kept while they are swapped */
+#define APPEND_TEMP_NAME "Appending"
+#define APPEND_TEMP_OMEGAS "Appending Omegas"
+#define APPEND_BACKUP_NAME "Replaced"
+
+int readStringAttribute(hid_t h_obj, const char *name, char *str,
+                        size_t len);
+int readAttribute(hid_t h_obj, const char *name, hid_t h_type,
+                  void *values, size_t n);
+int replaceAttribute(hid_t h_obj, const char *name, hid_t h_type,
+                     const void *values, size_t n);
+int readTitles(hid_t h_file, int *n_titles, char ***titles);
+void freeTitles(char **titles, int n_titles);
+int valuesMatch(const double *a, const double *b, size_t n);
+int prepareAppend(struct params *pars, const char *fname);
+int append_perturb(struct perturb_data *data, struct params *pars,
+                   struct units *us, char *fname);
+
+#endif
@@ -0,0 +1,92 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Alignment of the buffers, file offsets and lengths for O_DIRECT */
+#define ASYNC_ALIGNMENT 4096
+
+/* Ways of submitting the asynchronous writes */
+enum async_backend {
+    ASYNC_AUTO = 0,   //io_uring if the kernel allows it, else threads
+    ASYNC_URING = 1,  //io_uring, without liburing
+    ASYNC_THREADS = 2 //a pool of threads calling pwrite
+};
+
+/* States of the buffers */
+enum async_state {
+    ASYNC_FREE = 0,    //can be filled
+    ASYNC_QUEUED = 1,  //submitted, waiting for a thread
+    ASYNC_WRITING = 2  //being written
+};
+
+/* An aligned buffer and the part of the file that it is written to */
+struct async_buffer {
+    char *data;
+    size_t length; //bytes to write
+    off_t offset; //position in the file
+    int state; //one of async_state
+    struct iovec iov; //for the io_uring submission
+};
+
+struct uring_state;
+
+/* Sequential writer that keeps up to depth aligned buffers in flight, while
+ * the caller fills the next one */
+struct async_writer {
+    int fd;
+    int buffered_fd; //the same file without O_DIRECT, for unaligned writes
+    int backend; //ASYNC_URING or ASYNC_THREADS
+    int direct; //opened with O_DIRECT?
+    int depth; //number of buffers
+    size_t buffer_size;
+    struct async_buffer *buffers;
+    int next; //the buffer that is handed out next
+    int error; //set when a write failed
+    size_t bytes_written;
+    double start_time;
+    double wait_time; //time spent waiting for free buffers
+
+    /* io_uring backend */
+    struct uring_state *ring;
+
+    /* Thread pool backend, protected by lock */
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int take; //the buffer that the threads take next
+    int queued; //number of queued buffers
+    int stop;
+};
+
+int parseAsyncBackend(const char *str);
+const char *asyncBackendName(int backend);
+int openAsyncWriter(struct async_writer *w, const char *fname, int direct,
+                    int backend, int depth, size_t buffer_size);
+struct async_buffer *asyncGetBuffer(struct async_writer *w);
+int asyncSubmit(struct async_writer *w, struct async_buffer *b);
+int closeAsyncWriter(struct async_writer *w, off_t file_size);
+
+#endif
@@ -23,16 +23,18 @@
 #include <class.h>
 
 #include "input.h"
+#include "extraction.h"
+#include "precision.h"
 
 struct perturb_data {
   int k_size;
   int tau_size;
   int n_functions;
-  double *delta;
+  real_t *delta; //stored in single precision with -DSINGLE_PRECISION
   double *k;
   double *log_tau;
   double *redshift;
-  double *Omega;
+  real_t *Omega;
   double *Omega_m;
   double *Omega_r;
   double *Hubble_H;
@@ -41,11 +43,31 @@ struct perturb_data {
   double *growth_f;
   double *growth_f_prime;
   // char **titles;
+  const struct extraction_plan *plan; //to (re)compute functions on demand
+};
+
+/* Background columns at all sampled conformal times, in CLASS units */
+struct background_batch {
+  size_t tau_size;
+  double *a;
+  double *rho_crit;
+  double *Omega_m;
+  double *Omega_r;
+  double *H;
+  double *H_prime;
+  double *D;
+  double *f;
 };
 
 int readPerturbData(struct perturb_data *data, struct params *pars,
-                    struct units *us, struct perturbations *pt, struct background *ba);
+                    struct extraction_plan *plan, struct units *us,
+                    struct perturbations *pt, struct background *ba);
 int cleanPerturbData(struct perturb_data *data);
+int evaluateBackgroundBatch(struct background_batch *bb, double *rho,
+                            const struct extraction_plan *plan,
+                            struct perturbations *pt, struct background *ba);
+int cleanBackgroundBatch(struct background_batch *bb);
+void unitPowers(const char *title, int *length_power, int *time_power);
 double unitConversionFactor(char *title, double unit_length_factor,
                             double unit_time_factor);
 
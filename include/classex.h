@@ -23,9 +23,24 @@
 #include <stdio.h>
 
 #include "input.h"
+#include "precision.h"
 #include "class_titles.h"
+#include "extraction.h"
 #include "class_transfer.h"
 #include "output.h"
+#include "function_datasets.h"
+#include "append.h"
+#include "file_layout.h"
+#include "swmr.h"
+#include "aggregate.h"
+#include "raw_output.h"
+#include "async_io.h"
+#include "layout.h"
+#include "streaming.h"
+#include "pipeline.h"
+#include "parallel.h"
+#include "compression.h"
+#include "prediction.h"
 #include "derivatives.h"
 
 #define TXT_RED "\033[31;1m"
@@ -0,0 +1,75 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <hdf5.h>
+
+#include "input.h"
+#include "precision.h"
+
+/* Chunking of the transfer function cube in the output file. Every chunk
+ * holds part of a single function, so that reading one function only touches
+ * its own chunks. */
+enum cube_chunking {
+    CHUNK_NONE = 0, //contiguous storage, no filters (default)
+    CHUNK_TAU = 1,  //one function x ChunkSize times x all wavenumbers
+    CHUNK_K = 2     //one function x all times x ChunkSize wavenumbers
+};
+
+/* Lossy storage, rounding the values to the fewest mantissa bits that keep
+ * the error within the bound of each function, which is LossyErrorBound
+ * unless set in LossyErrorBounds. The values keep their storage type, but
+ * the trailing zero bits compress very well with shuffle and deflate. */
+enum lossy_mode {
+    LOSSY_NONE = 0,     //lossless (default)
+    LOSSY_ABSOLUTE = 1, //|error| <= bound, in internal units
+    LOSSY_RELATIVE = 2  //|error| <= bound * |value|
+};
+
+int parseChunking(const char *str);
+const char *chunkingName(int chunking);
+int parseLossyMode(const char *str);
+const char *lossyModeName(int mode);
+int tauAxis(int layout);
+void cubeChunkShape(const struct params *pars, size_t tau_size, size_t k_size,
+                    hsize_t chunk[3]);
+hid_t createCubeProperties(const struct params *pars, size_t tau_size,
+                           size_t k_size);
+hid_t createFunctionProperties(const struct params *pars, size_t tau_size,
+                               size_t k_size);
+int writeCompressionAttributes(hid_t h_data, const struct params *pars,
+                               size_t tau_size, size_t k_size);
+int useDirectChunkWrites(hid_t h_data, const struct params *pars);
+void lossySettings(const struct params *pars, const char *title, int *mode,
+                   double *bound);
+void quantizeFunction(const struct params *pars, const char *title,
+                      const real_t *T, real_t *out, size_t size, size_t stride,
+                      double *max_abs_error, double *max_rel_error);
+int writeLossyAttributes(hid_t h_data, const struct params *pars, char **titles,
+                         int n_functions, const double *max_abs_error,
+                         const double *max_rel_error);
+int updateLossyErrors(hid_t h_data, int n_functions, const double *max_abs_error,
+                      const double *max_rel_error);
+int writeChunksParallel(hid_t h_data, const struct params *pars,
+                        const real_t *block, const hsize_t block_shape[3],
+                        const hsize_t block_start[3]);
+
+#endif
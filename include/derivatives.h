@@ -23,7 +23,35 @@
 #include "input.h"
 #include "class_transfer.h"
 
-int isNewDerivativeTitle(struct params *pars, char *title);
+/* Number of wavenumbers per block when integrating over time */
+#define INTEGRAL_K_BLOCK 32
+
+/* Finite difference stencils for d/dx at every sample point, where x is the
+ * conformal time or ln(k). Also used for quadrature weights of the integral
+ * over the interval that ends at each point. */
+struct fd_stencil {
+    int order; //order of accuracy (2 or 4)
+    int width; //number of points, order + 1
+    size_t N; //number of sample points
+    size_t *first; //first point of the stencil, for each point
+    double *weights; //width weights, for each point
+    double *weights_T; //the same weights as [j][point], for loops over points
+};
+
+int initStencil(struct fd_stencil *st, const double *x, size_t N, int order);
+int initIntegralStencil(struct fd_stencil *st, const double *x, size_t N,
+                        int order);
+int cleanStencil(struct fd_stencil *st);
+void differentiateFunction(const struct fd_stencil *st, const double *T,
+                           double *dT, size_t Nk, const double *factor);
+void timeVariableFactors(const struct perturb_data *data, int variable,
+                         double *factor);
+void integrateFunction(const struct fd_stencil *st, const double *T,
+                       double *I, size_t Nk);
+size_t logarithmicSlope(const struct fd_stencil *st, const double *T,
+                        double *out, size_t Ntau);
+int computeDerivedEntry(const struct perturb_data *data, int index_func,
+                        const double *T, double *out);
 int computeDerivatives(struct perturb_data *data, struct params *pars,
                        struct units *us);
 
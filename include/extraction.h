@@ -0,0 +1,108 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef EXTRACTION_H
+#define EXTRACTION_H
+
+#include <class.h>
+
+#include "input.h"
+#include "class_titles.h"
+#include "precision.h"
+
+struct fd_stencil;
+
+/* Ways in which an exported function is obtained */
+enum entry_type {
+    ENTRY_CLASS, //converted from a CLASS source function
+    ENTRY_DERIVATIVE, //time derivative of another entry
+    ENTRY_K_DERIVATIVE, //logarithmic slope in k of another entry
+    ENTRY_INTEGRAL //cumulative conformal time integral of another entry
+};
+
+/* Time variables of derivatives, with the suffix of their titles */
+enum time_variable {
+    TIME_CONFORMAL, //d/dtau, "_prime"
+    TIME_LOG_A, //d/dln(a), "_dloga"
+    TIME_REDSHIFT, //d/dz, "_dz"
+    TIME_COSMIC //d/dt, "_dt"
+};
+
+/* One exported function, with everything needed to compute it */
+struct extraction_entry {
+    int type; //one of entry_type
+    const double *source; //CLASS source function, stored as [tau][k]
+    double scale; //unit conversion factor from CLASS to internal units
+    int ba_index; //CLASS background index (-1 if there is none)
+    int parent; //index of the entry that it is derived from (or -1)
+    int variable; //one of time_variable, for derivatives
+    int depth; //number of derivatives or integrals taken of a CLASS function
+    size_t offset; //offset in data->delta, or among the intermediates
+    char *title; //owned by the plan
+};
+
+/* The extraction plan is compiled once, after matching the titles. It lists
+ * all exported functions, in the order of the output: first the n_class
+ * functions from CLASS, then the derived functions. These n_entries functions
+ * are followed by the intermediates of chained derivatives that were not
+ * requested, up to n_total. */
+struct extraction_plan {
+    int n_entries;
+    int n_class;
+    int n_total;
+    size_t k_size;
+    size_t tau_size;
+    struct extraction_entry *entries;
+
+    /* The derived entries, in an order that respects their dependencies */
+    int n_schedule;
+    int *schedule;
+    int max_depth;
+
+    /* Wavenumbers in 1/U_L */
+    double *k;
+
+    /* Conformal times in U_T and the stencils for time derivatives */
+    double *tau;
+    struct fd_stencil *stencil;
+
+    /* The stencils in ln(k) for wavenumber derivatives */
+    struct fd_stencil *k_stencil;
+
+    /* Quadrature weights for time integrals */
+    struct fd_stencil *integral_stencil;
+
+    /* CLASS to internal units conversion factors */
+    double unit_length_factor;
+    double unit_time_factor;
+};
+
+int compileExtractionPlan(struct extraction_plan *plan, struct params *pars,
+                          struct class_titles *cat, struct units *us,
+                          struct perturbations *pt);
+int executeExtractionPlan(const struct extraction_plan *plan, double *delta);
+int extractFunctions(const struct extraction_plan *plan, int first, int count,
+                     double *dest);
+int extractTimes(const struct extraction_plan *plan, int index_func,
+                 size_t first_tau, size_t n_tau, real_t *dest);
+void entryUnits(const struct extraction_plan *plan, int index,
+                int *length_power, int *time_power);
+int cleanExtractionPlan(struct extraction_plan *plan);
+
+#endif
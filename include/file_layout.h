@@ -0,0 +1,34 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef FILE_LAYOUT_H
+#define FILE_LAYOUT_H
+
+#include <hdf5.h>
+
+#include "input.h"
+
+/* Number of file-space pages that readers buffer in the benchmark */
+#define BENCHMARK_PAGE_BUFFER 4
+
+hid_t createFileCreationProperties(const struct params *pars);
+hid_t createFileAccessProperties(const struct params *pars);
+int benchmarkOutputFile(const char *fname, const struct params *pars);
+
+#endif
@@ -0,0 +1,44 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef FUNCTION_DATASETS_H
+#define FUNCTION_DATASETS_H
+
+#include <hdf5.h>
+
+#include "input.h"
+#include "class_transfer.h"
+
+/* Name of the group with one dataset per function, in the /Perturb group */
+#define FUNCTIONS_GROUP "Functions"
+
+void formatUnits(int length_power, int time_power, char *str, size_t len);
+int validDatasetName(const char *title);
+int createVirtualCube(hid_t h_grp, const char *cube_name,
+                      const struct params *pars, char **titles,
+                      int n_functions, size_t tau_size, size_t k_size);
+int addFunctionDatasets(hid_t h_fgrp, const struct perturb_data *data,
+                        struct params *pars, const struct units *us,
+                        int first_index, double *max_abs_error,
+                        double *max_rel_error);
+int writeFunctionDatasets(hid_t h_grp, const struct perturb_data *data,
+                          struct params *pars, const struct units *us,
+                          double *max_abs_error, double *max_rel_error);
+
+#endif
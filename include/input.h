@@ -40,12 +40,38 @@ struct params {
 
     /* Output parameters */
     char *OutputFilename;
+    int OutputFormat; //file format of the output (hdf5 or raw)
+    int Append; //add the functions that are missing to an existing output file?
+    int DirectIO; //write raw output with O_DIRECT and asynchronous writes?
+    int IOBackend; //submit the writes with io_uring or a pool of threads
+    double IOBufferMB; //size of each of the aligned output buffers
+    int IODepth; //number of output buffers, i.e. writes in flight
+    double StripeSizeMB; //file space page size, matching the stripes of a parallel filesystem (0 = off)
+    int BenchmarkOutput; //number of cold opens and reads of the output file to time
+    int SWMR; //write the cube in blocks of times that readers can follow (SWMR)?
     char **DesiredFunctions; //titles of columns that need to be exported
     int *ClassPerturbIndices; //the corresponding CLASS perturb indices
     int *ClassBackgroundIndices; //the CLASS indices of some background quantities
     int NumDesiredFunctions; //the number of requested functions
     int MatchedFunctions; //the number of functions with data
     int MatchedWithBackground; //# of matched f's that also have a bg quantity
+    int Layout; //ordering of the transfer function cube in the output file
+    int FunctionDatasets; //one dataset per function, with a virtual cube?
+    int Streaming; //compute and write one block of functions at a time?
+    double MemoryBudgetMB; //memory available for blocks in streaming mode
+    int Pipeline; //overlap computing and writing the blocks with a writer thread?
+    int PipelineDepth; //number of blocks in the queue of the writer thread
+    int Chunking; //chunking of the transfer function cube (none, tau or k)
+    int ChunkSize; //number of times or wavenumbers per chunk (0 = all)
+    int Shuffle; //use the shuffle filter?
+    int DeflateLevel; //deflate compression level (0 = no compression)
+    int LossyMode; //lossy storage (none, absolute or relative error bound)
+    double LossyErrorBound; //maximum error of the lossy storage
+    char **LossyBoundTitles; //titles of the functions with their own lossy settings
+    int *LossyBoundModes; //the corresponding lossy modes
+    double *LossyBounds; //the corresponding error bounds
+    int NumLossyBounds; //the number of functions with their own lossy settings
+    int Prediction; //predictive filter along tau (none, linear or quadratic)
 
     /* Parameters transferred from CLASS */
     int N_ncdm; //number of non-cold dark matter species (neutrinos)
@@ -54,6 +80,9 @@ struct params {
     double T_CMB; //temperature in U_T
     double h; //Hubble parameter
 
+    /* Order of accuracy of the finite difference time derivatives */
+    int DerivativeOrder;
+
     /* Parameter used in derivative checks (does not affect output) */
     double DerivativeCheckTol;
 
@@ -0,0 +1,45 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+
+#include "precision.h"
+
+/* Tile size (in elements) of the cache-blocked transpose */
+#define LAYOUT_TILE_SIZE 32
+
+/* Orderings of the transfer function cube in the output file. In memory,
+ * data->delta is always stored as [function][tau][k]. */
+enum cube_layout {
+    LAYOUT_FTK = 0, //[function][tau][k] (default)
+    LAYOUT_FKT = 1, //[function][k][tau]
+    LAYOUT_TKF = 2  //[tau][k][function]
+};
+
+int parseLayout(const char *str);
+const char *layoutName(int layout);
+void layoutShape(int layout, size_t n_functions, size_t tau_size,
+                 size_t k_size, size_t shape[3]);
+int transposeCube(const real_t *in, real_t *out, int layout,
+                  size_t n_functions, size_t tau_size, size_t k_size);
+
+#endif
@@ -24,6 +24,22 @@
 
 #include "class_transfer.h"
 
+/* File formats of the output */
+enum output_format {
+    FORMAT_HDF5 = 0, //HDF5 file (default)
+    FORMAT_RAW = 1   //memory-mappable raw file, see raw_format.h
+};
+
+int parseOutputFormat(const char *str);
+const char *outputFormatName(int format);
+
+int writeCube(hid_t h_data, struct perturb_data *data, struct params *pars,
+              int offset, double *max_abs_error, double *max_rel_error);
+int writeCubeAttributes(hid_t h_data, const struct params *pars, char **titles,
+                        int n_functions, size_t tau_size, size_t k_size,
+                        const double *max_abs_error,
+                        const double *max_rel_error);
+
 int write_perturb(struct perturb_data *data, struct params *pars,
                   struct units *us, char *fname);
 
@@ -0,0 +1,45 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <hdf5.h>
+
+#include "input.h"
+
+/* Support for running classex on several MPI ranks, which requires building
+ * with -DWITH_MPI against a parallel HDF5 library (see 'make mpi'). Every
+ * rank runs CLASS, but only extracts and writes its own range of functions.
+ * Without MPI, these functions describe a single rank. */
+
+int initParallel(int *argc, char ***argv);
+int finalizeParallel(void);
+int parallelRank(void);
+int parallelSize(void);
+void functionRange(int n_functions, int rank, int size, int *first, int *count);
+int maxOverRanks(int value);
+void reduceMaxOverRanks(double *values, int n);
+double wallTime(void);
+hid_t createOutputFile(const char *fname, const struct params *pars);
+hid_t openOutputFile(const char *fname, const struct params *pars);
+hid_t createTransferProperties(void);
+void closeTransferProperties(hid_t h_xfer);
+
+#endif
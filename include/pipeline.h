@@ -0,0 +1,61 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "precision.h"
+
+/* One block of consecutive functions, in the order of the output layout */
+struct queued_block {
+    int first; //index of the first function in the block
+    int count; //number of functions in the block (0 marks the end)
+    real_t *data; //the values, owned by the queue
+};
+
+/* Bounded single-producer single-consumer queue of blocks. The slots and
+ * their buffers are allocated once. The producer fills the slot at tail and
+ * the consumer drains the slot at head; the two indices are only ever
+ * advanced by their owner. A side that finds the queue full or empty raises
+ * its waiting flag and sleeps on a condition variable, which the other side
+ * only signals when it sees the flag as it advances its index. */
+struct block_queue {
+    size_t capacity; //number of slots
+    struct queued_block *slots;
+    atomic_size_t head; //number of blocks released by the consumer
+    atomic_size_t tail; //number of blocks published by the producer
+    atomic_int error; //set by the consumer if a block could not be written
+    atomic_int producer_waiting; //the producer sleeps until head advances
+    atomic_int consumer_waiting; //the consumer sleeps until tail advances
+    pthread_mutex_t lock; //only taken to sleep on or signal changed
+    pthread_cond_t changed; //signalled when a waiting side can continue
+};
+
+int initBlockQueue(struct block_queue *q, size_t capacity, size_t block_size);
+struct queued_block *queueReserve(struct block_queue *q, double *wait_time);
+void queuePublish(struct block_queue *q);
+struct queued_block *queuePeek(struct block_queue *q, double *wait_time);
+void queueRelease(struct block_queue *q);
+void cleanBlockQueue(struct block_queue *q);
+
+#endif
@@ -0,0 +1,38 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef PRECISION_H
+#define PRECISION_H
+
+/* Storage precision of the transfer function cube and the background
+ * densities, both in memory and in the output file. All computations are
+ * done in double precision and the results are rounded once when stored.
+ * Compile with -DSINGLE_PRECISION to halve the memory and the file size. */
+#ifdef SINGLE_PRECISION
+typedef float real_t;
+#define H5T_NATIVE_REAL H5T_NATIVE_FLOAT
+#else
+typedef double real_t;
+#define H5T_NATIVE_REAL H5T_NATIVE_DOUBLE
+#endif
+
+/* Are the functions stored in the double precision of the computations? */
+#define REAL_IS_DOUBLE (sizeof(real_t) == sizeof(double))
+
+#endif
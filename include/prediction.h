@@ -0,0 +1,66 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef PREDICTION_H
+#define PREDICTION_H
+
+#include <stddef.h>
+#include <hdf5.h>
+
+/* Identifier of the predictive filter. Values from 32768 upwards are reserved
+ * by the HDF Group for filters that are not distributed with HDF5. */
+#define H5Z_FILTER_PREDICTIVE 32768
+
+/* The filter predicts each value from the previous values along the tau axis
+ * of the chunk, stores the difference between the value and its prediction,
+ * and then shuffles and deflates these residuals. It is lossless. */
+enum prediction_mode {
+    PREDICT_NONE = 0,     //use the standard shuffle and deflate filters (default)
+    PREDICT_LINEAR = 1,   //extrapolate the previous two values
+    PREDICT_QUADRATIC = 2 //extrapolate the previous three values
+};
+
+/* The parameters (cd_values) of the filter. The first three are set by the
+ * user and the others by the filter itself, when the dataset is created. */
+enum prediction_parameter {
+    PREDICT_CD_MODE = 0,   //the prediction mode
+    PREDICT_CD_AXIS = 1,   //the tau axis of the chunks
+    PREDICT_CD_LEVEL = 2,  //the deflate level
+    PREDICT_CD_SIZE = 3,   //the size of the elements (4 or 8 bytes)
+    PREDICT_CD_RANK = 4,   //the number of chunk dimensions
+    PREDICT_CD_DIMS = 5    //the chunk dimensions
+};
+
+#define PREDICT_CD_USER 3
+#define PREDICT_CD_MAX (PREDICT_CD_DIMS + H5S_MAX_RANK)
+
+extern const H5Z_class2_t H5Z_PREDICTIVE[1];
+
+int parsePrediction(const char *str);
+const char *predictionName(int mode);
+int registerPredictiveFilter(void);
+size_t predictiveBound(size_t nbytes);
+size_t predictiveEncode(size_t cd_nelmts, const unsigned int cd_values[],
+                        const void *in, size_t nbytes, void *out,
+                        size_t out_size);
+size_t predictiveDecode(size_t cd_nelmts, const unsigned int cd_values[],
+                        const void *in, size_t nbytes, void *out,
+                        size_t out_size);
+
+#endif
@@ -0,0 +1,237 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+/* Memory-mappable raw output format of classex.
+ *
+ * This header is self-contained (it depends only on the C library and POSIX)
+ * so that it can be copied into other codes that read the raw files. A file
+ * starts with a fixed struct raw_header, followed by the arrays listed in
+ * enum raw_array. Each array starts at a multiple of RAW_ALIGNMENT bytes, so
+ * that after mapping the file, all arrays can be used in place without any
+ * copying. Numbers are stored in the byte order of the machine that wrote
+ * the file, which the reader checks with endian_check.
+ *
+ * Example:
+ *
+ *     struct raw_perturb raw;
+ *     if (openRawPerturb(&raw, "perturb.raw") != 0) exit(1);
+ *     const double *k = rawArray(&raw, RAW_K);
+ *     int index_func = rawFindFunction(&raw, "d_cdm");
+ *     double T = rawTransferValue(&raw, index_func, index_tau, index_k);
+ *     closeRawPerturb(&raw);
+ */
+
+#ifndef RAW_FORMAT_H
+#define RAW_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RAW_MAGIC "CLASSEX"
+#define RAW_VERSION 1
+#define RAW_ENDIAN_CHECK 0x01020304
+#define RAW_ALIGNMENT 64
+#define RAW_NAME_LENGTH 64
+
+/* The arrays in the file, in the order in which they are stored */
+enum raw_array {
+    RAW_TITLES = 0,         //char [n_functions][title_length], NUL-padded
+    RAW_K = 1,              //double [k_size], wavenumbers in 1/U_L
+    RAW_LOG_TAU = 2,        //double [tau_size], log conformal times in U_T
+    RAW_REDSHIFT = 3,       //double [tau_size]
+    RAW_OMEGA_M = 4,        //double [tau_size]
+    RAW_OMEGA_R = 5,        //double [tau_size]
+    RAW_HUBBLE_H = 6,       //double [tau_size]
+    RAW_HUBBLE_H_PRIME = 7, //double [tau_size]
+    RAW_GROWTH_D = 8,       //double [tau_size]
+    RAW_GROWTH_F = 9,       //double [tau_size]
+    RAW_GROWTH_F_PRIME = 10,//double [tau_size]
+    RAW_M_NCDM = 11,        //double [n_ncdm], masses in eV
+    RAW_T_NCDM = 12,        //double [n_ncdm], temperatures in units of T_CMB
+    RAW_DELTA = 13,         //real [3 dimensions in the given layout]
+    RAW_OMEGA = 14,         //real [n_functions][tau_size]
+    RAW_N_ARRAYS = 15
+};
+
+/* Orderings of the transfer function cube (as enum cube_layout) */
+enum raw_layout {
+    RAW_LAYOUT_FTK = 0, //[function][tau][k]
+    RAW_LAYOUT_FKT = 1, //[function][k][tau]
+    RAW_LAYOUT_TKF = 2  //[tau][k][function]
+};
+
+/* The header at the start of every file (512 bytes) */
+struct raw_header {
+    char magic[8]; //RAW_MAGIC, NUL-terminated
+    uint32_t version; //RAW_VERSION
+    uint32_t endian_check; //RAW_ENDIAN_CHECK in the byte order of the file
+    uint32_t header_size; //sizeof(struct raw_header)
+    uint32_t real_size; //bytes per value of delta and Omega (4 or 8)
+    uint32_t layout; //one of raw_layout
+    uint32_t title_length; //bytes per function title, including NULs
+    uint64_t k_size;
+    uint64_t tau_size;
+    uint64_t n_functions;
+    uint64_t n_ncdm;
+    uint64_t file_size; //total size of the file in bytes
+
+    /* The internal unit system */
+    double unit_mass_cgs;
+    double unit_length_cgs;
+    double unit_time_cgs;
+    double unit_temperature_cgs;
+
+    /* Cosmological parameters */
+    double h;
+    double Omega_m;
+    double Omega_b;
+    double Omega_lambda;
+    double Omega_k;
+    double Omega_ur;
+    double T_CMB; //in U_T
+
+    char name[RAW_NAME_LENGTH]; //name of the simulation, NUL-terminated
+
+    /* Location of the arrays in bytes from the start of the file */
+    uint64_t offset[RAW_N_ARRAYS];
+    uint64_t size[RAW_N_ARRAYS];
+
+    char padding[48];
+};
+
+_Static_assert(sizeof(struct raw_header) == 512, "unexpected raw header size");
+
+/* A mapped raw file */
+struct raw_perturb {
+    const struct raw_header *header;
+    void *map;
+    size_t map_size;
+};
+
+/* Round up a byte offset to the next aligned position */
+static inline uint64_t rawAlign(uint64_t offset) {
+    return (offset + RAW_ALIGNMENT - 1) / RAW_ALIGNMENT * RAW_ALIGNMENT;
+}
+
+/* Map a raw file read-only and check its header. Returns 0 on success. */
+static inline int openRawPerturb(struct raw_perturb *raw, const char *fname) {
+    raw->header = NULL;
+    raw->map = NULL;
+    raw->map_size = 0;
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct raw_header)) {
+        close(fd);
+        return 2;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 3;
+
+    const struct raw_header *h = map;
+    int err = 0;
+    if (memcmp(h->magic, RAW_MAGIC, sizeof(RAW_MAGIC)) != 0) err = 4;
+    else if (h->endian_check != RAW_ENDIAN_CHECK) err = 5;
+    else if (h->version != RAW_VERSION) err = 6;
+    else if (h->header_size != sizeof(struct raw_header)) err = 7;
+    else if (h->file_size > (uint64_t) st.st_size) err = 8;
+    for (int i=0; i<RAW_N_ARRAYS && !err; i++) {
+        if (h->offset[i] % RAW_ALIGNMENT != 0 ||
+            h->offset[i] + h->size[i] > h->file_size) {
+            err = 8;
+        }
+    }
+
+    if (err) {
+        munmap(map, st.st_size);
+        return err;
+    }
+
+    raw->header = h;
+    raw->map = map;
+    raw->map_size = st.st_size;
+    return 0;
+}
+
+static inline void closeRawPerturb(struct raw_perturb *raw) {
+    if (raw->map != NULL) {
+        munmap(raw->map, raw->map_size);
+    }
+    raw->header = NULL;
+    raw->map = NULL;
+    raw->map_size = 0;
+}
+
+/* Pointer to one of the arrays in the mapped file */
+static inline const void *rawArray(const struct raw_perturb *raw, int array) {
+    return (const char *) raw->map + raw->header->offset[array];
+}
+
+/* Title of the transfer function with the given index */
+static inline const char *rawTitle(const struct raw_perturb *raw, int index_func) {
+    return (const char *) rawArray(raw, RAW_TITLES) +
+           (size_t) index_func * raw->header->title_length;
+}
+
+/* Index of the transfer function with the given title (-1 if not found) */
+static inline int rawFindFunction(const struct raw_perturb *raw, const char *title) {
+    for (uint64_t i=0; i<raw->header->n_functions; i++) {
+        if (strcmp(rawTitle(raw, i), title) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Position of T(index_tau, index_k) of a function in the RAW_DELTA array */
+static inline size_t rawIndex(const struct raw_perturb *raw, size_t index_func,
+                              size_t index_tau, size_t index_k) {
+    const struct raw_header *h = raw->header;
+    if (h->layout == RAW_LAYOUT_FKT) {
+        return (index_func * h->k_size + index_k) * h->tau_size + index_tau;
+    } else if (h->layout == RAW_LAYOUT_TKF) {
+        return (index_tau * h->k_size + index_k) * h->n_functions + index_func;
+    } else {
+        return (index_func * h->tau_size + index_tau) * h->k_size + index_k;
+    }
+}
+
+/* Value of a transfer function, regardless of the layout and precision */
+static inline double rawTransferValue(const struct raw_perturb *raw,
+                                      size_t index_func, size_t index_tau,
+                                      size_t index_k) {
+    const size_t i = rawIndex(raw, index_func, index_tau, index_k);
+    const void *delta = rawArray(raw, RAW_DELTA);
+    if (raw->header->real_size == sizeof(float)) {
+        return ((const float *) delta)[i];
+    } else {
+        return ((const double *) delta)[i];
+    }
+}
+
+#endif
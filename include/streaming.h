@@ -0,0 +1,40 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include <hdf5.h>
+
+#include "input.h"
+#include "class_transfer.h"
+
+int computeFunctionSlab(const struct perturb_data *data, struct params *pars,
+                        int index_func, double *slab, double *scratch);
+double *allocateWorkspace(const struct perturb_data *data);
+int storeFunctionsWith(const struct perturb_data *data, struct params *pars,
+                       int first, int count, real_t *dest, double *work);
+int storeFunctions(const struct perturb_data *data, struct params *pars,
+                   int first, int count, real_t *dest);
+int streamingBlockSize(const struct perturb_data *data, struct params *pars);
+int writeCubeStreaming(hid_t h_data, const struct perturb_data *data,
+                       struct params *pars, int offset, double *max_abs_error,
+                       double *max_rel_error);
+
+#endif
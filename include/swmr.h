@@ -0,0 +1,40 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef SWMR_H
+#define SWMR_H
+
+#include <hdf5.h>
+
+#include "input.h"
+#include "class_transfer.h"
+
+/* Number of times per flushed block, unless ChunkSize sets it */
+#define SWMR_DEFAULT_TIMES 16
+
+/* Attribute of the cube with the number of times that can be read */
+#define SWMR_PROGRESS_ATTRIBUTE "Times written"
+
+hid_t createGrowingCube(hid_t h_grp, const struct params *pars,
+                        size_t n_functions, size_t tau_size, size_t k_size);
+int writeCubeSWMR(hid_t h_file, hid_t h_data, struct perturb_data *data,
+                  struct params *pars, double *max_abs_error,
+                  double *max_rel_error);
+
+#endif
@@ -0,0 +1,37 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+/* HDF5 plugin for the predictive filter, so that programs other than classex
+ * can read transfer functions stored with Prediction = linear or quadratic.
+ * Put the directory with the library on HDF5_PLUGIN_PATH, e.g.
+ *
+ *   export HDF5_PLUGIN_PATH=/path/to/classex/plugin
+ *
+ * after which h5dump, h5py, etc. decode the chunks transparently. */
+
+#include <H5PLextern.h>
+#include "../include/prediction.h"
+
+H5PL_type_t H5PLget_plugin_type(void) {
+    return H5PL_TYPE_FILTER;
+}
+
+const void *H5PLget_plugin_info(void) {
+    return H5Z_PREDICTIVE;
+}
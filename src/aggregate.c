@@ -0,0 +1,607 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include "../include/aggregate.h"
+#include "../include/append.h"
+#include "../include/layout.h"
+
+static const char *background_names[AGGREGATE_BACKGROUND_COUNT] = {
+    "Redshifts", "Omega matter", "Omega radiation", "Hubble rates",
+    "Hubble rate conformal time derivatives", "Growth factors (D)",
+    "Logarithmic growth rates (f)",
+    "Logarithmic growth rate conformal derivatives (f')"};
+
+static const char *grid_names[AGGREGATE_GRID_COUNT] = {
+    "Wavenumbers", "Log conformal times"};
+
+static const char *unit_names[4] = {
+    "Unit mass in cgs (U_M)", "Unit length in cgs (U_L)",
+    "Unit time in cgs (U_t)", "Unit temperature in cgs (U_T)"};
+
+/* One of the files that are aggregated */
+struct source_file {
+    char path[PATH_MAX]; //path of the file relative to the aggregate file
+    char name[DEFAULT_STRING_LENGTH]; //name of the simulation
+    int *order; //index in this file of each function of the aggregate
+    int reordered; //are the functions in another order than in the first file?
+};
+
+/* Everything that all files must have in common, taken from the first */
+struct common_grid {
+    int k_size;
+    int tau_size;
+    int n_functions;
+    int layout;
+    char **titles;
+    hid_t h_type; //storage type of the transfer functions
+    double units[4];
+    double *grids[AGGREGATE_GRID_COUNT];
+};
+
+/* The path to the file fname, relative to the directory dir, so that the
+ * aggregate keeps working when the files are moved together. HDF5 looks for
+ * relative source files in the directory of the virtual dataset file. */
+static int relativePath(const char *dir, const char *fname, char *path,
+                        size_t len) {
+    char target[PATH_MAX];
+    if (realpath(fname, target) == NULL) return 1;
+    if (strcmp(dir, "/") == 0) {
+        return snprintf(path, len, "%s", target + 1) >= (int) len;
+    }
+
+    /* The longest common directory of the two */
+    size_t common = 0;
+    for (size_t i = 0; dir[i] != '\0' && dir[i] == target[i]; i++) {
+        if (dir[i + 1] == '\0' && target[i + 1] == '/') common = i + 1;
+        else if (dir[i] == '/') common = i;
+    }
+
+    /* Go up from dir to the common directory, then down to the file */
+    size_t used = 0;
+    path[0] = '\0';
+    for (const char *c = dir + common; *c != '\0'; c++) {
+        if (*c == '/') used += snprintf(path + used, len - used, "../");
+        if (used >= len) return 1;
+    }
+    used += snprintf(path + used, len - used, "%s", target + common + 1);
+
+    return used >= len;
+}
+
+/* Read the grid, the functions and the storage of the first file */
+static int readCommonGrid(hid_t h_file, struct common_grid *grid,
+                          const char *fname) {
+    int err = 0;
+    char str[DEFAULT_STRING_LENGTH];
+
+    hid_t h_grp = H5Gopen(h_file, "/Header", H5P_DEFAULT);
+    err |= readAttribute(h_grp, "k_size", H5T_NATIVE_INT, &grid->k_size, 1);
+    err |= readAttribute(h_grp, "tau_size", H5T_NATIVE_INT, &grid->tau_size, 1);
+    for (int i=0; i<4; i++) {
+        err |= readAttribute(h_grp, unit_names[i], H5T_NATIVE_DOUBLE, &grid->units[i], 1);
+    }
+    H5Gclose(h_grp);
+    err |= readTitles(h_file, &grid->n_functions, &grid->titles);
+    if (err) {
+        printf("Error: could not read the header of '%s'.\n", fname);
+        return 1;
+    }
+
+    /* Files without a recorded layout were written before there was a choice */
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    if (h_data < 0) {
+        printf("Error: '%s' does not contain any transfer functions.\n", fname);
+        return 1;
+    }
+    grid->layout = LAYOUT_FTK;
+    if (readStringAttribute(h_data, "Layout", str, DEFAULT_STRING_LENGTH) == 0) {
+        grid->layout = parseLayout(str);
+    }
+    grid->h_type = H5Dget_type(h_data);
+    H5Dclose(h_data);
+    if (grid->layout < 0) {
+        printf("Error: '%s' has the unknown layout '%s'.\n", fname, str);
+        return 1;
+    }
+
+    const size_t sizes[AGGREGATE_GRID_COUNT] = {grid->k_size, grid->tau_size};
+    for (int i=0; i<AGGREGATE_GRID_COUNT; i++) {
+        grid->grids[i] = malloc(sizes[i] * sizeof(double));
+        h_grp = H5Gopen(h_file, "/Perturb", H5P_DEFAULT);
+        h_data = H5Dopen(h_grp, grid_names[i], H5P_DEFAULT);
+        err |= (H5Dread(h_data, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+                        H5P_DEFAULT, grid->grids[i]) < 0);
+        H5Dclose(h_data);
+        H5Gclose(h_grp);
+    }
+    if (err) printf("Error: could not read the grids of '%s'.\n", fname);
+
+    return err;
+}
+
+static void cleanCommonGrid(struct common_grid *grid) {
+    freeTitles(grid->titles, grid->n_functions);
+    if (grid->h_type > 0) H5Tclose(grid->h_type);
+    for (int i=0; i<AGGREGATE_GRID_COUNT; i++) {
+        free(grid->grids[i]);
+    }
+}
+
+/* The cosmological parameters of every file, one column per attribute of
+ * the /Cosmology group of the first file */
+struct parameter_table {
+    int n_columns;
+    char **names;
+    int *counts; //number of values per file, e.g. one per ncdm species
+    double **values; //the counts[c] values of every file in column c
+};
+
+static herr_t addColumn(hid_t h_obj, const char *name, const H5A_info_t *info,
+                        void *arg) {
+    struct parameter_table *table = arg;
+    const int c = table->n_columns++;
+    table->names = realloc(table->names, table->n_columns * sizeof(char*));
+    table->counts = realloc(table->counts, table->n_columns * sizeof(int));
+    table->names[c] = malloc(strlen(name) + 1);
+    strcpy(table->names[c], name);
+
+    hid_t h_attr = H5Aopen(h_obj, name, H5P_DEFAULT);
+    hid_t h_space = H5Aget_space(h_attr);
+    table->counts[c] = H5Sget_simple_extent_npoints(h_space);
+    H5Sclose(h_space);
+    H5Aclose(h_attr);
+
+    return 0;
+}
+
+/* Set up the columns of the table from the first file */
+static int initParameterTable(hid_t h_file, struct parameter_table *table,
+                              int n_files) {
+    memset(table, 0, sizeof(*table));
+
+    hid_t h_grp = H5Gopen(h_file, "/Cosmology", H5P_DEFAULT);
+    if (h_grp < 0) return 1;
+    herr_t h_err = H5Aiterate2(h_grp, H5_INDEX_NAME, H5_ITER_NATIVE, NULL,
+                               addColumn, table);
+    H5Gclose(h_grp);
+
+    table->values = malloc(table->n_columns * sizeof(double*));
+    for (int c=0; c<table->n_columns; c++) {
+        table->values[c] = malloc(n_files * table->counts[c] * sizeof(double));
+    }
+
+    return h_err < 0;
+}
+
+/* Fill in the row of the parameter table of file index */
+static int readParameters(hid_t h_file, struct parameter_table *table,
+                          int index, const char *fname) {
+    hid_t h_grp = H5Gopen(h_file, "/Cosmology", H5P_DEFAULT);
+    int err = (h_grp < 0);
+
+    for (int c=0; c<table->n_columns && !err; c++) {
+        const int count = table->counts[c];
+        err = readAttribute(h_grp, table->names[c], H5T_NATIVE_DOUBLE,
+                            table->values[c] + index * count, count);
+        if (err) {
+            printf("Error: '%s' does not have the parameter '%s' with %d value(s).\n",
+                   fname, table->names[c], count);
+        }
+    }
+
+    if (h_grp >= 0) H5Gclose(h_grp);
+
+    return err;
+}
+
+static void cleanParameterTable(struct parameter_table *table) {
+    for (int c=0; c<table->n_columns; c++) {
+        free(table->names[c]);
+        free(table->values[c]);
+    }
+    free(table->names);
+    free(table->counts);
+    free(table->values);
+}
+
+/* Is the file on the same grid, with the same functions, stored in the same
+ * way as the first file? The functions may be in another order. */
+static int checkSourceFile(hid_t h_file, const struct common_grid *grid,
+                           struct source_file *src, const char *fname) {
+    int err = 0;
+
+    /* The grid sizes and the units */
+    hid_t h_grp = H5Gopen(h_file, "/Header", H5P_DEFAULT);
+    int k_size = -1, tau_size = -1;
+    readAttribute(h_grp, "k_size", H5T_NATIVE_INT, &k_size, 1);
+    readAttribute(h_grp, "tau_size", H5T_NATIVE_INT, &tau_size, 1);
+    if (k_size != grid->k_size || tau_size != grid->tau_size) {
+        printf("Error: '%s' has %d wavenumbers and %d times, but the first file has %d and %d.\n",
+               fname, k_size, tau_size, grid->k_size, grid->tau_size);
+        err = 1;
+    }
+
+    for (int i=0; i<4 && !err; i++) {
+        double unit = 0.;
+        readAttribute(h_grp, unit_names[i], H5T_NATIVE_DOUBLE, &unit, 1);
+        if (!valuesMatch(&unit, &grid->units[i], 1)) {
+            printf("Error: '%s' in '%s' does not match.\n", unit_names[i], fname);
+            err = 1;
+        }
+    }
+
+    snprintf(src->name, DEFAULT_STRING_LENGTH, "%s", "");
+    readStringAttribute(h_grp, "Name", src->name, DEFAULT_STRING_LENGTH);
+    H5Gclose(h_grp);
+    if (err) return err;
+
+    /* The wavenumbers and times themselves */
+    const size_t sizes[AGGREGATE_GRID_COUNT] = {grid->k_size, grid->tau_size};
+    h_grp = H5Gopen(h_file, "/Perturb", H5P_DEFAULT);
+    for (int i=0; i<AGGREGATE_GRID_COUNT && !err; i++) {
+        double *values = malloc(sizes[i] * sizeof(double));
+        hid_t h_data = H5Dopen(h_grp, grid_names[i], H5P_DEFAULT);
+        err = (h_data < 0 || H5Dread(h_data, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+                                     H5P_DEFAULT, values) < 0);
+        if (h_data >= 0) H5Dclose(h_data);
+        if (err || !valuesMatch(values, grid->grids[i], sizes[i])) {
+            printf("Error: '%s' in '%s' does not match.\n", grid_names[i], fname);
+            err = 1;
+        }
+        free(values);
+    }
+    H5Gclose(h_grp);
+    if (err) return err;
+
+    /* The same functions, possibly in another order */
+    int n_titles = 0;
+    char **titles = NULL;
+    if (readTitles(h_file, &n_titles, &titles) != 0) {
+        printf("Error: could not read the function titles of '%s'.\n", fname);
+        return 1;
+    }
+
+    src->order = malloc(grid->n_functions * sizeof(int));
+    src->reordered = 0;
+    err = (n_titles != grid->n_functions);
+    for (int i=0; i<grid->n_functions && !err; i++) {
+        src->order[i] = -1;
+        for (int j=0; j<n_titles; j++) {
+            if (strcmp(grid->titles[i], titles[j]) == 0) src->order[i] = j;
+        }
+        err = (src->order[i] < 0);
+        src->reordered |= (src->order[i] != i);
+    }
+    freeTitles(titles, n_titles);
+    if (err) {
+        printf("Error: '%s' does not have the same functions as the first file.\n", fname);
+        return err;
+    }
+
+    /* The transfer functions must be complete and stored in the same way */
+    char str[DEFAULT_STRING_LENGTH];
+    int layout = LAYOUT_FTK;
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    if (h_data < 0) {
+        printf("Error: '%s' does not contain any transfer functions.\n", fname);
+        return 1;
+    }
+    if (readStringAttribute(h_data, "Layout", str, DEFAULT_STRING_LENGTH) == 0) {
+        layout = parseLayout(str);
+    }
+    hid_t h_type = H5Dget_type(h_data);
+    hid_t h_space = H5Dget_space(h_data);
+    hsize_t dims[3] = {0, 0, 0};
+    size_t shape[3];
+    layoutShape(grid->layout, grid->n_functions, grid->tau_size, grid->k_size, shape);
+    H5Sget_simple_extent_dims(h_space, dims, NULL);
+
+    if (layout != grid->layout) {
+        printf("Error: '%s' has the layout '%s', but the first file has '%s'.\n",
+               fname, layoutName(layout), layoutName(grid->layout));
+        err = 1;
+    } else if (H5Tequal(h_type, grid->h_type) <= 0) {
+        printf("Error: '%s' stores the transfer functions with another type than the first file.\n",
+               fname);
+        err = 1;
+    } else if (dims[0] != shape[0] || dims[1] != shape[1] || dims[2] != shape[2]) {
+        printf("Error: the transfer functions in '%s' are incomplete.\n", fname);
+        err = 1;
+    }
+
+    H5Sclose(h_space);
+    H5Tclose(h_type);
+    H5Dclose(h_data);
+
+    return err;
+}
+
+/* Create the virtual dataset name in the group h_grp, which stacks the
+ * dataset /Perturb/name of every file along a new leading cosmology axis.
+ * The source datasets have the given rank and dimensions. Functions along
+ * the axis func_axis of the source (-1 if there is none) are put in the
+ * order of the first file, mapping them one at a time for files in which
+ * they are in another order. No data is copied. */
+static int createStackedDataset(hid_t h_grp, const char *name, hid_t h_type,
+                                int rank, const hsize_t *dims, int func_axis,
+                                const struct source_file *files, int n_files) {
+    hsize_t vdims[4] = {n_files, 0, 0, 0};
+    for (int i=0; i<rank; i++) {
+        vdims[i + 1] = dims[i];
+    }
+    hid_t h_vspace = H5Screate_simple(rank + 1, vdims, NULL);
+    hid_t h_sspace = H5Screate_simple(rank, dims, NULL);
+
+    char source[256];
+    snprintf(source, sizeof(source), "/Perturb/%s", name);
+
+    hid_t h_prop = H5Pcreate(H5P_DATASET_CREATE);
+    herr_t h_err = 0;
+    for (int f=0; f<n_files && h_err >= 0; f++) {
+        const int n_maps = (func_axis >= 0 && files[f].reordered) ? dims[func_axis] : 1;
+
+        for (int j=0; j<n_maps && h_err >= 0; j++) {
+            hsize_t start[4] = {f, 0, 0, 0};
+            hsize_t count[4] = {1, 1, 1, 1};
+            hsize_t source_start[3] = {0, 0, 0};
+            hsize_t source_count[3];
+            for (int i=0; i<rank; i++) {
+                count[i + 1] = dims[i];
+                source_count[i] = dims[i];
+            }
+
+            /* A single function, taken from its position in the file */
+            if (n_maps > 1) {
+                start[func_axis + 1] = j;
+                count[func_axis + 1] = 1;
+                source_start[func_axis] = files[f].order[j];
+                source_count[func_axis] = 1;
+            }
+
+            H5Sselect_hyperslab(h_vspace, H5S_SELECT_SET, start, NULL, count, NULL);
+            H5Sselect_hyperslab(h_sspace, H5S_SELECT_SET, source_start, NULL,
+                                source_count, NULL);
+            h_err = H5Pset_virtual(h_prop, h_vspace, files[f].path, source, h_sspace);
+            if (h_err < 0) printf("Error while mapping '%s' to the virtual dataset.\n", files[f].path);
+        }
+    }
+
+    hid_t h_data = -1;
+    if (h_err >= 0) {
+        H5Sselect_all(h_vspace);
+        h_data = H5Dcreate(h_grp, name, h_type, h_vspace, H5P_DEFAULT, h_prop,
+                           H5P_DEFAULT);
+        if (h_data < 0) printf("Error while creating dataspace '%s'.\n", name);
+        H5Dclose(h_data);
+    }
+
+    H5Pclose(h_prop);
+    H5Sclose(h_sspace);
+    H5Sclose(h_vspace);
+
+    return h_data < 0;
+}
+
+/* Write the aggregate file: the common header, the table of cosmological
+ * parameters, the shared grids and the virtual datasets */
+static int writeAggregate(const char *out_fname, const struct common_grid *grid,
+                          const struct source_file *files, int n_files,
+                          const struct parameter_table *table) {
+    hid_t h_file = H5Fcreate(out_fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (h_file < 0) {
+        printf("Error while opening file '%s'.\n", out_fname);
+        return 1;
+    }
+
+    int err = 0;
+
+    /* The header, with the files and their names along the cosmology axis */
+    hid_t h_grp = H5Gcreate(h_file, "/Header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    err |= replaceAttribute(h_grp, "n_cosmologies", H5T_NATIVE_INT, &n_files, 1);
+    err |= replaceAttribute(h_grp, "k_size", H5T_NATIVE_INT, &grid->k_size, 1);
+    err |= replaceAttribute(h_grp, "tau_size", H5T_NATIVE_INT, &grid->tau_size, 1);
+    err |= replaceAttribute(h_grp, "n_functions", H5T_NATIVE_INT, &grid->n_functions, 1);
+    for (int i=0; i<4; i++) {
+        err |= replaceAttribute(h_grp, unit_names[i], H5T_NATIVE_DOUBLE, &grid->units[i], 1);
+    }
+
+    const char **paths = malloc(n_files * sizeof(char*));
+    const char **names = malloc(n_files * sizeof(char*));
+    for (int f=0; f<n_files; f++) {
+        paths[f] = files[f].path;
+        names[f] = files[f].name;
+    }
+    hid_t h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, H5T_VARIABLE);
+    err |= replaceAttribute(h_grp, "FunctionTitles", h_type, grid->titles, grid->n_functions);
+    err |= replaceAttribute(h_grp, "Files", h_type, paths, n_files);
+    err |= replaceAttribute(h_grp, "Names", h_type, names, n_files);
+    H5Tclose(h_type);
+    free(paths);
+    free(names);
+    H5Gclose(h_grp);
+
+    /* The parameter table: one dataset per parameter, with a row per file */
+    h_grp = H5Gcreate(h_file, "/Cosmology", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    for (int c=0; c<table->n_columns; c++) {
+        hsize_t dims[2] = {n_files, table->counts[c]};
+        hid_t h_space = H5Screate_simple(table->counts[c] > 1 ? 2 : 1, dims, NULL);
+        hid_t h_data = H5Dcreate(h_grp, table->names[c], H5T_NATIVE_DOUBLE, h_space,
+                                 H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        err |= (H5Dwrite(h_data, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                         table->values[c]) < 0);
+        H5Dclose(h_data);
+        H5Sclose(h_space);
+    }
+    H5Gclose(h_grp);
+
+    h_grp = H5Gcreate(h_file, "/Perturb", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+    /* The shared grids are small, so they are simply written */
+    const hsize_t sizes[AGGREGATE_GRID_COUNT] = {grid->k_size, grid->tau_size};
+    for (int i=0; i<AGGREGATE_GRID_COUNT; i++) {
+        hid_t h_space = H5Screate_simple(1, &sizes[i], NULL);
+        hid_t h_data = H5Dcreate(h_grp, grid_names[i], H5T_NATIVE_DOUBLE, h_space,
+                                 H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        err |= (H5Dwrite(h_data, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                         grid->grids[i]) < 0);
+        H5Dclose(h_data);
+        H5Sclose(h_space);
+    }
+
+    /* The background quantities, as [cosmology][tau] */
+    const hsize_t tau_dims[1] = {grid->tau_size};
+    for (int i=0; i<AGGREGATE_BACKGROUND_COUNT; i++) {
+        err |= createStackedDataset(h_grp, background_names[i], H5T_NATIVE_DOUBLE,
+                                    1, tau_dims, -1, files, n_files);
+    }
+
+    /* The background densities, as [cosmology][function][tau] */
+    const hsize_t Omega_dims[2] = {grid->n_functions, grid->tau_size};
+    err |= createStackedDataset(h_grp, "Omegas", grid->h_type, 2, Omega_dims,
+                                0, files, n_files);
+
+    /* The transfer functions, as [cosmology][function][tau][k] in the
+     * default layout, or with the layout of the files after the first axis */
+    size_t shape[3];
+    layoutShape(grid->layout, grid->n_functions, grid->tau_size, grid->k_size, shape);
+    const hsize_t cube_dims[3] = {shape[0], shape[1], shape[2]};
+    const int func_axis = (grid->layout == LAYOUT_TKF) ? 2 : 0;
+    err |= createStackedDataset(h_grp, "Transfer functions", grid->h_type, 3,
+                                cube_dims, func_axis, files, n_files);
+
+    /* Record the layout of the last three axes */
+    hid_t h_data = H5Dopen(h_grp, "Transfer functions", H5P_DEFAULT);
+    if (h_data >= 0) {
+        const char *layout_name = layoutName(grid->layout);
+        hid_t h_space = H5Screate(H5S_SCALAR);
+        h_type = H5Tcopy(H5T_C_S1);
+        H5Tset_size(h_type, strlen(layout_name));
+        hid_t h_attr = H5Acreate1(h_data, "Layout", h_type, h_space, H5P_DEFAULT);
+        err |= (H5Awrite(h_attr, h_type, layout_name) < 0);
+        H5Aclose(h_attr);
+        H5Tclose(h_type);
+        H5Sclose(h_space);
+        H5Dclose(h_data);
+    }
+
+    H5Gclose(h_grp);
+    H5Fclose(h_file);
+
+    return err;
+}
+
+/* Aggregate the n_files classex output files fnames into the file out_fname,
+ * which contains virtual datasets that refer to the data in those files.
+ * The transfer functions are exposed as one dataset with a leading
+ * cosmology axis, [cosmology][function][tau][k] in the default layout, and
+ * the cosmological parameters as a table with a row per file. All files
+ * must share the wavenumbers, times, units, functions and storage type,
+ * which is verified first. Source files are referred to relative to the
+ * directory of the aggregate file. */
+int aggregateOutputFiles(const char *out_fname, int n_files, char **fnames) {
+    if (n_files < 1) {
+        printf("Error: there are no files to aggregate.\n");
+        return 1;
+    }
+
+    /* The directory of the aggregate file, which must exist */
+    char out_copy[PATH_MAX], out_dir[PATH_MAX];
+    snprintf(out_copy, PATH_MAX, "%s", out_fname);
+    if (realpath(dirname(out_copy), out_dir) == NULL) {
+        printf("Error: the directory of '%s' does not exist.\n", out_fname);
+        return 1;
+    }
+
+    /* The aggregate may not exist yet, so its canonical path is that of its
+     * directory followed by its name. It must not replace one of the files. */
+    char out_path[PATH_MAX], in_path[PATH_MAX];
+    snprintf(out_copy, PATH_MAX, "%s", out_fname);
+    const char *out_base = basename(out_copy);
+    if (snprintf(out_path, PATH_MAX, "%s/%s", strcmp(out_dir, "/") == 0 ? "" : out_dir,
+                 out_base) >= PATH_MAX) {
+        printf("Error: the path of '%s' is too long.\n", out_fname);
+        return 1;
+    }
+    for (int f=0; f<n_files; f++) {
+        if (realpath(fnames[f], in_path) != NULL && strcmp(in_path, out_path) == 0) {
+            printf("Error: the aggregate file '%s' is also one of the input files.\n",
+                   out_fname);
+            return 1;
+        }
+    }
+
+    struct source_file *files = calloc(n_files, sizeof(struct source_file));
+    struct common_grid grid;
+    struct parameter_table table;
+    memset(&grid, 0, sizeof(grid));
+    memset(&table, 0, sizeof(table));
+    int err = 0;
+
+    for (int f=0; f<n_files && !err; f++) {
+        hid_t h_file = H5Fopen(fnames[f], H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (h_file < 0) {
+            printf("Error while opening file '%s'.\n", fnames[f]);
+            err = 1;
+            break;
+        }
+
+        /* The first file sets the grid and the parameters to tabulate */
+        if (f == 0) {
+            err = readCommonGrid(h_file, &grid, fnames[f]);
+            if (!err && initParameterTable(h_file, &table, n_files) != 0) {
+                printf("Error: could not read the cosmology of '%s'.\n", fnames[f]);
+                err = 1;
+            }
+        }
+
+        if (!err) err = checkSourceFile(h_file, &grid, &files[f], fnames[f]);
+        if (!err) err = readParameters(h_file, &table, f, fnames[f]);
+        if (!err && relativePath(out_dir, fnames[f], files[f].path, PATH_MAX) != 0) {
+            printf("Error: could not locate '%s'.\n", fnames[f]);
+            err = 1;
+        }
+
+        H5Fclose(h_file);
+    }
+
+    if (!err) {
+        err = writeAggregate(out_fname, &grid, files, n_files, &table);
+        if (err) printf("Error while writing the aggregate file '%s'.\n", out_fname);
+    }
+
+    if (!err) {
+        printf("Aggregated %d files with %d functions, %d times and %d wavenumbers into '%s'.\n",
+               n_files, grid.n_functions, grid.tau_size, grid.k_size, out_fname);
+    }
+
+    for (int f=0; f<n_files; f++) {
+        free(files[f].order);
+    }
+    free(files);
+    cleanCommonGrid(&grid);
+    cleanParameterTable(&table);
+
+    return err;
+}
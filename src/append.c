@@ -0,0 +1,805 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "../include/append.h"
+#include "../include/output.h"
+#include "../include/layout.h"
+#include "../include/compression.h"
+#include "../include/prediction.h"
+#include "../include/parallel.h"
+#include "../include/function_datasets.h"
+
+/* Read a fixed-length string attribute */
+int readStringAttribute(hid_t h_obj, const char *name, char *str,
+                        size_t len) {
+    if (H5Aexists(h_obj, name) <= 0) return 1;
+
+    hid_t h_attr = H5Aopen(h_obj, name, H5P_DEFAULT);
+    hid_t h_type = H5Aget_type(h_attr);
+    char *buffer = calloc(H5Tget_size(h_type) + 1, 1);
+    herr_t h_err = H5Aread(h_attr, h_type, buffer);
+    snprintf(str, len, "%s", buffer);
+    free(buffer);
+    H5Tclose(h_type);
+    H5Aclose(h_attr);
+
+    return h_err < 0;
+}
+
+/* Read an attribute of n values of the given memory type */
+int readAttribute(hid_t h_obj, const char *name, hid_t h_type,
+                  void *values, size_t n) {
+    if (H5Aexists(h_obj, name) <= 0) return 1;
+
+    hid_t h_attr = H5Aopen(h_obj, name, H5P_DEFAULT);
+    hid_t h_space = H5Aget_space(h_attr);
+    int err = (H5Sget_simple_extent_npoints(h_space) != n);
+    if (!err) err = (H5Aread(h_attr, h_type, values) < 0);
+    H5Sclose(h_space);
+    H5Aclose(h_attr);
+
+    return err;
+}
+
+/* Replace an attribute by one with n values of the given memory type */
+int replaceAttribute(hid_t h_obj, const char *name, hid_t h_type,
+                     const void *values, size_t n) {
+    if (H5Aexists(h_obj, name) > 0) H5Adelete(h_obj, name);
+
+    hsize_t dim[1] = {n};
+    hid_t h_space = H5Screate_simple(1, dim, NULL);
+    hid_t h_attr = H5Acreate1(h_obj, name, h_type, h_space, H5P_DEFAULT);
+    herr_t h_err = H5Awrite(h_attr, h_type, values);
+    H5Aclose(h_attr);
+    H5Sclose(h_space);
+
+    return h_err < 0;
+}
+
+/* Read the variable-length strings of the attribute h_attr into new copies */
+static int readStrings(hid_t h_attr, int *n_titles, char ***titles) {
+    hid_t h_space = H5Aget_space(h_attr);
+    const int n = H5Sget_simple_extent_npoints(h_space);
+    hid_t h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, H5T_VARIABLE);
+
+    char **buffer = malloc(n * sizeof(char*));
+    char **copies = malloc(n * sizeof(char*));
+    herr_t h_err = -1;
+    if (n > 0 && (buffer == NULL || copies == NULL)) {
+        printf("Error: could not allocate memory for %d titles.\n", n);
+    } else {
+        h_err = H5Aread(h_attr, h_type, buffer);
+    }
+
+    /* Keep our own copies of the strings */
+    if (h_err >= 0) {
+        int copied = 0;
+        while (copied < n && (copies[copied] = malloc(strlen(buffer[copied]) + 1)) != NULL) {
+            strcpy(copies[copied], buffer[copied]);
+            copied++;
+        }
+        H5Dvlen_reclaim(h_type, h_space, H5P_DEFAULT, buffer);
+
+        if (copied < n) {
+            printf("Error: could not allocate memory for %d titles.\n", n);
+            freeTitles(copies, copied);
+            h_err = -1;
+        } else {
+            *titles = copies;
+            *n_titles = n;
+        }
+    } else {
+        free(copies);
+    }
+
+    free(buffer);
+    H5Tclose(h_type);
+    H5Sclose(h_space);
+
+    return h_err < 0;
+}
+
+/* Read the titles of the functions in the file from the header */
+int readTitles(hid_t h_file, int *n_titles, char ***titles) {
+    hid_t h_attr = H5Aopen_by_name(h_file, "/Header", "FunctionTitles",
+                                   H5P_DEFAULT, H5P_DEFAULT);
+    if (h_attr < 0) return 1;
+
+    int err = readStrings(h_attr, n_titles, titles);
+    H5Aclose(h_attr);
+
+    return err;
+}
+
+void freeTitles(char **titles, int n_titles) {
+    for (int i=0; i<n_titles; i++) {
+        free(titles[i]);
+    }
+    free(titles);
+}
+
+/* Replace the titles of the functions in the header group h_grp */
+static int writeTitles(hid_t h_grp, char **titles, int n_titles) {
+    hid_t h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, H5T_VARIABLE);
+    int err = replaceAttribute(h_grp, "FunctionTitles", h_type, titles, n_titles);
+    H5Tclose(h_type);
+
+    return err;
+}
+
+/* Store the new functions in the same way as the existing ones, using the
+ * layout and the storage settings recorded as attributes of the cube */
+static int adoptStorageSettings(hid_t h_data, struct params *pars) {
+    char str[DEFAULT_STRING_LENGTH];
+    int err = 0;
+
+    err |= readStringAttribute(h_data, "Layout", str, DEFAULT_STRING_LENGTH);
+    if (!err) err = ((pars->Layout = parseLayout(str)) < 0);
+    err |= readStringAttribute(h_data, "Chunking", str, DEFAULT_STRING_LENGTH);
+    if (!err) err = ((pars->Chunking = parseChunking(str)) < 0);
+    err |= readStringAttribute(h_data, "Prediction", str, DEFAULT_STRING_LENGTH);
+    if (!err) err = ((pars->Prediction = parsePrediction(str)) < 0);
+    err |= readAttribute(h_data, "Shuffle", H5T_NATIVE_INT, &pars->Shuffle, 1);
+    err |= readAttribute(h_data, "Deflate level", H5T_NATIVE_INT,
+                         &pars->DeflateLevel, 1);
+    if (err) return err;
+
+    /* The size of the chunks along the chunked axis */
+    pars->ChunkSize = 0;
+    if (pars->Chunking != CHUNK_NONE) {
+        hsize_t chunk[3];
+        err = readAttribute(h_data, "Chunk shape", H5T_NATIVE_HSIZE, chunk, 3);
+        if (err) return err;
+
+        const int layout = pars->Layout;
+        const int tau_axis = (layout == LAYOUT_FKT) ? 2 : (layout == LAYOUT_TKF) ? 0 : 1;
+        const int k_axis = (layout == LAYOUT_FTK) ? 2 : 1;
+        pars->ChunkSize = chunk[(pars->Chunking == CHUNK_TAU) ? tau_axis : k_axis];
+    }
+
+    /* The lossy settings are only recorded for lossy files */
+    pars->LossyMode = LOSSY_NONE;
+    if (readStringAttribute(h_data, "Lossy mode", str, DEFAULT_STRING_LENGTH) == 0) {
+        err = ((pars->LossyMode = parseLossyMode(str)) < 0);
+        err |= readAttribute(h_data, "Lossy error bound", H5T_NATIVE_DOUBLE,
+                             &pars->LossyErrorBound, 1);
+    }
+
+    return err;
+}
+
+/* Keep the lossy settings of the n_titles functions in the file, as recorded
+ * in the attributes of the cube h_data, ahead of the settings of the new
+ * functions. Files without these attributes use the global settings. */
+static int adoptLossyBounds(hid_t h_data, struct params *pars, char **titles,
+                            int n_titles) {
+    if (H5Aexists(h_data, "Lossy modes") <= 0) return 0;
+
+    int n_modes = 0;
+    char **modes = NULL;
+    hid_t h_attr = H5Aopen(h_data, "Lossy modes", H5P_DEFAULT);
+    int err = (h_attr < 0) || readStrings(h_attr, &n_modes, &modes);
+    if (h_attr >= 0) H5Aclose(h_attr);
+    if (err) return 1;
+
+    const int n_total = pars->NumLossyBounds + n_titles;
+    double *bounds = malloc(n_titles * sizeof(double));
+    char **all_titles = calloc(n_total, sizeof(char *));
+    int *all_modes = malloc(n_total * sizeof(int));
+    double *all_bounds = malloc(n_total * sizeof(double));
+    err = (n_modes != n_titles || bounds == NULL || all_titles == NULL ||
+           all_modes == NULL || all_bounds == NULL);
+    if (!err) {
+        err = readAttribute(h_data, "Lossy error bounds", H5T_NATIVE_DOUBLE,
+                            bounds, n_titles);
+    }
+
+    for (int i=0; i<n_titles && !err; i++) {
+        all_modes[i] = parseLossyMode(modes[i]);
+        all_bounds[i] = bounds[i];
+        all_titles[i] = malloc(strlen(titles[i]) + 1);
+        err = (all_modes[i] < 0 || all_titles[i] == NULL);
+        if (!err) strcpy(all_titles[i], titles[i]);
+    }
+
+    if (!err) {
+        for (int i=0; i<pars->NumLossyBounds; i++) {
+            all_titles[n_titles + i] = pars->LossyBoundTitles[i];
+            all_modes[n_titles + i] = pars->LossyBoundModes[i];
+            all_bounds[n_titles + i] = pars->LossyBounds[i];
+        }
+        free(pars->LossyBoundTitles);
+        free(pars->LossyBoundModes);
+        free(pars->LossyBounds);
+        pars->LossyBoundTitles = all_titles;
+        pars->LossyBoundModes = all_modes;
+        pars->LossyBounds = all_bounds;
+        pars->NumLossyBounds = n_total;
+    } else {
+        for (int i=0; i<n_titles && all_titles != NULL; i++) {
+            free(all_titles[i]);
+        }
+        free(all_titles);
+        free(all_modes);
+        free(all_bounds);
+    }
+
+    freeTitles(modes, n_modes);
+    free(bounds);
+
+    return err;
+}
+
+/* Can the new functions be added to the file? This requires a cube that can
+ * be extended along the function axis, or one dataset per function, with
+ * values of the precision that classex was built with. */
+static int checkExtendible(hid_t h_data, struct params *pars,
+                           const char *fname) {
+    hid_t h_type = H5Dget_type(h_data);
+    const size_t size = H5Tget_size(h_type);
+    H5Tclose(h_type);
+    if (size != sizeof(real_t)) {
+        printf("Error: '%s' stores %zu-byte values, but classex was built for %zu-byte values.\n",
+               fname, size, sizeof(real_t));
+        return 1;
+    }
+
+    if (pars->FunctionDatasets) {
+        if (parallelSize() > 1) {
+            printf("Error: appending function datasets is not supported with MPI.\n");
+            return 1;
+        }
+        if (pars->Pipeline) {
+            printf("WARNING: pipelined output is not supported with function datasets.\n");
+            pars->Pipeline = 0;
+        }
+        return 0;
+    }
+
+    hsize_t dims[3], max_dims[3];
+    hid_t h_space = H5Dget_space(h_data);
+    H5Sget_simple_extent_dims(h_space, dims, max_dims);
+    H5Sclose(h_space);
+
+    if (max_dims[(pars->Layout == LAYOUT_TKF) ? 2 : 0] != H5S_UNLIMITED) {
+        printf("Error: the transfer functions in '%s' cannot be extended. Only chunked files and files with function datasets can be appended to.\n",
+               fname);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Prepare to append to the output file fname, before anything is computed.
+ * The layout and storage settings of the file replace those of the
+ * parameter file, and functions that are already in the file are removed
+ * from the desired functions, so that only the new ones are computed. If
+ * the file does not exist yet, it is written as usual. */
+int prepareAppend(struct params *pars, const char *fname) {
+    if (access(fname, F_OK) != 0) {
+        printf("The output file '%s' does not exist yet, creating it.\n", fname);
+        pars->Append = 0;
+        return 0;
+    }
+
+    hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (h_file < 0) {
+        printf("Error while opening file '%s'.\n", fname);
+        return 1;
+    }
+
+    int err = 0;
+    hid_t h_grp = H5Gopen(h_file, "/Perturb", H5P_DEFAULT);
+    hid_t h_data = -1;
+    if (h_grp >= 0 && H5Lexists(h_grp, "Transfer functions", H5P_DEFAULT) > 0) {
+        h_data = H5Dopen(h_grp, "Transfer functions", H5P_DEFAULT);
+    }
+    if (h_data < 0) {
+        printf("Error: '%s' does not contain any transfer functions.\n", fname);
+        err = 1;
+    }
+
+    if (!err && adoptStorageSettings(h_data, pars) != 0) {
+        printf("Error: could not read the storage settings of '%s'.\n", fname);
+        err = 1;
+    }
+
+    if (!err) {
+        pars->FunctionDatasets = (H5Lexists(h_grp, FUNCTIONS_GROUP, H5P_DEFAULT) > 0);
+        err = checkExtendible(h_data, pars, fname);
+    }
+
+    int n_titles = 0;
+    char **titles = NULL;
+    if (!err && readTitles(h_file, &n_titles, &titles) != 0) {
+        printf("Error: could not read the function titles of '%s'.\n", fname);
+        err = 1;
+    }
+
+    if (!err && pars->LossyMode != LOSSY_NONE &&
+        adoptLossyBounds(h_data, pars, titles, n_titles) != 0) {
+        printf("Error: could not read the lossy settings of '%s'.\n", fname);
+        freeTitles(titles, n_titles);
+        err = 1;
+    }
+
+    if (h_data >= 0) H5Dclose(h_data);
+    if (h_grp >= 0) H5Gclose(h_grp);
+    H5Fclose(h_file);
+    if (err) return 1;
+
+    /* Only keep the functions that are not yet in the file */
+    const int n_desired = pars->NumDesiredFunctions;
+    int n_new = 0;
+    for (int i=0; i<n_desired; i++) {
+        int present = 0;
+        for (int j=0; j<n_titles && !present; j++) {
+            present = (strcmp(pars->DesiredFunctions[i], titles[j]) == 0);
+        }
+
+        if (present) {
+            free(pars->DesiredFunctions[i]);
+        } else {
+            pars->DesiredFunctions[n_new++] = pars->DesiredFunctions[i];
+        }
+    }
+    pars->NumDesiredFunctions = n_new;
+    freeTitles(titles, n_titles);
+
+    printf("Appending to '%s', which has %d functions: %d of the %d requested functions are new.\n",
+           fname, n_titles, n_new, n_desired);
+    printf("Using the layout '%s' and the storage settings of the file.\n",
+           layoutName(pars->Layout));
+
+    return 0;
+}
+
+/* Do the values a and b agree within the tolerance? */
+int valuesMatch(const double *a, const double *b, size_t n) {
+    for (size_t i=0; i<n; i++) {
+        const double scale = fmax(fabs(a[i]), fabs(b[i]));
+        if (fabs(a[i] - b[i]) > APPEND_TOLERANCE * scale) return 0;
+    }
+    return 1;
+}
+
+/* Compare n values of an attribute, or of a dataset, in the file with ours */
+static int checkValues(hid_t h_obj, const char *name, int is_dataset,
+                       const double *values, size_t n, const char *fname) {
+    double *file_values = malloc(n * sizeof(double));
+    int err = 0;
+
+    if (is_dataset) {
+        hid_t h_data = H5Dopen(h_obj, name, H5P_DEFAULT);
+        hid_t h_space = H5Dget_space(h_data);
+        err = (h_data < 0 || H5Sget_simple_extent_npoints(h_space) != n);
+        if (!err) err = (H5Dread(h_data, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+                                 H5P_DEFAULT, file_values) < 0);
+        if (h_space >= 0) H5Sclose(h_space);
+        if (h_data >= 0) H5Dclose(h_data);
+    } else {
+        err = readAttribute(h_obj, name, H5T_NATIVE_DOUBLE, file_values, n);
+    }
+
+    if (err) {
+        printf("Error: could not read '%s' from '%s'.\n", name, fname);
+    } else if (!valuesMatch(file_values, values, n)) {
+        printf("Error: '%s' in '%s' does not match.\n", name, fname);
+        err = 1;
+    }
+
+    free(file_values);
+
+    return err;
+}
+
+/* Are the new functions on the same grid, in the same units and for the
+ * same cosmology as the functions in the file? */
+static int checkCompatible(hid_t h_file, const struct perturb_data *data,
+                           const struct params *pars, const struct units *us,
+                           const char *fname) {
+    int err = 0;
+
+    /* The grid sizes and the units */
+    hid_t h_grp = H5Gopen(h_file, "/Header", H5P_DEFAULT);
+    int k_size = -1, tau_size = -1;
+    readAttribute(h_grp, "k_size", H5T_NATIVE_INT, &k_size, 1);
+    readAttribute(h_grp, "tau_size", H5T_NATIVE_INT, &tau_size, 1);
+    if (k_size != data->k_size || tau_size != data->tau_size) {
+        printf("Error: '%s' has %d wavenumbers and %d times, but the new functions have %d and %d.\n",
+               fname, k_size, tau_size, data->k_size, data->tau_size);
+        H5Gclose(h_grp);
+        return 1;
+    }
+
+    const double unit_mass_cgs = us->UnitMassKilogram * 1000;
+    const double unit_length_cgs = us->UnitLengthMetres * 100;
+    const double unit_time_cgs = us->UnitTimeSeconds;
+    const double unit_temperature_cgs = us->UnitTemperatureKelvin;
+    err |= checkValues(h_grp, "Unit mass in cgs (U_M)", 0, &unit_mass_cgs, 1, fname);
+    err |= checkValues(h_grp, "Unit length in cgs (U_L)", 0, &unit_length_cgs, 1, fname);
+    err |= checkValues(h_grp, "Unit time in cgs (U_t)", 0, &unit_time_cgs, 1, fname);
+    err |= checkValues(h_grp, "Unit temperature in cgs (U_T)", 0,
+                       &unit_temperature_cgs, 1, fname);
+    H5Gclose(h_grp);
+
+    /* The wavenumbers and times themselves */
+    h_grp = H5Gopen(h_file, "/Perturb", H5P_DEFAULT);
+    err |= checkValues(h_grp, "Wavenumbers", 1, data->k, data->k_size, fname);
+    err |= checkValues(h_grp, "Log conformal times", 1, data->log_tau,
+                       data->tau_size, fname);
+    H5Gclose(h_grp);
+
+    /* The cosmological parameters */
+    h_grp = H5Gopen(h_file, "/Cosmology", H5P_DEFAULT);
+    err |= checkValues(h_grp, "T_CMB (U_T)", 0, &pars->T_CMB, 1, fname);
+    err |= checkValues(h_grp, "h", 0, &pars->h, 1, fname);
+    err |= checkValues(h_grp, "Omega_lambda", 0, &pars->Omega_lambda, 1, fname);
+    err |= checkValues(h_grp, "Omega_k", 0, &pars->Omega_k, 1, fname);
+    err |= checkValues(h_grp, "Omega_m", 0, &pars->Omega_m, 1, fname);
+    err |= checkValues(h_grp, "Omega_b", 0, &pars->Omega_b, 1, fname);
+    err |= checkValues(h_grp, "Omega_ur", 0, &pars->Omega_ur, 1, fname);
+
+    int N_ncdm = -1;
+    readAttribute(h_grp, "N_ncdm", H5T_NATIVE_INT, &N_ncdm, 1);
+    if (N_ncdm != pars->N_ncdm) {
+        printf("Error: '%s' has %d ncdm species, but the new functions have %d.\n",
+               fname, N_ncdm, pars->N_ncdm);
+        err = 1;
+    } else if (N_ncdm > 0) {
+        err |= checkValues(h_grp, "M_ncdm (eV)", 0, pars->M_ncdm_eV, N_ncdm, fname);
+        err |= checkValues(h_grp, "T_ncdm (T_CMB)", 0, pars->T_ncdm, N_ncdm, fname);
+    }
+    H5Gclose(h_grp);
+
+    return err;
+}
+
+/* Replace the object linked as name in h_grp by the one linked as temp_name.
+ * The old object is kept under a backup name until the new one is in place,
+ * and restored if it cannot be. The new object is then removed instead. */
+static herr_t replaceLink(hid_t h_grp, const char *temp_name, const char *name) {
+    herr_t h_err = H5Lmove(h_grp, name, h_grp, APPEND_BACKUP_NAME, H5P_DEFAULT,
+                           H5P_DEFAULT);
+    if (h_err < 0) {
+        printf("Error while removing '%s'.\n", name);
+        H5Ldelete(h_grp, temp_name, H5P_DEFAULT);
+        return h_err;
+    }
+
+    h_err = H5Lmove(h_grp, temp_name, h_grp, name, H5P_DEFAULT, H5P_DEFAULT);
+    if (h_err < 0) {
+        printf("Error while renaming '%s' to '%s'.\n", temp_name, name);
+        H5Lmove(h_grp, APPEND_BACKUP_NAME, h_grp, name, H5P_DEFAULT, H5P_DEFAULT);
+        H5Ldelete(h_grp, temp_name, H5P_DEFAULT);
+        return h_err;
+    }
+
+    if (H5Ldelete(h_grp, APPEND_BACKUP_NAME, H5P_DEFAULT) < 0) {
+        printf("WARNING: could not remove the replaced '%s'.\n", name);
+    }
+
+    return h_err;
+}
+
+/* Write the background densities of the n_old existing functions, followed
+ * by those of the new functions, to a new dataset temp_name, which replaces
+ * the existing one once the rest of the file has been updated */
+static int appendOmegas(hid_t h_grp, const struct perturb_data *data,
+                        int n_old, const char *temp_name) {
+    const size_t tau_size = data->tau_size;
+    const size_t n_total = n_old + data->n_functions;
+
+    real_t *Omega = malloc(n_total * tau_size * sizeof(real_t));
+    if (Omega == NULL) {
+        printf("Error: could not allocate memory for the background densities.\n");
+        return 1;
+    }
+
+    hid_t h_data = H5Dopen(h_grp, "Omegas", H5P_DEFAULT);
+    herr_t h_err = -1;
+    if (h_data >= 0) {
+        h_err = H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL,
+                        H5P_DEFAULT, Omega);
+        H5Dclose(h_data);
+    }
+    if (h_err < 0) {
+        printf("Error while reading data array '%s'.\n", "Omegas");
+        free(Omega);
+        return 1;
+    }
+    memcpy(Omega + n_old * tau_size, data->Omega,
+           data->n_functions * tau_size * sizeof(real_t));
+
+    hsize_t shape_Omega[2] = {n_total, tau_size};
+    hid_t h_space = H5Screate_simple(2, shape_Omega, NULL);
+    h_data = H5Dcreate(h_grp, temp_name, H5T_NATIVE_REAL, h_space,
+                       H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (h_data >= 0) {
+        h_err = H5Dwrite(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL,
+                         H5P_DEFAULT, Omega);
+        H5Dclose(h_data);
+    } else {
+        h_err = -1;
+    }
+    H5Sclose(h_space);
+    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->Omega");
+
+    free(Omega);
+
+    return h_err < 0;
+}
+
+/* Remove the datasets of the new functions that a failed append left in
+ * the group h_fgrp */
+static void removeFunctionDatasets(hid_t h_fgrp, char **titles, int n_titles) {
+    for (int i=0; i<n_titles; i++) {
+        if (H5Lexists(h_fgrp, titles[i], H5P_DEFAULT) > 0) {
+            H5Ldelete(h_fgrp, titles[i], H5P_DEFAULT);
+        }
+    }
+}
+
+/* Append the transfer functions of data to the existing output file fname,
+ * which was prepared with prepareAppend. The new functions are written
+ * behind the existing ones, either by extending the chunked cube along the
+ * function axis or by adding datasets to /Perturb/Functions and mapping them
+ * into a new virtual cube. The background densities, the lossy errors and
+ * the header are updated accordingly. If any of these steps fails, the file
+ * is restored to the existing functions. */
+int append_perturb(struct perturb_data *data, struct params *pars,
+                   struct units *us, char *fname) {
+    if (data->n_functions == 0) {
+        printf("None of the new functions could be extracted, there is nothing to append.\n");
+        return 0;
+    }
+
+    hid_t h_file = openOutputFile(fname, pars);
+    if (h_file < 0) {
+        printf("Error while opening file '%s'.\n", fname);
+        return 1;
+    }
+
+    printf("Appending %d functions to '%s'.\n", data->n_functions, fname);
+
+    /* The new functions must be on the same grid and for the same cosmology */
+    int n_old = 0;
+    char **old_titles = NULL;
+    int err = checkCompatible(h_file, data, pars, us, fname);
+    if (err) {
+        printf("Error: the new functions do not match those in '%s'.\n", fname);
+    } else if (readTitles(h_file, &n_old, &old_titles) != 0) {
+        printf("Error: could not read the function titles of '%s'.\n", fname);
+        err = 1;
+    }
+    if (err) {
+        H5Fclose(h_file);
+        return 1;
+    }
+
+    const int n_total = n_old + data->n_functions;
+    const size_t tau_size = data->tau_size;
+    const size_t k_size = data->k_size;
+
+    /* The titles of the existing and the new functions */
+    char **titles = malloc(n_total * sizeof(char*));
+    if (titles == NULL) {
+        printf("Error: could not allocate memory for %d titles.\n", n_total);
+        freeTitles(old_titles, n_old);
+        H5Fclose(h_file);
+        return 1;
+    }
+    for (int i=0; i<n_old; i++) {
+        titles[i] = old_titles[i];
+    }
+    for (int i=0; i<data->n_functions; i++) {
+        titles[n_old + i] = data->plan->entries[i].title;
+    }
+
+    hid_t h_grp = H5Gopen(h_file, "/Perturb", H5P_DEFAULT);
+    hid_t h_data = H5Dopen(h_grp, "Transfer functions", H5P_DEFAULT);
+
+    /* The errors of all functions in lossy mode, starting with those in the file */
+    double *max_abs_error = NULL;
+    double *max_rel_error = NULL;
+    double *new_abs_error = NULL;
+    double *new_rel_error = NULL;
+    if (pars->LossyMode != LOSSY_NONE) {
+        max_abs_error = calloc(n_total, sizeof(double));
+        max_rel_error = calloc(n_total, sizeof(double));
+        readAttribute(h_data, "Max absolute errors", H5T_NATIVE_DOUBLE,
+                      max_abs_error, n_old);
+        readAttribute(h_data, "Max relative errors", H5T_NATIVE_DOUBLE,
+                      max_rel_error, n_old);
+        new_abs_error = max_abs_error + n_old;
+        new_rel_error = max_rel_error + n_old;
+    }
+
+    const double write_start = wallTime();
+
+    /* The new functions are written first, then the background densities
+     * and the header. The new virtual cube and background densities are
+     * only swapped in at the end, and any failure restores the file. */
+    int clash = 0;
+    int extended = 0;
+    int header_written = 0;
+    int cube_swapped = 0;
+
+    if (pars->FunctionDatasets) {
+        /* Add the new datasets and map all functions into a new virtual cube */
+        H5Dclose(h_data);
+        h_data = -1;
+        hid_t h_fgrp = H5Gopen(h_grp, FUNCTIONS_GROUP, H5P_DEFAULT);
+        /* Datasets that are already there are left alone, and the titles
+         * must be valid names */
+        for (int i=n_old; i<n_total; i++) {
+            if (!validDatasetName(titles[i])) {
+                printf("Error: '%s' cannot be used as the name of a dataset.\n", titles[i]);
+                clash = 1;
+            } else if (H5Lexists(h_fgrp, titles[i], H5P_DEFAULT) != 0) {
+                printf("Error: '%s' already has a dataset for '%s'.\n", fname, titles[i]);
+                clash = 1;
+            }
+        }
+
+        if (clash) {
+            err = 1;
+        } else {
+            err = addFunctionDatasets(h_fgrp, data, pars, us, n_old, new_abs_error,
+                                      new_rel_error);
+        }
+        H5Gclose(h_fgrp);
+
+        if (!err) {
+            err = createVirtualCube(h_grp, APPEND_TEMP_NAME, pars, titles,
+                                    n_total, tau_size, k_size);
+        }
+        if (!err) {
+            h_data = H5Dopen(h_grp, APPEND_TEMP_NAME, H5P_DEFAULT);
+            err = (h_data < 0);
+        }
+        if (!err) {
+            err = writeCubeAttributes(h_data, pars, titles, n_total, tau_size, k_size,
+                                      max_abs_error, max_rel_error);
+        }
+        if (err) printf("Error while writing the function datasets.\n");
+    } else {
+        /* Extend the cube and write the new functions behind the others */
+        size_t shape_layout[3];
+        layoutShape(pars->Layout, n_total, tau_size, k_size, shape_layout);
+        hsize_t shape_cube[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+        if (H5Dset_extent(h_data, shape_cube) < 0) {
+            printf("Error while extending dataset '%s'.\n", "Transfer functions");
+            err = 1;
+        } else {
+            extended = 1;
+        }
+
+        if (!err) {
+            err = writeCube(h_data, data, pars, n_old, new_abs_error, new_rel_error);
+            err = maxOverRanks(err);
+            if (err) printf("Error while writing data array '%s'.\n", "data->delta");
+        }
+
+        if (!err && pars->LossyMode != LOSSY_NONE) {
+            err = writeLossyAttributes(h_data, pars, titles, n_total,
+                                       max_abs_error, max_rel_error);
+        }
+    }
+
+    if (h_data >= 0) H5Dclose(h_data);
+
+    printf("Wrote the transfer functions in %.3f s on %d rank(s).\n",
+           wallTime() - write_start, parallelSize());
+
+    /* The background densities of all functions */
+    if (!err) {
+        err = appendOmegas(h_grp, data, n_old, APPEND_TEMP_OMEGAS);
+    }
+
+    /* Record the new functions in the header */
+    if (!err) {
+        hid_t h_hdr = H5Gopen(h_file, "/Header", H5P_DEFAULT);
+        header_written = 1;
+        err |= replaceAttribute(h_hdr, "n_functions", H5T_NATIVE_INT, &n_total, 1);
+        err |= writeTitles(h_hdr, titles, n_total);
+        H5Gclose(h_hdr);
+    }
+
+    /* Finally, swap in the new cube and background densities */
+    if (!err && pars->FunctionDatasets) {
+        err = replaceLink(h_grp, APPEND_TEMP_NAME, "Transfer functions") < 0;
+        cube_swapped = !err;
+    }
+    if (!err) {
+        err = replaceLink(h_grp, APPEND_TEMP_OMEGAS, "Omegas") < 0;
+    }
+    err = maxOverRanks(err);
+
+    /* Otherwise, restore the file to the existing functions */
+    if (err) {
+        printf("Error: restoring the %d existing functions of '%s'.\n", n_old, fname);
+
+        if (H5Lexists(h_grp, APPEND_TEMP_OMEGAS, H5P_DEFAULT) > 0) {
+            H5Ldelete(h_grp, APPEND_TEMP_OMEGAS, H5P_DEFAULT);
+        }
+        if (H5Lexists(h_grp, APPEND_TEMP_NAME, H5P_DEFAULT) > 0) {
+            H5Ldelete(h_grp, APPEND_TEMP_NAME, H5P_DEFAULT);
+        }
+
+        if (header_written) {
+            hid_t h_hdr = H5Gopen(h_file, "/Header", H5P_DEFAULT);
+            replaceAttribute(h_hdr, "n_functions", H5T_NATIVE_INT, &n_old, 1);
+            writeTitles(h_hdr, titles, n_old);
+            H5Gclose(h_hdr);
+        }
+
+        if (pars->FunctionDatasets) {
+            /* The old virtual cube, if it has already been replaced */
+            if (cube_swapped && createVirtualCube(h_grp, APPEND_TEMP_NAME, pars, titles,
+                                                  n_old, tau_size, k_size) == 0) {
+                h_data = H5Dopen(h_grp, APPEND_TEMP_NAME, H5P_DEFAULT);
+                writeCubeAttributes(h_data, pars, titles, n_old, tau_size, k_size,
+                                    max_abs_error, max_rel_error);
+                H5Dclose(h_data);
+                replaceLink(h_grp, APPEND_TEMP_NAME, "Transfer functions");
+            }
+            if (!clash) {
+                hid_t h_fgrp = H5Gopen(h_grp, FUNCTIONS_GROUP, H5P_DEFAULT);
+                removeFunctionDatasets(h_fgrp, titles + n_old, data->n_functions);
+                H5Gclose(h_fgrp);
+            }
+        } else if (extended) {
+            /* Shrink the cube back to the existing functions */
+            h_data = H5Dopen(h_grp, "Transfer functions", H5P_DEFAULT);
+            size_t shape_layout[3];
+            layoutShape(pars->Layout, n_old, tau_size, k_size, shape_layout);
+            hsize_t shape_old[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+            if (H5Dset_extent(h_data, shape_old) < 0) {
+                printf("Error while restoring dataset '%s'.\n", "Transfer functions");
+            }
+            if (pars->LossyMode != LOSSY_NONE) {
+                writeLossyAttributes(h_data, pars, titles, n_old, max_abs_error,
+                                     max_rel_error);
+            }
+            H5Dclose(h_data);
+        }
+    }
+    H5Gclose(h_grp);
+
+    H5Fclose(h_file);
+
+    if (!err) {
+        printf("The file '%s' now has %d functions.\n", fname, n_total);
+    }
+
+    free(max_abs_error);
+    free(max_rel_error);
+    free(titles);
+    freeTitles(old_titles, n_old);
+
+    return err;
+}
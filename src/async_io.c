@@ -0,0 +1,463 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "../include/async_io.h"
+
+static const char *backend_names[3] = {"auto", "uring", "threads"};
+
+int parseAsyncBackend(const char *str) {
+    for (int i=0; i<3; i++) {
+        if (strcasecmp(str, backend_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *asyncBackendName(int backend) {
+    return backend_names[backend];
+}
+
+/* The submission and completion rings shared with the kernel. We talk to
+ * io_uring directly through its system calls, so that liburing is not
+ * needed. */
+struct uring_state {
+    int fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+};
+
+static void closeRing(struct uring_state *r) {
+    if (r->sqes != NULL) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr != NULL) munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    free(r);
+}
+
+/* Set up a ring with room for entries writes, or return NULL */
+static struct uring_state *openRing(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return NULL;
+
+    struct uring_state *r = calloc(1, sizeof(struct uring_state));
+    if (r == NULL) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+
+    /* Map the rings, which newer kernels place in a single mapping */
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        closeRing(r);
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            closeRing(r);
+            return NULL;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        closeRing(r);
+        return NULL;
+    }
+
+    r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+
+    return r;
+}
+
+/* Write length bytes synchronously, starting with the descriptor fd. After a
+ * short write, the remainder need not be aligned, so it is written through
+ * the buffered descriptor, which does not use O_DIRECT. */
+static int writeRemainder(const struct async_writer *w, int fd, const char *data,
+                          size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        data += n;
+        length -= n;
+        offset += n;
+        fd = w->buffered_fd;
+    }
+    return 0;
+}
+
+static int ringSubmit(struct async_writer *w, int index) {
+    struct uring_state *r = w->ring;
+    struct async_buffer *b = &w->buffers[index];
+
+    const unsigned tail = *r->sq_tail;
+    const unsigned slot = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[slot];
+
+    b->iov.iov_base = b->data;
+    b->iov.iov_len = b->length;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = w->fd;
+    sqe->addr = (unsigned long) &b->iov;
+    sqe->len = 1;
+    sqe->off = b->offset;
+    sqe->user_data = index;
+    r->sq_array[slot] = slot;
+
+    /* Publish the entry before the kernel sees the new tail */
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret != 1;
+}
+
+/* Wait for at least one write to complete and process all completions.
+ * Returns 1 if the ring can no longer be waited on. */
+static int ringReap(struct async_writer *w) {
+    struct uring_state *r = w->ring;
+
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, 0, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            printf("Error while waiting for io_uring: %s.\n", strerror(errno));
+            w->error = 1;
+            return 1;
+        }
+    }
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct async_buffer *b = &w->buffers[cqe->user_data];
+
+        if (cqe->res < 0) {
+            printf("Error while writing at offset %ld: %s.\n", (long) b->offset,
+                   strerror(-cqe->res));
+            w->error = 1;
+        } else if ((size_t) cqe->res < b->length) {
+            if (writeRemainder(w, w->buffered_fd, b->data + cqe->res,
+                               b->length - cqe->res, b->offset + cqe->res) != 0) {
+                printf("Error while writing at offset %ld.\n", (long) b->offset);
+                w->error = 1;
+            }
+        }
+        b->state = ASYNC_FREE;
+        head++;
+    }
+
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Thread pool: take the queued buffers in order and write them */
+static void *writerThread(void *arg) {
+    struct async_writer *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->queued == 0 && !w->stop) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->queued == 0 && w->stop) break;
+
+        struct async_buffer *b = &w->buffers[w->take];
+        w->take = (w->take + 1) % w->depth;
+        w->queued--;
+        b->state = ASYNC_WRITING;
+        pthread_mutex_unlock(&w->lock);
+
+        int err = writeRemainder(w, w->fd, b->data, b->length, b->offset);
+        if (err) {
+            printf("Error while writing at offset %ld: %s.\n", (long) b->offset,
+                   strerror(errno));
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (err) w->error = 1;
+        b->state = ASYNC_FREE;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/* Wait until the buffer has been written. If waiting on the ring fails, no
+ * more completions will arrive, so we stop with the error set. A failed
+ * write of another buffer does not stop the wait, since the kernel may
+ * still be reading from this one. */
+static void waitForBuffer(struct async_writer *w, struct async_buffer *b) {
+    if (w->backend == ASYNC_URING) {
+        while (b->state != ASYNC_FREE) {
+            if (ringReap(w) != 0) break;
+        }
+    } else {
+        pthread_mutex_lock(&w->lock);
+        while (b->state != ASYNC_FREE) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static void closeFiles(struct async_writer *w) {
+    if (w->buffered_fd != w->fd) close(w->buffered_fd);
+    close(w->fd);
+}
+
+static void freeBuffers(struct async_writer *w) {
+    for (int i=0; i<w->depth; i++) {
+        free(w->buffers[i].data);
+    }
+    free(w->buffers);
+    w->buffers = NULL;
+}
+
+/* Let the first n threads of the pool finish and clean up the pool */
+static void stopThreads(struct async_writer *w, int n) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    for (int i=0; i<n; i++) {
+        pthread_join(w->threads[i], NULL);
+    }
+    free(w->threads);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+}
+
+/* Create the file fname and prepare depth aligned buffers of buffer_size
+ * bytes (rounded up to the alignment). With direct, the page cache is
+ * bypassed if the file system allows it. Returns 0 on success. */
+int openAsyncWriter(struct async_writer *w, const char *fname, int direct,
+                    int backend, int depth, size_t buffer_size) {
+    memset(w, 0, sizeof(struct async_writer));
+    w->depth = depth;
+    w->buffer_size = (buffer_size + ASYNC_ALIGNMENT - 1) / ASYNC_ALIGNMENT * ASYNC_ALIGNMENT;
+    if (w->buffer_size == 0) w->buffer_size = ASYNC_ALIGNMENT;
+
+    w->direct = direct;
+    w->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+    if (w->fd < 0 && direct && errno == EINVAL) {
+        printf("WARNING: the file system does not support O_DIRECT, using buffered writes.\n");
+        w->direct = 0;
+        w->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (w->fd < 0) {
+        printf("Error while opening file '%s': %s.\n", fname, strerror(errno));
+        return 1;
+    }
+
+    /* Remainders of short writes need not be aligned, so they are written
+     * without O_DIRECT */
+    w->buffered_fd = w->fd;
+    if (w->direct) {
+        w->buffered_fd = open(fname, O_WRONLY);
+        if (w->buffered_fd < 0) {
+            printf("Error while opening file '%s': %s.\n", fname, strerror(errno));
+            close(w->fd);
+            return 1;
+        }
+    }
+
+    w->buffers = calloc(depth, sizeof(struct async_buffer));
+    if (w->buffers == NULL) {
+        printf("Error: could not allocate the output buffers.\n");
+        closeFiles(w);
+        return 1;
+    }
+    for (int i=0; i<depth; i++) {
+        if (posix_memalign((void **) &w->buffers[i].data, ASYNC_ALIGNMENT,
+                           w->buffer_size) != 0) {
+            printf("Error: could not allocate the aligned output buffers.\n");
+            freeBuffers(w);
+            closeFiles(w);
+            return 1;
+        }
+    }
+
+    /* Prefer io_uring and fall back to threads if the kernel refuses it */
+    if (backend != ASYNC_THREADS) {
+        w->ring = openRing(depth);
+        if (w->ring != NULL) {
+            w->backend = ASYNC_URING;
+        } else {
+            printf("%sio_uring is unavailable (%s), using %d writer threads.\n",
+                   backend == ASYNC_URING ? "WARNING: " : "", strerror(errno), depth);
+        }
+    }
+    if (w->ring == NULL) {
+        w->backend = ASYNC_THREADS;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        w->threads = malloc(depth * sizeof(pthread_t));
+        int started = 0;
+        while (w->threads != NULL && started < depth
+               && pthread_create(&w->threads[started], NULL, writerThread, w) == 0) {
+            started++;
+        }
+        if (started < depth) {
+            printf("Error: could not start the writer threads.\n");
+            stopThreads(w, started);
+            freeBuffers(w);
+            closeFiles(w);
+            return 1;
+        }
+    }
+
+    w->start_time = omp_get_wtime();
+
+    return 0;
+}
+
+/* Return the next buffer to fill, waiting for its previous write if needed.
+ * The caller sets the offset and length and hands it to asyncSubmit. */
+struct async_buffer *asyncGetBuffer(struct async_writer *w) {
+    struct async_buffer *b = &w->buffers[w->next];
+    w->next = (w->next + 1) % w->depth;
+
+    double start = omp_get_wtime();
+    waitForBuffer(w, b);
+    w->wait_time += omp_get_wtime() - start;
+
+    b->length = 0;
+    return b;
+}
+
+/* Start writing a filled buffer. With O_DIRECT, the offset must be aligned
+ * and the length is padded with zeros to a multiple of the alignment. */
+int asyncSubmit(struct async_writer *w, struct async_buffer *b) {
+    w->bytes_written += b->length;
+
+    if (w->direct && b->length % ASYNC_ALIGNMENT != 0) {
+        size_t padded = (b->length + ASYNC_ALIGNMENT - 1) / ASYNC_ALIGNMENT * ASYNC_ALIGNMENT;
+        memset(b->data + b->length, 0, padded - b->length);
+        b->length = padded;
+    }
+
+    if (w->backend == ASYNC_URING) {
+        b->state = ASYNC_WRITING;
+        if (ringSubmit(w, b - w->buffers) != 0) {
+            printf("Error while submitting a write to io_uring: %s.\n", strerror(errno));
+            b->state = ASYNC_FREE;
+            w->error = 1;
+            return 1;
+        }
+    } else {
+        pthread_mutex_lock(&w->lock);
+        b->state = ASYNC_QUEUED;
+        w->queued++;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return 0;
+}
+
+/* Wait for all writes, cut the file to file_size (if not negative), which
+ * removes the padding of the last buffer, and close it. Returns 0 if all
+ * writes succeeded. */
+int closeAsyncWriter(struct async_writer *w, off_t file_size) {
+    for (int i=0; i<w->depth; i++) {
+        waitForBuffer(w, &w->buffers[i]);
+    }
+
+    if (w->backend == ASYNC_URING) {
+        closeRing(w->ring);
+        w->ring = NULL;
+    } else {
+        stopThreads(w, w->depth);
+    }
+
+    if (file_size >= 0 && ftruncate(w->fd, file_size) != 0) {
+        printf("Error while resizing the file: %s.\n", strerror(errno));
+        w->error = 1;
+    }
+    if (w->buffered_fd != w->fd && close(w->buffered_fd) != 0) {
+        w->error = 1;
+    }
+    if (close(w->fd) != 0) {
+        w->error = 1;
+    }
+
+    freeBuffers(w);
+
+    return w->error;
+}
@@ -18,27 +18,23 @@
  ******************************************************************************/
 
 #include "../include/class_transfer.h"
+#include "../include/streaming.h"
 
 int readPerturbData(struct perturb_data *data, struct params *pars,
-                    struct units *us, struct perturbations *pt, struct background *ba) {
-    /* Try getting a source */
-    int index_md = pt->index_md_scalars;  // scalar mode
-    int index_ic = 0;                     // index of the initial condition
-    int index_tp;                         // type of source function
-
+                    struct extraction_plan *plan, struct units *us,
+                    struct perturbations *pt, struct background *ba) {
     /* Size of the perturbations */
-    size_t k_size = pt->k_size[index_md];
-    size_t tau_size = pt->tau_size;
+    size_t k_size = plan->k_size;
+    size_t tau_size = plan->tau_size;
 
-    /* The number of transfer functions to be read */
-    const size_t n_functions = pars->MatchedFunctions;
+    /* The number of transfer functions, including those derived later */
+    const size_t n_functions = plan->n_entries;
 
     /* Little Hubble h */
     // const double h = ba->h;
 
     /* CLASS to internal units conversion factor */
-    const double unit_length_factor = MPC_METRES / us->UnitLengthMetres;
-    const double unit_time_factor = unit_length_factor / us->SpeedOfLight;
+    const double unit_time_factor = plan->unit_time_factor;
 
     /* Vector of the wavenumbers */
     data->k_size = k_size;
@@ -56,102 +52,88 @@ int readPerturbData(struct perturb_data *data, struct params *pars,
     data->growth_f = (double *)calloc(tau_size, sizeof(double));
     data->growth_f_prime = (double *)calloc(tau_size, sizeof(double));
 
-    /* The number of transfer functions to be read */
+    /* The final number of transfer functions, known from the plan */
     data->n_functions = n_functions;
 
-    /* Vector with the transfer functions T(tau, k) */
-    data->delta = (double *)calloc(n_functions * k_size * tau_size, sizeof(double));
+    /* The plan can be used to recompute functions later on */
+    data->plan = plan;
+
+    /* Vector with the transfer functions T(tau, k). This is deliberately not
+     * calloc'ed: the pages are first touched by the threads that fill them
+     * in executeExtractionPlan, which places them on the right NUMA node.
+     * In streaming mode, the functions are only computed while writing. */
+    if (pars->Streaming) {
+        data->delta = NULL;
+    } else {
+        data->delta = (real_t *)malloc(n_functions * k_size * tau_size * sizeof(real_t));
+    }
 
     /* Vector of background quantities at each time Omega(tau) */
-    data->Omega = (double *)calloc(n_functions * tau_size, sizeof(double));
+    data->Omega = (real_t *)calloc(n_functions * tau_size, sizeof(real_t));
 
-    /* Read out the log conformal times */
+    /* Read out the log conformal times (the plan has tau in U_T) */
     for (size_t index_tau = 0; index_tau < tau_size; index_tau++) {
-        /* Convert tau from Mpc to U_T */
-        double tau = pt->tau_sampling[index_tau] * unit_time_factor;
-        data->log_tau[index_tau] = log(tau);
+        data->log_tau[index_tau] = log(plan->tau[index_tau]);
     }
 
     /* Read out the wavenumbers */
     for (size_t index_k = 0; index_k < k_size; index_k++) {
         /* Note: CLASS exports transfer function files with k in h/Mpc,
-         * but internally it uses 1/Mpc. */
-
-         /* Convert k from 1/Mpc to 1/U_L */
-        double k = pt->k[index_md][index_k] / unit_length_factor;
-        data->k[index_k] = k;
+         * but internally it uses 1/Mpc. The plan has k in 1/U_L. */
+        data->k[index_k] = plan->k[index_k];
     }
 
-    /* The index for data->delta, not CLASS index, nor index in titles string */
-    int index_func = 0;
-    /* Convert and store the transfer functions */
-    for (size_t i = 0; i < pars->NumDesiredFunctions; i++) {
-        /* Ignore functions that have no matching CLASS index */
-        if (pars->ClassPerturbIndices[i] < 0) continue;
-
-        /* Determine the unit conversion factor */
-        char *title = pars->DesiredFunctions[i];
-        double unit_factor = unitConversionFactor(title, unit_length_factor, unit_time_factor);
-
-        printf("Unit conversion factor for '%s' is %f\n", title, unit_factor);
-
-        /* For each timestep and wavenumber */
-        for (size_t index_tau = 0; index_tau < tau_size; index_tau++) {
-            for (size_t index_k = 0; index_k < k_size; index_k++) {
-                /* Transfer the corresponding data */
-                index_tp = pars->ClassPerturbIndices[i];  // CLASS index
-                double p = pt->sources[index_md][index_ic * pt->tp_size[index_md] +
-                                                index_tp][index_tau * k_size + index_k];
-
-                /* Convert transfer functions from CLASS format to CAMB/HeWon/dexm/
-                *  Eisenstein-Hu format by multiplying by -1/k^2.
-                */
-                double k = pt->k[index_md][index_k] / unit_length_factor;
-                double T = -p/k/k;
-
-                /* Convert from CLASS units to output units */
-                T *= unit_factor;
-
-                data->delta[tau_size * k_size * index_func + k_size * index_tau + index_k] = T;
-            }
+    /* Convert and store the transfer functions. In single precision, every
+     * function is extracted in double precision and rounded once when stored.
+     * The derived functions follow in computeDerivatives. */
+    if (!pars->Streaming) {
+#ifdef SINGLE_PRECISION
+        const size_t slab_size = k_size * tau_size;
+        double *work = allocateWorkspace(data);
+        if (work == NULL) return 1;
+
+        int err = 0;
+        for (int index_func = 0; index_func < plan->n_entries && !err; index_func++) {
+            if (plan->entries[index_func].type != ENTRY_CLASS) continue;
+            err = storeFunctionsWith(data, pars, index_func, 1,
+                                     data->delta + index_func * slab_size, work);
         }
-        index_func++;
+        free(work);
+        if (err) return 1;
+#else
+        executeExtractionPlan(plan, data->delta);
+#endif
     }
 
-    printf("\n");
-
     /* Finally, we also want to get the redshifts and background densities.
-     * To do this, we need to let CLASS populate a vector of background
-     * quantities at each time step.
+     * CLASS evaluates all the background columns that we need in a single
+     * pass over the conformal times. The densities are written to the rows
+     * of rho (those without a background index stay zero).
      */
+    double *rho = (double *)calloc(n_functions * tau_size, sizeof(double));
+    struct background_batch bb;
+    evaluateBackgroundBatch(&bb, rho, plan, pt, ba);
 
-    /* Allocate array for background quantities */
-    double *pvecback = malloc(ba->bg_size * sizeof(double));
-    int last_index; //not used, but is output by CLASS
+    /* Conversion factor for the Hubble rate derivatives */
+    const double unit_time_factor_2 = pow(unit_time_factor, 2);
 
-    /* Read out the redshifts and background densities */
+    /* Derive the redshifts, growth rates, etc. from the batch */
+    #pragma omp simd
     for (size_t index_tau = 0; index_tau < tau_size; index_tau++) {
-        /* Conformal time in Mpc/c (the internal time unit in CLASS) */
-        double tau = pt->tau_sampling[index_tau];
-
-        /* Make CLASS evaluate background quantities at this time*/
-        background_at_tau(ba, tau, ba->bg_size, 0,
-                          &last_index, pvecback);
-
         /* The scale-factor and redshift */
-        double a = pvecback[ba->index_bg_a];
+        double a = bb.a[index_tau];
         double z = 1./a - 1.;
 
         /* The critical density at this redshift in CLASS units */
-        double rho_crit = pvecback[ba->index_bg_rho_crit];
-        double Omega_m = pvecback[ba->index_bg_Omega_m];
-        double Omega_r = pvecback[ba->index_bg_Omega_r];
+        double rho_crit = bb.rho_crit[index_tau];
+        double Omega_m = bb.Omega_m[index_tau];
+        double Omega_r = bb.Omega_r[index_tau];
 
         /* Retrieve background quantities in CLASS units */
-        double H = pvecback[ba->index_bg_H];
-        double H_prime = pvecback[ba->index_bg_H_prime];
-        double D = pvecback[ba->index_bg_D];
-        double f = pvecback[ba->index_bg_f];
+        double H = bb.H[index_tau];
+        double H_prime = bb.H_prime[index_tau];
+        double D = bb.D[index_tau];
+        double f = bb.f[index_tau];
         double D_prime = f * a * H * D;
         double rho_M = rho_crit * Omega_m;
         double a_prime = a*a*H;
@@ -165,7 +147,7 @@ int readPerturbData(struct perturb_data *data, struct params *pars,
 
         /* The Hubble constant in 1/U_T and its conformal derivative in 1/U_T^2 */
         data->Hubble_H[index_tau] = H / unit_time_factor;
-        data->Hubble_H_prime[index_tau] = H_prime / pow(unit_time_factor,2);
+        data->Hubble_H_prime[index_tau] = H_prime / unit_time_factor_2;
 
         /* The growth factor and logarithmic growth rate */
         data->growth_D[index_tau] = D;
@@ -176,33 +158,25 @@ int readPerturbData(struct perturb_data *data, struct params *pars,
         /* Overall background densisities in matter and radiation */
         data->Omega_m[index_tau] = Omega_m;
         data->Omega_r[index_tau] = Omega_r;
+    }
 
-        /* Read out the background densities */
-        index_func = 0;
-        for (size_t i = 0; i < pars->NumDesiredFunctions; i++) {
-            /* Ignore functions that have no matching CLASS perturbation index */
-            if (pars->ClassPerturbIndices[i] < 0) continue;
-
-            /* For functions that also have a CLASS background index */
-            if (pars->ClassBackgroundIndices[i] >= 0) {
-                /* The density corresponding to this function (CLASS units) */
-                double rho = pvecback[pars->ClassBackgroundIndices[i]];
-
-                /* Fraction of the critical density (dimensionless) */
-                double Omega = rho/rho_crit;
+    /* Convert the densities into fractions of the critical density */
+    for (int index_func = 0; index_func < plan->n_entries; index_func++) {
+        /* Functions without a background index just keep zeros */
+        if (plan->entries[index_func].ba_index < 0) continue;
 
-                /* Store the dimensionless background density */
-                data->Omega[tau_size * index_func + index_tau] = Omega;
-            } else {
-                //We just store zero, to keep it simple. The memory was calloc'ed.
-            }
+        const double *rho_f = rho + tau_size * index_func;
+        real_t *Omega = data->Omega + tau_size * index_func;
 
-            index_func++;
+        #pragma omp simd
+        for (size_t index_tau = 0; index_tau < tau_size; index_tau++) {
+            Omega[index_tau] = rho_f[index_tau] / bb.rho_crit[index_tau];
         }
     }
 
-    /* Done with the CLASS background vector */
-    free(pvecback);
+    /* Done with the background batch */
+    cleanBackgroundBatch(&bb);
+    free(rho);
 
     /* Compute finite difference approximations as consistency check */
     for (size_t index_tau = 1; index_tau < tau_size-1; index_tau++) {
@@ -266,41 +240,147 @@ int readPerturbData(struct perturb_data *data, struct params *pars,
     return 0;
 }
 
-/* Unit conversion factor for transfer functions, depending on the title. */
-double unitConversionFactor(char *title, double unit_length_factor,
-                            double unit_time_factor) {
+/* Evaluate the background at all conformal times pt->tau_sampling in a single
+ * pass. Since tau_sampling is increasing, CLASS can start each table search
+ * from the position of the previous time (inter_closeby) rather than doing a
+ * full search for every time. The columns are stored as a struct of arrays.
+ * The densities rho(tau) of the plan entries with a background index are
+ * written to the rows of the array rho (n_entries * tau_size), in CLASS units.
+ */
+int evaluateBackgroundBatch(struct background_batch *bb, double *rho,
+                            const struct extraction_plan *plan,
+                            struct perturbations *pt, struct background *ba) {
+    const size_t tau_size = pt->tau_size;
+
+    bb->tau_size = tau_size;
+    bb->a = malloc(tau_size * sizeof(double));
+    bb->rho_crit = malloc(tau_size * sizeof(double));
+    bb->Omega_m = malloc(tau_size * sizeof(double));
+    bb->Omega_r = malloc(tau_size * sizeof(double));
+    bb->H = malloc(tau_size * sizeof(double));
+    bb->H_prime = malloc(tau_size * sizeof(double));
+    bb->D = malloc(tau_size * sizeof(double));
+    bb->f = malloc(tau_size * sizeof(double));
 
-    /* Note the difference between strcmp and strncmp! */
-    const char *title_end = &title[strlen(title)];
+    /* Allocate array for background quantities */
+    double *pvecback = malloc(ba->bg_size * sizeof(double));
+    int last_index = 0; //position in the CLASS table, reused as a hint
 
-    /* Most transfer functions are dimensionless, (e.g. overdensities) */
-    double factor = 1.0;
+    for (size_t index_tau = 0; index_tau < tau_size; index_tau++) {
+        /* Conformal time in Mpc/c (the internal time unit in CLASS) */
+        double tau = pt->tau_sampling[index_tau];
 
-    /* Energy flux transfer functions (theta = nabla.v) have dimension
-    * inverse time. These have titles starting with "t_". */
-    if (strncmp(title, "t_", 2) == 0) {
-        factor /= unit_time_factor;
-    }
+        /* Only the first time needs a full search of the table */
+        enum interpolation_method inter_mode = (index_tau == 0) ? inter_normal
+                                                                : inter_closeby;
 
-    /* Functions that are time derivatives have dimension inverse time */
-    if (strlen(title) >= 13 && strncmp(title_end-12, "_prime_prime", 12) == 0) {
-        factor /= pow(unit_time_factor, 2);
-    } else if (strlen(title) >= 7 && strncmp(title_end-6, "_prime", 6) == 0) {
-        factor /= unit_time_factor;
+        /* Make CLASS evaluate background quantities at this time*/
+        background_at_tau(ba, tau, long_info, inter_mode, &last_index, pvecback);
+
+        bb->a[index_tau] = pvecback[ba->index_bg_a];
+        bb->rho_crit[index_tau] = pvecback[ba->index_bg_rho_crit];
+        bb->Omega_m[index_tau] = pvecback[ba->index_bg_Omega_m];
+        bb->Omega_r[index_tau] = pvecback[ba->index_bg_Omega_r];
+        bb->H[index_tau] = pvecback[ba->index_bg_H];
+        bb->H_prime[index_tau] = pvecback[ba->index_bg_H_prime];
+        bb->D[index_tau] = pvecback[ba->index_bg_D];
+        bb->f[index_tau] = pvecback[ba->index_bg_f];
+
+        /* The densities corresponding to the exported functions */
+        for (int index_func = 0; index_func < plan->n_entries; index_func++) {
+            int ba_index = plan->entries[index_func].ba_index;
+            if (ba_index >= 0) {
+                rho[tau_size * index_func + index_tau] = pvecback[ba_index];
+            }
+        }
     }
 
+    /* Done with the CLASS background vector */
+    free(pvecback);
+
+    return 0;
+}
+
+int cleanBackgroundBatch(struct background_batch *bb) {
+    free(bb->a);
+    free(bb->rho_crit);
+    free(bb->Omega_m);
+    free(bb->Omega_r);
+    free(bb->H);
+    free(bb->H_prime);
+    free(bb->D);
+    free(bb->f);
+
+    return 0;
+}
+
+/* The dimensions of the transfer functions, as powers of length and time,
+ * for the titles that start with the given prefix. A prefix without a
+ * trailing underscore also matches the bare name. */
+static const struct unit_rule {
+    const char *pattern;
+    int length_power;
+    int time_power;
+} unit_prefixes[] = {
+    /* Energy flux transfer functions (theta = nabla.v) have dimension
+     * inverse time */
+    {"t_", 0, -1},
     /* Potential transfer functions have dimensions of energy per mass or
-    * (Length/Time)^2. This applies to "phi", "psi", "h", "eta" and their
-    * derivatives (and possibly higher order derivatives).
-    */
-    if (strcmp(title, "h") == 0   || strncmp(title, "h_", 2) == 0 ||
-        strcmp(title, "phi") == 0 || strncmp(title, "phi_", 4) == 0 ||
-        strcmp(title, "eta") == 0 || strncmp(title, "eta_", 4) == 0 ||
-        strcmp(title, "psi") == 0 || strncmp(title, "psi_", 4) == 0) {
-            factor *= pow(unit_length_factor / unit_time_factor, 2);
+     * (Length/Time)^2, as do their derivatives */
+    {"h", 2, -2},
+    {"phi", 2, -2},
+    {"eta", 2, -2},
+    {"psi", 2, -2},
+};
+
+/* Time derivatives have an additional dimension of inverse time, for the
+ * first of these suffixes that matches */
+static const struct unit_rule unit_suffixes[] = {
+    {"_prime_prime", 0, -2},
+    {"_prime", 0, -1},
+};
+
+/* The dimensions of the transfer function with this title, as powers of
+ * length and time. Most transfer functions, e.g. overdensities, are
+ * dimensionless. */
+void unitPowers(const char *title, int *length_power, int *time_power) {
+    const size_t length = strlen(title);
+    *length_power = 0;
+    *time_power = 0;
+
+    const int n_prefixes = sizeof(unit_prefixes) / sizeof(unit_prefixes[0]);
+    for (int i = 0; i < n_prefixes; i++) {
+        const char *prefix = unit_prefixes[i].pattern;
+        const size_t n = strlen(prefix);
+        if (strncmp(title, prefix, n) != 0) continue;
+        if (prefix[n - 1] == '_' || title[n] == '\0' || title[n] == '_') {
+            *length_power += unit_prefixes[i].length_power;
+            *time_power += unit_prefixes[i].time_power;
+        }
+    }
+
+    const int n_suffixes = sizeof(unit_suffixes) / sizeof(unit_suffixes[0]);
+    for (int i = 0; i < n_suffixes; i++) {
+        const char *suffix = unit_suffixes[i].pattern;
+        const size_t n = strlen(suffix);
+        if (length > n && strcmp(title + length - n, suffix) == 0) {
+            *length_power += unit_suffixes[i].length_power;
+            *time_power += unit_suffixes[i].time_power;
+            break;
+        }
     }
+}
+
+/* Unit conversion factor for transfer functions, depending on the title. */
+double unitConversionFactor(char *title, double unit_length_factor,
+                            double unit_time_factor) {
+    int length_power, time_power;
+    unitPowers(title, &length_power, &time_power);
 
-    return factor;
+    /* The length dimensions come with time, as powers of velocity */
+    const double velocity_factor = unit_length_factor / unit_time_factor;
+    return pow(velocity_factor, length_power) *
+           pow(unit_time_factor, time_power + length_power);
 }
 
 int cleanPerturbData(struct perturb_data *data) {
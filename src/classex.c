@@ -25,8 +25,12 @@
 #include "../include/classex.h"
 
 int main(int argc, char *argv[]) {
+    /* Start MPI, if enabled */
+    initParallel(&argc, &argv);
+
     if (argc == 1) {
         printf("No parameter file specified.\n");
+        finalizeParallel();
         return 0;
     }
 
@@ -39,10 +43,27 @@ int main(int argc, char *argv[]) {
     struct units us;
     struct class_titles titles;
     struct perturb_data data;
+    struct extraction_plan plan;
 
     readParams(&pars, fname);
     readUnits(&us, fname);
 
+    /* When appending, only the functions that are not yet in the file are computed */
+    if (pars.Append) {
+        if (prepareAppend(&pars, pars.OutputFilename) != 0) {
+            finalizeParallel();
+            return 1;
+        }
+
+        if (pars.NumDesiredFunctions == 0) {
+            printf("All functions are already in '%s', there is nothing to append.\n",
+                   pars.OutputFilename);
+            cleanParams(&pars);
+            finalizeParallel();
+            return 0;
+        }
+    }
+
     /* Define the CLASS structures */
     struct precision pr;  /* for precision parameters */
     struct background ba; /* for cosmological background */
@@ -60,6 +81,8 @@ int main(int argc, char *argv[]) {
     /* If no class .ini file was specified, stop. */
     if (pars.ClassIniFile[0] == '\0') {
         printf("No CLASS file specified!\n");
+        cleanParams(&pars);
+        finalizeParallel();
         return 1;
     }
 
@@ -91,14 +114,23 @@ int main(int argc, char *argv[]) {
     initClassTitles(&titles, &pt, &ba);
     matchClassTitles(&titles, &pars);
 
+    /* Compile the extraction plan for the matched functions */
+    compileExtractionPlan(&plan, &pars, &titles, &us, &pt);
+
     /* Read perturb data */
-    readPerturbData(&data, &pars, &us, &pt, &ba);
+    int err = readPerturbData(&data, &pars, &plan, &us, &pt, &ba);
+    if (err) {
+        printf("Error while reading the perturbations.\n");
+    }
 
     printf("We have read out %d functions.\n", data.n_functions);
     printf("For %d functions, we also have non-zero Omega(tau).\n", pars.MatchedWithBackground);
 
     /* Compute derivatives */
-    computeDerivatives(&data, &pars, &us);
+    if (!err && computeDerivatives(&data, &pars, &us) != 0) {
+        printf("Error while computing the derived functions.\n");
+        err = 1;
+    }
 
     /* Retrieve the number of ncdm species and their masses in eV */
     pars.N_ncdm = ba.N_ncdm;
@@ -117,11 +149,28 @@ int main(int argc, char *argv[]) {
         pars.Omega_m -= ba.Omega0_ncdm[i];
     }
 
-    /* Write it to a file */
-    write_perturb(&data, &pars, &us, pars.OutputFilename);
+    /* Write it to a file, unless the functions could not be computed */
+    if (!err) {
+        if (pars.OutputFormat == FORMAT_RAW) {
+            err = write_raw(&data, &pars, &us, pars.OutputFilename);
+        } else if (pars.Append) {
+            err = append_perturb(&data, &pars, &us, pars.OutputFilename);
+        } else {
+            err = write_perturb(&data, &pars, &us, pars.OutputFilename);
+        }
+        if (err) {
+            printf("Error while writing the output file '%s'.\n", pars.OutputFilename);
+        }
+    }
+
+    /* Time how long readers take to open the file and read a function */
+    if (!err && pars.BenchmarkOutput > 0) {
+        benchmarkOutputFile(pars.OutputFilename, &pars);
+    }
 
     /* Clean perturb data */
     cleanPerturbData(&data);
+    cleanExtractionPlan(&plan);
 
     printf("\nShutting CLASS down again.\n");
 
@@ -134,20 +183,27 @@ int main(int argc, char *argv[]) {
     /* Close CLASS again */
     if (perturbations_free(&pt) == _FAILURE_) {
         printf("Error in freeing class memory \n%s\n", pt.error_message);
+        finalizeParallel();
         return 1;
     }
 
     if (thermodynamics_free(&th) == _FAILURE_) {
         printf("Error in thermodynamics_free \n%s\n", th.error_message);
+        finalizeParallel();
         return 1;
     }
 
     if (background_free(&ba) == _FAILURE_) {
         printf("Error in background_free \n%s\n", ba.error_message);
+        finalizeParallel();
         return 1;
     }
 
     /* Clean up */
     cleanClassTitles(&titles);
     cleanParams(&pars);
+
+    finalizeParallel();
+
+    return err;
 }
@@ -0,0 +1,33 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+
+#include "../include/aggregate.h"
+
+/* Combine classex output files for different cosmologies, on the same grid,
+ * into a single file with virtual datasets that refer to the original data */
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s aggregate.hdf5 perturb_1.hdf5 [perturb_2.hdf5 ...]\n", argv[0]);
+        return 1;
+    }
+
+    return aggregateOutputFiles(argv[1], argc - 2, argv + 2);
+}
@@ -0,0 +1,648 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <strings.h>
+#include <zlib.h>
+#include <omp.h>
+#include "../include/compression.h"
+#include "../include/layout.h"
+#include "../include/prediction.h"
+#include "../include/parallel.h"
+
+/* Chunking names, as used in the parameter file and in the output file */
+static const char *chunking_names[] = {"none", "tau", "k"};
+
+/* Returns the chunking corresponding to the string, or -1 if unknown */
+int parseChunking(const char *str) {
+    for (int i=0; i<3; i++) {
+        if (strcasecmp(str, chunking_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *chunkingName(int chunking) {
+    return chunking_names[chunking];
+}
+
+/* Lossy mode names, as used in the parameter file and in the output file */
+static const char *lossy_names[] = {"none", "absolute", "relative"};
+
+/* Returns the lossy mode corresponding to the string, or -1 if unknown */
+int parseLossyMode(const char *str) {
+    for (int i=0; i<3; i++) {
+        if (strcasecmp(str, lossy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *lossyModeName(int mode) {
+    return lossy_names[mode];
+}
+
+/* The dimensions of a chunk of the cube, in the order of the output layout.
+ * A ChunkSize of zero (or larger than the axis) means the whole axis, in
+ * which case a chunk is exactly one function. */
+void cubeChunkShape(const struct params *pars, size_t tau_size, size_t k_size,
+                    hsize_t chunk[3]) {
+    size_t tau_chunk = tau_size;
+    size_t k_chunk = k_size;
+
+    if (pars->ChunkSize > 0) {
+        size_t size = pars->ChunkSize;
+        if (pars->Chunking == CHUNK_TAU && size < tau_size) {
+            tau_chunk = size;
+        } else if (pars->Chunking == CHUNK_K && size < k_size) {
+            k_chunk = size;
+        }
+    }
+
+    size_t shape[3];
+    layoutShape(pars->Layout, 1, tau_chunk, k_chunk, shape);
+    for (int i=0; i<3; i++) {
+        chunk[i] = shape[i];
+    }
+}
+
+/* The position of the tau axis in the cube and its chunks, in the given layout */
+int tauAxis(int layout) {
+    if (layout == LAYOUT_FKT) return 2;
+    if (layout == LAYOUT_TKF) return 0;
+    return 1;
+}
+
+/* Set the chunk shape and the filters: the optional shuffle and deflate
+ * filters or the predictive filter along the axis tau_axis. Data that asks
+ * for the predictive filter is not stored without it. */
+static int setChunkFilters(hid_t h_prop, const struct params *pars, int rank,
+                           const hsize_t *chunk, int tau_axis) {
+    herr_t h_err = H5Pset_chunk(h_prop, rank, chunk);
+    if (h_err < 0) {
+        printf("Error while setting chunk shape.\n");
+        return 1;
+    }
+
+    /* The predictive filter does its own shuffling and deflating */
+    if (pars->Prediction != PREDICT_NONE) {
+        if (registerPredictiveFilter() != 0) return 1;
+
+        unsigned int cd_values[PREDICT_CD_USER];
+        cd_values[PREDICT_CD_MODE] = pars->Prediction;
+        cd_values[PREDICT_CD_AXIS] = tau_axis;
+        cd_values[PREDICT_CD_LEVEL] = pars->DeflateLevel;
+        h_err = H5Pset_filter(h_prop, H5Z_FILTER_PREDICTIVE, H5Z_FLAG_MANDATORY,
+                              PREDICT_CD_USER, cd_values);
+        if (h_err < 0) printf("Error while enabling the predictive filter.\n");
+        return h_err < 0;
+    }
+
+    /* The shuffle filter groups the bytes of the values by significance,
+     * which makes smooth data much easier to compress */
+    if (pars->Shuffle) {
+        h_err = H5Pset_shuffle(h_prop);
+        if (h_err < 0) {
+            printf("Error while enabling the shuffle filter.\n");
+            return 1;
+        }
+    }
+
+    if (pars->DeflateLevel > 0) {
+        if (!H5Zfilter_avail(H5Z_FILTER_DEFLATE)) {
+            printf("WARNING: the deflate filter is not available in this HDF5 library.\n");
+        } else {
+            h_err = H5Pset_deflate(h_prop, pars->DeflateLevel);
+            if (h_err < 0) {
+                printf("Error while enabling the deflate filter.\n");
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Dataset creation properties for the transfer function cube: contiguous,
+ * or chunked with the optional shuffle and deflate filters or with the
+ * predictive filter. Returns a negative value if the filters cannot be set. */
+hid_t createCubeProperties(const struct params *pars, size_t tau_size,
+                           size_t k_size) {
+    hid_t h_prop = H5Pcreate(H5P_DATASET_CREATE);
+    if (h_prop < 0) return h_prop;
+
+    /* The default is contiguous storage */
+    if (pars->Chunking == CHUNK_NONE) return h_prop;
+
+    hsize_t chunk[3];
+    cubeChunkShape(pars, tau_size, k_size, chunk);
+    if (setChunkFilters(h_prop, pars, 3, chunk, tauAxis(pars->Layout)) != 0) {
+        H5Pclose(h_prop);
+        return -1;
+    }
+
+    return h_prop;
+}
+
+/* The same properties for the dataset of a single function, which is stored
+ * as [k][tau] in the fkt layout and as [tau][k] otherwise */
+hid_t createFunctionProperties(const struct params *pars, size_t tau_size,
+                               size_t k_size) {
+    hid_t h_prop = H5Pcreate(H5P_DATASET_CREATE);
+    if (h_prop < 0) return h_prop;
+
+    if (pars->Chunking == CHUNK_NONE) return h_prop;
+
+    /* Drop the function axis, which has length one in the chunks */
+    hsize_t chunk[3];
+    cubeChunkShape(pars, tau_size, k_size, chunk);
+    hsize_t function_chunk[2] = {chunk[1], chunk[2]};
+    if (pars->Layout == LAYOUT_TKF) {
+        function_chunk[0] = chunk[0];
+        function_chunk[1] = chunk[1];
+    }
+    if (setChunkFilters(h_prop, pars, 2, function_chunk,
+                        (pars->Layout == LAYOUT_FKT) ? 1 : 0) != 0) {
+        H5Pclose(h_prop);
+        return -1;
+    }
+
+    return h_prop;
+}
+
+/* Record the storage settings as attributes of the cube dataset h_data */
+int writeCompressionAttributes(hid_t h_data, const struct params *pars,
+                               size_t tau_size, size_t k_size) {
+    hid_t h_space, h_type, h_attr;
+    int err = 0;
+
+    /* The name of the chunking scheme */
+    const char *name = chunkingName(pars->Chunking);
+    h_space = H5Screate(H5S_SCALAR);
+    h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, strlen(name));
+    h_attr = H5Acreate1(h_data, "Chunking", h_type, h_space, H5P_DEFAULT);
+    err |= (H5Awrite(h_attr, h_type, name) < 0);
+    H5Aclose(h_attr);
+    H5Tclose(h_type);
+
+    /* The filter settings, where the predictive filter replaces shuffle */
+    const int shuffle = (pars->Prediction == PREDICT_NONE) ? pars->Shuffle : 0;
+    h_attr = H5Acreate1(h_data, "Shuffle", H5T_NATIVE_INT, h_space, H5P_DEFAULT);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_INT, &shuffle) < 0);
+    H5Aclose(h_attr);
+
+    h_attr = H5Acreate1(h_data, "Deflate level", H5T_NATIVE_INT, h_space, H5P_DEFAULT);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_INT, &pars->DeflateLevel) < 0);
+    H5Aclose(h_attr);
+
+    /* The prediction along the tau axis */
+    const char *prediction = predictionName(pars->Prediction);
+    h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, strlen(prediction));
+    h_attr = H5Acreate1(h_data, "Prediction", h_type, h_space, H5P_DEFAULT);
+    err |= (H5Awrite(h_attr, h_type, prediction) < 0);
+    H5Aclose(h_attr);
+    H5Tclose(h_type);
+    H5Sclose(h_space);
+
+    /* The chunk shape, in the order of the layout */
+    if (pars->Chunking != CHUNK_NONE) {
+        hsize_t chunk[3];
+        cubeChunkShape(pars, tau_size, k_size, chunk);
+
+        hsize_t dim[1] = {3};
+        h_space = H5Screate_simple(1, dim, NULL);
+        h_attr = H5Acreate1(h_data, "Chunk shape", H5T_NATIVE_HSIZE, h_space, H5P_DEFAULT);
+        err |= (H5Awrite(h_attr, H5T_NATIVE_HSIZE, chunk) < 0);
+        H5Aclose(h_attr);
+        H5Sclose(h_space);
+    }
+
+    return err;
+}
+
+/* Does the filter pipeline of the dataset h_data contain the given filter? */
+static int hasFilter(hid_t h_data, H5Z_filter_t filter) {
+    hid_t h_prop = H5Dget_create_plist(h_data);
+    int found = 0;
+
+    int nfilters = H5Pget_nfilters(h_prop);
+    for (int i=0; i<nfilters; i++) {
+        unsigned int flags;
+        size_t nelements = 0;
+        unsigned int filter_config;
+        if (H5Pget_filter2(h_prop, i, &flags, &nelements, NULL, 0, NULL,
+                           &filter_config) == filter) {
+            found = 1;
+        }
+    }
+
+    H5Pclose(h_prop);
+    return found;
+}
+
+/* Should the cube be written as chunks that we compress ourselves? */
+int useDirectChunkWrites(hid_t h_data, const struct params *pars) {
+#if H5_VERSION_GE(1,10,3)
+    if (pars->Chunking == CHUNK_NONE) return 0;
+    /* Direct chunk writes are not supported with MPI-IO */
+    if (parallelSize() > 1) return 0;
+    return hasFilter(h_data, H5Z_FILTER_SHUFFLE) || hasFilter(h_data, H5Z_FILTER_DEFLATE)
+           || hasFilter(h_data, H5Z_FILTER_PREDICTIVE);
+#else
+    return 0;
+#endif
+}
+
+/* Byte shuffle of n elements of the given size, as done by the HDF5 shuffle
+ * filter: first all the first bytes, then all the second bytes, etc. */
+static void shuffleBytes(const unsigned char *in, unsigned char *out,
+                         size_t n, size_t size) {
+    for (size_t j=0; j<size; j++) {
+        for (size_t i=0; i<n; i++) {
+            out[j * n + i] = in[i * size + j];
+        }
+    }
+}
+
+/* One chunk, compressed in the same way as the HDF5 filter pipeline would */
+struct compressed_chunk {
+    hsize_t offset[3];
+    unsigned char *buffer;
+    size_t size;
+    int error;
+};
+
+/* Write the block, with dimensions block_shape in the order of the layout and
+ * starting at block_start in the dataset h_data, chunk by chunk. The block
+ * must consist of whole chunks along the function axis, which is always the
+ * case because chunks hold a single function. The chunks are filled and
+ * compressed in parallel, and then written directly with H5Dwrite_chunk,
+ * bypassing the serial filter pipeline of HDF5. The result is identical to
+ * what the filters would have produced, so any HDF5 reader can read it.
+ * Datasets of a single function have rank 2; their blocks are passed with a
+ * function axis of length one. */
+int writeChunksParallel(hid_t h_data, const struct params *pars,
+                        const real_t *block, const hsize_t block_shape[3],
+                        const hsize_t block_start[3]) {
+#if H5_VERSION_GE(1,10,3)
+    /* The chunk shape and filters of the dataset */
+    hsize_t chunk[3];
+    hid_t h_prop = H5Dget_create_plist(h_data);
+    const int rank = H5Pget_chunk(h_prop, 3, chunk);
+    H5Pclose(h_prop);
+    if (rank == 2) {
+        chunk[2] = chunk[1];
+        chunk[1] = chunk[0];
+        chunk[0] = 1;
+    }
+
+    /* The complete parameters of the predictive filter, if it is used */
+    size_t cd_nelmts = 0;
+    unsigned int cd_values[PREDICT_CD_MAX];
+    if (hasFilter(h_data, H5Z_FILTER_PREDICTIVE)) {
+        unsigned int flags;
+        cd_nelmts = PREDICT_CD_MAX;
+        h_prop = H5Dget_create_plist(h_data);
+        H5Pget_filter_by_id2(h_prop, H5Z_FILTER_PREDICTIVE, &flags, &cd_nelmts,
+                             cd_values, 0, NULL, NULL);
+        H5Pclose(h_prop);
+    }
+    const int predictive = (cd_nelmts > 0);
+
+    /* Otherwise, the shuffle and deflate filters are applied */
+    const int shuffle = !predictive && hasFilter(h_data, H5Z_FILTER_SHUFFLE);
+    const int deflate = !predictive && hasFilter(h_data, H5Z_FILTER_DEFLATE);
+    const int level = pars->DeflateLevel;
+
+    /* The number of chunks along each axis of the block */
+    hsize_t n_chunks[3];
+    for (int i=0; i<3; i++) {
+        n_chunks[i] = (block_shape[i] + chunk[i] - 1) / chunk[i];
+    }
+    const size_t total_chunks = n_chunks[0] * n_chunks[1] * n_chunks[2];
+    const size_t chunk_elements = chunk[0] * chunk[1] * chunk[2];
+    const size_t chunk_bytes = chunk_elements * sizeof(real_t);
+
+    /* Compress a batch of chunks in parallel, then write them in order */
+    const int threads = omp_get_max_threads();
+    const size_t batch = 4 * threads;
+    struct compressed_chunk *chunks = calloc(batch, sizeof(struct compressed_chunk));
+    if (chunks == NULL) return 1;
+
+    int err = 0;
+    for (size_t first = 0; first < total_chunks && !err; first += batch) {
+        const size_t count = (total_chunks - first < batch) ? total_chunks - first : batch;
+
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t c = 0; c < count; c++) {
+            struct compressed_chunk *cc = &chunks[c];
+            const size_t index = first + c;
+
+            /* The position of the chunk in the block */
+            hsize_t pos[3];
+            pos[0] = (index / (n_chunks[1] * n_chunks[2])) * chunk[0];
+            pos[1] = ((index / n_chunks[2]) % n_chunks[1]) * chunk[1];
+            pos[2] = (index % n_chunks[2]) * chunk[2];
+            for (int i=0; i<3; i++) {
+                cc->offset[i] = block_start[i] + pos[i];
+            }
+
+            /* Copy the chunk, padded with zeros at the edges of the dataset.
+             * The predictive filter needs only its own output buffer. */
+            real_t *values = calloc(chunk_elements, sizeof(real_t));
+            unsigned char *shuffled = NULL;
+            uLongf bound;
+            if (predictive) {
+                bound = predictiveBound(chunk_bytes);
+                cc->buffer = malloc(bound);
+            } else {
+                shuffled = shuffle ? malloc(chunk_bytes) : NULL;
+                bound = compressBound(chunk_bytes);
+                cc->buffer = deflate ? malloc(bound) : NULL;
+            }
+            cc->error = (values == NULL || (shuffle && shuffled == NULL)
+                         || ((deflate || predictive) && cc->buffer == NULL));
+            if (cc->error) {
+                free(values);
+                free(shuffled);
+                continue;
+            }
+
+            for (hsize_t i = 0; i < chunk[0] && pos[0] + i < block_shape[0]; i++) {
+                for (hsize_t j = 0; j < chunk[1] && pos[1] + j < block_shape[1]; j++) {
+                    const real_t *src = block + ((pos[0] + i) * block_shape[1]
+                                      + pos[1] + j) * block_shape[2] + pos[2];
+                    real_t *dest = values + (i * chunk[1] + j) * chunk[2];
+                    hsize_t n = chunk[2];
+                    if (pos[2] + n > block_shape[2]) n = block_shape[2] - pos[2];
+                    memcpy(dest, src, n * sizeof(real_t));
+                }
+            }
+
+            /* The predictive filter replaces the whole pipeline */
+            if (predictive) {
+                cc->size = predictiveEncode(cd_nelmts, cd_values, values,
+                                            chunk_bytes, cc->buffer, bound);
+                cc->error = (cc->size == 0);
+                free(values);
+                continue;
+            }
+
+            /* Apply the filters in the order of the pipeline */
+            unsigned char *data = (unsigned char *) values;
+            if (shuffle) {
+                shuffleBytes(data, shuffled, chunk_elements, sizeof(real_t));
+                data = shuffled;
+            }
+
+            if (deflate) {
+                cc->error = compress2(cc->buffer, &bound, data, chunk_bytes, level) != Z_OK;
+                cc->size = bound;
+                free(values);
+                free(shuffled);
+            } else {
+                /* Keep the (shuffled) chunk itself */
+                cc->buffer = data;
+                cc->size = chunk_bytes;
+                if (data != (unsigned char *) values) free(values);
+            }
+        }
+
+        /* HDF5 itself is not thread-safe, so the writes are serial */
+        for (size_t c = 0; c < count; c++) {
+            struct compressed_chunk *cc = &chunks[c];
+            if (!err && !cc->error) {
+                herr_t h_err = H5Dwrite_chunk(h_data, H5P_DEFAULT, 0,
+                                              cc->offset + (3 - rank),
+                                              cc->size, cc->buffer);
+                if (h_err < 0) {
+                    printf("Error while writing chunk %zu.\n", first + c);
+                    err = 1;
+                }
+            } else if (cc->error) {
+                printf("Error while compressing chunk %zu.\n", first + c);
+                err = 1;
+            }
+            free(cc->buffer);
+            cc->buffer = NULL;
+        }
+    }
+
+    free(chunks);
+
+    return err;
+#else
+    printf("Error: direct chunk writes need HDF5 1.10.3 or later.\n");
+    return 1;
+#endif
+}
+
+/* Round x to nearest, keeping only the leading bits of its 52 bit mantissa.
+ * The error is at most half a unit in the last kept bit. */
+static inline double roundMantissa(double x, int bits) {
+    if (bits >= 52) return x;
+
+    uint64_t u;
+    memcpy(&u, &x, sizeof(double));
+
+    /* Leave infinities and NaNs alone */
+    if (((u >> 52) & 0x7ff) == 0x7ff) return x;
+
+    const int drop = 52 - bits;
+    const uint64_t half = (uint64_t) 1 << (drop - 1);
+    const uint64_t mask = ~(((uint64_t) 1 << drop) - 1);
+    u = (u + half) & mask; //a carry correctly increments the exponent
+
+    double rounded;
+    memcpy(&rounded, &u, sizeof(double));
+    return isinf(rounded) ? x : rounded;
+}
+
+/* The lossy mode and error bound of the function with the given title: its
+ * own settings from LossyErrorBounds, or else the global ones */
+void lossySettings(const struct params *pars, const char *title, int *mode,
+                   double *bound) {
+    *mode = pars->LossyMode;
+    *bound = pars->LossyErrorBound;
+
+    for (int i=0; i<pars->NumLossyBounds && title != NULL; i++) {
+        if (strcmp(pars->LossyBoundTitles[i], title) == 0) {
+            *mode = pars->LossyBoundModes[i];
+            *bound = pars->LossyBounds[i];
+            return;
+        }
+    }
+}
+
+/* Apply the lossy rounding to the size values T[i * stride] of the function
+ * with the given title and store them at the same positions in out, which
+ * may be T itself. If out is NULL, the values are only rounded to find the
+ * errors. Returns the largest absolute and relative errors that were made,
+ * which are measured from the values as they are actually stored. */
+void quantizeFunction(const struct params *pars, const char *title,
+                      const real_t *T, real_t *out, size_t size, size_t stride,
+                      double *max_abs_error, double *max_rel_error) {
+    int mode;
+    double bound;
+    lossySettings(pars, title, &mode, &bound);
+
+    /* Functions without a bound are stored as they are */
+    if (mode == LOSSY_NONE) {
+        for (size_t i = 0; i < size && out != NULL && out != T; i++) {
+            out[i * stride] = T[i * stride];
+        }
+        *max_abs_error = 0.;
+        *max_rel_error = 0.;
+        return;
+    }
+
+    /* For a relative bound r, the number of bits is the same for all values:
+     * the error is at most 2^-(bits+1) |x| <= r |x| */
+    int rel_bits = (int) ceil(-log2(bound) - 1.0);
+    if (rel_bits < 0) rel_bits = 0;
+
+    /* For an absolute bound, x = 1.f * 2^e needs bits >= e - 1 - log2(bound) */
+    const int log2_bound = (int) floor(log2(bound));
+
+    double err_abs = 0;
+    double err_rel = 0;
+
+    #pragma omp parallel for schedule(static) reduction(max:err_abs,err_rel)
+    for (size_t i = 0; i < size; i++) {
+        const double x = T[i * stride];
+        double q;
+
+        if (mode == LOSSY_RELATIVE) {
+            q = roundMantissa(x, rel_bits);
+        } else if (fabs(x) <= bound) {
+            q = 0.;
+        } else {
+            int bits = ilogb(x) - 1 - log2_bound;
+            q = roundMantissa(x, bits < 0 ? 0 : bits);
+        }
+
+        const real_t stored = (real_t) q;
+        if (out != NULL) out[i * stride] = stored;
+
+        const double e = fabs(x - (double) stored);
+        if (e > err_abs) err_abs = e;
+        if (x != 0 && e / fabs(x) > err_rel) err_rel = e / fabs(x);
+    }
+
+    *max_abs_error = err_abs;
+    *max_rel_error = err_rel;
+}
+
+/* Write the attribute name of the dataset h_data, with n values of the given
+ * memory type or a scalar if n is zero, replacing any existing attribute */
+static int writeLossyAttribute(hid_t h_data, const char *name, hid_t h_type,
+                               const void *values, hsize_t n) {
+    if (H5Aexists(h_data, name) > 0 && H5Adelete(h_data, name) < 0) return 1;
+
+    hid_t h_space = (n == 0) ? H5Screate(H5S_SCALAR) : H5Screate_simple(1, &n, NULL);
+    hid_t h_attr = H5Acreate1(h_data, name, h_type, h_space, H5P_DEFAULT);
+    herr_t h_err = (h_attr < 0) ? -1 : H5Awrite(h_attr, h_type, values);
+    if (h_attr >= 0) H5Aclose(h_attr);
+    H5Sclose(h_space);
+
+    return h_err < 0;
+}
+
+/* Record the lossy settings as attributes of the cube dataset h_data: the
+ * global mode and bound, and the mode, bound and achieved maximum errors of
+ * each of the n_functions functions with the given titles. Attributes that
+ * are already there are replaced. */
+int writeLossyAttributes(hid_t h_data, const struct params *pars, char **titles,
+                         int n_functions, const double *max_abs_error,
+                         const double *max_rel_error) {
+    int err = 0;
+
+    /* The global settings, used for functions without their own */
+    const char *name = lossyModeName(pars->LossyMode);
+    hid_t h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, strlen(name));
+    err |= writeLossyAttribute(h_data, "Lossy mode", h_type, name, 0);
+    H5Tclose(h_type);
+    err |= writeLossyAttribute(h_data, "Lossy error bound", H5T_NATIVE_DOUBLE,
+                               &pars->LossyErrorBound, 0);
+
+    /* The settings of each function */
+    const char **modes = malloc(n_functions * sizeof(char *));
+    double *bounds = malloc(n_functions * sizeof(double));
+    if (n_functions > 0 && (modes == NULL || bounds == NULL)) {
+        printf("Error: could not allocate memory for the lossy settings.\n");
+        free(modes);
+        free(bounds);
+        return 1;
+    }
+    for (int i=0; i<n_functions; i++) {
+        int mode;
+        lossySettings(pars, titles[i], &mode, &bounds[i]);
+        modes[i] = lossyModeName(mode);
+    }
+
+    h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, H5T_VARIABLE);
+    err |= writeLossyAttribute(h_data, "Lossy modes", h_type, modes, n_functions);
+    H5Tclose(h_type);
+    err |= writeLossyAttribute(h_data, "Lossy error bounds", H5T_NATIVE_DOUBLE,
+                               bounds, n_functions);
+    free(modes);
+    free(bounds);
+
+    /* The achieved errors, one for each function */
+    err |= writeLossyAttribute(h_data, "Max absolute errors", H5T_NATIVE_DOUBLE,
+                               max_abs_error, n_functions);
+    err |= writeLossyAttribute(h_data, "Max relative errors", H5T_NATIVE_DOUBLE,
+                               max_rel_error, n_functions);
+
+    return err;
+}
+
+/* Overwrite the maximum errors recorded by writeLossyAttributes for the
+ * n_functions functions. Unlike creating them, this is allowed in SWMR mode. */
+int updateLossyErrors(hid_t h_data, int n_functions, const double *max_abs_error,
+                      const double *max_rel_error) {
+    const char *names[2] = {"Max absolute errors", "Max relative errors"};
+    const double *values[2] = {max_abs_error, max_rel_error};
+    int err = 0;
+
+    for (int i=0; i<2; i++) {
+        hid_t h_attr = H5Aopen(h_data, names[i], H5P_DEFAULT);
+        hid_t h_space = (h_attr < 0) ? -1 : H5Aget_space(h_attr);
+        if (h_space < 0 || H5Sget_simple_extent_npoints(h_space) != n_functions) {
+            printf("Error: the attribute '%s' does not hold %d values.\n", names[i], n_functions);
+            err = 1;
+        } else {
+            err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, values[i]) < 0);
+        }
+        if (h_space >= 0) H5Sclose(h_space);
+        if (h_attr >= 0) H5Aclose(h_attr);
+    }
+
+    return err;
+}
@@ -18,137 +18,435 @@
  ******************************************************************************/
 
 #include <stdlib.h>
-#include <string.h>
+#include <math.h>
 #include <assert.h>
 #include "../include/derivatives.h"
+#include "../include/streaming.h"
 
-#define arr_id(func,ik,itau,nk,ntau) ntau*nk*(func) + nk*(itau) + ik
+/* Weights w_j such that sum_j w_j f(x_j) is the derivative at x0 of the
+ * polynomial through the n points (x_j, f(x_j)). This is the derivative of
+ * the Lagrange basis, with the nodes taken relative to x0 for accuracy. */
+static void lagrangeDerivativeWeights(double x0, const double *x, int n,
+                                      double *w) {
+    for (int j=0; j<n; j++) {
+        double dj = x[j] - x0;
+        w[j] = 0;
+        for (int l=0; l<n; l++) {
+            if (l == j) continue;
+            double term = 1.0 / (dj - (x[l] - x0));
+            for (int m=0; m<n; m++) {
+                if (m == j || m == l) continue;
+                double dm = x[m] - x0;
+                term *= -dm / (dj - dm);
+            }
+            w[j] += term;
+        }
+    }
+}
 
-/* Is this the title of a new derivative, i.e. a function ending in "_prime",
- * NOT computed by CLASS, of some function that is computed by CLASS.
- *
- * Returns -1 if not a new derivative, otherwise returns the order of the
- * differentiated function among the matched functions (>=0).
- */
-int isNewDerivativeTitle(struct params *pars, char *title) {
-    /* Is the title long enough to end in '_prime'? */
-    if (strlen(title) < 6) return -1;
-
-    /* Does the title end in '_prime'? */
-    char *end = title + strlen(title) - 6;
-    if (strncmp(end, "_prime", 6) != 0) return -1;
-
-    /* Then check if it is a new function, i.e. not yet matched */
-    char isnew = 0;
-    for (int i=0; i<pars->NumDesiredFunctions; i++) {
-        if (strcmp(pars->DesiredFunctions[i], title) == 0
-            && pars->ClassPerturbIndices[i] < 0) { //new, i.e. has no matching index
-            isnew = 1;
-        }
-    }
-
-    /* If it isn't new, it's not a new derivative title */
-    if (isnew == 0) return -1;
-
-    /* Is it the derivative of a title XXX that exists (title = XXX_prime) */
-    int matched_index = -1;
-    int count = 0;
-    for (int i=0; i<pars->NumDesiredFunctions; i++) {
-        if (pars->ClassPerturbIndices[i] >= 0) { //function exists, has index
-            /* Does it match XXX? */
-            if (strncmp(pars->DesiredFunctions[i], title, strlen(title)-7) == 0) {
-                matched_index = count;
+/* Precompute the non-uniform finite difference stencils for d/dx at each
+ * of the N increasing points x, which are conformal times or ln(k). A stencil
+ * of the given order uses order + 1 consecutive points: centred where
+ * possible, shifted inwards at the ends. */
+int initStencil(struct fd_stencil *st, const double *x, size_t N, int order) {
+    /* Use the highest order that the number of points allows */
+    if (order > (int) N - 1) {
+        order = (int) N - 1;
+    }
+
+    st->order = order;
+    st->width = order + 1;
+    st->N = N;
+    st->first = malloc(N * sizeof(size_t));
+    st->weights = malloc(N * st->width * sizeof(double));
+    st->weights_T = malloc(N * st->width * sizeof(double));
+    if (st->first == NULL || st->weights == NULL || st->weights_T == NULL) return 1;
+
+    const int half = order / 2;
+    for (size_t index_x = 0; index_x < N; index_x++) {
+        /* The first point of the stencil, kept within [0, N - width] */
+        size_t first = (index_x > half) ? index_x - half : 0;
+        if (first + st->width > N) {
+            first = N - st->width;
+        }
+
+        st->first[index_x] = first;
+        lagrangeDerivativeWeights(x[index_x], x + first, st->width,
+                                  st->weights + index_x * st->width);
+    }
+
+    /* The weights reordered as [j][point], see logarithmicSlope */
+    for (size_t index_x = 0; index_x < N; index_x++) {
+        for (int j = 0; j < st->width; j++) {
+            st->weights_T[j * N + index_x] = st->weights[index_x * st->width + j];
+        }
+    }
+
+    return 0;
+}
+
+/* Precompute quadrature weights for the integral over [x_{i-1}, x_i] at each
+ * of the N increasing points x_i. The weights integrate the polynomial
+ * through width = order consecutive points: the trapezoidal rule for order 2
+ * and a cubic for order 4, centred on the interval where possible. The
+ * weights of the first point, which ends no interval, are zero. */
+int initIntegralStencil(struct fd_stencil *st, const double *x, size_t N,
+                        int order) {
+    /* The two point Gauss-Legendre rule is exact for cubics */
+    const double gauss = 0.5 / sqrt(3.0);
+
+    /* Use the highest order that the number of points allows */
+    if (order > (int) N) {
+        order = (int) N;
+    }
+    if (order < 2) {
+        order = 2;
+    }
+
+    st->order = order;
+    st->width = order;
+    st->N = N;
+    st->first = calloc(N, sizeof(size_t));
+    st->weights = calloc(N * st->width, sizeof(double));
+    st->weights_T = NULL;
+    if (st->first == NULL || st->weights == NULL) return 1;
+
+    /* A single point has no intervals */
+    if (N < 2) return 0;
+
+    const int half = st->width / 2;
+    for (size_t index_x = 1; index_x < N; index_x++) {
+        /* The first point of the stencil, kept within [0, N - width] */
+        size_t first = (index_x > half) ? index_x - half : 0;
+        if (first + st->width > N) {
+            first = N - st->width;
+        }
+        st->first[index_x] = first;
+
+        /* Integrate the Lagrange basis over [x_{i-1}, x_i], relative to x_i */
+        const double *nodes = x + first;
+        const double h = x[index_x] - x[index_x - 1];
+        const double x_g[2] = {-h * (0.5 - gauss), -h * (0.5 + gauss)};
+        double *w = st->weights + index_x * st->width;
+
+        for (int j = 0; j < st->width; j++) {
+            double dj = nodes[j] - x[index_x];
+            for (int g = 0; g < 2; g++) {
+                double L = 1.0;
+                for (int l = 0; l < st->width; l++) {
+                    if (l == j) continue;
+                    double dl = nodes[l] - x[index_x];
+                    L *= (x_g[g] - dl) / (dj - dl);
+                }
+                w[j] += 0.5 * h * L;
             }
-            count++;
         }
     }
 
-    return matched_index;
+    return 0;
 }
 
-/* This needs to happen after reading the perturb data */
-int computeDerivatives(struct perturb_data *data, struct params *pars,
-                       struct units *us) {
-    /* Find the titles of new derivatives */
-    int derivatives = 0;
-    for (int i=0; i<pars->NumDesiredFunctions; i++) {
-        if (isNewDerivativeTitle(pars, pars->DesiredFunctions[i]) >= 0) {
-            derivatives++;
+int cleanStencil(struct fd_stencil *st) {
+    free(st->first);
+    free(st->weights);
+    free(st->weights_T);
+
+    return 0;
+}
+
+/* Time derivative dT/dx = (dtau/dx) dT/dtau of a single function T, stored
+ * as [tau][k], using the precomputed stencils. The factors dtau/dx are given
+ * per time, or factor is NULL for x = tau. Each output row is a weighted sum
+ * of a few contiguous input rows, which vectorizes along k. The rows are
+ * independent and are computed in parallel. */
+void differentiateFunction(const struct fd_stencil *st, const double *T,
+                           double *dT, size_t Nk, const double *factor) {
+    const int width = st->width;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t index_tau = 0; index_tau < st->N; index_tau++) {
+        const double *w = st->weights + index_tau * width;
+        const double *T_first = T + st->first[index_tau] * Nk;
+        double *out = dT + index_tau * Nk;
+
+        #pragma omp simd
+        for (size_t index_k = 0; index_k < Nk; index_k++) {
+            out[index_k] = w[0] * T_first[index_k];
+        }
+
+        for (int j = 1; j < width; j++) {
+            const double wj = w[j];
+            const double *T_j = T_first + j * Nk;
+
+            #pragma omp simd
+            for (size_t index_k = 0; index_k < Nk; index_k++) {
+                out[index_k] += wj * T_j[index_k];
+            }
+        }
+
+        /* Change the variable while the row is still in cache. This is done
+         * after the sum, which may involve large cancellations. */
+        if (factor != NULL) {
+            const double c = factor[index_tau];
+
+            #pragma omp simd
+            for (size_t index_k = 0; index_k < Nk; index_k++) {
+                out[index_k] *= c;
+            }
         }
     }
+}
 
-    /* We are done if there are no new derivatives */
-    if (derivatives == 0) return 0;
+/* The derivative at point index_x of the samples f, using a single stencil */
+static inline double applyStencil(const struct fd_stencil *st, size_t index_x,
+                                  const double *f) {
+    const double *w = st->weights + index_x * st->width;
+    const double *f_first = f + st->first[index_x];
 
-    /* Reallocate enough memory for the derivatives */
-    data->n_functions += derivatives;
-    pars->MatchedFunctions += derivatives;
-    data->delta = realloc(data->delta, data->n_functions * data->k_size * data->tau_size * sizeof(double));
+    double sum = 0;
+    for (int j = 0; j < st->width; j++) {
+        sum += w[j] * f_first[j];
+    }
+    return sum;
+}
 
-    /* Also expand the Omega array, to keep the data structure simple */
-    data->Omega = realloc(data->Omega, data->n_functions * data->tau_size * sizeof(double));
+/* Cumulative conformal time integral I(tau) of a single function T, stored
+ * as [tau][k], from the first sampled time onwards. Each row of I is the
+ * previous row plus a weighted sum of a few rows of T. This recurrence runs
+ * over tau, so the work is split into blocks of wavenumbers instead, and
+ * vectorized along k within each block. With T in internal units and tau in
+ * U_T, the integral is in internal units as well. */
+void integrateFunction(const struct fd_stencil *st, const double *T,
+                       double *I, size_t Nk) {
+    const size_t Ntau = st->N;
+    const int width = st->width;
 
-    /* Just fill the rest of the Omega array with zeros */
-    int end_of_original_array = (data->n_functions - derivatives) * data->tau_size;
-    int additional_elements = derivatives * data->tau_size;
-    memset(data->Omega + end_of_original_array, 0, additional_elements * sizeof(double));
+    #pragma omp parallel for schedule(static)
+    for (size_t block = 0; block < Nk; block += INTEGRAL_K_BLOCK) {
+        const size_t k_end = (block + INTEGRAL_K_BLOCK < Nk) ? block + INTEGRAL_K_BLOCK : Nk;
 
-    printf("Computing %d extra derivatives.\n", derivatives);
+        /* The integral vanishes at the first time */
+        #pragma omp simd
+        for (size_t index_k = block; index_k < k_end; index_k++) {
+            I[index_k] = 0.;
+        }
 
-    if (data->delta == NULL) {
-        printf("Error: could not reallocate memory to compute derivatives.\n");
-        return 1;
+        for (size_t index_tau = 1; index_tau < Ntau; index_tau++) {
+            const double *w = st->weights + index_tau * width;
+            const double *T_first = T + st->first[index_tau] * Nk;
+            const double *previous = I + (index_tau - 1) * Nk;
+            double *row = I + index_tau * Nk;
+
+            #pragma omp simd
+            for (size_t index_k = block; index_k < k_end; index_k++) {
+                row[index_k] = previous[index_k] + w[0] * T_first[index_k];
+            }
+
+            for (int j = 1; j < width; j++) {
+                const double wj = w[j];
+                const double *T_j = T_first + j * Nk;
+
+                #pragma omp simd
+                for (size_t index_k = block; index_k < k_end; index_k++) {
+                    row[index_k] += wj * T_j[index_k];
+                }
+            }
+        }
     }
+}
+
+/* Logarithmic slope dln(T)/dln(k) of a single function T, stored as [tau][k],
+ * using stencils in ln(k). The derivative runs along the contiguous k axis.
+ * In the interior, each stencil starts order/2 points before its wavenumber,
+ * so with the weights stored as [j][k] the inner loop is a plain vector
+ * operation. The shifted stencils at the ends are done separately. Where T
+ * vanishes, the slope is not finite and is set to 0 instead. Returns the
+ * number of such points. */
+size_t logarithmicSlope(const struct fd_stencil *st, const double *T,
+                        double *out, size_t Ntau) {
+    const size_t Nk = st->N;
+    const int width = st->width;
+    const size_t half = st->order / 2;
+    const double *W = st->weights_T;
+
+    /* The wavenumbers with centred stencils are [begin, end) */
+    const size_t begin = half;
+    const size_t end = Nk + 1 + half - width;
 
-    size_t Nk = data->k_size;
-    size_t Ntau = data->tau_size;
-    size_t Nf = data->n_functions;
+    size_t n_zero = 0;
 
-    /* Compute the new derivatives.
-     * NB: the derivatives come after the CLASS functions, regardless of
-     * their order in the titles string. */
+    #pragma omp parallel for schedule(static) reduction(+:n_zero)
+    for (size_t index_tau = 0; index_tau < Ntau; index_tau++) {
+        const double *row = T + index_tau * Nk;
+        double *slope = out + index_tau * Nk;
 
-    /* The index for data->delta, not CLASS index, nor index in titles string */
-    int index_func = Nf - derivatives;
+        /* The shifted stencils at both ends */
+        for (size_t index_k = 0; index_k < begin; index_k++) {
+            slope[index_k] = applyStencil(st, index_k, row);
+        }
+        for (size_t index_k = end; index_k < Nk; index_k++) {
+            slope[index_k] = applyStencil(st, index_k, row);
+        }
 
-    /* For each requested title */
-    for (int i=0; i<pars->NumDesiredFunctions; i++) {
-        int deriv_of = isNewDerivativeTitle(pars, pars->DesiredFunctions[i]);
+        /* The centred stencils, vectorized along k */
+        const double *row_first = row - half;
 
-        /* Ensure that this is a new derivative */
-        if (deriv_of < 0) continue;
+        #pragma omp simd
+        for (size_t index_k = begin; index_k < end; index_k++) {
+            slope[index_k] = W[index_k] * row_first[index_k];
+        }
 
+        for (int j = 1; j < width; j++) {
+            const double *Wj = W + j * Nk;
+            const double *row_j = row_first + j;
 
-        /* For each wavenumber */
-        for (size_t index_k = 0; index_k < Nk; index_k++) {
-            /* Set the derivative to a forward difference at the initial time */
-            double Ti = data->delta[arr_id(deriv_of,index_k,0,Nk,Ntau)];
-            double Tp = data->delta[arr_id(deriv_of,index_k,1,Nk,Ntau)];
-            double dtau_i = exp(data->log_tau[1]) - exp(data->log_tau[0]);
-            data->delta[arr_id(index_func,index_k,0,Nk,Ntau)] = (Tp-Ti)/dtau_i;
-
-            /* Set the derivative to a backward estimate at the final time */
-            double Tf = data->delta[arr_id(deriv_of,index_k,Ntau-1,Nk,Ntau)];
-            double Tm = data->delta[arr_id(deriv_of,index_k,Ntau-2,Nk,Ntau)];
-            double dtau_f = exp(data->log_tau[Ntau-1]) - exp(data->log_tau[Ntau-2]);
-            data->delta[arr_id(index_func,index_k,Ntau-1,Nk,Ntau)] = (Tf-Tm)/dtau_f;
-
-            /* For each intermediate time, use a centred difference */
-            for (size_t index_tau = 1; index_tau < Ntau-1; index_tau++) {
-                double T0 = data->delta[arr_id(deriv_of,index_k,(index_tau-1),Nk,Ntau)];
-                double T1 = data->delta[arr_id(deriv_of,index_k,(index_tau+1),Nk,Ntau)];
-
-                double tau0 = exp(data->log_tau[index_tau - 1]);
-                double tau1 = exp(data->log_tau[index_tau + 1]);
-                double dTdtau = (T1 - T0)/(tau1 - tau0);
-
-                data->delta[arr_id(index_func,index_k,index_tau,Nk,Ntau)] = dTdtau;
+            #pragma omp simd
+            for (size_t index_k = begin; index_k < end; index_k++) {
+                slope[index_k] += Wj[index_k] * row_j[index_k];
             }
         }
 
-        index_func++;
+        /* From dT/dln(k) to dln(T)/dln(k) */
+        #pragma omp simd reduction(+:n_zero)
+        for (size_t index_k = 0; index_k < Nk; index_k++) {
+            const int zero = (row[index_k] == 0.);
+            slope[index_k] = zero ? 0. : slope[index_k] / row[index_k];
+            n_zero += zero;
+        }
+    }
+
+    return n_zero;
+}
+
+/* The factors dtau/dx at each time, which turn conformal time derivatives
+ * into derivatives with respect to the time variable x. With H in 1/U_T, we
+ * have d ln(a)/dtau = aH, dz/dtau = -H and dt/dtau = a. This needs the
+ * background quantities, so it can only be done after reading them. */
+void timeVariableFactors(const struct perturb_data *data, int variable,
+                         double *factor) {
+    for (int index_tau = 0; index_tau < data->tau_size; index_tau++) {
+        double a = 1.0 / (1.0 + data->redshift[index_tau]);
+        double H = data->Hubble_H[index_tau];
+
+        if (variable == TIME_LOG_A) {
+            factor[index_tau] = 1.0 / (a * H);
+        } else if (variable == TIME_REDSHIFT) {
+            factor[index_tau] = -1.0 / H;
+        } else if (variable == TIME_COSMIC) {
+            factor[index_tau] = 1.0 / a;
+        } else {
+            factor[index_tau] = 1.0;
+        }
+    }
+}
+
+/* Compute the derived function index_func of the plan from its parent T */
+int computeDerivedEntry(const struct perturb_data *data, int index_func,
+                        const double *T, double *dT) {
+    const struct extraction_plan *plan = data->plan;
+    const struct extraction_entry *entry = &plan->entries[index_func];
+
+    /* Wavenumber derivatives */
+    if (entry->type == ENTRY_K_DERIVATIVE) {
+        size_t n_zero = logarithmicSlope(plan->k_stencil, T, dT, data->tau_size);
+        if (n_zero > 0) {
+            printf("WARNING: the parent of '%s' vanishes at %zu points, where the slope is set to 0.\n",
+                   entry->title, n_zero);
+        }
+        return 0;
+    }
+
+    /* Time integrals */
+    if (entry->type == ENTRY_INTEGRAL) {
+        integrateFunction(plan->integral_stencil, T, dT, data->k_size);
+        return 0;
+    }
+
+    /* Conformal time derivatives need no change of variables */
+    if (entry->variable == TIME_CONFORMAL) {
+        differentiateFunction(plan->stencil, T, dT, data->k_size, NULL);
+        return 0;
     }
 
+    double *factor = malloc(data->tau_size * sizeof(double));
+    if (factor == NULL) return 1;
+
+    timeVariableFactors(data, entry->variable, factor);
+    differentiateFunction(plan->stencil, T, dT, data->k_size, factor);
+    free(factor);
+
     return 0;
+}
+
+/* This needs to happen after reading the perturb data. The derived functions
+ * are computed one at a time, straight into their slots in data->delta, which
+ * were allocated with the rest of the cube. A parent that was requested as
+ * well is taken from data->delta. Intermediates that were not requested are
+ * computed again for every function that needs them, in scratch space of a
+ * few slabs instead of the whole cube. In single precision, the stored
+ * parents are rounded, so every derived function is computed from CLASS in
+ * double precision and rounded once when stored. */
+int computeDerivatives(struct perturb_data *data, struct params *pars,
+                       struct units *us) {
+    const struct extraction_plan *plan = data->plan;
+
+    /* The number of new derivatives */
+    int derivatives = plan->n_entries - plan->n_class;
+
+    /* We are done if there are no new derivatives */
+    if (derivatives == 0) return 0;
+
+    /* In streaming mode, the derivatives are computed while writing */
+    if (data->delta == NULL) {
+        printf("Deferring %d derived functions to the streaming output.\n", derivatives);
+        return 0;
+    }
+
+    printf("Computing %d derived functions.\n", derivatives);
+
+    const size_t slab_size = data->k_size * data->tau_size;
+
+#ifdef SINGLE_PRECISION
+    /* The CLASS functions were already stored by readPerturbData */
+    double *work = allocateWorkspace(data);
+    if (work == NULL) return 1;
+
+    int err = 0;
+    for (int index_func = 0; index_func < plan->n_entries && !err; index_func++) {
+        if (plan->entries[index_func].type == ENTRY_CLASS) continue;
+        err = storeFunctionsWith(data, pars, index_func, 1,
+                                 data->delta + index_func * slab_size, work);
+    }
+    free(work);
+
+    return err;
+#else
+    /* The scratch space of computeFunctionSlab for the parent chains */
+    double *scratch = malloc(plan->max_depth * slab_size * sizeof(double));
+    if (scratch == NULL) {
+        printf("Error: could not allocate memory for intermediates.\n");
+        return 1;
+    }
+
+    /* Parents are scheduled before their derivatives */
+    int err = 0;
+    for (int i = 0; i < plan->n_schedule && !err; i++) {
+        int index_func = plan->schedule[i];
+        if (index_func >= plan->n_entries) continue;
+
+        const struct extraction_entry *entry = &plan->entries[index_func];
+        double *dT = data->delta + index_func * slab_size;
+        if (entry->parent < plan->n_entries) {
+            const double *T = data->delta + entry->parent * slab_size;
+            err = computeDerivedEntry(data, index_func, T, dT);
+        } else {
+            err = computeFunctionSlab(data, pars, index_func, dT, scratch);
+        }
+        if (err) printf("Error: could not compute '%s'.\n", entry->title);
+    }
+
+    free(scratch);
 
+    return err;
+#endif
 }
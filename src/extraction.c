@@ -0,0 +1,405 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../include/extraction.h"
+#include "../include/class_transfer.h"
+#include "../include/derivatives.h"
+
+/* Suffixes of derived titles, XXX_suffix being derived from XXX */
+static const struct {
+    const char *suffix;
+    int type;
+    int variable;
+} derived_suffixes[] = {
+    {"_prime", ENTRY_DERIVATIVE, TIME_CONFORMAL},
+    {"_dloga", ENTRY_DERIVATIVE, TIME_LOG_A},
+    {"_dz", ENTRY_DERIVATIVE, TIME_REDSHIFT},
+    {"_dt", ENTRY_DERIVATIVE, TIME_COSMIC},
+    {"_dlnk", ENTRY_K_DERIVATIVE, TIME_CONFORMAL},
+    {"_integral", ENTRY_INTEGRAL, TIME_CONFORMAL}
+};
+
+/* Find the entry with the given title among the n_total entries so far */
+static int findEntry(const struct extraction_plan *plan, const char *title) {
+    for (int i = 0; i < plan->n_total; i++) {
+        if (strcmp(plan->entries[i].title, title) == 0) return i;
+    }
+    return -1;
+}
+
+/* Append an empty entry with a copy of the title and return its index */
+static int addEntry(struct extraction_plan *plan, const char *title) {
+    struct extraction_entry *entries = realloc(plan->entries,
+                        (plan->n_total + 1) * sizeof(struct extraction_entry));
+    if (entries == NULL) return -1;
+    plan->entries = entries;
+
+    struct extraction_entry *entry = &plan->entries[plan->n_total];
+    entry->type = ENTRY_CLASS;
+    entry->source = NULL;
+    entry->scale = 1.0;
+    entry->ba_index = -1;
+    entry->parent = -1;
+    entry->variable = TIME_CONFORMAL;
+    entry->depth = 0;
+    entry->offset = 0;
+    entry->title = malloc(strlen(title) + 1);
+    strcpy(entry->title, title);
+
+    return plan->n_total++;
+}
+
+/* Resolve a title to an entry of the plan, adding entries as needed. A title
+ * is either a CLASS function or derived from one, such as XXX_prime, XXX_dlnk
+ * or XXX_integral,
+ * where XXX can itself be resolved.
+ * Each function is added only once, so intermediates are shared between
+ * titles, and parents are always added before their derivatives.
+ *
+ * Returns -1 if the title cannot be computed, otherwise the entry index.
+ */
+static int resolveTitle(struct extraction_plan *plan, struct class_titles *cat,
+                        struct perturbations *pt, const char *title) {
+    int index_md = pt->index_md_scalars;  // scalar mode
+    int index_ic = 0;                     // index of the initial condition
+
+    /* Has the function already been planned? */
+    int index = findEntry(plan, title);
+    if (index >= 0) return index;
+
+    /* Is it computed by CLASS? */
+    for (int i = 0; i < cat->num; i++) {
+        if (strcmp(cat->pairs[i].title, title) != 0) continue;
+
+        index = addEntry(plan, title);
+        if (index < 0) return -1;
+
+        struct extraction_entry *entry = &plan->entries[index];
+        int index_tp = cat->pairs[i].pt_index;  // CLASS index
+        entry->type = ENTRY_CLASS;
+        entry->source = pt->sources[index_md][index_ic * pt->tp_size[index_md] + index_tp];
+        entry->scale = unitConversionFactor(entry->title, plan->unit_length_factor,
+                                            plan->unit_time_factor);
+        entry->ba_index = cat->pairs[i].ba_index;
+
+        return index;
+    }
+
+    /* Is it derived from a function XXX that can be resolved? */
+    const size_t len = strlen(title);
+    const int num_suffixes = sizeof(derived_suffixes) / sizeof(derived_suffixes[0]);
+    for (int i = 0; i < num_suffixes; i++) {
+        const size_t suffix = strlen(derived_suffixes[i].suffix);
+        if (len <= suffix) continue;
+        if (strcmp(title + len - suffix, derived_suffixes[i].suffix) != 0) continue;
+
+        char *base = malloc(len - suffix + 1);
+        strncpy(base, title, len - suffix);
+        base[len - suffix] = '\0';
+        int parent = resolveTitle(plan, cat, pt, base);
+        free(base);
+
+        if (parent < 0) return -1;
+
+        /* Derived functions are computed from functions in internal units,
+         * so they are in internal units as well */
+        index = addEntry(plan, title);
+        if (index < 0) return -1;
+
+        struct extraction_entry *entry = &plan->entries[index];
+        entry->type = derived_suffixes[i].type;
+        entry->parent = parent;
+        entry->variable = derived_suffixes[i].variable;
+        entry->depth = plan->entries[parent].depth + 1;
+
+        return index;
+    }
+
+    return -1;
+}
+
+/* Resolve the CLASS pointers, unit factors and offsets of all the exported
+ * functions once, so that the extraction itself is a plain streaming loop.
+ * The derived functions are resolved here as well, as a dependency graph, so
+ * that the final number of functions is known before anything is allocated.
+ *
+ * The entries are ordered as in the output: first the requested CLASS
+ * functions, then the requested derived functions, and finally the
+ * intermediates that are needed for the derivatives but not exported. */
+int compileExtractionPlan(struct extraction_plan *plan, struct params *pars,
+                          struct class_titles *cat, struct units *us,
+                          struct perturbations *pt) {
+    int index_md = pt->index_md_scalars;  // scalar mode
+
+    /* Size of the perturbations */
+    const size_t k_size = pt->k_size[index_md];
+    const size_t tau_size = pt->tau_size;
+
+    /* CLASS to internal units conversion factor */
+    plan->unit_length_factor = MPC_METRES / us->UnitLengthMetres;
+    plan->unit_time_factor = plan->unit_length_factor / us->SpeedOfLight;
+
+    plan->k_size = k_size;
+    plan->tau_size = tau_size;
+    plan->k = malloc(k_size * sizeof(double));
+
+    for (size_t index_k = 0; index_k < k_size; index_k++) {
+        /* Convert k from 1/Mpc to 1/U_L */
+        plan->k[index_k] = pt->k[index_md][index_k] / plan->unit_length_factor;
+    }
+
+    /* Convert the conformal times from Mpc to U_T */
+    plan->tau = malloc(tau_size * sizeof(double));
+    for (size_t index_tau = 0; index_tau < tau_size; index_tau++) {
+        plan->tau[index_tau] = pt->tau_sampling[index_tau] * plan->unit_time_factor;
+    }
+
+    /* The finite difference stencils are the same for all derivatives */
+    plan->stencil = malloc(sizeof(struct fd_stencil));
+    if (plan->stencil == NULL) return 1;
+    initStencil(plan->stencil, plan->tau, tau_size, pars->DerivativeOrder);
+
+    /* Wavenumber derivatives use stencils in ln(k) */
+    double *log_k = malloc(k_size * sizeof(double));
+    plan->k_stencil = malloc(sizeof(struct fd_stencil));
+    if (log_k == NULL || plan->k_stencil == NULL) return 1;
+    for (size_t index_k = 0; index_k < k_size; index_k++) {
+        log_k[index_k] = log(plan->k[index_k]);
+    }
+    initStencil(plan->k_stencil, log_k, k_size, pars->DerivativeOrder);
+    free(log_k);
+
+    /* Time integrals use quadrature weights of the same order */
+    plan->integral_stencil = malloc(sizeof(struct fd_stencil));
+    if (plan->integral_stencil == NULL) return 1;
+    initIntegralStencil(plan->integral_stencil, plan->tau, tau_size,
+                        pars->DerivativeOrder);
+
+    /* Build the dependency graph, in the order in which entries are added */
+    plan->entries = NULL;
+    plan->n_total = 0;
+
+    /* The entries that are exported, in the order of the output */
+    int *requested = malloc(pars->NumDesiredFunctions * sizeof(int));
+    int n_requested = 0;
+
+    /* The CLASS functions come first, then the derived functions, regardless
+     * of their order in the titles string */
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < pars->NumDesiredFunctions; i++) {
+            int is_class = pars->ClassPerturbIndices[i] >= 0;
+            if ((pass == 0) != is_class) continue;
+
+            int index = resolveTitle(plan, cat, pt, pars->DesiredFunctions[i]);
+            if (index < 0) {
+                printf("Ignoring '%s', which cannot be derived from CLASS functions.\n",
+                       pars->DesiredFunctions[i]);
+                continue;
+            }
+
+            /* Export each function only once */
+            int duplicate = 0;
+            for (int j = 0; j < n_requested; j++) {
+                if (requested[j] == index) duplicate = 1;
+            }
+            if (!duplicate) requested[n_requested++] = index;
+        }
+
+        if (pass == 0) plan->n_class = n_requested;
+    }
+
+    plan->n_entries = n_requested;
+
+    /* Move the exported entries to the front, keeping the intermediates in
+     * the order in which they were added */
+    const int n_total = plan->n_total;
+    int *slot = malloc(n_total * sizeof(int));
+    for (int i = 0; i < n_total; i++) slot[i] = -1;
+    for (int j = 0; j < n_requested; j++) slot[requested[j]] = j;
+    int next = n_requested;
+    for (int i = 0; i < n_total; i++) {
+        if (slot[i] < 0) slot[i] = next++;
+    }
+
+    struct extraction_entry *ordered = malloc(n_total * sizeof(struct extraction_entry));
+    if (n_total > 0 && ordered == NULL) return 1;
+    for (int i = 0; i < n_total; i++) {
+        ordered[slot[i]] = plan->entries[i];
+        if (plan->entries[i].parent >= 0) {
+            ordered[slot[i]].parent = slot[plan->entries[i].parent];
+        }
+    }
+
+    /* A parent is always added before its derivatives, so evaluating the
+     * derivatives in the order of addition respects all dependencies */
+    plan->schedule = malloc(n_total * sizeof(int));
+    plan->n_schedule = 0;
+    plan->max_depth = 0;
+    for (int i = 0; i < n_total; i++) {
+        if (plan->entries[i].parent >= 0) {
+            plan->schedule[plan->n_schedule++] = slot[i];
+        }
+        if (plan->entries[i].depth > plan->max_depth) {
+            plan->max_depth = plan->entries[i].depth;
+        }
+    }
+
+    free(plan->entries);
+    free(requested);
+    free(slot);
+    plan->entries = ordered;
+
+    /* Exported functions live in data->delta, while intermediates are only
+     * ever computed one at a time, in scratch space */
+    for (int i = 0; i < n_total; i++) {
+        struct extraction_entry *entry = &plan->entries[i];
+        size_t position = (i < plan->n_entries) ? i : i - plan->n_entries;
+        entry->offset = tau_size * k_size * position;
+
+        const char *role = (i < plan->n_entries) ? "" : " (intermediate)";
+        if (entry->type == ENTRY_CLASS) {
+            printf("Unit conversion factor for '%s' is %f%s\n", entry->title,
+                   entry->scale, role);
+        } else {
+            const char *kind = (entry->type == ENTRY_INTEGRAL) ? "integral" : "derivative";
+            printf("Planned %s '%s' of '%s'%s\n", kind, entry->title,
+                   plan->entries[entry->parent].title, role);
+        }
+    }
+
+    printf("\n");
+
+    return 0;
+}
+
+/* Convert and store the transfer functions, count of them starting with the
+ * entry first, in the consecutive [tau][k] blocks of dest. Each (function,
+ * tau) block is a contiguous row of k_size values, both in CLASS and in dest,
+ * and the blocks are independent. Every element is computed in the same way
+ * regardless of the number of threads, so the result is identical to a
+ * serial run. The vectorized loop also does the same operations in the same
+ * order as a scalar loop, dividing twice by k rather than multiplying by a
+ * precomputed -1/k^2, so the result does not depend on the vectorization
+ * either. */
+int extractFunctions(const struct extraction_plan *plan, int first, int count,
+                     double *dest) {
+    const size_t k_size = plan->k_size;
+    const size_t tau_size = plan->tau_size;
+    const double *k = plan->k;
+
+    /* The destination offsets are relative to the first function */
+    if (count <= 0) return 0;
+    const size_t first_offset = plan->entries[first].offset;
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int index_f = 0; index_f < count; index_f++) {
+        for (size_t index_tau = 0; index_tau < tau_size; index_tau++) {
+            const struct extraction_entry *entry = &plan->entries[first + index_f];
+            const double *p = entry->source + index_tau * k_size;
+            double *T = dest + (entry->offset - first_offset) + index_tau * k_size;
+            const double scale = entry->scale;
+
+            /* Convert transfer functions from CLASS format to CAMB/HeWon/dexm/
+             * Eisenstein-Hu format by multiplying by -1/k^2, then convert from
+             * CLASS units to output units */
+            #pragma omp simd
+            for (size_t index_k = 0; index_k < k_size; index_k++) {
+                T[index_k] = -p[index_k] / k[index_k] / k[index_k] * scale;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Convert and store the times [first_tau, first_tau + n_tau) of the CLASS
+ * function index_func as a [tau][k] block in dest. Every value is computed
+ * as in extractFunctions and, in single precision, rounded once. */
+int extractTimes(const struct extraction_plan *plan, int index_func,
+                 size_t first_tau, size_t n_tau, real_t *dest) {
+    const size_t k_size = plan->k_size;
+    const double *k = plan->k;
+    const struct extraction_entry *entry = &plan->entries[index_func];
+    const double scale = entry->scale;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t index_tau = 0; index_tau < n_tau; index_tau++) {
+        const double *p = entry->source + (first_tau + index_tau) * k_size;
+        real_t *T = dest + index_tau * k_size;
+
+        #pragma omp simd
+        for (size_t index_k = 0; index_k < k_size; index_k++) {
+            T[index_k] = -p[index_k] / k[index_k] / k[index_k] * scale;
+        }
+    }
+
+    return 0;
+}
+
+/* Convert and store all the planned CLASS functions in the cube delta */
+int executeExtractionPlan(const struct extraction_plan *plan, double *delta) {
+    return extractFunctions(plan, 0, plan->n_class, delta);
+}
+
+/* The dimensions of an entry in internal units, as powers of the unit length
+ * and the unit time. For CLASS functions, they follow from the title, see
+ * unitPowers, and derived functions change those of their parent. */
+void entryUnits(const struct extraction_plan *plan, int index,
+                int *length_power, int *time_power) {
+    const struct extraction_entry *entry = &plan->entries[index];
+
+    if (entry->type == ENTRY_CLASS) {
+        unitPowers(entry->title, length_power, time_power);
+        return;
+    }
+
+    entryUnits(plan, entry->parent, length_power, time_power);
+
+    if (entry->type == ENTRY_DERIVATIVE && (entry->variable == TIME_CONFORMAL ||
+                                            entry->variable == TIME_COSMIC)) {
+        *time_power -= 1;
+    } else if (entry->type == ENTRY_K_DERIVATIVE) {
+        /* The logarithmic slope is dimensionless */
+        *length_power = 0;
+        *time_power = 0;
+    } else if (entry->type == ENTRY_INTEGRAL) {
+        *time_power += 1;
+    }
+}
+
+int cleanExtractionPlan(struct extraction_plan *plan) {
+    for (int i = 0; i < plan->n_total; i++) {
+        free(plan->entries[i].title);
+    }
+    free(plan->entries);
+    free(plan->schedule);
+    free(plan->k);
+    free(plan->tau);
+    cleanStencil(plan->stencil);
+    free(plan->stencil);
+    cleanStencil(plan->k_stencil);
+    free(plan->k_stencil);
+    cleanStencil(plan->integral_stencil);
+    free(plan->integral_stencil);
+
+    return 0;
+}
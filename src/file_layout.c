@@ -0,0 +1,203 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../include/file_layout.h"
+#include "../include/layout.h"
+#include "../include/parallel.h"
+#include "../include/precision.h"
+
+/* File creation properties. On parallel filesystems such as Lustre, the file
+ * space is allocated in pages of the stripe size: the metadata (groups,
+ * attributes, dataset headers and small datasets) is aggregated into a few
+ * pages, rather than scattered over the file in small blocks, and every
+ * dataset of at least a page starts on a stripe boundary. */
+hid_t createFileCreationProperties(const struct params *pars) {
+    hid_t h_fcpl = H5Pcreate(H5P_FILE_CREATE);
+    if (h_fcpl < 0 || !(pars->StripeSizeMB > 0)) return h_fcpl;
+
+    const hsize_t page_size = pars->StripeSizeMB * 1024 * 1024;
+    herr_t h_err = H5Pset_file_space_strategy(h_fcpl, H5F_FSPACE_STRATEGY_PAGE, 0, 1);
+    if (h_err >= 0) h_err = H5Pset_file_space_page_size(h_fcpl, page_size);
+    if (h_err < 0) printf("Error while enabling paged file space aggregation.\n");
+
+    return h_fcpl;
+}
+
+/* File access properties. The striped layout uses the latest file format,
+ * whose object headers and attribute storage are the most compact, and with
+ * MPI all metadata is read and written collectively, so that not every rank
+ * makes its own small requests. SWMR output needs the latest format too. */
+hid_t createFileAccessProperties(const struct params *pars) {
+    hid_t h_fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (h_fapl < 0) return h_fapl;
+
+    if (pars->StripeSizeMB > 0 || pars->SWMR) {
+        H5Pset_libver_bounds(h_fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+#ifdef WITH_MPI
+        H5Pset_all_coll_metadata_ops(h_fapl, 1);
+        H5Pset_coll_metadata_write(h_fapl, 1);
+#endif
+    } else {
+        H5Pset_libver_bounds(h_fapl, H5F_LIBVER_V18, H5F_LIBVER_LATEST);
+    }
+
+    return h_fapl;
+}
+
+/* Drop the file from the page cache, so that the next open is cold. This only
+ * affects the local cache, and only pages that have been written back. */
+static void evictFromCache(const char *fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Read access properties with a page buffer, if the file has pages */
+static hid_t createReaderProperties(const char *fname) {
+    hid_t h_fapl = H5Pcreate(H5P_FILE_ACCESS);
+
+    hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (h_file < 0) return h_fapl;
+    hid_t h_fcpl = H5Fget_create_plist(h_file);
+    H5F_fspace_strategy_t strategy;
+    hsize_t page_size = 0;
+    H5Pget_file_space_strategy(h_fcpl, &strategy, NULL, NULL);
+    H5Pget_file_space_page_size(h_fcpl, &page_size);
+    H5Pclose(h_fcpl);
+    H5Fclose(h_file);
+
+    if (strategy == H5F_FSPACE_STRATEGY_PAGE) {
+        H5Pset_page_buffer_size(h_fapl, BENCHMARK_PAGE_BUFFER * page_size, 0, 0);
+    }
+
+    return h_fapl;
+}
+
+/* Time what a reader of the output file does, starting from a cold cache:
+ * opening the file and reading the header (the open latency), and reading a
+ * single transfer function (the read latency). With MPI, all ranks do this at
+ * the same time, each reading another function, as the ranks of a simulation
+ * would, and the slowest rank counts. The medians over BenchmarkOutput
+ * repetitions are reported. */
+int benchmarkOutputFile(const char *fname, const struct params *pars) {
+    const int repeats = pars->BenchmarkOutput;
+    double *open_time = malloc(repeats * sizeof(double));
+    double *read_time = malloc(repeats * sizeof(double));
+    if (open_time == NULL || read_time == NULL) {
+        printf("Error: could not allocate memory for the benchmark.\n");
+        free(open_time);
+        free(read_time);
+        return 1;
+    }
+
+    hid_t h_fapl = createReaderProperties(fname);
+    real_t *slab = NULL;
+    size_t slab_bytes = 0;
+    int err = 0;
+
+    for (int r = 0; r < repeats && !err; r++) {
+        evictFromCache(fname);
+
+        /* Open the file, and read the header and the dataset metadata */
+        double start = wallTime();
+        hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, h_fapl);
+        if (h_file < 0) {
+            err = 1;
+            break;
+        }
+        hid_t h_grp = H5Gopen(h_file, "/Header", H5P_DEFAULT);
+        hid_t h_attr = H5Aopen(h_grp, "n_functions", H5P_DEFAULT);
+        int n_functions = 0;
+        err = (H5Aread(h_attr, H5T_NATIVE_INT, &n_functions) < 0);
+        H5Aclose(h_attr);
+        H5Gclose(h_grp);
+
+        hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+        hid_t h_space = H5Dget_space(h_data);
+        hsize_t dims[3];
+        err |= (h_data < 0 || n_functions < 1);
+        H5Sget_simple_extent_dims(h_space, dims, NULL);
+        open_time[r] = wallTime() - start;
+
+        /* Read one function, the slab or column that it occupies */
+        const int index_func = parallelRank() % (n_functions > 0 ? n_functions : 1);
+        hsize_t offset[3] = {index_func, 0, 0};
+        hsize_t count[3] = {1, dims[1], dims[2]};
+        if (pars->Layout == LAYOUT_TKF) {
+            offset[0] = 0;
+            offset[2] = index_func;
+            count[0] = dims[0];
+            count[2] = 1;
+        }
+        slab_bytes = count[0] * count[1] * count[2] * sizeof(real_t);
+        if (slab == NULL) slab = malloc(slab_bytes);
+
+        start = wallTime();
+        if (!err && slab != NULL) {
+            H5Sselect_hyperslab(h_space, H5S_SELECT_SET, offset, NULL, count, NULL);
+            hid_t h_memspace = H5Screate_simple(3, count, NULL);
+            err = (H5Dread(h_data, H5T_NATIVE_REAL, h_memspace, h_space,
+                           H5P_DEFAULT, slab) < 0);
+            H5Sclose(h_memspace);
+        }
+        read_time[r] = wallTime() - start;
+
+        H5Sclose(h_space);
+        H5Dclose(h_data);
+        H5Fclose(h_file);
+    }
+
+    H5Pclose(h_fapl);
+    free(slab);
+
+    err = maxOverRanks(err);
+    if (err) {
+        printf("Error while benchmarking '%s'.\n", fname);
+    } else {
+        /* The slowest rank of each repetition */
+        reduceMaxOverRanks(open_time, repeats);
+        reduceMaxOverRanks(read_time, repeats);
+        qsort(open_time, repeats, sizeof(double), compareDoubles);
+        qsort(read_time, repeats, sizeof(double), compareDoubles);
+
+        const double open_median = open_time[repeats / 2];
+        const double read_median = read_time[repeats / 2];
+        printf("Benchmark of %d cold opens on %d rank(s): open %.3f ms (min %.3f, max %.3f), read %.3f ms (min %.3f, max %.3f, %.1f MB/s).\n",
+               repeats, parallelSize(), 1e3 * open_median, 1e3 * open_time[0],
+               1e3 * open_time[repeats - 1], 1e3 * read_median,
+               1e3 * read_time[0], 1e3 * read_time[repeats - 1],
+               slab_bytes / (1024. * 1024.) / read_median);
+    }
+
+    free(open_time);
+    free(read_time);
+
+    return err;
+}
@@ -0,0 +1,343 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../include/function_datasets.h"
+#include "../include/layout.h"
+#include "../include/streaming.h"
+#include "../include/compression.h"
+
+/* Describe the dimensions L^length_power t^time_power, e.g. "U_L^2 U_t^-2" */
+void formatUnits(int length_power, int time_power, char *str, size_t len) {
+    const int powers[2] = {length_power, time_power};
+    const char *names[2] = {"U_L", "U_t"};
+    size_t used = 0;
+
+    str[0] = '\0';
+    for (int i=0; i<2; i++) {
+        if (powers[i] == 0) continue;
+        used += snprintf(str + used, len - used, "%s%s", used ? " " : "", names[i]);
+        if (powers[i] != 1) {
+            used += snprintf(str + used, len - used, "^%d", powers[i]);
+        }
+        if (used >= len) return;
+    }
+
+    if (used == 0) {
+        snprintf(str, len, "dimensionless");
+    }
+}
+
+/* Write a string attribute */
+static void writeStringAttribute(hid_t h_obj, const char *name, const char *value) {
+    hid_t h_space = H5Screate(H5S_SCALAR);
+    hid_t h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, strlen(value));
+    hid_t h_attr = H5Acreate1(h_obj, name, h_type, h_space, H5P_DEFAULT);
+    H5Awrite(h_attr, h_type, value);
+    H5Aclose(h_attr);
+    H5Tclose(h_type);
+    H5Sclose(h_space);
+}
+
+/* Create the dataset of function index_func, with its position index_cube
+ * in the combined cube, its units and its background density as attributes */
+static hid_t createFunctionDataset(hid_t h_fgrp, hid_t h_prop,
+                                   const struct perturb_data *data,
+                                   const struct units *us,
+                                   const hsize_t shape[2], int index_func,
+                                   int index_cube) {
+    const char *title = data->plan->entries[index_func].title;
+    if (!validDatasetName(title)) {
+        printf("Error: '%s' cannot be used as the name of a dataset.\n", title);
+        return -1;
+    }
+
+    hid_t h_space = H5Screate_simple(2, shape, NULL);
+    hid_t h_data = H5Dcreate(h_fgrp, title, H5T_NATIVE_REAL, h_space,
+                             H5P_DEFAULT, h_prop, H5P_DEFAULT);
+    H5Sclose(h_space);
+    if (h_data < 0) {
+        printf("Error while creating dataspace '%s'.\n", title);
+        return h_data;
+    }
+
+    /* The index of the function in the combined cube */
+    h_space = H5Screate(H5S_SCALAR);
+    hid_t h_attr = H5Acreate1(h_data, "Index", H5T_NATIVE_INT, h_space, H5P_DEFAULT);
+    H5Awrite(h_attr, H5T_NATIVE_INT, &index_cube);
+    H5Aclose(h_attr);
+
+    /* The units, and the factor that converts the values to cgs */
+    int length_power, time_power;
+    entryUnits(data->plan, index_func, &length_power, &time_power);
+    char units[DEFAULT_STRING_LENGTH];
+    formatUnits(length_power, time_power, units, DEFAULT_STRING_LENGTH);
+    writeStringAttribute(h_data, "Units", units);
+
+    double to_cgs = pow(us->UnitLengthMetres * 100, length_power) *
+                    pow(us->UnitTimeSeconds, time_power);
+    h_attr = H5Acreate1(h_data, "Conversion factor to cgs", H5T_NATIVE_DOUBLE,
+                        h_space, H5P_DEFAULT);
+    H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &to_cgs);
+    H5Aclose(h_attr);
+    H5Sclose(h_space);
+
+    /* The background density Omega(tau), zero if there is none */
+    hsize_t dim[1] = {data->tau_size};
+    h_space = H5Screate_simple(1, dim, NULL);
+    h_attr = H5Acreate1(h_data, "Omega", H5T_NATIVE_REAL, h_space, H5P_DEFAULT);
+    H5Awrite(h_attr, H5T_NATIVE_REAL, data->Omega + index_func * data->tau_size);
+    H5Aclose(h_attr);
+    H5Sclose(h_space);
+
+    return h_data;
+}
+
+/* Write the values T of one function, stored as [tau][k], to its dataset */
+static int writeFunction(hid_t h_data, struct params *pars, const real_t *T,
+                         real_t *scratch, const hsize_t shape[2],
+                         size_t tau_size, size_t k_size) {
+    /* Datasets in the fkt layout are stored as [k][tau] */
+    const real_t *out = T;
+    if (pars->Layout == LAYOUT_FKT) {
+        transposeCube(T, scratch, LAYOUT_FKT, 1, tau_size, k_size);
+        out = scratch;
+    }
+
+    herr_t h_err;
+    if (useDirectChunkWrites(h_data, pars)) {
+        hsize_t block_shape[3] = {1, shape[0], shape[1]};
+        hsize_t start[3] = {0, 0, 0};
+        h_err = writeChunksParallel(h_data, pars, out, block_shape, start);
+    } else {
+        h_err = H5Dwrite(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, out);
+    }
+
+    return h_err != 0;
+}
+
+/* Can the title be used as the name of a dataset in the group of functions?
+ * Titles with a '/' would name a path instead, and '.' is the group itself. */
+int validDatasetName(const char *title) {
+    return title[0] != '\0' && strchr(title, '/') == NULL && strcmp(title, ".") != 0;
+}
+
+/* Create the combined cube with the given name in the group h_grp as a
+ * virtual dataset, in the requested layout, which maps each of the
+ * n_functions titles to its own dataset in the group FUNCTIONS_GROUP */
+int createVirtualCube(hid_t h_grp, const char *cube_name,
+                      const struct params *pars, char **titles,
+                      int n_functions, size_t tau_size, size_t k_size) {
+    size_t shape_layout[3];
+    layoutShape(pars->Layout, n_functions, tau_size, k_size, shape_layout);
+    hsize_t shape_cube[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+    hid_t h_vspace = H5Screate_simple(3, shape_cube, NULL);
+
+    /* The datasets are [k][tau] in the fkt layout and [tau][k] otherwise */
+    hsize_t shape[2] = {tau_size, k_size};
+    if (pars->Layout == LAYOUT_FKT) {
+        shape[0] = k_size;
+        shape[1] = tau_size;
+    }
+    hid_t h_sspace = H5Screate_simple(2, shape, NULL);
+
+    /* The path of the function datasets within the file */
+    char path[256];
+    ssize_t path_length = H5Iget_name(h_grp, path, sizeof(path));
+    if (path_length <= 0 || path_length >= (ssize_t) sizeof(path)) {
+        printf("Error: could not find the path of the virtual dataset, or it is too long.\n");
+        H5Sclose(h_sspace);
+        H5Sclose(h_vspace);
+        return 1;
+    }
+
+    hid_t h_prop = H5Pcreate(H5P_DATASET_CREATE);
+    herr_t h_err = 0;
+    for (int i=0; i<n_functions && h_err >= 0; i++) {
+        /* The function occupies a slab, or a column in the tkf layout */
+        hsize_t start[3] = {i, 0, 0};
+        hsize_t count[3] = {1, shape_cube[1], shape_cube[2]};
+        if (pars->Layout == LAYOUT_TKF) {
+            start[0] = 0;
+            start[2] = i;
+            count[0] = shape_cube[0];
+            count[2] = 1;
+        }
+        H5Sselect_hyperslab(h_vspace, H5S_SELECT_SET, start, NULL, count, NULL);
+
+        char name[512];
+        int length = snprintf(name, sizeof(name), "%s/%s/%s", path, FUNCTIONS_GROUP,
+                              titles[i]);
+        if (!validDatasetName(titles[i]) || length >= (int) sizeof(name)) {
+            printf("Error: '%s' cannot be mapped to the virtual dataset.\n", titles[i]);
+            h_err = -1;
+            break;
+        }
+        h_err = H5Pset_virtual(h_prop, h_vspace, ".", name, h_sspace);
+        if (h_err < 0) printf("Error while mapping '%s' to the virtual dataset.\n", name);
+    }
+
+    hid_t h_data = -1;
+    if (h_err >= 0) {
+        H5Sselect_all(h_vspace);
+        h_data = H5Dcreate(h_grp, cube_name, H5T_NATIVE_REAL, h_vspace,
+                           H5P_DEFAULT, h_prop, H5P_DEFAULT);
+        if (h_data < 0)
+        printf("Error while creating dataspace '%s'.\n", cube_name);
+        H5Dclose(h_data);
+    }
+
+    H5Pclose(h_prop);
+    H5Sclose(h_sspace);
+    H5Sclose(h_vspace);
+
+    return h_data < 0;
+}
+
+/* Write every function of data to its own dataset in the existing group
+ * h_fgrp, named after its title. The functions take the positions starting
+ * at first_index in the combined cube. In lossy mode, the values are rounded
+ * and the errors recorded per function. */
+int addFunctionDatasets(hid_t h_fgrp, const struct perturb_data *data,
+                        struct params *pars, const struct units *us,
+                        int first_index, double *max_abs_error,
+                        double *max_rel_error) {
+    const size_t n_functions = data->n_functions;
+    const size_t tau_size = data->tau_size;
+    const size_t k_size = data->k_size;
+    const size_t slab_size = tau_size * k_size;
+
+    /* The datasets are [k][tau] in the fkt layout and [tau][k] otherwise */
+    hsize_t shape[2] = {tau_size, k_size};
+    if (pars->Layout == LAYOUT_FKT) {
+        shape[0] = k_size;
+        shape[1] = tau_size;
+    }
+
+    hid_t h_prop = createFunctionProperties(pars, tau_size, k_size);
+    hid_t *h_funcs = malloc(n_functions * sizeof(hid_t));
+    int err = (h_funcs == NULL);
+    for (int i=0; i<n_functions && !err; i++) {
+        h_funcs[i] = -1;
+    }
+    for (int i=0; i<n_functions && !err; i++) {
+        h_funcs[i] = createFunctionDataset(h_fgrp, h_prop, data, us, shape, i,
+                                           first_index + i);
+        err = (h_funcs[i] < 0);
+    }
+    H5Pclose(h_prop);
+
+    /* Compute the functions a block at a time in streaming mode */
+    const int block_size = (data->delta == NULL) ? streamingBlockSize(data, pars) : n_functions;
+    real_t *block = data->delta;
+    if (data->delta == NULL) {
+        printf("Streaming %d functions in blocks of %d (memory budget %g MB).\n",
+               data->n_functions, block_size, pars->MemoryBudgetMB);
+        block = malloc(block_size * slab_size * sizeof(real_t));
+    }
+    real_t *scratch = malloc(slab_size * sizeof(real_t));
+
+    /* In lossy mode, functions in data->delta are rounded in a copy */
+    const int copy = (pars->LossyMode != LOSSY_NONE && data->delta != NULL);
+    real_t *rounded = copy ? malloc(slab_size * sizeof(real_t)) : NULL;
+    if (block == NULL || scratch == NULL || (copy && rounded == NULL)) {
+        printf("Error: could not allocate memory for a block of functions.\n");
+        err = 1;
+    }
+
+    for (int first = 0; first < n_functions && !err; first += block_size) {
+        const int count = (first + block_size <= n_functions) ? block_size
+                                                              : n_functions - first;
+
+        if (data->delta == NULL) {
+            err = storeFunctions(data, pars, first, count, block);
+            if (err) break;
+        }
+
+        for (int j = 0; j < count && !err; j++) {
+            real_t *T = (data->delta == NULL) ? block + j * slab_size
+                                              : block + (first + j) * slab_size;
+
+            /* Round the values in lossy mode */
+            if (pars->LossyMode != LOSSY_NONE) {
+                real_t *dest = (rounded != NULL) ? rounded : T;
+                quantizeFunction(pars, data->plan->entries[first + j].title,
+                                 T, dest, slab_size, 1,
+                                 &max_abs_error[first + j],
+                                 &max_rel_error[first + j]);
+                T = dest;
+            }
+
+            err = writeFunction(h_funcs[first + j], pars, T, scratch, shape,
+                                tau_size, k_size);
+            if (err) printf("Error while writing function '%s'.\n",
+                            data->plan->entries[first + j].title);
+        }
+    }
+
+    if (block != data->delta) free(block);
+    free(scratch);
+    free(rounded);
+
+    for (int i=0; i<n_functions && h_funcs != NULL; i++) {
+        if (h_funcs[i] >= 0) H5Dclose(h_funcs[i]);
+    }
+    free(h_funcs);
+
+    return err;
+}
+
+/* Write every function to its own dataset in the group /Perturb/Functions,
+ * named after its title, so that readers can read any function without
+ * touching the others. The combined cube "Transfer functions" remains
+ * available as a virtual dataset, which the caller can annotate. In lossy
+ * mode, the values are rounded and the errors recorded per function. */
+int writeFunctionDatasets(hid_t h_grp, const struct perturb_data *data,
+                          struct params *pars, const struct units *us,
+                          double *max_abs_error, double *max_rel_error) {
+    hid_t h_fgrp = H5Gcreate(h_grp, FUNCTIONS_GROUP, H5P_DEFAULT, H5P_DEFAULT,
+                             H5P_DEFAULT);
+    if (h_fgrp < 0) {
+        printf("Error while creating group '%s'.\n", FUNCTIONS_GROUP);
+        return 1;
+    }
+
+    int err = addFunctionDatasets(h_fgrp, data, pars, us, 0, max_abs_error,
+                                  max_rel_error);
+    H5Gclose(h_fgrp);
+
+    /* The titles of the functions, in the order of the plan */
+    char **titles = malloc(data->n_functions * sizeof(char*));
+    if (titles == NULL) return 1;
+    for (int i=0; i<data->n_functions; i++) {
+        titles[i] = data->plan->entries[i].title;
+    }
+
+    if (!err) {
+        err = createVirtualCube(h_grp, "Transfer functions", pars, titles,
+                                data->n_functions, data->tau_size, data->k_size);
+    }
+    free(titles);
+
+    return err;
+}
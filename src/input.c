@@ -17,9 +17,76 @@
  *
  ******************************************************************************/
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../include/input.h"
+#include "../include/output.h"
+#include "../include/layout.h"
+#include "../include/compression.h"
+#include "../include/prediction.h"
+#include "../include/parallel.h"
+#include "../include/async_io.h"
+#include "../include/swmr.h"
+
+/* Read the functions that have their own lossy settings, given as a list of
+ * title:bound or title:mode:bound, where the mode defaults to LossyMode */
+static void readLossyBounds(struct params *pars, const char *fname) {
+    char *listStr = malloc(1000);
+    ini_gets("Output", "LossyErrorBounds", "", listStr, 1000, fname);
+
+    /* First, count the number of entries (# of comma's + 1) */
+    int num = 1;
+    for (int j=0; listStr[j] != '\0'; j++) {
+        if (listStr[j] == ',') {
+            num++;
+        }
+    }
+
+    pars->NumLossyBounds = 0;
+    pars->LossyBoundTitles = malloc(num * sizeof(char*));
+    pars->LossyBoundModes = malloc(num * sizeof(int));
+    pars->LossyBounds = malloc(num * sizeof(double));
+
+    /* Then read out the entries */
+    int read = 0, bytes;
+    char str[200];
+    while(pars->NumLossyBounds < num &&
+          sscanf(listStr + read, "%199[^,]%n", str, &bytes) > 0) {
+        read += bytes;
+        if (listStr[read] == ',') read++;
+
+        char title[40], modeStr[40];
+        int mode = pars->LossyMode;
+        double bound = 0.;
+        if (sscanf(str, " %39[^: ] : %39[^: ] : %lf", title, modeStr, &bound) == 3) {
+            mode = parseLossyMode(modeStr);
+        } else if (sscanf(str, " %39[^: ] : %lf", title, &bound) != 2) {
+            printf("WARNING: cannot read the lossy settings '%s', expected title:bound or title:mode:bound.\n", str);
+            continue;
+        }
+        if (mode < 0) {
+            printf("WARNING: unknown lossy mode '%s' for '%s', using the global settings.\n", modeStr, title);
+            continue;
+        }
+        if (mode != LOSSY_NONE && !(bound > 0)) {
+            printf("WARNING: the lossy error bound of '%s' must be positive, using the global settings.\n", title);
+            continue;
+        }
+
+        const int i = pars->NumLossyBounds++;
+        pars->LossyBoundTitles[i] = malloc(strlen(title) + 1);
+        strcpy(pars->LossyBoundTitles[i], title);
+        pars->LossyBoundModes[i] = mode;
+        pars->LossyBounds[i] = bound;
+    }
+
+    if (pars->NumLossyBounds > 0 && pars->LossyMode == LOSSY_NONE) {
+        printf("WARNING: LossyErrorBounds only applies with a LossyMode, using lossless output.\n");
+    }
+
+    free(listStr);
+}
 
 int readParams(struct params *pars, const char *fname) {
     /* Read strings */
@@ -49,6 +116,246 @@ int readParams(struct params *pars, const char *fname) {
         }
     }
 
+    /* File format of the output */
+    char formatStr[DEFAULT_STRING_LENGTH];
+    ini_gets("Output", "Format", "hdf5", formatStr, DEFAULT_STRING_LENGTH, fname);
+    pars->OutputFormat = parseOutputFormat(formatStr);
+    if (pars->OutputFormat < 0) {
+        printf("WARNING: unknown output format '%s', using 'hdf5' instead.\n", formatStr);
+        pars->OutputFormat = FORMAT_HDF5;
+    }
+    if (pars->OutputFormat == FORMAT_RAW && parallelSize() > 1) {
+        printf("WARNING: the raw format is not supported with MPI, using 'hdf5' instead.\n");
+        pars->OutputFormat = FORMAT_HDF5;
+    }
+
+    /* Append the missing functions to an existing output file */
+    pars->Append = ini_getl("Output", "Append", 0, fname);
+    if (pars->Append && pars->OutputFormat == FORMAT_RAW) {
+        printf("WARNING: appending is not supported with the raw format.\n");
+        pars->Append = 0;
+    }
+
+    /* Asynchronous direct writes for the raw format */
+    pars->DirectIO = ini_getl("Output", "DirectIO", 0, fname);
+    char backendStr[DEFAULT_STRING_LENGTH];
+    ini_gets("Output", "IOBackend", "auto", backendStr, DEFAULT_STRING_LENGTH, fname);
+    pars->IOBackend = parseAsyncBackend(backendStr);
+    if (pars->IOBackend < 0) {
+        printf("WARNING: unknown I/O backend '%s', using 'auto' instead.\n", backendStr);
+        pars->IOBackend = ASYNC_AUTO;
+    }
+    pars->IOBufferMB = ini_getd("Output", "IOBufferMB", 8, fname);
+    if (!(pars->IOBufferMB > 0)) {
+        printf("WARNING: I/O buffers of %g MB are too small, using 8 MB instead.\n", pars->IOBufferMB);
+        pars->IOBufferMB = 8;
+    }
+    pars->IODepth = ini_getl("Output", "IODepth", 4, fname);
+    if (pars->IODepth < 1) {
+        printf("WARNING: I/O depth %d is too small, using 4 instead.\n", pars->IODepth);
+        pars->IODepth = 4;
+    }
+    if (pars->DirectIO && pars->OutputFormat != FORMAT_RAW) {
+        printf("WARNING: direct I/O is only supported with the raw format.\n");
+        pars->DirectIO = 0;
+    }
+
+    /* Paged file layout for parallel filesystems, with pages of a stripe */
+    pars->StripeSizeMB = ini_getd("Output", "StripeSizeMB", 0, fname);
+    if (pars->StripeSizeMB != 0 && !(pars->StripeSizeMB * 1024 * 1024 >= 512)) {
+        printf("WARNING: stripes of %g MB are too small, using the default file layout.\n", pars->StripeSizeMB);
+        pars->StripeSizeMB = 0;
+    }
+    if (pars->StripeSizeMB > 0 && pars->OutputFormat == FORMAT_RAW) {
+        printf("WARNING: the stripe size only applies to the hdf5 format.\n");
+        pars->StripeSizeMB = 0;
+    }
+
+    /* Time cold opens and reads of the output file after writing it */
+    pars->BenchmarkOutput = ini_getl("Output", "BenchmarkOutput", 0, fname);
+    if (pars->BenchmarkOutput < 0) {
+        printf("WARNING: cannot benchmark the output %d times, skipping the benchmark.\n", pars->BenchmarkOutput);
+        pars->BenchmarkOutput = 0;
+    }
+    if (pars->BenchmarkOutput > 0 && pars->OutputFormat == FORMAT_RAW) {
+        printf("WARNING: the output benchmark only applies to the hdf5 format.\n");
+        pars->BenchmarkOutput = 0;
+    }
+
+    /* Ordering of the transfer function cube in the output file */
+    char layoutStr[DEFAULT_STRING_LENGTH];
+    ini_gets("Output", "Layout", "ftk", layoutStr, DEFAULT_STRING_LENGTH, fname);
+    pars->Layout = parseLayout(layoutStr);
+    if (pars->Layout < 0) {
+        printf("WARNING: unknown layout '%s', using 'ftk' instead.\n", layoutStr);
+        pars->Layout = LAYOUT_FTK;
+    }
+
+    /* One dataset per function under /Perturb/Functions */
+    pars->FunctionDatasets = ini_getl("Output", "FunctionDatasets", 0, fname);
+
+    /* Streaming output, computing only a block of functions at a time */
+    pars->Streaming = ini_getl("Output", "Streaming", 0, fname);
+    pars->MemoryBudgetMB = ini_getd("Output", "MemoryBudgetMB", 1024, fname);
+
+    /* Pipelined output, overlapping the computation with a writer thread */
+    pars->Pipeline = ini_getl("Output", "Pipeline", 0, fname);
+    pars->PipelineDepth = ini_getl("Output", "PipelineDepth", 2, fname);
+    if (pars->PipelineDepth < 1) {
+        printf("WARNING: pipeline depth %d is too small, using 2 instead.\n", pars->PipelineDepth);
+        pars->PipelineDepth = 2;
+    }
+    /* With several MPI ranks, every rank streams its own functions, and the
+     * collective writes have to be made from the main thread */
+    if (parallelSize() > 1 && pars->FunctionDatasets) {
+        printf("WARNING: function datasets are not supported with MPI.\n");
+        pars->FunctionDatasets = 0;
+    }
+    if (parallelSize() > 1) {
+        if (!pars->Streaming) {
+            printf("Running on %d ranks, using streaming.\n", parallelSize());
+            pars->Streaming = 1;
+        }
+        if (pars->Pipeline) {
+            printf("WARNING: pipelined output is not supported with MPI.\n");
+            pars->Pipeline = 0;
+        }
+    }
+    if (pars->Pipeline && pars->FunctionDatasets) {
+        printf("WARNING: pipelined output is not supported with function datasets.\n");
+        pars->Pipeline = 0;
+    }
+    if (pars->Pipeline && !pars->Streaming) {
+        printf("Pipelined output computes the functions while writing, using streaming.\n");
+        pars->Streaming = 1;
+    }
+
+    /* Chunking and compression of the transfer function cube */
+    char chunkStr[DEFAULT_STRING_LENGTH];
+    ini_gets("Output", "Chunking", "none", chunkStr, DEFAULT_STRING_LENGTH, fname);
+    pars->Chunking = parseChunking(chunkStr);
+    if (pars->Chunking < 0) {
+        printf("WARNING: unknown chunking '%s', using 'none' instead.\n", chunkStr);
+        pars->Chunking = CHUNK_NONE;
+    }
+    pars->ChunkSize = ini_getl("Output", "ChunkSize", 0, fname);
+    pars->Shuffle = ini_getl("Output", "Shuffle", 0, fname);
+    pars->DeflateLevel = ini_getl("Output", "DeflateLevel", 0, fname);
+    if (pars->DeflateLevel < 0 || pars->DeflateLevel > 9) {
+        printf("WARNING: deflate level %d is not in [0, 9], using 0 instead.\n", pars->DeflateLevel);
+        pars->DeflateLevel = 0;
+    }
+
+    /* Optional lossy storage with an error bound */
+    char lossyStr[DEFAULT_STRING_LENGTH];
+    ini_gets("Output", "LossyMode", "none", lossyStr, DEFAULT_STRING_LENGTH, fname);
+    pars->LossyMode = parseLossyMode(lossyStr);
+    if (pars->LossyMode < 0) {
+        printf("WARNING: unknown lossy mode '%s', using 'none' instead.\n", lossyStr);
+        pars->LossyMode = LOSSY_NONE;
+    }
+    pars->LossyErrorBound = ini_getd("Output", "LossyErrorBound", 1e-6, fname);
+    if (pars->LossyMode != LOSSY_NONE && !(pars->LossyErrorBound > 0)) {
+        printf("WARNING: the lossy error bound must be positive, using lossless output.\n");
+        pars->LossyMode = LOSSY_NONE;
+    }
+
+    /* Functions with their own lossy mode or error bound */
+    readLossyBounds(pars, fname);
+
+    /* The rounded values only become smaller after shuffle and deflate */
+    if (pars->OutputFormat == FORMAT_HDF5 && pars->LossyMode != LOSSY_NONE &&
+        pars->DeflateLevel == 0) {
+        printf("Lossy output requires compression, using shuffle and deflate.\n");
+        pars->Shuffle = 1;
+        pars->DeflateLevel = 4;
+    }
+
+    /* Optional prediction along the tau axis, replacing shuffle and deflate */
+    char predictStr[DEFAULT_STRING_LENGTH];
+    ini_gets("Output", "Prediction", "none", predictStr, DEFAULT_STRING_LENGTH, fname);
+    pars->Prediction = parsePrediction(predictStr);
+    if (pars->Prediction < 0) {
+        printf("WARNING: unknown prediction '%s', using 'none' instead.\n", predictStr);
+        pars->Prediction = PREDICT_NONE;
+    }
+    if (pars->OutputFormat == FORMAT_HDF5 && pars->Prediction != PREDICT_NONE &&
+        pars->DeflateLevel == 0) {
+        printf("The predictive filter deflates the residuals, using level 4.\n");
+        pars->DeflateLevel = 4;
+    }
+
+    /* The raw format stores the values as they are, to be mapped in place */
+    if (pars->OutputFormat == FORMAT_RAW) {
+        if (pars->Chunking != CHUNK_NONE || pars->Shuffle || pars->DeflateLevel > 0 ||
+            pars->LossyMode != LOSSY_NONE || pars->Prediction != PREDICT_NONE) {
+            printf("WARNING: the raw format is uncompressed, ignoring the chunking and compression options.\n");
+        }
+        if (pars->Pipeline) {
+            printf("WARNING: pipelined output is not supported with the raw format.\n");
+        }
+        pars->Chunking = CHUNK_NONE;
+        pars->Shuffle = 0;
+        pars->DeflateLevel = 0;
+        pars->LossyMode = LOSSY_NONE;
+        pars->Prediction = PREDICT_NONE;
+        pars->Pipeline = 0;
+    }
+
+    /* Filters can only be applied to chunked datasets */
+    if ((pars->Shuffle || pars->DeflateLevel > 0) && pars->Chunking == CHUNK_NONE) {
+        printf("Filters require chunking, using one chunk per function.\n");
+        pars->Chunking = CHUNK_TAU;
+        pars->ChunkSize = 0;
+    }
+
+    /* Single-writer/multiple-reader output, growing the cube one chunk of
+     * times at a time, so that readers can start with the earliest times */
+    pars->SWMR = ini_getl("Output", "SWMR", 0, fname);
+    if (pars->SWMR && pars->OutputFormat == FORMAT_RAW) {
+        printf("WARNING: SWMR output only applies to the hdf5 format.\n");
+        pars->SWMR = 0;
+    }
+    if (pars->SWMR && pars->Append) {
+        printf("WARNING: SWMR output is not supported when appending.\n");
+        pars->SWMR = 0;
+    }
+    if (pars->SWMR && parallelSize() > 1) {
+        printf("WARNING: SWMR output is not supported with MPI.\n");
+        pars->SWMR = 0;
+    }
+    if (pars->SWMR && pars->FunctionDatasets) {
+        printf("WARNING: SWMR output is not supported with function datasets.\n");
+        pars->SWMR = 0;
+    }
+    if (pars->SWMR && pars->Pipeline) {
+        printf("SWMR output computes all functions one block of times at a time, not using the pipeline.\n");
+        pars->Pipeline = 0;
+    }
+    if (pars->SWMR) {
+        /* The CLASS functions are extracted as their times are written */
+        pars->Streaming = 1;
+    }
+    if (pars->SWMR && pars->Chunking != CHUNK_TAU) {
+        printf("SWMR output writes one chunk of times at a time, using Chunking = tau.\n");
+        if (pars->Chunking == CHUNK_K && pars->ChunkSize > 0) {
+            printf("WARNING: ChunkSize = %d counts wavenumbers, which does not apply to chunks of times.\n", pars->ChunkSize);
+            pars->ChunkSize = 0;
+        }
+        pars->Chunking = CHUNK_TAU;
+    }
+    if (pars->SWMR && pars->ChunkSize <= 0) {
+        printf("SWMR output writes one chunk of times at a time, using chunks of %d times.\n", SWMR_DEFAULT_TIMES);
+        pars->ChunkSize = SWMR_DEFAULT_TIMES;
+    }
+
+    /* Order of the finite difference stencils for new derivatives */
+    pars->DerivativeOrder = ini_getl("Output", "DerivativeOrder", 2, fname);
+    if (pars->DerivativeOrder != 2 && pars->DerivativeOrder != 4) {
+        printf("WARNING: derivative order %d is not supported, using 2 instead.\n", pars->DerivativeOrder);
+        pars->DerivativeOrder = 2;
+    }
+
     /* Derivative checks tolerance */
     pars->DerivativeCheckTol = ini_getd("Simulation", "DerivativeCheckTol", 1e-2, fname);
 
@@ -99,6 +406,12 @@ int cleanParams(struct params *parser) {
         free(parser->DesiredFunctions[i]);
     }
     free(parser->DesiredFunctions);
+    for (int i=0; i<parser->NumLossyBounds; i++) {
+        free(parser->LossyBoundTitles[i]);
+    }
+    free(parser->LossyBoundTitles);
+    free(parser->LossyBoundModes);
+    free(parser->LossyBounds);
     free(parser->ClassPerturbIndices);
     free(parser->ClassBackgroundIndices);
     free(parser->OutputFilename);
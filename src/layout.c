@@ -0,0 +1,119 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <string.h>
+#include <strings.h>
+#include "../include/layout.h"
+
+/* Layout names, as used in the parameter file and in the output file */
+static const char *layout_names[] = {"ftk", "fkt", "tkf"};
+
+/* Returns the layout corresponding to the string, or -1 if unknown */
+int parseLayout(const char *str) {
+    for (int i=0; i<3; i++) {
+        if (strcasecmp(str, layout_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *layoutName(int layout) {
+    return layout_names[layout];
+}
+
+/* The dimensions of the cube when stored in the given layout */
+void layoutShape(int layout, size_t n_functions, size_t tau_size,
+                 size_t k_size, size_t shape[3]) {
+    if (layout == LAYOUT_FKT) {
+        shape[0] = n_functions;
+        shape[1] = k_size;
+        shape[2] = tau_size;
+    } else if (layout == LAYOUT_TKF) {
+        shape[0] = tau_size;
+        shape[1] = k_size;
+        shape[2] = n_functions;
+    } else {
+        shape[0] = n_functions;
+        shape[1] = tau_size;
+        shape[2] = k_size;
+    }
+}
+
+/* Transpose one tile of the matrix in[rows][cols] (leading dimension in_ld)
+ * into out[cols][rows] (leading dimension out_ld). */
+static inline void transposeTile(const real_t *in, real_t *out, size_t rows,
+                                 size_t cols, size_t in_ld, size_t out_ld,
+                                 size_t row0, size_t col0) {
+    size_t row1 = row0 + LAYOUT_TILE_SIZE < rows ? row0 + LAYOUT_TILE_SIZE : rows;
+    size_t col1 = col0 + LAYOUT_TILE_SIZE < cols ? col0 + LAYOUT_TILE_SIZE : cols;
+
+    for (size_t c = col0; c < col1; c++) {
+        for (size_t r = row0; r < row1; r++) {
+            out[c * out_ld + r] = in[r * in_ld + c];
+        }
+    }
+}
+
+/* Reorder the cube in ([function][tau][k], as in data->delta) into the given
+ * layout. The transpose is done in small tiles that fit in cache, in
+ * parallel over the tiles. The arrays in and out may not overlap. */
+int transposeCube(const real_t *in, real_t *out, int layout,
+                  size_t n_functions, size_t tau_size, size_t k_size) {
+
+    const size_t n_tiles_tau = (tau_size + LAYOUT_TILE_SIZE - 1) / LAYOUT_TILE_SIZE;
+    const size_t n_tiles_k = (k_size + LAYOUT_TILE_SIZE - 1) / LAYOUT_TILE_SIZE;
+    const size_t n_tiles_f = (n_functions + LAYOUT_TILE_SIZE - 1) / LAYOUT_TILE_SIZE;
+
+    if (layout == LAYOUT_FTK) {
+        memcpy(out, in, n_functions * tau_size * k_size * sizeof(real_t));
+    } else if (layout == LAYOUT_FKT) {
+        /* For each function, transpose the [tau][k] matrix */
+        #pragma omp parallel for collapse(3) schedule(static)
+        for (size_t f = 0; f < n_functions; f++) {
+            for (size_t i = 0; i < n_tiles_tau; i++) {
+                for (size_t j = 0; j < n_tiles_k; j++) {
+                    const real_t *in_f = in + f * tau_size * k_size;
+                    real_t *out_f = out + f * k_size * tau_size;
+                    transposeTile(in_f, out_f, tau_size, k_size, k_size,
+                                  tau_size, i * LAYOUT_TILE_SIZE,
+                                  j * LAYOUT_TILE_SIZE);
+                }
+            }
+        }
+    } else if (layout == LAYOUT_TKF) {
+        /* For each time, transpose the [function][k] matrix */
+        #pragma omp parallel for collapse(3) schedule(static)
+        for (size_t t = 0; t < tau_size; t++) {
+            for (size_t i = 0; i < n_tiles_f; i++) {
+                for (size_t j = 0; j < n_tiles_k; j++) {
+                    const real_t *in_t = in + t * k_size;
+                    real_t *out_t = out + t * k_size * n_functions;
+                    transposeTile(in_t, out_t, n_functions, k_size,
+                                  tau_size * k_size, n_functions,
+                                  i * LAYOUT_TILE_SIZE, j * LAYOUT_TILE_SIZE);
+                }
+            }
+        }
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
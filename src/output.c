@@ -17,17 +17,170 @@
  *
  ******************************************************************************/
 
+#include <omp.h>
+#include <strings.h>
 #include "../include/output.h"
 #include "../include/derivatives.h"
+#include "../include/layout.h"
+#include "../include/streaming.h"
+#include "../include/compression.h"
+#include "../include/parallel.h"
+#include "../include/function_datasets.h"
+#include "../include/swmr.h"
+
+static const char *format_names[2] = {"hdf5", "raw"};
+
+int parseOutputFormat(const char *str) {
+    for (int i=0; i<2; i++) {
+        if (strcasecmp(str, format_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *outputFormatName(int format) {
+    return format_names[format];
+}
+
+/* Record the layout, the chunking and compression settings and, in lossy
+ * mode, the settings and errors of each of the n_functions functions with
+ * the given titles as attributes of the transfer function cube h_data */
+int writeCubeAttributes(hid_t h_data, const struct params *pars, char **titles,
+                        int n_functions, size_t tau_size, size_t k_size,
+                        const double *max_abs_error,
+                        const double *max_rel_error) {
+    /* Record the layout as a string attribute of the dataset */
+    const char *layout_name = layoutName(pars->Layout);
+    hid_t h_layout_space = H5Screate(H5S_SCALAR);
+    hid_t h_layout_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_layout_type, strlen(layout_name));
+    hid_t h_attr = H5Acreate1(h_data, "Layout", h_layout_type, h_layout_space, H5P_DEFAULT);
+    herr_t h_err = H5Awrite(h_attr, h_layout_type, layout_name);
+    H5Aclose(h_attr);
+    H5Tclose(h_layout_type);
+    H5Sclose(h_layout_space);
+
+    /* Record the chunking and compression settings */
+    int err = (h_err < 0);
+    err |= writeCompressionAttributes(h_data, pars, tau_size, k_size);
+
+    /* Record the lossy settings and the errors that were made */
+    if (pars->LossyMode != LOSSY_NONE) {
+        err |= writeLossyAttributes(h_data, pars, titles, n_functions, max_abs_error,
+                                    max_rel_error);
+    }
+
+    return err;
+}
+
+/* Write the transfer functions of data to the cube h_data, which has already
+ * been created, starting at function offset. In streaming mode, the functions
+ * are computed and written a block at a time. Otherwise, they are taken from
+ * memory and, in lossy mode, rounded in a copy, so that data->delta keeps the
+ * exact values. The errors of the functions are stored in max_abs_error and
+ * max_rel_error. */
+int writeCube(hid_t h_data, struct perturb_data *data, struct params *pars,
+              int offset, double *max_abs_error, double *max_rel_error) {
+    herr_t h_err;
+
+    if (data->delta == NULL) {
+        /* In streaming mode, compute and write one block at a time */
+        h_err = writeCubeStreaming(h_data, data, pars, offset, max_abs_error,
+                                   max_rel_error);
+        if (h_err != 0) printf("Error while streaming data array '%s'.\n", "data->delta");
+
+        /* Every rank only knows the errors of its own functions */
+        if (pars->LossyMode != LOSSY_NONE) {
+            reduceMaxOverRanks(max_abs_error, data->n_functions);
+            reduceMaxOverRanks(max_rel_error, data->n_functions);
+        }
+
+        return h_err != 0;
+    }
+
+    /* Reorder the transfer functions if a different layout is requested.
+     * Lossy storage also needs a copy, which holds the rounded values. */
+    const size_t cube_size = data->n_functions * data->tau_size * data->k_size;
+    real_t *delta_out = data->delta;
+    if (pars->Layout != LAYOUT_FTK || pars->LossyMode != LOSSY_NONE) {
+        delta_out = malloc(cube_size * sizeof(real_t));
+        if (delta_out == NULL) {
+            printf("Error: could not allocate memory to transpose or round the transfer functions.\n");
+            return 1;
+        }
+    }
+    if (pars->Layout != LAYOUT_FTK) {
+        transposeCube(data->delta, delta_out, pars->Layout, data->n_functions,
+                      data->tau_size, data->k_size);
+
+        printf("Transposed the transfer functions to layout '%s'.\n", layoutName(pars->Layout));
+    }
+
+    /* Round the values in lossy mode. Each function is a slab of the cube,
+     * except in the tkf layout, where it is every n_functions-th value. */
+    if (pars->LossyMode != LOSSY_NONE) {
+        const size_t slab_size = data->tau_size * data->k_size;
+        const int tkf = (pars->Layout == LAYOUT_TKF);
+        const real_t *in = (pars->Layout == LAYOUT_FTK) ? data->delta : delta_out;
+        for (int i=0; i<data->n_functions; i++) {
+            const size_t pos = tkf ? (size_t) i : i * slab_size;
+            quantizeFunction(pars, data->plan->entries[i].title, in + pos,
+                             delta_out + pos, slab_size,
+                             tkf ? data->n_functions : 1, &max_abs_error[i],
+                             &max_rel_error[i]);
+        }
+    }
+
+    /* The part of the cube that holds these functions */
+    size_t shape_layout[3];
+    layoutShape(pars->Layout, data->n_functions, data->tau_size, data->k_size,
+                shape_layout);
+    hsize_t shape_delta[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+    hsize_t start[3] = {offset, 0, 0};
+    if (pars->Layout == LAYOUT_TKF) {
+        start[0] = 0;
+        start[2] = offset;
+    }
+
+    /* Write temporary buffer to HDF5 dataspace, compressing the chunks
+     * in parallel if there are filters */
+    if (useDirectChunkWrites(h_data, pars)) {
+        printf("Compressing the chunks on %d threads.\n", omp_get_max_threads());
+        h_err = writeChunksParallel(h_data, pars, delta_out, shape_delta, start);
+        if (h_err != 0) printf("Error while writing chunks of '%s'.\n", "data->delta");
+    } else {
+        hid_t h_filespace = H5Dget_space(h_data);
+        H5Sselect_hyperslab(h_filespace, H5S_SELECT_SET, start, NULL, shape_delta, NULL);
+        hid_t h_memspace = H5Screate_simple(3, shape_delta, NULL);
+        h_err = H5Dwrite(h_data, H5T_NATIVE_REAL, h_memspace, h_filespace, H5P_DEFAULT, delta_out);
+        if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->delta");
+        H5Sclose(h_memspace);
+        H5Sclose(h_filespace);
+    }
+
+    if (delta_out != data->delta) {
+        free(delta_out);
+    }
+
+    return h_err != 0;
+}
 
 int write_perturb(struct perturb_data *data, struct params *pars,
                   struct units *us, char *fname) {
     /* The memory for the transfer functions is located here */
     hid_t h_file, h_grp, h_data, h_err, h_space, h_attr;
 
-    /* Open file */
-    h_file = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
-    if (h_file < 0) printf("Error while opening file '%s'.\n", fname);
+    /* Open file. With MPI, all ranks create it together and write the same
+     * metadata and small datasets, but only their own transfer functions. */
+    h_file = createOutputFile(fname, pars);
+    if (h_file < 0) {
+        printf("Error while opening file '%s'.\n", fname);
+        return 1;
+    }
+
+    /* Any failure below makes the file incomplete */
+    int err = 0;
 
     printf("Writing the perturbation to '%s'.\n", fname);
 
@@ -45,17 +198,17 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write the size of the perturbation (along the k-dimension) */
     h_attr = H5Acreate1(h_grp, "k_size", H5T_NATIVE_INT, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_INT, &data->k_size);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_INT, &data->k_size) < 0);
     H5Aclose(h_attr);
 
     /* Write the size of the perturbation (along the tau-direction) */
     h_attr = H5Acreate1(h_grp, "tau_size", H5T_NATIVE_INT, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_INT, &data->tau_size);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_INT, &data->tau_size) < 0);
     H5Aclose(h_attr);
 
     /* Write the number of transfer functions */
     h_attr = H5Acreate1(h_grp, "n_functions", H5T_NATIVE_INT, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_INT, &data->n_functions);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_INT, &data->n_functions) < 0);
     H5Aclose(h_attr);
 
     /* Determine the units used */
@@ -66,19 +219,19 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write the internal unit system */
     h_attr = H5Acreate1(h_grp, "Unit mass in cgs (U_M)", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_mass_cgs);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_mass_cgs) < 0);
     H5Aclose(h_attr);
 
     h_attr = H5Acreate1(h_grp, "Unit length in cgs (U_L)", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_length_cgs);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_length_cgs) < 0);
     H5Aclose(h_attr);
 
     h_attr = H5Acreate1(h_grp, "Unit time in cgs (U_t)", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_time_cgs);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_time_cgs) < 0);
     H5Aclose(h_attr);
 
     h_attr = H5Acreate1(h_grp, "Unit temperature in cgs (U_T)", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_temperature_cgs);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &unit_temperature_cgs) < 0);
     H5Aclose(h_attr);
 
     /* For strings, we need to prepare a datatype */
@@ -89,31 +242,17 @@ int write_perturb(struct perturb_data *data, struct params *pars,
     h_attr = H5Acreate1(h_grp, "Name", h_type, h_space, H5P_DEFAULT);
 
     /* Write the name attribute */
-    h_err = H5Awrite(h_attr, h_type, pars->Name);
+    err |= (H5Awrite(h_attr, h_type, pars->Name) < 0);
+    H5Aclose(h_attr);
 
     /* Done with the single entry dataspace */
     H5Sclose(h_space);
 
-    /* Create array of titles of only those functions that are exported. */
+    /* Array of titles of only those functions that are exported, in the
+     * order of the plan: first the CLASS functions, then the derivatives. */
     char **output_titles = malloc(data->n_functions * sizeof(char*));
-
-    /* First, add the titles that have a matching index. */
-    int j = 0;
-    for (int i=0; i<pars->NumDesiredFunctions; i++) {
-        if (pars->ClassPerturbIndices[i] >= 0) { //has a matching index
-            output_titles[j] = malloc(strlen(pars->DesiredFunctions[i]) + 1);
-            strcpy(output_titles[j], pars->DesiredFunctions[i]);
-            j++;
-        }
-    }
-
-    /* Then, add the titles of computed derivatives */
-    for (int i=0; i<pars->NumDesiredFunctions; i++) {
-        if (isNewDerivativeTitle(pars, pars->DesiredFunctions[i]) >= 0) {
-            output_titles[j] = malloc(strlen(pars->DesiredFunctions[i]) + 1);
-            strcpy(output_titles[j], pars->DesiredFunctions[i]);
-            j++;
-        }
+    for (int i=0; i<data->n_functions; i++) {
+        output_titles[i] = data->plan->entries[i].title;
     }
 
     /* Write array of column titles, corresponding to the exported functions */
@@ -130,7 +269,9 @@ int write_perturb(struct perturb_data *data, struct params *pars,
     h_attr = H5Acreate1(h_grp, "FunctionTitles", h_type, h_space, H5P_DEFAULT);
 
     /* Write the name attribute */
-    h_err = H5Awrite(h_attr, h_type, output_titles);
+    err |= (H5Awrite(h_attr, h_type, output_titles) < 0);
+    H5Aclose(h_attr);
+    H5Tclose(h_type);
 
 
     /* Done with the dataspace */
@@ -149,42 +290,42 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write the CMB temperature */
     h_attr = H5Acreate1(h_grp, "T_CMB (U_T)", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->T_CMB);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->T_CMB) < 0);
     H5Aclose(h_attr);
 
     /* Write the Hubble parameter in units of 100 km/s/Mpc */
     h_attr = H5Acreate1(h_grp, "h", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->h);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->h) < 0);
     H5Aclose(h_attr);
 
     /* Write the present dark energy density as fraction of the critical density */
     h_attr = H5Acreate1(h_grp, "Omega_lambda", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_lambda);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_lambda) < 0);
     H5Aclose(h_attr);
 
     /* Write the curvature density parameter */
     h_attr = H5Acreate1(h_grp, "Omega_k", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_k);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_k) < 0);
     H5Aclose(h_attr);
 
     /* Write the present energy density of total matter (excluding ncdm) */
     h_attr = H5Acreate1(h_grp, "Omega_m", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_m);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_m) < 0);
     H5Aclose(h_attr);
 
     /* Write the present energy density of baryons */
     h_attr = H5Acreate1(h_grp, "Omega_b", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_b);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_b) < 0);
     H5Aclose(h_attr);
 
     /* Write the present energy density of ultra-relativistic species (excluding photons) */
     h_attr = H5Acreate1(h_grp, "Omega_ur", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_ur);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, &pars->Omega_ur) < 0);
     H5Aclose(h_attr);
 
     /* Write the total number of ncdm species in the cosmology (not all are necessarily exported) */
     h_attr = H5Acreate1(h_grp, "N_ncdm", H5T_NATIVE_INT, h_space, H5P_DEFAULT);
-    h_err = H5Awrite(h_attr, H5T_NATIVE_INT, &pars->N_ncdm);
+    err |= (H5Awrite(h_attr, H5T_NATIVE_INT, &pars->N_ncdm) < 0);
     H5Aclose(h_attr);
 
     /* If we have at least one neutrino, write some attributes for each neutrino species */
@@ -195,12 +336,12 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
         /* Write the mass of each ncdm species in the cosmology */
         h_attr = H5Acreate1(h_grp, "M_ncdm (eV)", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-        h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, pars->M_ncdm_eV);
+        err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, pars->M_ncdm_eV) < 0);
         H5Aclose(h_attr);
 
         /* Write the present temperature of each ncdm species (as fraction of T_CMB) */
         h_attr = H5Acreate1(h_grp, "T_ncdm (T_CMB)", H5T_NATIVE_DOUBLE, h_space, H5P_DEFAULT);
-        h_err = H5Awrite(h_attr, H5T_NATIVE_DOUBLE, pars->T_ncdm);
+        err |= (H5Awrite(h_attr, H5T_NATIVE_DOUBLE, pars->T_ncdm) < 0);
         H5Aclose(h_attr);
     }
 
@@ -236,7 +377,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->k);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->k");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->k");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -255,7 +399,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->log_tau);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->log_tau");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->log_tau");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -268,7 +415,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->redshift);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->redshift");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->redshift");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -281,7 +431,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->Omega_m);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->Omega_m");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->Omega_m");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -294,7 +447,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->Omega_r);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->Omega_r");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->Omega_r");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -307,7 +463,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->Hubble_H);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->Hubble_H");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->Hubble_H");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -320,7 +479,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->Hubble_H_prime);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->Hubble_H_prime");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->Hubble_H_prime");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -333,7 +495,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->growth_D);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->growth_D");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->growth_D");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -346,7 +511,10 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->growth_f);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->growth_f");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->growth_f");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -359,45 +527,106 @@ int write_perturb(struct perturb_data *data, struct params *pars,
 
     /* Write temporary buffer to HDF5 dataspace */
     h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->growth_f_prime);
-    if (h_err < 0) printf("Error while writing data array '%s'.\n", "data->growth_f_prime");
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->growth_f_prime");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
 
-    /* Set the extent of the transfer function data */
-    rank = 3;
-    hsize_t shape_delta[3] = {data->n_functions, data->tau_size, data->k_size};
-    h_err = H5Sset_extent_simple(h_space, rank, shape_delta, shape_delta);
+    /* Set the extent of the background densities data */
+    rank = 2;
+    hsize_t shape_Omega[2] = {data->n_functions, data->tau_size};
+    h_err = H5Sset_extent_simple(h_space, rank, shape_Omega, shape_Omega);
     if (h_err < 0) printf("Error while changing data space shape.");
 
     /* Create dataset */
-    h_data = H5Dcreate(h_grp, "Transfer functions", H5T_NATIVE_DOUBLE, h_space,
+    h_data = H5Dcreate(h_grp, "Omegas", H5T_NATIVE_REAL, h_space,
                        H5P_DEFAULT, h_prop, H5P_DEFAULT);
     if (h_data < 0)
-    printf("Error while creating dataspace '%s'.", "Transfer functions");
+    printf("Error while creating dataspace '%s'.", "Omegas");
 
     /* Write temporary buffer to HDF5 dataspace */
-    h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->delta);
-    if (h_err < 0) printf("Error while writing data array '%s'.", "data->delta");
+    h_err = H5Dwrite(h_data, H5T_NATIVE_REAL, h_space, H5S_ALL, H5P_DEFAULT, data->Omega);
+    if (h_err < 0) {
+        printf("Error while writing data array '%s'.\n", "data->Omega");
+        err = 1;
+    }
 
     /* Close the dataset */
     H5Dclose(h_data);
 
-    /* Set the extent of the background densities data */
-    rank = 2;
-    hsize_t shape_Omega[2] = {data->n_functions, data->tau_size};
-    h_err = H5Sset_extent_simple(h_space, rank, shape_Omega, shape_Omega);
-    if (h_err < 0) printf("Error while changing data space shape.");
+    /* The achieved maximum errors of each function in lossy mode */
+    double *max_abs_error = NULL;
+    double *max_rel_error = NULL;
+    if (pars->LossyMode != LOSSY_NONE) {
+        max_abs_error = calloc(data->n_functions, sizeof(double));
+        max_rel_error = calloc(data->n_functions, sizeof(double));
+    }
 
-    /* Create dataset */
-    h_data = H5Dcreate(h_grp, "Omegas", H5T_NATIVE_DOUBLE, h_space,
-                       H5P_DEFAULT, h_prop, H5P_DEFAULT);
-    if (h_data < 0)
-    printf("Error while creating dataspace '%s'.", "Omegas");
+    const double write_start = wallTime();
+
+    if (pars->FunctionDatasets) {
+        /* One dataset per function, and the cube as a virtual dataset */
+        h_err = writeFunctionDatasets(h_grp, data, pars, us, max_abs_error,
+                                      max_rel_error);
+        if (h_err != 0) printf("Error while writing the function datasets.\n");
+        err |= (h_err != 0);
+        h_data = H5Dopen(h_grp, "Transfer functions", H5P_DEFAULT);
+    } else if (pars->SWMR) {
+        /* Readers can follow the cube while it grows along the time axis */
+        h_data = createGrowingCube(h_grp, pars, data->n_functions,
+                                   data->tau_size, data->k_size);
+        h_err = writeCubeSWMR(h_file, h_data, data, pars, max_abs_error,
+                              max_rel_error);
+        if (h_err != 0) printf("Error while writing data array '%s'.\n", "data->delta");
+        err |= (h_err != 0);
+    } else {
+        /* Set the extent of the transfer function data, in the requested layout */
+        rank = 3;
+        size_t shape_layout[3];
+        layoutShape(pars->Layout, data->n_functions, data->tau_size, data->k_size,
+                    shape_layout);
+        hsize_t shape_delta[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+
+        /* Chunked cubes can be extended along the function axis, so that
+         * functions can be appended later */
+        hsize_t max_delta[3] = {shape_delta[0], shape_delta[1], shape_delta[2]};
+        if (pars->Chunking != CHUNK_NONE) {
+            max_delta[(pars->Layout == LAYOUT_TKF) ? 2 : 0] = H5S_UNLIMITED;
+        }
+        h_err = H5Sset_extent_simple(h_space, rank, shape_delta, max_delta);
+        if (h_err < 0) printf("Error while changing data space shape.");
+
+        /* The cube may be chunked and compressed */
+        hid_t h_prop_cube = createCubeProperties(pars, data->tau_size, data->k_size);
+
+        /* Create dataset */
+        h_data = H5Dcreate(h_grp, "Transfer functions", H5T_NATIVE_REAL, h_space,
+                           H5P_DEFAULT, h_prop_cube, H5P_DEFAULT);
+        if (h_data < 0)
+        printf("Error while creating dataspace '%s'.", "Transfer functions");
+        H5Pclose(h_prop_cube);
+
+        h_err = writeCube(h_data, data, pars, 0, max_abs_error, max_rel_error);
+        if (h_err != 0) printf("Error while writing data array '%s'.\n", "data->delta");
+        err |= (h_err != 0);
+    }
 
-    /* Write temporary buffer to HDF5 dataspace */
-    h_err = H5Dwrite(h_data, H5T_NATIVE_DOUBLE, h_space, H5S_ALL, H5P_DEFAULT, data->Omega);
-    if (h_err < 0) printf("Error while writing data array '%s'.", "data->Omega");
+    printf("Wrote the transfer functions in %.3f s on %d rank(s).\n",
+           wallTime() - write_start, parallelSize());
+
+    /* Record the layout, storage settings and errors as attributes, which
+     * in SWMR mode had to be done before writing */
+    if (!pars->SWMR) {
+        err |= writeCubeAttributes(h_data, pars, output_titles, data->n_functions,
+                                   data->tau_size, data->k_size, max_abs_error,
+                                   max_rel_error);
+    }
+    free(max_abs_error);
+    free(max_rel_error);
+    free(output_titles);
 
     /* Close the dataset */
     H5Dclose(h_data);
@@ -409,7 +638,14 @@ int write_perturb(struct perturb_data *data, struct params *pars,
     H5Gclose(h_grp);
 
     /* Close file */
-    H5Fclose(h_file);
+    if (H5Fclose(h_file) < 0) err = 1;
+
+    /* Do not leave an incomplete file behind */
+    err = maxOverRanks(err);
+    if (err && parallelRank() == 0) {
+        printf("Error: removing the incomplete file '%s'.\n", fname);
+        remove(fname);
+    }
 
-    return 0;
+    return err;
 }
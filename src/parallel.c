@@ -0,0 +1,206 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+#ifdef WITH_MPI
+#include <mpi.h>
+#endif
+#include "../include/parallel.h"
+#include "../include/file_layout.h"
+
+#ifdef WITH_MPI
+/* The part of a line of output that has not been passed on yet */
+struct rank_output {
+    char line[1024];
+    size_t length;
+};
+
+/* Pass on a complete line of output of the other ranks, if it is an error or
+ * a warning, prefixed with the rank */
+static void passOnLine(struct rank_output *out) {
+    const char *start = out->line;
+    while (*start == '\n' || *start == ' ') start++;
+
+    if (strncmp(start, "Error", 5) == 0 || strncmp(start, "WARNING", 7) == 0) {
+        char prefixed[sizeof(out->line) + 32];
+        int n = snprintf(prefixed, sizeof(prefixed), "[rank %d] %.*s",
+                         parallelRank(), (int) out->length, out->line);
+        if (n > (int) sizeof(prefixed) - 1) n = sizeof(prefixed) - 1;
+        if (write(STDOUT_FILENO, prefixed, n) < 0) {
+            /* There is nowhere left to report this */
+        }
+    }
+    out->length = 0;
+}
+
+static ssize_t writeRankOutput(void *cookie, const char *buf, size_t size) {
+    struct rank_output *out = cookie;
+    for (size_t i = 0; i < size; i++) {
+        out->line[out->length++] = buf[i];
+        if (buf[i] == '\n' || out->length == sizeof(out->line)) {
+            passOnLine(out);
+        }
+    }
+    return size;
+}
+
+static int closeRankOutput(void *cookie) {
+    struct rank_output *out = cookie;
+    if (out->length > 0) passOnLine(out);
+    free(out);
+    return 0;
+}
+#endif
+
+/* Start MPI, if enabled. The other ranks do the same work as the first one
+ * and would repeat all of its progress messages, so they only print their
+ * errors and warnings. */
+int initParallel(int *argc, char ***argv) {
+#ifdef WITH_MPI
+#ifndef H5_HAVE_PARALLEL
+#error "Building with MPI requires a parallel HDF5 library."
+#endif
+    if (MPI_Init(argc, argv) != MPI_SUCCESS) return 1;
+    if (parallelRank() > 0) {
+        struct rank_output *out = calloc(1, sizeof(struct rank_output));
+        cookie_io_functions_t functions = {NULL, writeRankOutput, NULL, closeRankOutput};
+        FILE *filtered = out ? fopencookie(out, "w", functions) : NULL;
+        if (filtered == NULL) {
+            free(out);
+            return 1;
+        }
+        fflush(stdout);
+        stdout = filtered;
+    }
+#endif
+    return 0;
+}
+
+int finalizeParallel(void) {
+#ifdef WITH_MPI
+    fflush(stdout);
+    MPI_Finalize();
+#endif
+    return 0;
+}
+
+int parallelRank(void) {
+#ifdef WITH_MPI
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+#else
+    return 0;
+#endif
+}
+
+int parallelSize(void) {
+#ifdef WITH_MPI
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    return size;
+#else
+    return 1;
+#endif
+}
+
+/* The contiguous range of functions of the given rank, balanced such that
+ * the counts of the ranks differ by at most one */
+void functionRange(int n_functions, int rank, int size, int *first, int *count) {
+    const int base = n_functions / size;
+    const int extra = n_functions % size;
+
+    *count = base + (rank < extra ? 1 : 0);
+    *first = rank * base + (rank < extra ? rank : extra);
+}
+
+/* The largest value over all ranks */
+int maxOverRanks(int value) {
+#ifdef WITH_MPI
+    int max;
+    MPI_Allreduce(&value, &max, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    return max;
+#else
+    return value;
+#endif
+}
+
+/* Replace the values by their maximum over all ranks, in place */
+void reduceMaxOverRanks(double *values, int n) {
+#ifdef WITH_MPI
+    MPI_Allreduce(MPI_IN_PLACE, values, n, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+}
+
+double wallTime(void) {
+#ifdef WITH_MPI
+    return MPI_Wtime();
+#else
+    return omp_get_wtime();
+#endif
+}
+
+/* Create the output file, which is shared by all ranks with MPI-IO. The
+ * file format of HDF5 1.8 or later allows attributes larger than 64 kB, such
+ * as the Omega(tau) of the function datasets. The file creation and access
+ * properties may select a layout for parallel filesystems. */
+hid_t createOutputFile(const char *fname, const struct params *pars) {
+    hid_t h_fcpl = createFileCreationProperties(pars);
+    hid_t h_fapl = createFileAccessProperties(pars);
+#ifdef WITH_MPI
+    H5Pset_fapl_mpio(h_fapl, MPI_COMM_WORLD, MPI_INFO_NULL);
+#endif
+    hid_t h_file = H5Fcreate(fname, H5F_ACC_TRUNC, h_fcpl, h_fapl);
+    H5Pclose(h_fapl);
+    H5Pclose(h_fcpl);
+    return h_file;
+}
+
+/* Open an existing output file for writing, shared by all ranks with
+ * MPI-IO, in order to append functions to it */
+hid_t openOutputFile(const char *fname, const struct params *pars) {
+    hid_t h_fapl = createFileAccessProperties(pars);
+#ifdef WITH_MPI
+    H5Pset_fapl_mpio(h_fapl, MPI_COMM_WORLD, MPI_INFO_NULL);
+#endif
+    hid_t h_file = H5Fopen(fname, H5F_ACC_RDWR, h_fapl);
+    H5Pclose(h_fapl);
+    return h_file;
+}
+
+/* Transfer properties for writing the transfer function cube: collective
+ * with MPI-IO, which is also required for filtered datasets */
+hid_t createTransferProperties(void) {
+#ifdef WITH_MPI
+    hid_t h_xfer = H5Pcreate(H5P_DATASET_XFER);
+    H5Pset_dxpl_mpio(h_xfer, H5FD_MPIO_COLLECTIVE);
+    return h_xfer;
+#else
+    return H5P_DEFAULT;
+#endif
+}
+
+void closeTransferProperties(hid_t h_xfer) {
+    if (h_xfer != H5P_DEFAULT) H5Pclose(h_xfer);
+}
@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+#include "../include/pipeline.h"
+
+/* Allocate a queue with capacity slots of block_size values each */
+int initBlockQueue(struct block_queue *q, size_t capacity, size_t block_size) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+
+    q->capacity = capacity;
+    q->slots = calloc(capacity, sizeof(struct queued_block));
+    if (q->slots == NULL) {
+        cleanBlockQueue(q);
+        return 1;
+    }
+
+    for (size_t i=0; i<capacity; i++) {
+        q->slots[i].data = malloc(block_size * sizeof(real_t));
+        if (q->slots[i].data == NULL) {
+            cleanBlockQueue(q);
+            return 1;
+        }
+    }
+
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->error, 0);
+    atomic_init(&q->producer_waiting, 0);
+    atomic_init(&q->consumer_waiting, 0);
+
+    return 0;
+}
+
+/* Advance the index of one side and wake up the other side if it is waiting
+ * for that. The waiting side raises its flag before checking the indices
+ * again, and the index is advanced before the flag is checked here, so that
+ * (both being sequentially consistent) either it sees the new index or we see
+ * its flag. Taking the lock ensures that the wake-up cannot slip in between
+ * its check of the indices and its wait. Otherwise, no lock is taken. */
+static void queueAdvance(struct block_queue *q, atomic_size_t *index,
+                         atomic_int *waiting) {
+    atomic_fetch_add(index, 1);
+
+    if (atomic_load(waiting)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->changed);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/* Producer: wait for a free slot and return it, without publishing it yet.
+ * The time spent waiting for the consumer is added to wait_time. */
+struct queued_block *queueReserve(struct block_queue *q, double *wait_time) {
+    const size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == q->capacity) {
+        double start = omp_get_wtime();
+        pthread_mutex_lock(&q->lock);
+        atomic_store(&q->producer_waiting, 1);
+        while (tail - atomic_load(&q->head) == q->capacity) {
+            pthread_cond_wait(&q->changed, &q->lock);
+        }
+        atomic_store(&q->producer_waiting, 0);
+        pthread_mutex_unlock(&q->lock);
+        *wait_time += omp_get_wtime() - start;
+    }
+
+    return &q->slots[tail % q->capacity];
+}
+
+/* Producer: hand the reserved slot over to the consumer */
+void queuePublish(struct block_queue *q) {
+    queueAdvance(q, &q->tail, &q->consumer_waiting);
+}
+
+/* Consumer: wait for the next published slot and return it. The time spent
+ * waiting for the producer is added to wait_time. */
+struct queued_block *queuePeek(struct block_queue *q, double *wait_time) {
+    const size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (atomic_load_explicit(&q->tail, memory_order_acquire) == head) {
+        double start = omp_get_wtime();
+        pthread_mutex_lock(&q->lock);
+        atomic_store(&q->consumer_waiting, 1);
+        while (atomic_load(&q->tail) == head) {
+            pthread_cond_wait(&q->changed, &q->lock);
+        }
+        atomic_store(&q->consumer_waiting, 0);
+        pthread_mutex_unlock(&q->lock);
+        *wait_time += omp_get_wtime() - start;
+    }
+
+    return &q->slots[head % q->capacity];
+}
+
+/* Consumer: give the slot back to the producer */
+void queueRelease(struct block_queue *q) {
+    queueAdvance(q, &q->head, &q->producer_waiting);
+}
+
+void cleanBlockQueue(struct block_queue *q) {
+    if (q->slots != NULL) {
+        for (size_t i=0; i<q->capacity; i++) {
+            free(q->slots[i].data);
+        }
+    }
+    free(q->slots);
+    q->slots = NULL;
+
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+}
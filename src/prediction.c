@@ -0,0 +1,338 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include "../include/prediction.h"
+
+/* This file is also compiled into the HDF5 plugin library (see plugin/), so
+ * that other programs can read the output. It should therefore depend only
+ * on HDF5 and zlib. */
+
+/* Prediction mode names, as used in the parameter file and in the output file */
+static const char *prediction_names[] = {"none", "linear", "quadratic"};
+
+/* Returns the prediction mode corresponding to the string, or -1 if unknown */
+int parsePrediction(const char *str) {
+    for (int i=0; i<3; i++) {
+        if (strcasecmp(str, prediction_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *predictionName(int mode) {
+    return prediction_names[mode];
+}
+
+/* The shape of a chunk, seen as [outer][tau][inner] */
+struct chunk_geometry {
+    int mode;
+    int level;
+    size_t size;  //bytes per element
+    size_t outer; //product of the dimensions before the tau axis
+    size_t tau;   //length of the tau axis
+    size_t inner; //product of the dimensions after the tau axis
+};
+
+/* Read the geometry from the complete filter parameters */
+static int chunkGeometry(size_t cd_nelmts, const unsigned int cd_values[],
+                         struct chunk_geometry *g) {
+    if (cd_nelmts < PREDICT_CD_DIMS) return 1;
+
+    const unsigned int rank = cd_values[PREDICT_CD_RANK];
+    const unsigned int axis = cd_values[PREDICT_CD_AXIS];
+    if (cd_nelmts < PREDICT_CD_DIMS + rank || axis >= rank) return 1;
+
+    g->mode = cd_values[PREDICT_CD_MODE];
+    g->level = cd_values[PREDICT_CD_LEVEL];
+    g->size = cd_values[PREDICT_CD_SIZE];
+    if (g->size != 4 && g->size != 8) return 1;
+
+    g->outer = 1;
+    g->inner = 1;
+    g->tau = cd_values[PREDICT_CD_DIMS + axis];
+    for (unsigned int i=0; i<rank; i++) {
+        if (i < axis) g->outer *= cd_values[PREDICT_CD_DIMS + i];
+        if (i > axis) g->inner *= cd_values[PREDICT_CD_DIMS + i];
+    }
+
+    return 0;
+}
+
+/* Little-endian loads and stores, so that the encoded chunks are portable */
+static inline uint64_t loadElement(const unsigned char *p, size_t size) {
+    uint64_t u = 0;
+    for (size_t b=0; b<size; b++) {
+        u |= (uint64_t) p[b] << (8 * b);
+    }
+    return u;
+}
+
+static inline void storeElement(unsigned char *p, uint64_t u, size_t size) {
+    for (size_t b=0; b<size; b++) {
+        p[b] = (u >> (8 * b)) & 0xff;
+    }
+}
+
+/* Map the bits of a floating point number onto an unsigned integer with the
+ * same ordering, so that the prediction can be done with exact integer
+ * arithmetic and does not depend on the floating point environment. */
+static inline uint64_t toOrdered(uint64_t u, uint64_t sign, uint64_t mask) {
+    return (u & sign) ? (~u & mask) : (u | sign);
+}
+
+static inline uint64_t fromOrdered(uint64_t m, uint64_t sign, uint64_t mask) {
+    return (m & sign) ? (m & ~sign) : (~m & mask);
+}
+
+/* Residuals are stored as zigzag encoded differences, which keeps the high
+ * bytes of small negative differences zero as well */
+static inline uint64_t zigzag(uint64_t d, uint64_t sign, uint64_t mask) {
+    return ((d << 1) ^ ((d & sign) ? mask : 0)) & mask;
+}
+
+static inline uint64_t unzigzag(uint64_t z, uint64_t mask) {
+    return ((z >> 1) ^ ((z & 1) ? mask : 0)) & mask;
+}
+
+/* Predict the value at position t along the tau axis from the values before
+ * it, which are stride elements apart. Near the start of the axis, lower
+ * order predictions are used. The offsets are signed, since negating the
+ * unsigned stride would wrap around. */
+static inline uint64_t predict(const uint64_t *m, size_t t, size_t stride,
+                               int mode, uint64_t mask) {
+    const ptrdiff_t s = (ptrdiff_t) stride;
+
+    if (t == 0) {
+        return 0;
+    } else if (t == 1) {
+        return m[-s];
+    } else if (t == 2 || mode == PREDICT_LINEAR) {
+        return (2 * m[-s] - m[-2 * s]) & mask;
+    } else {
+        return (3 * m[-s] - 3 * m[-2 * s] + m[-3 * s]) & mask;
+    }
+}
+
+/* The largest possible size of an encoded chunk of nbytes */
+size_t predictiveBound(size_t nbytes) {
+    return compressBound(nbytes);
+}
+
+/* Encode a chunk of nbytes, given the complete filter parameters. Returns the
+ * size of the encoded chunk in out, or 0 on failure. */
+size_t predictiveEncode(size_t cd_nelmts, const unsigned int cd_values[],
+                        const void *in, size_t nbytes, void *out,
+                        size_t out_size) {
+    struct chunk_geometry g;
+    if (chunkGeometry(cd_nelmts, cd_values, &g) != 0) return 0;
+
+    const size_t n = g.outer * g.tau * g.inner;
+    if (n * g.size != nbytes) return 0;
+
+    const uint64_t sign = (uint64_t) 1 << (8 * g.size - 1);
+    const uint64_t mask = sign | (sign - 1);
+    const unsigned char *bytes = in;
+
+    uint64_t *m = malloc(n * sizeof(uint64_t));
+    unsigned char *shuffled = malloc(nbytes);
+    if (m == NULL || shuffled == NULL) {
+        free(m);
+        free(shuffled);
+        return 0;
+    }
+
+    for (size_t j=0; j<n; j++) {
+        m[j] = toOrdered(loadElement(bytes + j * g.size, g.size), sign, mask);
+    }
+
+    /* Store the residuals with their bytes grouped by significance */
+    for (size_t o=0; o<g.outer; o++) {
+        for (size_t t=0; t<g.tau; t++) {
+            const size_t row = (o * g.tau + t) * g.inner;
+            for (size_t i=0; i<g.inner; i++) {
+                const size_t j = row + i;
+                uint64_t p = predict(m + j, t, g.inner, g.mode, mask);
+                uint64_t r = zigzag((m[j] - p) & mask, sign, mask);
+                for (size_t b=0; b<g.size; b++) {
+                    shuffled[b * n + j] = (r >> (8 * b)) & 0xff;
+                }
+            }
+        }
+    }
+
+    uLongf dest_size = out_size;
+    int err = compress2(out, &dest_size, shuffled, nbytes, g.level);
+
+    free(m);
+    free(shuffled);
+
+    return (err == Z_OK) ? dest_size : 0;
+}
+
+/* Decode a chunk of nbytes into out, which must hold the complete chunk.
+ * Returns the size of the decoded chunk, or 0 on failure. */
+size_t predictiveDecode(size_t cd_nelmts, const unsigned int cd_values[],
+                        const void *in, size_t nbytes, void *out,
+                        size_t out_size) {
+    struct chunk_geometry g;
+    if (chunkGeometry(cd_nelmts, cd_values, &g) != 0) return 0;
+
+    const size_t n = g.outer * g.tau * g.inner;
+    const size_t chunk_bytes = n * g.size;
+    if (out_size < chunk_bytes) return 0;
+
+    const uint64_t sign = (uint64_t) 1 << (8 * g.size - 1);
+    const uint64_t mask = sign | (sign - 1);
+    unsigned char *bytes = out;
+
+    uint64_t *m = malloc(n * sizeof(uint64_t));
+    unsigned char *shuffled = malloc(chunk_bytes);
+    if (m == NULL || shuffled == NULL) {
+        free(m);
+        free(shuffled);
+        return 0;
+    }
+
+    uLongf dest_size = chunk_bytes;
+    int err = uncompress(shuffled, &dest_size, in, nbytes);
+    if (err != Z_OK || dest_size != chunk_bytes) {
+        free(m);
+        free(shuffled);
+        return 0;
+    }
+
+    /* Undo the predictions in the same order as they were made */
+    for (size_t o=0; o<g.outer; o++) {
+        for (size_t t=0; t<g.tau; t++) {
+            const size_t row = (o * g.tau + t) * g.inner;
+            for (size_t i=0; i<g.inner; i++) {
+                const size_t j = row + i;
+                uint64_t r = 0;
+                for (size_t b=0; b<g.size; b++) {
+                    r |= (uint64_t) shuffled[b * n + j] << (8 * b);
+                }
+                uint64_t p = predict(m + j, t, g.inner, g.mode, mask);
+                m[j] = (unzigzag(r, mask) + p) & mask;
+            }
+        }
+    }
+
+    for (size_t j=0; j<n; j++) {
+        storeElement(bytes + j * g.size, fromOrdered(m[j], sign, mask), g.size);
+    }
+
+    free(m);
+    free(shuffled);
+
+    return chunk_bytes;
+}
+
+/* Complete the filter parameters when a dataset is created, by appending the
+ * element size and the chunk dimensions to the user parameters. */
+static herr_t predictiveSetLocal(hid_t dcpl_id, hid_t type_id, hid_t space_id) {
+    unsigned int flags;
+    size_t cd_nelmts = PREDICT_CD_MAX;
+    unsigned int cd_values[PREDICT_CD_MAX];
+    if (H5Pget_filter_by_id2(dcpl_id, H5Z_FILTER_PREDICTIVE, &flags, &cd_nelmts,
+                             cd_values, 0, NULL, NULL) < 0) return -1;
+    if (cd_nelmts < PREDICT_CD_USER) return -1;
+
+    hsize_t dims[H5S_MAX_RANK];
+    int rank = H5Pget_chunk(dcpl_id, H5S_MAX_RANK, dims);
+    size_t size = H5Tget_size(type_id);
+    if (rank <= 0 || (size != 4 && size != 8)) return -1;
+    if (cd_values[PREDICT_CD_AXIS] >= (unsigned int) rank) return -1;
+
+    cd_values[PREDICT_CD_SIZE] = size;
+    cd_values[PREDICT_CD_RANK] = rank;
+    for (int i=0; i<rank; i++) {
+        cd_values[PREDICT_CD_DIMS + i] = dims[i];
+    }
+
+    return H5Pmodify_filter(dcpl_id, H5Z_FILTER_PREDICTIVE, flags,
+                            PREDICT_CD_DIMS + rank, cd_values);
+}
+
+/* The filter callback. HDF5 owns the buffers, so they are (re)allocated with
+ * the HDF5 memory functions. */
+static size_t predictiveFilter(unsigned int flags, size_t cd_nelmts,
+                               const unsigned int cd_values[], size_t nbytes,
+                               size_t *buf_size, void **buf) {
+    struct chunk_geometry g;
+    if (chunkGeometry(cd_nelmts, cd_values, &g) != 0) return 0;
+
+    size_t out_size;
+    if (flags & H5Z_FLAG_REVERSE) {
+        out_size = g.outer * g.tau * g.inner * g.size;
+    } else {
+        out_size = predictiveBound(nbytes);
+    }
+
+    void *out = H5allocate_memory(out_size, 0);
+    if (out == NULL) return 0;
+
+    size_t size;
+    if (flags & H5Z_FLAG_REVERSE) {
+        size = predictiveDecode(cd_nelmts, cd_values, *buf, nbytes, out, out_size);
+    } else {
+        size = predictiveEncode(cd_nelmts, cd_values, *buf, nbytes, out, out_size);
+    }
+
+    if (size == 0) {
+        H5free_memory(out);
+        return 0;
+    }
+
+    H5free_memory(*buf);
+    *buf = out;
+    *buf_size = out_size;
+
+    return size;
+}
+
+const H5Z_class2_t H5Z_PREDICTIVE[1] = {{
+    H5Z_CLASS_T_VERS,         //version of the struct
+    H5Z_FILTER_PREDICTIVE,    //filter identifier
+    1,                        //encoder present
+    1,                        //decoder present
+    "classex tau prediction", //name for debugging
+    NULL,                     //can_apply callback
+    predictiveSetLocal,       //set_local callback
+    predictiveFilter          //the filter itself
+}};
+
+/* Make the filter available to HDF5 in this program */
+int registerPredictiveFilter(void) {
+    if (H5Zfilter_avail(H5Z_FILTER_PREDICTIVE) > 0) return 0;
+
+    if (H5Zregister(H5Z_PREDICTIVE) < 0) {
+        printf("Error while registering the predictive filter.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,455 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <omp.h>
+#include "../include/raw_output.h"
+#include "../include/layout.h"
+#include "../include/streaming.h"
+#include "../include/parallel.h"
+#include "../include/async_io.h"
+
+/* Place the transfer function cube in the mapped file, in the order of the
+ * output layout. In streaming mode, the functions are computed one block at
+ * a time. In the default layout, the blocks are computed in place. */
+static int writeRawCube(const struct perturb_data *data, struct params *pars,
+                        real_t *cube) {
+    const int layout = pars->Layout;
+    const size_t n_functions = data->n_functions;
+    const size_t tau_size = data->tau_size;
+    const size_t k_size = data->k_size;
+    const size_t slab_size = tau_size * k_size;
+
+    if (data->delta != NULL) {
+        return transposeCube(data->delta, cube, layout, n_functions, tau_size,
+                             k_size);
+    }
+
+    const int block_size = streamingBlockSize(data, pars);
+    printf("Streaming the transfer functions in blocks of %d functions.\n", block_size);
+
+    /* Other layouts need the block in memory to reorder it */
+    real_t *buffer = NULL;
+    real_t *transposed = NULL;
+    if (layout != LAYOUT_FTK) {
+        buffer = malloc(block_size * slab_size * sizeof(real_t));
+        if (buffer == NULL) {
+            printf("Error: could not allocate memory for a block of functions.\n");
+            return 1;
+        }
+    }
+    if (layout == LAYOUT_TKF) {
+        transposed = malloc(block_size * slab_size * sizeof(real_t));
+        if (transposed == NULL) {
+            printf("Error: could not allocate memory for a block of functions.\n");
+            free(buffer);
+            return 1;
+        }
+    }
+
+    int err = 0;
+    for (int first = 0; first < n_functions && !err; first += block_size) {
+        const int count = (first + block_size <= n_functions) ? block_size
+                                                              : n_functions - first;
+
+        if (layout == LAYOUT_FTK) {
+            err = storeFunctions(data, pars, first, count, cube + first * slab_size);
+        } else if (layout == LAYOUT_FKT) {
+            err = storeFunctions(data, pars, first, count, buffer);
+            if (!err) {
+                transposeCube(buffer, cube + first * slab_size, layout, count,
+                              tau_size, k_size);
+            }
+        } else {
+            /* The block is a range of columns of the [tau][k][function] cube */
+            err = storeFunctions(data, pars, first, count, buffer);
+            if (!err) {
+                transposeCube(buffer, transposed, layout, count, tau_size, k_size);
+                #pragma omp parallel for schedule(static)
+                for (size_t i = 0; i < slab_size; i++) {
+                    memcpy(cube + i * n_functions + first, transposed + i * count,
+                           count * sizeof(real_t));
+                }
+            }
+        }
+    }
+
+    free(buffer);
+    free(transposed);
+
+    return err;
+}
+
+/* The header, with the sizes and aligned positions of all arrays */
+static void fillRawHeader(struct raw_header *header,
+                          const struct perturb_data *data,
+                          const struct params *pars, const struct units *us) {
+    const size_t n_functions = data->n_functions;
+    const size_t tau_size = data->tau_size;
+    const size_t k_size = data->k_size;
+
+    /* All titles get the same, 8-byte aligned, length */
+    size_t title_length = 8;
+    for (int i=0; i<n_functions; i++) {
+        size_t len = strlen(data->plan->entries[i].title) + 1;
+        if (len > title_length) {
+            title_length = (len + 7) / 8 * 8;
+        }
+    }
+
+    memset(header, 0, sizeof(struct raw_header));
+    memcpy(header->magic, RAW_MAGIC, sizeof(RAW_MAGIC));
+    header->version = RAW_VERSION;
+    header->endian_check = RAW_ENDIAN_CHECK;
+    header->header_size = sizeof(struct raw_header);
+    header->real_size = sizeof(real_t);
+    header->layout = pars->Layout;
+    header->title_length = title_length;
+    header->k_size = k_size;
+    header->tau_size = tau_size;
+    header->n_functions = n_functions;
+    header->n_ncdm = pars->N_ncdm;
+
+    /* Determine the units used */
+    header->unit_mass_cgs = us->UnitMassKilogram * 1000;
+    header->unit_length_cgs = us->UnitLengthMetres * 100;
+    header->unit_time_cgs = us->UnitTimeSeconds;
+    header->unit_temperature_cgs = us->UnitTemperatureKelvin;
+
+    /* Cosmological parameters */
+    header->h = pars->h;
+    header->Omega_m = pars->Omega_m;
+    header->Omega_b = pars->Omega_b;
+    header->Omega_lambda = pars->Omega_lambda;
+    header->Omega_k = pars->Omega_k;
+    header->Omega_ur = pars->Omega_ur;
+    header->T_CMB = pars->T_CMB;
+    strncpy(header->name, pars->Name, RAW_NAME_LENGTH - 1);
+
+    /* The sizes of the arrays in bytes */
+    header->size[RAW_TITLES] = n_functions * title_length;
+    header->size[RAW_K] = k_size * sizeof(double);
+    for (int i=RAW_LOG_TAU; i<=RAW_GROWTH_F_PRIME; i++) {
+        header->size[i] = tau_size * sizeof(double);
+    }
+    header->size[RAW_M_NCDM] = pars->N_ncdm * sizeof(double);
+    header->size[RAW_T_NCDM] = pars->N_ncdm * sizeof(double);
+    header->size[RAW_DELTA] = n_functions * tau_size * k_size * sizeof(real_t);
+    header->size[RAW_OMEGA] = n_functions * tau_size * sizeof(real_t);
+
+    /* Place the arrays one after the other, aligned */
+    uint64_t cursor = rawAlign(sizeof(struct raw_header));
+    for (int i=0; i<RAW_N_ARRAYS; i++) {
+        header->offset[i] = cursor;
+        cursor = rawAlign(cursor + header->size[i]);
+    }
+    header->file_size = cursor;
+}
+
+/* The sources of all arrays other than the cube. The titles are copied into
+ * a NUL-padded table, which the caller frees. Returns 0 on success. */
+static int rawArraySources(const struct raw_header *header,
+                           const struct perturb_data *data,
+                           const struct params *pars,
+                           const void *sources[RAW_N_ARRAYS]) {
+    char *titles = calloc(header->n_functions, header->title_length);
+    if (titles == NULL) {
+        printf("Error: could not allocate memory for the function titles.\n");
+        return 1;
+    }
+    for (int i=0; i<header->n_functions; i++) {
+        strcpy(titles + i * header->title_length, data->plan->entries[i].title);
+    }
+
+    sources[RAW_TITLES] = titles;
+    sources[RAW_K] = data->k;
+    sources[RAW_LOG_TAU] = data->log_tau;
+    sources[RAW_REDSHIFT] = data->redshift;
+    sources[RAW_OMEGA_M] = data->Omega_m;
+    sources[RAW_OMEGA_R] = data->Omega_r;
+    sources[RAW_HUBBLE_H] = data->Hubble_H;
+    sources[RAW_HUBBLE_H_PRIME] = data->Hubble_H_prime;
+    sources[RAW_GROWTH_D] = data->growth_D;
+    sources[RAW_GROWTH_F] = data->growth_f;
+    sources[RAW_GROWTH_F_PRIME] = data->growth_f_prime;
+    sources[RAW_M_NCDM] = pars->M_ncdm_eV;
+    sources[RAW_T_NCDM] = pars->T_ncdm;
+    sources[RAW_DELTA] = NULL;
+    sources[RAW_OMEGA] = data->Omega;
+
+    return 0;
+}
+
+/* Write the file through a shared mapping, in any order */
+static int writeRawMapped(const struct raw_header *header,
+                          const struct perturb_data *data,
+                          struct params *pars, char *fname) {
+    /* Create the file at its final size and map it */
+    int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error while opening file '%s': %s.\n", fname, strerror(errno));
+        return 1;
+    }
+    if (ftruncate(fd, header->file_size) != 0) {
+        printf("Error while resizing file '%s': %s.\n", fname, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    /* Reserve the blocks, since a full disk would otherwise only show up as
+     * a SIGBUS while writing to the mapping */
+    int fallocate_err = posix_fallocate(fd, 0, header->file_size);
+    if (fallocate_err != 0) {
+        printf("Error while reserving %zu bytes for file '%s': %s.\n",
+               (size_t) header->file_size, fname, strerror(fallocate_err));
+        close(fd);
+        return 1;
+    }
+    char *map = mmap(NULL, header->file_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Error while mapping file '%s': %s.\n", fname, strerror(errno));
+        return 1;
+    }
+
+    /* The ftruncate already zeroed the padding */
+    memcpy(map, header, sizeof(struct raw_header));
+
+    const void *sources[RAW_N_ARRAYS];
+    if (rawArraySources(header, data, pars, sources) != 0) {
+        munmap(map, header->file_size);
+        return 1;
+    }
+    for (int i=0; i<RAW_N_ARRAYS; i++) {
+        if (sources[i] != NULL && header->size[i] > 0) {
+            memcpy(map + header->offset[i], sources[i], header->size[i]);
+        }
+    }
+    free((void *) sources[RAW_TITLES]);
+
+    int err = writeRawCube(data, pars, (real_t *) (map + header->offset[RAW_DELTA]));
+    if (err != 0) printf("Error while writing data array '%s'.\n", "data->delta");
+
+    /* Write the pages back to the file, reporting any I/O errors */
+    if (msync(map, header->file_size, MS_SYNC) != 0) {
+        printf("Error while writing back file '%s': %s.\n", fname, strerror(errno));
+        err = 1;
+    }
+    if (munmap(map, header->file_size) != 0) {
+        printf("Error while unmapping file '%s': %s.\n", fname, strerror(errno));
+        err = 1;
+    }
+
+    return err;
+}
+
+/* Sequential output through the aligned buffers of an asynchronous writer */
+struct raw_stream {
+    struct async_writer writer;
+    struct async_buffer *buffer; //the buffer being filled (or NULL)
+    off_t position; //file offset of the next byte
+};
+
+/* Append bytes to the file, or zeros if src is NULL */
+static int rawStreamWrite(struct raw_stream *s, const void *src, size_t bytes) {
+    const char *p = src;
+    const size_t buffer_size = s->writer.buffer_size;
+
+    while (bytes > 0) {
+        if (s->buffer == NULL) {
+            s->buffer = asyncGetBuffer(&s->writer);
+            s->buffer->offset = s->position;
+        }
+
+        struct async_buffer *b = s->buffer;
+        size_t n = buffer_size - b->length;
+        if (n > bytes) n = bytes;
+
+        if (p != NULL) {
+            memcpy(b->data + b->length, p, n);
+            p += n;
+        } else {
+            memset(b->data + b->length, 0, n);
+        }
+        b->length += n;
+        s->position += n;
+        bytes -= n;
+
+        /* Hand over full buffers, whose offsets therefore stay aligned */
+        if (b->length == buffer_size) {
+            s->buffer = NULL;
+            if (asyncSubmit(&s->writer, b) != 0) return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Compute the cube and append it to the file, in the order of the layout.
+ * This is only possible for the tkf layout if the cube is in memory. */
+static int streamRawCube(struct raw_stream *s, const struct perturb_data *data,
+                         struct params *pars) {
+    const int layout = pars->Layout;
+    const size_t n_functions = data->n_functions;
+    const size_t tau_size = data->tau_size;
+    const size_t k_size = data->k_size;
+    const size_t slab_size = tau_size * k_size;
+
+    if (data->delta != NULL && layout == LAYOUT_FTK) {
+        return rawStreamWrite(s, data->delta, n_functions * slab_size * sizeof(real_t));
+    } else if (data->delta != NULL) {
+        real_t *cube = malloc(n_functions * slab_size * sizeof(real_t));
+        if (cube == NULL) {
+            printf("Error: could not allocate memory to transpose the transfer functions.\n");
+            return 1;
+        }
+        transposeCube(data->delta, cube, layout, n_functions, tau_size, k_size);
+        int err = rawStreamWrite(s, cube, n_functions * slab_size * sizeof(real_t));
+        free(cube);
+        return err;
+    }
+
+    const int block_size = streamingBlockSize(data, pars);
+    printf("Streaming the transfer functions in blocks of %d functions.\n", block_size);
+
+    real_t *buffer = malloc(block_size * slab_size * sizeof(real_t));
+    real_t *transposed = NULL;
+    if (layout != LAYOUT_FTK) {
+        transposed = malloc(block_size * slab_size * sizeof(real_t));
+    }
+    if (buffer == NULL || (layout != LAYOUT_FTK && transposed == NULL)) {
+        printf("Error: could not allocate memory for a block of functions.\n");
+        free(buffer);
+        free(transposed);
+        return 1;
+    }
+
+    int err = 0;
+    for (int first = 0; first < n_functions && !err; first += block_size) {
+        const int count = (first + block_size <= n_functions) ? block_size
+                                                              : n_functions - first;
+
+        err = storeFunctions(data, pars, first, count, buffer);
+        if (err) break;
+
+        real_t *out = buffer;
+        if (layout != LAYOUT_FTK) {
+            transposeCube(buffer, transposed, layout, count, tau_size, k_size);
+            out = transposed;
+        }
+        err = rawStreamWrite(s, out, count * slab_size * sizeof(real_t));
+    }
+
+    free(buffer);
+    free(transposed);
+
+    return err;
+}
+
+/* Write the file from start to end with asynchronous (and, if requested,
+ * direct) writes, while the next buffer is being filled */
+static int writeRawDirect(const struct raw_header *header,
+                          const struct perturb_data *data,
+                          struct params *pars, char *fname) {
+    struct raw_stream s;
+    s.buffer = NULL;
+    s.position = 0;
+
+    const size_t buffer_size = pars->IOBufferMB * 1024 * 1024;
+    if (openAsyncWriter(&s.writer, fname, 1, pars->IOBackend, pars->IODepth,
+                        buffer_size) != 0) {
+        return 1;
+    }
+
+    const void *sources[RAW_N_ARRAYS];
+    if (rawArraySources(header, data, pars, sources) != 0) {
+        closeAsyncWriter(&s.writer, -1);
+        return 1;
+    }
+
+    int err = rawStreamWrite(&s, header, sizeof(struct raw_header));
+    for (int i=0; i<RAW_N_ARRAYS && !err; i++) {
+        /* Pad up to the aligned start of the array */
+        err = rawStreamWrite(&s, NULL, header->offset[i] - s.position);
+        if (err) break;
+
+        if (i == RAW_DELTA) {
+            err = streamRawCube(&s, data, pars);
+            if (err != 0) printf("Error while writing data array '%s'.\n", "data->delta");
+        } else {
+            err = rawStreamWrite(&s, sources[i], header->size[i]);
+        }
+    }
+    free((void *) sources[RAW_TITLES]);
+
+    if (!err) err = rawStreamWrite(&s, NULL, header->file_size - s.position);
+    if (!err && s.buffer != NULL) err = asyncSubmit(&s.writer, s.buffer);
+
+    const double busy_time = omp_get_wtime() - s.writer.start_time;
+    const double MB = s.writer.bytes_written / (1024. * 1024.);
+    const int backend = s.writer.backend;
+    const int direct = s.writer.direct;
+    const double wait_time = s.writer.wait_time;
+
+    /* Wait for the last writes and remove the padding of the last buffer */
+    if (closeAsyncWriter(&s.writer, header->file_size) != 0) err = 1;
+
+    const double total_time = omp_get_wtime() - s.writer.start_time;
+    printf("Raw output: %.1f MB using %s%s, %.1f MB/s (waited %.3f s for the device, %.3f s to finish).\n",
+           MB, asyncBackendName(backend), direct ? " with O_DIRECT" : "",
+           MB / total_time, wait_time, total_time - busy_time);
+
+    return err;
+}
+
+int write_raw(struct perturb_data *data, struct params *pars,
+              struct units *us, char *fname) {
+    struct raw_header header;
+    fillRawHeader(&header, data, pars, us);
+
+    printf("Writing the perturbation to '%s' in the raw format.\n", fname);
+
+    /* Direct writes produce the file from start to end, which the blocks of
+     * the tkf layout do not */
+    int direct = pars->DirectIO;
+    if (direct && data->delta == NULL && pars->Layout == LAYOUT_TKF) {
+        printf("WARNING: streaming in the tkf layout requires mapped output, not using direct I/O.\n");
+        direct = 0;
+    }
+
+    const double write_start = wallTime();
+
+    int err;
+    if (direct) {
+        err = writeRawDirect(&header, data, pars, fname);
+    } else {
+        err = writeRawMapped(&header, data, pars, fname);
+    }
+
+    const double write_time = wallTime() - write_start;
+    printf("Wrote the transfer functions in %.3f s on %d rank(s) (%.1f MB/s).\n",
+           write_time, parallelSize(),
+           header.file_size / (1024. * 1024.) / write_time);
+
+    return err;
+}
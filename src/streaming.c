@@ -0,0 +1,418 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <omp.h>
+#include <pthread.h>
+#include "../include/streaming.h"
+#include "../include/derivatives.h"
+#include "../include/layout.h"
+#include "../include/compression.h"
+#include "../include/pipeline.h"
+#include "../include/parallel.h"
+
+/* Compute the function with index index_func (in the order of the plan) as
+ * a [tau][k] slab. CLASS functions are extracted directly. Derived
+ * functions are computed from their parent function, which is computed again into the
+ * first slab of the workspace scratch. Chained derivatives recurse, so the
+ * workspace must hold plan->max_depth slabs. */
+int computeFunctionSlab(const struct perturb_data *data, struct params *pars,
+                        int index_func, double *slab, double *scratch) {
+    const struct extraction_plan *plan = data->plan;
+    const struct extraction_entry *entry = &plan->entries[index_func];
+
+    if (entry->type == ENTRY_CLASS) {
+        return extractFunctions(plan, index_func, 1, slab);
+    } else if (entry->parent >= 0) {
+        const size_t slab_size = data->k_size * data->tau_size;
+        if (computeFunctionSlab(data, pars, entry->parent, scratch,
+                                scratch + slab_size) != 0) return 1;
+        return computeDerivedEntry(data, index_func, scratch, slab);
+    }
+
+    printf("Error: cannot stream function '%s'.\n", entry->title);
+    return 1;
+}
+
+/* The number of double precision slabs of workspace needed by storeFunctions:
+ * the scratch space of computeFunctionSlab and, if the functions are stored
+ * in single precision, one slab to compute them in before rounding. */
+static int workspaceSlabs(const struct extraction_plan *plan) {
+    int slabs = plan->max_depth + (REAL_IS_DOUBLE ? 0 : 1);
+    return slabs > 0 ? slabs : 1;
+}
+
+/* Allocate the workspace of storeFunctionsWith, or print an error */
+double *allocateWorkspace(const struct perturb_data *data) {
+    const size_t slab_size = data->k_size * data->tau_size;
+    double *work = malloc(workspaceSlabs(data->plan) * slab_size * sizeof(double));
+    if (work == NULL) {
+        printf("Error: could not allocate workspace for the functions.\n");
+    }
+
+    return work;
+}
+
+/* Compute count functions, starting at index first, and store them as
+ * consecutive [tau][k] slabs in dest, using the workspace work from
+ * allocateWorkspace. The functions are always computed in double precision
+ * and, with -DSINGLE_PRECISION, rounded once when stored. */
+int storeFunctionsWith(const struct perturb_data *data, struct params *pars,
+                       int first, int count, real_t *dest, double *work) {
+    const size_t slab_size = data->k_size * data->tau_size;
+
+    for (int j = 0; j < count; j++) {
+        real_t *T = dest + j * slab_size;
+#ifdef SINGLE_PRECISION
+        if (computeFunctionSlab(data, pars, first + j, work, work + slab_size) != 0) return 1;
+
+        #pragma omp parallel for simd schedule(static)
+        for (size_t i = 0; i < slab_size; i++) {
+            T[i] = (real_t) work[i];
+        }
+#else
+        if (computeFunctionSlab(data, pars, first + j, T, work) != 0) return 1;
+#endif
+    }
+
+    return 0;
+}
+
+/* As storeFunctionsWith, with a workspace for this call only */
+int storeFunctions(const struct perturb_data *data, struct params *pars,
+                   int first, int count, real_t *dest) {
+    double *work = allocateWorkspace(data);
+    if (work == NULL) return 1;
+
+    int err = storeFunctionsWith(data, pars, first, count, dest, work);
+    free(work);
+
+    return err;
+}
+
+/* The number of functions that can be held at once within the memory budget.
+ * Besides the block itself, we need the workspace of storeFunctions and, for
+ * other layouts than the default, a transposed copy of the block. When the
+ * writing is pipelined, every slot of the queue holds a block. */
+int streamingBlockSize(const struct perturb_data *data, struct params *pars) {
+    const double slab_MB = data->k_size * data->tau_size * sizeof(real_t)
+                           / (1024. * 1024.);
+    const double work_MB = data->k_size * data->tau_size * sizeof(double)
+                           * workspaceSlabs(data->plan) / (1024. * 1024.);
+    const int slots = pars->Pipeline ? pars->PipelineDepth : 1;
+    const int copies = slots + ((pars->Layout == LAYOUT_FTK) ? 0 : 1);
+
+    int block = (int) ((pars->MemoryBudgetMB - work_MB) / (copies * slab_MB));
+
+    if (block < 1) {
+        printf("WARNING: the memory budget of %g MB is too small for a single function (%g MB).\n",
+               pars->MemoryBudgetMB, copies * slab_MB + work_MB);
+        block = 1;
+    }
+
+    if (block > data->n_functions) {
+        block = data->n_functions;
+    }
+
+    return block;
+}
+
+/* Compute the count functions starting at first into buffer, round them in
+ * lossy mode, and store them in the order of the output layout in dest. For
+ * the default layout, dest may be the same as buffer. */
+static int prepareBlock(const struct perturb_data *data, struct params *pars,
+                        int first, int count, real_t *buffer, real_t *dest,
+                        double *max_abs_error, double *max_rel_error) {
+    const size_t slab_size = data->k_size * data->tau_size;
+
+    /* Compute the functions in this block */
+    if (storeFunctions(data, pars, first, count, buffer) != 0) return 1;
+
+    /* Round the values in lossy mode */
+    for (int j = 0; j < count && pars->LossyMode != LOSSY_NONE; j++) {
+        quantizeFunction(pars, data->plan->entries[first + j].title,
+                         buffer + j * slab_size, buffer + j * slab_size,
+                         slab_size, 1, &max_abs_error[first + j],
+                         &max_rel_error[first + j]);
+    }
+
+    /* Reorder the block if a different layout is requested */
+    if (pars->Layout != LAYOUT_FTK) {
+        transposeCube(buffer, dest, pars->Layout, count, data->tau_size,
+                      data->k_size);
+    }
+
+    return 0;
+}
+
+/* Write a prepared block of count functions, starting at first, to the part
+ * of the dataset h_data that corresponds to it. With collective MPI-IO, all
+ * ranks must take part in every write, so ranks without a block left write
+ * an empty block with count 0. */
+static int writeBlock(hid_t h_data, hid_t h_filespace, hid_t h_xfer,
+                      struct params *pars, int direct, const real_t *out,
+                      int first, int count, size_t tau_size, size_t k_size) {
+    const int layout = pars->Layout;
+    herr_t h_err;
+
+    /* Select the part of the dataset that corresponds to this block */
+    size_t shape[3];
+    layoutShape(layout, count, tau_size, k_size, shape);
+    hsize_t block_shape[3] = {shape[0], shape[1], shape[2]};
+    hsize_t start[3] = {first, 0, 0};
+    if (layout == LAYOUT_TKF) {
+        start[0] = 0;
+        start[2] = first;
+    }
+
+    /* Blocks consist of whole chunks, which we can compress ourselves */
+    if (direct) {
+        h_err = writeChunksParallel(h_data, pars, out, block_shape, start);
+        if (h_err != 0) printf("Error while writing block starting at function %d.\n", first);
+        return h_err != 0;
+    }
+
+    hid_t h_memspace;
+    if (count > 0) {
+        h_err = H5Sselect_hyperslab(h_filespace, H5S_SELECT_SET, start, NULL,
+                                    block_shape, NULL);
+        if (h_err < 0) printf("Error while selecting hyperslab.\n");
+        h_memspace = H5Screate_simple(3, block_shape, NULL);
+    } else {
+        H5Sselect_none(h_filespace);
+        h_memspace = H5Scopy(h_filespace);
+    }
+
+    /* Write the block */
+    h_err = H5Dwrite(h_data, H5T_NATIVE_REAL, h_memspace, h_filespace,
+                     h_xfer, out);
+    if (h_err < 0) printf("Error while writing block starting at function %d.\n", first);
+    H5Sclose(h_memspace);
+
+    return h_err < 0;
+}
+
+/* Everything the writer thread needs to drain the queue */
+struct writer_args {
+    struct block_queue *queue;
+    hid_t h_data;
+    hid_t h_filespace;
+    struct params *pars;
+    int direct;
+    int offset; //position of the first function in the dataset
+    size_t tau_size;
+    size_t k_size;
+    double wait_time; //time spent waiting for blocks
+    double write_time; //time spent writing blocks
+};
+
+/* The writer thread is the only thread that calls HDF5 while the pipeline
+ * runs, since the library is not thread-safe */
+static void *writerThread(void *arg) {
+    struct writer_args *w = arg;
+    struct block_queue *q = w->queue;
+
+    while (1) {
+        struct queued_block *b = queuePeek(q, &w->wait_time);
+        if (b->count == 0) {
+            queueRelease(q);
+            break;
+        }
+
+        /* After an error, keep draining the queue to let the producer finish */
+        if (!atomic_load(&q->error)) {
+            double start = omp_get_wtime();
+            if (writeBlock(w->h_data, w->h_filespace, H5P_DEFAULT, w->pars,
+                           w->direct, b->data, w->offset + b->first, b->count, w->tau_size,
+                           w->k_size) != 0) {
+                atomic_store(&q->error, 1);
+            }
+            w->write_time += omp_get_wtime() - start;
+        }
+
+        queueRelease(q);
+    }
+
+    return NULL;
+}
+
+/* Pipelined version of writeCubeStreaming. The calling thread computes the
+ * blocks and hands them to a dedicated writer thread through a bounded
+ * queue of PipelineDepth blocks, so that computing and writing overlap. */
+static int writeCubePipelined(hid_t h_data, hid_t h_filespace,
+                              const struct perturb_data *data,
+                              struct params *pars, int block, int direct,
+                              int offset, double *max_abs_error,
+                              double *max_rel_error) {
+    const size_t slab_size = data->k_size * data->tau_size;
+    const int Nf = data->n_functions;
+    const int layout = pars->Layout;
+
+    /* The queue, and a buffer to compute in if the blocks are transposed */
+    struct block_queue queue;
+    real_t *buffer = NULL;
+    if (layout != LAYOUT_FTK) {
+        buffer = malloc(block * slab_size * sizeof(real_t));
+    }
+
+    if ((layout != LAYOUT_FTK && buffer == NULL)
+        || initBlockQueue(&queue, pars->PipelineDepth, block * slab_size) != 0) {
+        printf("Error: could not allocate memory for the pipeline.\n");
+        free(buffer);
+        return 1;
+    }
+
+    struct writer_args w = {&queue, h_data, h_filespace, pars, direct, offset,
+                            data->tau_size, data->k_size, 0., 0.};
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, writerThread, &w) != 0) {
+        printf("Error: could not start the writer thread.\n");
+        cleanBlockQueue(&queue);
+        free(buffer);
+        return 1;
+    }
+
+    double start = omp_get_wtime();
+    double wait_time = 0.;
+    int err = 0;
+
+    for (int first = 0; first < Nf && !err; first += block) {
+        int count = (Nf - first < block) ? Nf - first : block;
+
+        /* Fill a free slot of the queue */
+        struct queued_block *b = queueReserve(&queue, &wait_time);
+        real_t *dest = b->data;
+        real_t *compute = (layout == LAYOUT_FTK) ? dest : buffer;
+        err = prepareBlock(data, pars, first, count, compute, dest,
+                           max_abs_error, max_rel_error);
+        if (err) break;
+
+        b->first = first;
+        b->count = count;
+        queuePublish(&queue);
+
+        err = atomic_load(&queue.error);
+    }
+
+    /* Mark the end of the stream and wait for the writer to finish */
+    struct queued_block *b = queueReserve(&queue, &wait_time);
+    b->count = 0;
+    queuePublish(&queue);
+    pthread_join(writer, NULL);
+
+    if (atomic_load(&queue.error)) err = 1;
+
+    printf("Pipeline: %.3f s in total, %.3f s writing, the writer waited %.3f s and the producer %.3f s.\n",
+           omp_get_wtime() - start, w.write_time, w.wait_time, wait_time);
+
+    cleanBlockQueue(&queue);
+    free(buffer);
+
+    return err;
+}
+
+/* Compute and write the transfer functions, one block of functions at a time,
+ * to the already created dataset h_data. The full cube is never held in
+ * memory. In lossy mode, the errors of each function are stored in
+ * max_abs_error and max_rel_error. With MPI, every rank computes and writes
+ * only its own range of functions. The functions are placed in the dataset
+ * starting at function offset, which is non-zero when appending. */
+int writeCubeStreaming(hid_t h_data, const struct perturb_data *data,
+                       struct params *pars, int offset, double *max_abs_error,
+                       double *max_rel_error) {
+    const size_t Nk = data->k_size;
+    const size_t Ntau = data->tau_size;
+    const int Nf = data->n_functions;
+    const size_t slab_size = Nk * Ntau;
+    const int layout = pars->Layout;
+
+    const int block = streamingBlockSize(data, pars);
+
+    printf("Streaming %d functions in blocks of %d (memory budget %g MB).\n",
+           Nf, block, pars->MemoryBudgetMB);
+
+    /* The functions of this rank, and the number of blocks of the busiest */
+    int rank_first, rank_count;
+    functionRange(Nf, parallelRank(), parallelSize(), &rank_first, &rank_count);
+    const int n_blocks = maxOverRanks((rank_count + block - 1) / block);
+    if (parallelSize() > 1) {
+        printf("Writing %d blocks collectively on %d ranks.\n", n_blocks, parallelSize());
+    }
+
+    hid_t h_filespace = H5Dget_space(h_data);
+
+    /* With filters, the chunks are compressed in parallel */
+    const int direct = useDirectChunkWrites(h_data, pars);
+    if (direct) {
+        printf("Compressing the chunks on %d threads.\n", omp_get_max_threads());
+    }
+
+    /* Overlap computing and writing, using a separate writer thread */
+    if (pars->Pipeline) {
+        printf("Pipelining the output with a queue of %d blocks.\n", pars->PipelineDepth);
+        int err = writeCubePipelined(h_data, h_filespace, data, pars, block,
+                                     direct, offset, max_abs_error,
+                                     max_rel_error);
+        H5Sclose(h_filespace);
+        return err;
+    }
+
+    /* Allocate memory for one block and a transposed copy */
+    real_t *buffer = malloc(block * slab_size * sizeof(real_t));
+    real_t *transposed = NULL;
+    if (layout != LAYOUT_FTK) {
+        transposed = malloc(block * slab_size * sizeof(real_t));
+    }
+
+    int err = 0;
+    if (buffer == NULL || (layout != LAYOUT_FTK && transposed == NULL)) {
+        printf("Error: could not allocate memory for streaming output.\n");
+        err = 1;
+    }
+
+    real_t *out = (layout == LAYOUT_FTK) ? buffer : transposed;
+    const hid_t h_xfer = createTransferProperties();
+    const int rank_end = rank_first + rank_count;
+
+    /* After an error, this rank keeps taking part in the collective writes
+     * with empty blocks, since the other ranks would otherwise wait forever */
+    for (int i = 0; i < n_blocks; i++) {
+        int first = rank_first + i * block;
+        int count = (rank_end - first < block) ? rank_end - first : block;
+        if (count < 0 || err) count = 0;
+
+        if (count > 0 && prepareBlock(data, pars, first, count, buffer, out,
+                                      max_abs_error, max_rel_error) != 0) {
+            err = 1;
+            count = 0;
+        }
+
+        if (writeBlock(h_data, h_filespace, h_xfer, pars, direct, out,
+                       offset + first, count, Ntau, Nk) != 0) {
+            err = 1;
+        }
+    }
+
+    closeTransferProperties(h_xfer);
+    H5Sclose(h_filespace);
+    free(buffer);
+    free(transposed);
+
+    /* Fail on every rank if any of them failed */
+    return maxOverRanks(err);
+}
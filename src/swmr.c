@@ -0,0 +1,289 @@
+/*******************************************************************************
+ * This file is part of classex.
+ * Copyright (c) 2020 Willem Elbers (whe@willemelbers.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/swmr.h"
+#include "../include/output.h"
+#include "../include/layout.h"
+#include "../include/compression.h"
+#include "../include/streaming.h"
+#include "../include/parallel.h"
+
+/* Create the transfer function cube with no times yet. The time axis grows
+ * as blocks of times are written. The function axis is unlimited as well, so
+ * that functions can still be appended to the finished file. */
+hid_t createGrowingCube(hid_t h_grp, const struct params *pars,
+                        size_t n_functions, size_t tau_size, size_t k_size) {
+    const int layout = pars->Layout;
+    const int tau_axis = tauAxis(layout);
+    const int func_axis = (layout == LAYOUT_TKF) ? 2 : 0;
+
+    size_t shape_layout[3];
+    layoutShape(layout, n_functions, tau_size, k_size, shape_layout);
+    hsize_t shape[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+    hsize_t max_shape[3] = {shape[0], shape[1], shape[2]};
+    shape[tau_axis] = 0;
+    max_shape[tau_axis] = H5S_UNLIMITED;
+    max_shape[func_axis] = H5S_UNLIMITED;
+
+    hid_t h_space = H5Screate_simple(3, shape, max_shape);
+    hid_t h_prop = createCubeProperties(pars, tau_size, k_size);
+    hid_t h_data = H5Dcreate(h_grp, "Transfer functions", H5T_NATIVE_REAL,
+                             h_space, H5P_DEFAULT, h_prop, H5P_DEFAULT);
+    if (h_data < 0) printf("Error while creating dataspace '%s'.\n", "Transfer functions");
+    H5Pclose(h_prop);
+    H5Sclose(h_space);
+
+    return h_data;
+}
+
+/* Record how many times of every function can be read */
+static int writeProgress(hid_t h_data, int times_written) {
+    hid_t h_attr = H5Aopen(h_data, SWMR_PROGRESS_ATTRIBUTE, H5P_DEFAULT);
+    herr_t h_err = H5Awrite(h_attr, H5T_NATIVE_INT, &times_written);
+    H5Aclose(h_attr);
+
+    return h_err < 0;
+}
+
+/* The functions that are held in full while writing, as [tau][k] slabs: all
+ * of them if the cube is in memory, and otherwise only the derived functions,
+ * whose stencils need their parents at other times. These are computed here,
+ * in the memory returned in derived. The other slabs are NULL, because the
+ * CLASS functions are extracted one block of times at a time. */
+static int prepareSlabs(const struct perturb_data *data, struct params *pars,
+                        real_t **slabs, real_t **derived) {
+    const struct extraction_plan *plan = data->plan;
+    const size_t slab_size = data->k_size * data->tau_size;
+    const int Nf = data->n_functions;
+
+    *derived = NULL;
+    if (data->delta != NULL) {
+        for (int i=0; i<Nf; i++) {
+            slabs[i] = data->delta + i * slab_size;
+        }
+        return 0;
+    }
+
+    int n_derived = 0;
+    for (int i=0; i<Nf; i++) {
+        slabs[i] = NULL;
+        if (plan->entries[i].type != ENTRY_CLASS) n_derived++;
+    }
+    if (n_derived == 0) return 0;
+
+    printf("Computing %d derived functions before writing.\n", n_derived);
+
+    *derived = malloc(n_derived * slab_size * sizeof(real_t));
+    double *work = allocateWorkspace(data);
+    if (*derived == NULL || work == NULL) {
+        printf("Error: could not allocate memory for %d derived functions.\n", n_derived);
+        free(work);
+        return 1;
+    }
+
+    int err = 0;
+    for (int i=0, j=0; i<Nf && !err; i++) {
+        if (plan->entries[i].type == ENTRY_CLASS) continue;
+        slabs[i] = *derived + (j++) * slab_size;
+        err = storeFunctionsWith(data, pars, i, 1, slabs[i], work);
+    }
+    free(work);
+
+    return err;
+}
+
+/* Write the times [first, first + count) of all functions to the cube h_data,
+ * after extending its time axis to include them. The times are copied from
+ * the slabs or, where there is none, extracted from CLASS. In lossy mode, the
+ * values are rounded and the largest errors so far are kept in max_abs_error
+ * and max_rel_error. */
+static int writeTimeBlock(hid_t h_data, const struct perturb_data *data,
+                          struct params *pars, real_t **slabs, int direct,
+                          int first, int count, real_t *buffer,
+                          real_t *transposed, double *max_abs_error,
+                          double *max_rel_error) {
+    const int layout = pars->Layout;
+    const size_t Nk = data->k_size;
+    const int Nf = data->n_functions;
+    herr_t h_err;
+
+    /* Collect the times of this block, as [function][tau][k] */
+    for (int i=0; i<Nf; i++) {
+        real_t *times = buffer + i * count * Nk;
+        if (slabs[i] != NULL) {
+            memcpy(times, slabs[i] + first * Nk, count * Nk * sizeof(real_t));
+        } else {
+            extractTimes(data->plan, i, first, count, times);
+        }
+
+        if (pars->LossyMode != LOSSY_NONE) {
+            double abs_error, rel_error;
+            quantizeFunction(pars, data->plan->entries[i].title, times, times,
+                             count * Nk, 1, &abs_error, &rel_error);
+            if (abs_error > max_abs_error[i]) max_abs_error[i] = abs_error;
+            if (rel_error > max_rel_error[i]) max_rel_error[i] = rel_error;
+        }
+    }
+
+    /* Reorder the block if a different layout is requested */
+    real_t *out = buffer;
+    if (layout != LAYOUT_FTK) {
+        transposeCube(buffer, transposed, layout, Nf, count, Nk);
+        out = transposed;
+    }
+
+    /* The part of the cube that holds this block */
+    size_t shape_layout[3], extent_layout[3];
+    layoutShape(layout, Nf, count, Nk, shape_layout);
+    layoutShape(layout, Nf, first + count, Nk, extent_layout);
+    hsize_t block_shape[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+    hsize_t extent[3] = {extent_layout[0], extent_layout[1], extent_layout[2]};
+    hsize_t start[3] = {0, 0, 0};
+    start[tauAxis(layout)] = first;
+
+    h_err = H5Dset_extent(h_data, extent);
+    if (h_err < 0) {
+        printf("Error while extending the cube to %d times.\n", first + count);
+        return 1;
+    }
+
+    /* Whole chunks of times are compressed in parallel */
+    if (direct) {
+        h_err = writeChunksParallel(h_data, pars, out, block_shape, start);
+        if (h_err != 0) printf("Error while writing the times starting at %d.\n", first);
+        return h_err != 0;
+    }
+
+    hid_t h_filespace = H5Dget_space(h_data);
+    H5Sselect_hyperslab(h_filespace, H5S_SELECT_SET, start, NULL, block_shape, NULL);
+    hid_t h_memspace = H5Screate_simple(3, block_shape, NULL);
+    h_err = H5Dwrite(h_data, H5T_NATIVE_REAL, h_memspace, h_filespace, H5P_DEFAULT, out);
+    if (h_err < 0) printf("Error while writing the times starting at %d.\n", first);
+    H5Sclose(h_memspace);
+    H5Sclose(h_filespace);
+
+    return h_err < 0;
+}
+
+/* Write the transfer functions in single-writer/multiple-reader (SWMR) mode.
+ * The cube h_data, created by createGrowingCube, is filled one chunk of times
+ * at a time, starting at the earliest time. After each block, the cube is
+ * flushed and its attribute SWMR_PROGRESS_ATTRIBUTE is updated, so that
+ * readers that opened the file with H5F_ACC_SWMR_READ can read the times
+ * written so far while the rest is being written. Without a cube in memory,
+ * the CLASS functions are only extracted as their block of times is written.
+ * In SWMR mode, no objects or attributes can be created, so everything else
+ * in the file must already have been written. Here, the attributes of the
+ * cube are written first, and in lossy mode the maximum errors (zero in
+ * max_abs_error and max_rel_error to begin with) are updated after every
+ * block. */
+int writeCubeSWMR(hid_t h_file, hid_t h_data, struct perturb_data *data,
+                  struct params *pars, double *max_abs_error,
+                  double *max_rel_error) {
+    const size_t Nk = data->k_size;
+    const int Ntau = data->tau_size;
+    const int Nf = data->n_functions;
+
+    /* The blocks of times are the chunks of the cube */
+    hsize_t chunk[3];
+    cubeChunkShape(pars, Ntau, Nk, chunk);
+    const int block = chunk[tauAxis(pars->Layout)];
+
+    /* Record the layout, storage settings and errors as attributes */
+    char **titles = malloc(Nf * sizeof(char *));
+    if (titles == NULL) {
+        printf("Error: could not allocate memory for %d titles.\n", Nf);
+        return 1;
+    }
+    for (int i=0; i<Nf; i++) {
+        titles[i] = data->plan->entries[i].title;
+    }
+    int err = writeCubeAttributes(h_data, pars, titles, Nf, Ntau, Nk,
+                                  max_abs_error, max_rel_error);
+    free(titles);
+
+    /* Readers can poll this attribute to see how far the writing has come */
+    int times_written = 0;
+    hid_t h_space = H5Screate(H5S_SCALAR);
+    hid_t h_attr = H5Acreate1(h_data, SWMR_PROGRESS_ATTRIBUTE, H5T_NATIVE_INT, h_space, H5P_DEFAULT);
+    herr_t h_err = H5Awrite(h_attr, H5T_NATIVE_INT, &times_written);
+    H5Aclose(h_attr);
+    H5Sclose(h_space);
+    if (err || h_err < 0) {
+        printf("Error while writing the attributes of the cube.\n");
+        return 1;
+    }
+
+    /* The functions that cannot be computed one block of times at a time */
+    real_t **slabs = malloc(Nf * sizeof(real_t *));
+    real_t *derived = NULL;
+    if (slabs == NULL || prepareSlabs(data, pars, slabs, &derived) != 0) {
+        printf("Error while computing the functions.\n");
+        free(slabs);
+        free(derived);
+        return 1;
+    }
+
+    real_t *buffer = malloc(Nf * block * Nk * sizeof(real_t));
+    real_t *transposed = NULL;
+    if (pars->Layout != LAYOUT_FTK) {
+        transposed = malloc(Nf * block * Nk * sizeof(real_t));
+    }
+    if (buffer == NULL || (pars->Layout != LAYOUT_FTK && transposed == NULL)) {
+        printf("Error: could not allocate memory for a block of times.\n");
+        err = 1;
+    }
+
+    /* From here on, readers can open the file */
+    if (!err && H5Fstart_swmr_write(h_file) < 0) {
+        printf("Error while starting SWMR mode.\n");
+        err = 1;
+    }
+
+    if (!err) {
+        printf("Writing the transfer functions in SWMR mode, in blocks of %d times.\n", block);
+    }
+
+    const int direct = useDirectChunkWrites(h_data, pars);
+
+    for (int first = 0; first < Ntau && !err; first += block) {
+        int count = (Ntau - first < block) ? Ntau - first : block;
+
+        err = writeTimeBlock(h_data, data, pars, slabs, direct, first, count,
+                             buffer, transposed, max_abs_error, max_rel_error);
+
+        /* Make the block visible to readers, then announce it */
+        if (!err) err = (H5Dflush(h_data) < 0);
+        if (!err && pars->LossyMode != LOSSY_NONE) {
+            err = updateLossyErrors(h_data, Nf, max_abs_error, max_rel_error);
+        }
+        if (!err) err = writeProgress(h_data, first + count);
+        if (!err) err = (H5Dflush(h_data) < 0);
+    }
+
+    free(buffer);
+    free(transposed);
+    free(slabs);
+    free(derived);
+
+    return err;
+}
@@ -0,0 +1,90 @@
+#ifndef TEST_FIXTURE_H
+#define TEST_FIXTURE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/classex.h"
+
+/* Fake perturbation data for the output tests, with a plan of CLASS
+ * functions that only provides their titles */
+struct test_data {
+    struct extraction_entry *entries;
+    struct extraction_plan plan;
+    struct perturb_data data;
+    struct params pars;
+    struct units us;
+};
+
+/* The j-th of the nine background vectors of data, starting with log_tau */
+static inline double *testBackground(struct perturb_data *data, int j) {
+    double *vectors[9] = {data->log_tau, data->redshift, data->Omega_m,
+                          data->Omega_r, data->Hubble_H, data->Hubble_H_prime,
+                          data->growth_D, data->growth_f, data->growth_f_prime};
+    return vectors[j];
+}
+
+/* Fill the test data with distinct values: delta[i] = 0.5 i, Omega[i] = 0.25 i,
+ * k[i] = 0.1 (i + 1) and the j-th background vector 100 j + i. The units
+ * are Mpc and seconds, and the parameters name the run "Test" with h = 0.67. */
+static inline void makeTestData(struct test_data *t, char **titles,
+                                int n_functions, int tau_size, int k_size) {
+    memset(t, 0, sizeof(struct test_data));
+
+    t->entries = calloc(n_functions, sizeof(struct extraction_entry));
+    for (int i=0; i<n_functions; i++) {
+        t->entries[i].type = ENTRY_CLASS;
+        t->entries[i].parent = -1;
+        t->entries[i].title = titles[i];
+    }
+    t->plan.entries = t->entries;
+    t->plan.n_entries = n_functions;
+
+    struct perturb_data *data = &t->data;
+    const size_t cube_size = (size_t) n_functions * tau_size * k_size;
+    data->n_functions = n_functions;
+    data->tau_size = tau_size;
+    data->k_size = k_size;
+    data->plan = &t->plan;
+    data->delta = malloc(cube_size * sizeof(real_t));
+    data->Omega = malloc(n_functions * tau_size * sizeof(real_t));
+    data->k = malloc(k_size * sizeof(double));
+    double **bg[9] = {&data->log_tau, &data->redshift, &data->Omega_m,
+                      &data->Omega_r, &data->Hubble_H, &data->Hubble_H_prime,
+                      &data->growth_D, &data->growth_f, &data->growth_f_prime};
+    for (int j=0; j<9; j++) {
+        *bg[j] = malloc(tau_size * sizeof(double));
+        for (int i=0; i<tau_size; i++) {
+            (*bg[j])[i] = 100 * j + i;
+        }
+    }
+    for (int i=0; i<k_size; i++) {
+        data->k[i] = 0.1 * (i + 1);
+    }
+    for (size_t i=0; i<cube_size; i++) {
+        data->delta[i] = 0.5 * i;
+    }
+    for (int i=0; i<n_functions * tau_size; i++) {
+        data->Omega[i] = 0.25 * i;
+    }
+
+    t->pars.Name = "Test";
+    t->pars.h = 0.67;
+
+    t->us.UnitLengthMetres = MPC_METRES;
+    t->us.UnitTimeSeconds = 1.0;
+    t->us.UnitMassKilogram = 1.0;
+    t->us.UnitTemperatureKelvin = 1.0;
+}
+
+static inline void cleanTestData(struct test_data *t) {
+    free(t->data.delta);
+    free(t->data.Omega);
+    free(t->data.k);
+    for (int j=0; j<9; j++) {
+        free(testBackground(&t->data, j));
+    }
+    free(t->entries);
+}
+
+#endif
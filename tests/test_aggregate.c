@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+/* The test value of function f at time t and wavenumber k in cosmology c */
+static inline real_t testValue(int c, int f, int t, int k) {
+    return 10000 * c + 1000 * f + 10 * t + 0.5 * k;
+}
+
+/* Check the aggregate of the first n_files files written by the test, with
+ * the transfer functions in the given layout. The aggregate should refer to
+ * the files by the given paths. */
+static void checkAggregate(const char *out_fname, char **paths, int n_files,
+                           int layout, int n_functions, int tau_size,
+                           int k_size) {
+    const size_t slab_size = tau_size * k_size;
+    const size_t cube_size = n_functions * slab_size;
+
+    hid_t h_file = H5Fopen(out_fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    assert(h_file >= 0);
+
+    /* The transfer functions, as [cosmology] followed by the layout */
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    hid_t h_space = H5Dget_space(h_data);
+    hsize_t dims[4];
+    size_t shape[3];
+    layoutShape(layout, n_functions, tau_size, k_size, shape);
+    assert(H5Sget_simple_extent_ndims(h_space) == 4);
+    H5Sget_simple_extent_dims(h_space, dims, NULL);
+    assert(dims[0] == (hsize_t) n_files);
+    for (int i=0; i<3; i++) {
+        assert(dims[i + 1] == (hsize_t) shape[i]);
+    }
+    H5Sclose(h_space);
+
+    real_t *read = malloc(n_files * cube_size * sizeof(real_t));
+    real_t *expected = malloc(cube_size * sizeof(real_t));
+    real_t *transposed = malloc(cube_size * sizeof(real_t));
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+    for (int c=0; c<n_files; c++) {
+        for (int f=0; f<n_functions; f++) {
+            for (int t=0; t<tau_size; t++) {
+                for (int k=0; k<k_size; k++) {
+                    expected[(f * tau_size + t) * k_size + k] = testValue(c, f, t, k);
+                }
+            }
+        }
+        assert(transposeCube(expected, transposed, layout, n_functions,
+                             tau_size, k_size) == 0);
+        assert(memcmp(read + c * cube_size, transposed, cube_size * sizeof(real_t)) == 0);
+    }
+    H5Dclose(h_data);
+    free(expected);
+    free(transposed);
+
+    /* The background densities, as [cosmology][function][tau] */
+    h_data = H5Dopen(h_file, "/Perturb/Omegas", H5P_DEFAULT);
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+    for (int c=0; c<n_files; c++) {
+        for (int f=0; f<n_functions; f++) {
+            for (int t=0; t<tau_size; t++) {
+                assert(read[(c * n_functions + f) * tau_size + t] == testValue(c, f, t, 0));
+            }
+        }
+    }
+    H5Dclose(h_data);
+    free(read);
+
+    /* The growth factors of every cosmology, as [cosmology][tau] */
+    double *growth = malloc(n_files * tau_size * sizeof(double));
+    h_data = H5Dopen(h_file, "/Perturb/Growth factors (D)", H5P_DEFAULT);
+    assert(H5Dread(h_data, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, growth) >= 0);
+    for (int c=0; c<n_files; c++) {
+        for (int t=0; t<tau_size; t++) {
+            assert(growth[c * tau_size + t] == 100 * c + 60 + t);
+        }
+    }
+    H5Dclose(h_data);
+    free(growth);
+
+    /* The parameter table */
+    double *h = malloc(n_files * sizeof(double));
+    h_data = H5Dopen(h_file, "/Cosmology/h", H5P_DEFAULT);
+    assert(H5Dread(h_data, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, h) >= 0);
+    for (int c=0; c<n_files; c++) {
+        assert(fabs(h[c] - (0.6 + 0.1 * c)) < 1e-15);
+    }
+    H5Dclose(h_data);
+    free(h);
+
+    int n_cosmologies = 0;
+    hid_t h_attr = H5Aopen_by_name(h_file, "/Header", "n_cosmologies",
+                                   H5P_DEFAULT, H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_INT, &n_cosmologies) >= 0);
+    assert(n_cosmologies == n_files);
+    H5Aclose(h_attr);
+
+    char **files = malloc(n_files * sizeof(char *));
+    h_attr = H5Aopen_by_name(h_file, "/Header", "Files", H5P_DEFAULT, H5P_DEFAULT);
+    hid_t h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, H5T_VARIABLE);
+    assert(H5Aread(h_attr, h_type, files) >= 0);
+    for (int c=0; c<n_files; c++) {
+        assert(strcmp(files[c], paths[c]) == 0);
+        H5free_memory(files[c]);
+    }
+    free(files);
+    H5Tclose(h_type);
+    H5Aclose(h_attr);
+
+    H5Fclose(h_file);
+}
+
+int main() {
+    char *fnames[4] = {"test_aggregate_0.hdf5", "test_aggregate_1.hdf5",
+                       "test_aggregate_2.hdf5", "test_aggregate_3.hdf5"};
+    char out_fname[] = "test_aggregate.hdf5";
+    const int n_files = 3;
+    const int n_functions = 3;
+    const int tau_size = 13;
+    const int k_size = 11;
+
+    char *titles[3] = {"d_cdm", "phi", "d_b"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    struct extraction_entry *entries = fixture.entries;
+    struct perturb_data data = fixture.data;
+    struct units us = fixture.us;
+
+    struct params pars = fixture.pars;
+    pars.Omega_m = 0.3;
+    pars.Chunking = CHUNK_TAU;
+    pars.DeflateLevel = 4;
+
+    const int layouts[3] = {LAYOUT_FTK, LAYOUT_FKT, LAYOUT_TKF};
+    for (int l=0; l<3; l++) {
+        pars.Layout = layouts[l];
+
+        /* Three cosmologies, of which the last stores its functions in
+         * reverse order and as function datasets, and a fourth on another
+         * k grid */
+        for (int c=0; c<4; c++) {
+            for (int f=0; f<n_functions; f++) {
+                const int index = (c == 2) ? n_functions - 1 - f : f;
+                entries[index].type = ENTRY_CLASS;
+                entries[index].parent = -1;
+                entries[index].title = titles[f];
+                for (int t=0; t<tau_size; t++) {
+                    data.Omega[index * tau_size + t] = testValue(c, f, t, 0);
+                    for (int k=0; k<k_size; k++) {
+                        data.delta[(index * tau_size + t) * k_size + k] = testValue(c, f, t, k);
+                    }
+                }
+            }
+            for (int j=0; j<9; j++) {
+                for (int i=0; i<tau_size; i++) {
+                    testBackground(&data, j)[i] = (j == 0) ? i : 100 * c + 10 * j + i;
+                }
+            }
+            data.k[0] = (c == 3) ? 0.2 : 0.1;
+
+            pars.h = 0.6 + 0.1 * c;
+            pars.FunctionDatasets = (c == 2);
+            assert(write_perturb(&data, &pars, &us, fnames[c]) == 0);
+        }
+
+        assert(aggregateOutputFiles(out_fname, n_files, fnames) == 0);
+        checkAggregate(out_fname, fnames, n_files, layouts[l], n_functions,
+                       tau_size, k_size);
+
+        /* Files on another grid cannot be aggregated */
+        assert(aggregateOutputFiles(out_fname, 4, fnames) != 0);
+    }
+
+    /* The aggregate cannot overwrite one of its inputs */
+    assert(aggregateOutputFiles("./test_aggregate_1.hdf5", n_files, fnames) != 0);
+    hid_t h_file = H5Fopen(fnames[1], H5F_ACC_RDONLY, H5P_DEFAULT);
+    assert(h_file >= 0);
+    H5Fclose(h_file);
+
+    /* An aggregate made from another working directory refers to the files
+     * relative to itself, so that it can be read from anywhere */
+    char *relative[3] = {"../test_aggregate_0.hdf5", "../test_aggregate_1.hdf5",
+                         "../test_aggregate_2.hdf5"};
+    char *sources[3] = {"../../test_aggregate_0.hdf5", "../../test_aggregate_1.hdf5",
+                        "../../test_aggregate_2.hdf5"};
+    mkdir("test_aggregate_dir", 0755);
+    mkdir("test_aggregate_dir/cwd", 0755);
+    assert(chdir("test_aggregate_dir/cwd") == 0);
+    assert(aggregateOutputFiles("../test_aggregate.hdf5", n_files, sources) == 0);
+    assert(chdir("../..") == 0);
+    checkAggregate("test_aggregate_dir/test_aggregate.hdf5", relative, n_files,
+                   LAYOUT_TKF, n_functions, tau_size, k_size);
+    remove("test_aggregate_dir/test_aggregate.hdf5");
+    rmdir("test_aggregate_dir/cwd");
+    rmdir("test_aggregate_dir");
+
+    for (int c=0; c<4; c++) {
+        remove(fnames[c]);
+    }
+    remove(out_fname);
+
+    cleanTestData(&fixture);
+
+    sucmsg("test_aggregate:\t SUCCESS");
+}
@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+/* Parameters that request the given functions, as read from a file */
+static void requestFunctions(struct params *pars, char **titles, int n) {
+    pars->NumDesiredFunctions = n;
+    pars->DesiredFunctions = malloc(n * sizeof(char*));
+    for (int i=0; i<n; i++) {
+        pars->DesiredFunctions[i] = malloc(strlen(titles[i]) + 1);
+        strcpy(pars->DesiredFunctions[i], titles[i]);
+    }
+}
+
+static void cleanRequest(struct params *pars) {
+    for (int i=0; i<pars->NumDesiredFunctions; i++) {
+        free(pars->DesiredFunctions[i]);
+    }
+    free(pars->DesiredFunctions);
+}
+
+/* Parameters with lossy settings for the given functions, as read from a file */
+static void requestLossyBounds(struct params *pars, char **titles, int *modes,
+                               double *bounds, int n) {
+    pars->NumLossyBounds = n;
+    pars->LossyBoundTitles = malloc(n * sizeof(char*));
+    pars->LossyBoundModes = malloc(n * sizeof(int));
+    pars->LossyBounds = malloc(n * sizeof(double));
+    for (int i=0; i<n; i++) {
+        pars->LossyBoundTitles[i] = malloc(strlen(titles[i]) + 1);
+        strcpy(pars->LossyBoundTitles[i], titles[i]);
+        pars->LossyBoundModes[i] = modes[i];
+        pars->LossyBounds[i] = bounds[i];
+    }
+}
+
+static void cleanLossyBounds(struct params *pars) {
+    for (int i=0; i<pars->NumLossyBounds; i++) {
+        free(pars->LossyBoundTitles[i]);
+    }
+    free(pars->LossyBoundTitles);
+    free(pars->LossyBoundModes);
+    free(pars->LossyBounds);
+}
+
+int main() {
+    char fname[] = "test_append.hdf5";
+    const int n_functions = 4;
+    const int tau_size = 13;
+    const int k_size = 11;
+    const size_t slab_size = tau_size * k_size;
+    const size_t cube_size = n_functions * slab_size;
+
+    /* Four functions, of which the first two are written first */
+    char *titles[4] = {"d_cdm", "phi", "t_cdm", "d_b"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    struct perturb_data data = fixture.data;
+    struct units us = fixture.us;
+
+    /* The first two and the last two functions */
+    struct perturb_data first = data, second = data;
+    struct extraction_plan second_plan = fixture.plan;
+    first.n_functions = 2;
+    second.n_functions = 2;
+    second.delta = data.delta + 2 * slab_size;
+    second.Omega = data.Omega + 2 * tau_size;
+    second_plan.entries = fixture.entries + 2;
+    second.plan = &second_plan;
+
+    struct params pars = fixture.pars;
+    pars.Omega_m = 0.3;
+    pars.Chunking = CHUNK_TAU;
+    pars.ChunkSize = 5;
+    pars.Shuffle = 1;
+    pars.DeflateLevel = 4;
+
+    real_t *read = malloc(cube_size * sizeof(real_t));
+    real_t *expected = malloc(cube_size * sizeof(real_t));
+
+    /* Append to a chunked cube and to function datasets, in every layout */
+    for (int function_datasets=0; function_datasets<2; function_datasets++) {
+        for (int layout=0; layout<3; layout++) {
+            pars.Layout = layout;
+            pars.FunctionDatasets = function_datasets;
+            assert(write_perturb(&first, &pars, &us, fname) == 0);
+
+            /* Request one existing and two new functions, with other settings */
+            char *request[3] = {"phi", "t_cdm", "d_b"};
+            struct params append_pars = pars;
+            append_pars.Layout = LAYOUT_FTK;
+            append_pars.Chunking = CHUNK_NONE;
+            append_pars.ChunkSize = 0;
+            append_pars.DeflateLevel = 0;
+            append_pars.FunctionDatasets = 0;
+            append_pars.Append = 1;
+            requestFunctions(&append_pars, request, 3);
+
+            /* Only the new functions remain, stored like the existing ones */
+            assert(prepareAppend(&append_pars, fname) == 0);
+            assert(append_pars.Append == 1);
+            assert(append_pars.NumDesiredFunctions == 2);
+            assert(strcmp(append_pars.DesiredFunctions[0], "t_cdm") == 0);
+            assert(strcmp(append_pars.DesiredFunctions[1], "d_b") == 0);
+            assert(append_pars.Layout == layout);
+            assert(append_pars.Chunking == CHUNK_TAU);
+            assert(append_pars.ChunkSize == 5);
+            assert(append_pars.Shuffle == 1);
+            assert(append_pars.DeflateLevel == 4);
+            assert(append_pars.FunctionDatasets == function_datasets);
+
+            /* Functions that are already in the file are refused, leaving
+             * the file as it was */
+            if (function_datasets) {
+                assert(append_perturb(&first, &append_pars, &us, fname) != 0);
+            }
+
+            assert(append_perturb(&second, &append_pars, &us, fname) == 0);
+
+            /* Functions of another cosmology are refused */
+            append_pars.h = 0.7;
+            assert(append_perturb(&second, &append_pars, &us, fname) != 0);
+            cleanRequest(&append_pars);
+
+            /* The file now holds all functions */
+            hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+            int n = 0;
+            hid_t h_attr = H5Aopen_by_name(h_file, "/Header", "n_functions",
+                                           H5P_DEFAULT, H5P_DEFAULT);
+            assert(H5Aread(h_attr, H5T_NATIVE_INT, &n) >= 0);
+            assert(n == n_functions);
+            H5Aclose(h_attr);
+
+            char *read_titles[4];
+            h_attr = H5Aopen_by_name(h_file, "/Header", "FunctionTitles",
+                                     H5P_DEFAULT, H5P_DEFAULT);
+            hid_t h_type = H5Tcopy(H5T_C_S1);
+            H5Tset_size(h_type, H5T_VARIABLE);
+            assert(H5Aread(h_attr, h_type, read_titles) >= 0);
+            for (int i=0; i<n_functions; i++) {
+                assert(strcmp(read_titles[i], titles[i]) == 0);
+                H5free_memory(read_titles[i]);
+            }
+            H5Tclose(h_type);
+            H5Aclose(h_attr);
+
+            for (size_t i=0; i<cube_size; i++) {
+                expected[i] = 0.5 * i;
+            }
+            transposeCube(expected, read, layout, n_functions, tau_size, k_size);
+            memcpy(expected, read, cube_size * sizeof(real_t));
+
+            hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+            assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+            assert(memcmp(read, expected, cube_size * sizeof(real_t)) == 0);
+            H5Dclose(h_data);
+
+            h_data = H5Dopen(h_file, "/Perturb/Omegas", H5P_DEFAULT);
+            assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+            assert(memcmp(read, data.Omega, n_functions * tau_size * sizeof(real_t)) == 0);
+            H5Dclose(h_data);
+
+            /* The new function datasets know their place in the cube */
+            if (function_datasets) {
+                int index = -1;
+                h_attr = H5Aopen_by_name(h_file, "/Perturb/Functions/d_b", "Index",
+                                         H5P_DEFAULT, H5P_DEFAULT);
+                assert(H5Aread(h_attr, H5T_NATIVE_INT, &index) >= 0);
+                assert(index == 3);
+                H5Aclose(h_attr);
+            }
+
+            H5Fclose(h_file);
+
+            /* Nothing is left to append */
+            append_pars.Append = 1;
+            requestFunctions(&append_pars, titles, n_functions);
+            assert(prepareAppend(&append_pars, fname) == 0);
+            assert(append_pars.NumDesiredFunctions == 0);
+            cleanRequest(&append_pars);
+        }
+    }
+
+    /* Lossy files keep the settings of the existing functions, while the new
+     * ones get their own settings or the global ones of the file */
+    pars.Layout = LAYOUT_FTK;
+    pars.FunctionDatasets = 0;
+    pars.LossyMode = LOSSY_RELATIVE;
+    pars.LossyErrorBound = 1e-3;
+    char *first_titles[1] = {"phi"};
+    int first_modes[1] = {LOSSY_ABSOLUTE};
+    double first_bounds[1] = {1e-2};
+    requestLossyBounds(&pars, first_titles, first_modes, first_bounds, 1);
+    assert(write_perturb(&first, &pars, &us, fname) == 0);
+    cleanLossyBounds(&pars);
+
+    struct params lossy_pars = pars;
+    char *new_titles[2] = {"phi", "d_b"};
+    int new_modes[2] = {LOSSY_RELATIVE, LOSSY_NONE};
+    double new_bounds[2] = {1e-9, 0.};
+    requestLossyBounds(&lossy_pars, new_titles, new_modes, new_bounds, 2);
+    lossy_pars.LossyMode = LOSSY_NONE;
+    lossy_pars.Append = 1;
+    requestFunctions(&lossy_pars, titles, n_functions);
+    assert(prepareAppend(&lossy_pars, fname) == 0);
+    assert(lossy_pars.LossyMode == LOSSY_RELATIVE);
+    assert(lossy_pars.LossyErrorBound == 1e-3);
+    assert(append_perturb(&second, &lossy_pars, &us, fname) == 0);
+    cleanRequest(&lossy_pars);
+    cleanLossyBounds(&lossy_pars);
+
+    hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    const char *expected_modes[4] = {"relative", "absolute", "relative", "none"};
+    const double expected_bounds[4] = {1e-3, 1e-2, 1e-3, 0.};
+    double read_bounds[4], read_errors[4];
+    char *read_modes[4];
+    hid_t h_attr = H5Aopen(h_data, "Lossy error bounds", H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_DOUBLE, read_bounds) >= 0);
+    H5Aclose(h_attr);
+    h_attr = H5Aopen(h_data, "Max absolute errors", H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_DOUBLE, read_errors) >= 0);
+    H5Aclose(h_attr);
+    h_attr = H5Aopen(h_data, "Lossy modes", H5P_DEFAULT);
+    hid_t h_type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(h_type, H5T_VARIABLE);
+    assert(H5Aread(h_attr, h_type, read_modes) >= 0);
+    for (int i=0; i<n_functions; i++) {
+        assert(read_bounds[i] == expected_bounds[i]);
+        assert(strcmp(read_modes[i], expected_modes[i]) == 0);
+        H5free_memory(read_modes[i]);
+    }
+    H5Tclose(h_type);
+    H5Aclose(h_attr);
+
+    /* The last function is stored exactly */
+    assert(read_errors[3] == 0.);
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+    assert(memcmp(read + 3 * slab_size, data.delta + 3 * slab_size,
+                  slab_size * sizeof(real_t)) == 0);
+    H5Dclose(h_data);
+    H5Fclose(h_file);
+
+    pars.LossyMode = LOSSY_NONE;
+    pars.NumLossyBounds = 0;
+
+    /* Contiguous cubes cannot be extended */
+    pars.Layout = LAYOUT_FTK;
+    pars.FunctionDatasets = 0;
+    pars.Chunking = CHUNK_NONE;
+    pars.Shuffle = 0;
+    pars.DeflateLevel = 0;
+    assert(write_perturb(&first, &pars, &us, fname) == 0);
+
+    struct params append_pars = pars;
+    append_pars.Append = 1;
+    requestFunctions(&append_pars, titles, n_functions);
+    assert(prepareAppend(&append_pars, fname) != 0);
+    cleanRequest(&append_pars);
+
+    /* Without a file, it is simply created */
+    remove(fname);
+    requestFunctions(&append_pars, titles, n_functions);
+    assert(prepareAppend(&append_pars, fname) == 0);
+    assert(append_pars.Append == 0);
+    assert(append_pars.NumDesiredFunctions == n_functions);
+    cleanRequest(&append_pars);
+
+    free(read);
+    free(expected);
+    cleanTestData(&fixture);
+
+    sucmsg("test_append:\t SUCCESS");
+}
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../include/classex.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    const char fname[] = "test_async_io.bin";
+
+    /* Test parsing the backend names */
+    assert(parseAsyncBackend("auto") == ASYNC_AUTO);
+    assert(parseAsyncBackend("URING") == ASYNC_URING);
+    assert(parseAsyncBackend("threads") == ASYNC_THREADS);
+    assert(parseAsyncBackend("aio") == -1);
+    assert(strcmp(asyncBackendName(ASYNC_THREADS), "threads") == 0);
+
+    /* An odd number of bytes, so that the last buffer is padded */
+    const size_t n_bytes = 5 * ASYNC_ALIGNMENT * 3 + 123;
+    const size_t buffer_size = 3 * ASYNC_ALIGNMENT;
+
+    /* Write the file sequentially with both backends, direct or not */
+    for (int backend=ASYNC_AUTO; backend<=ASYNC_THREADS; backend++) {
+        for (int direct=0; direct<=1; direct++) {
+            struct async_writer w;
+            assert(openAsyncWriter(&w, fname, direct, backend, 2, buffer_size - 1) == 0);
+            assert(w.buffer_size == buffer_size);
+            assert(w.backend == ASYNC_URING || w.backend == ASYNC_THREADS);
+            if (backend == ASYNC_THREADS) assert(w.backend == ASYNC_THREADS);
+
+            size_t position = 0;
+            while (position < n_bytes) {
+                struct async_buffer *b = asyncGetBuffer(&w);
+                assert((uintptr_t) b->data % ASYNC_ALIGNMENT == 0);
+                b->offset = position;
+                b->length = (n_bytes - position < buffer_size) ? n_bytes - position
+                                                               : buffer_size;
+                for (size_t i=0; i<b->length; i++) {
+                    b->data[i] = (char) ((position + i) % 251);
+                }
+                position += b->length;
+                assert(asyncSubmit(&w, b) == 0);
+            }
+
+            assert(w.bytes_written == n_bytes);
+            assert(closeAsyncWriter(&w, n_bytes) == 0);
+
+            /* Read it back */
+            FILE *f = fopen(fname, "rb");
+            assert(f != NULL);
+            char *check = malloc(n_bytes + 1);
+            assert(fread(check, 1, n_bytes + 1, f) == n_bytes);
+            fclose(f);
+            for (size_t i=0; i<n_bytes; i++) {
+                assert(check[i] == (char) (i % 251));
+            }
+            free(check);
+        }
+    }
+
+    sucmsg("test_async_io:\t SUCCESS");
+}
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    const size_t n_functions = 3;
+    const size_t tau_size = 64;
+    const size_t k_size = 50;
+    const size_t cube_size = n_functions * tau_size * k_size;
+
+    /* Test parsing the chunking names */
+    assert(parseChunking("none") == CHUNK_NONE);
+    assert(parseChunking("TAU") == CHUNK_TAU);
+    assert(parseChunking("k") == CHUNK_K);
+    assert(parseChunking("function") == -1);
+    assert(strcmp(chunkingName(CHUNK_K), "k") == 0);
+
+    struct params pars;
+    memset(&pars, 0, sizeof(struct params));
+
+    /* Test the chunk shapes in the different layouts */
+    hsize_t chunk[3];
+    pars.Layout = LAYOUT_FTK;
+    pars.Chunking = CHUNK_TAU;
+    pars.ChunkSize = 16;
+    cubeChunkShape(&pars, tau_size, k_size, chunk);
+    assert(chunk[0] == 1 && chunk[1] == 16 && chunk[2] == k_size);
+
+    pars.Chunking = CHUNK_K;
+    cubeChunkShape(&pars, tau_size, k_size, chunk);
+    assert(chunk[0] == 1 && chunk[1] == tau_size && chunk[2] == 16);
+
+    pars.Layout = LAYOUT_TKF;
+    cubeChunkShape(&pars, tau_size, k_size, chunk);
+    assert(chunk[0] == tau_size && chunk[1] == 16 && chunk[2] == 1);
+
+    /* A chunk size of zero means one chunk per function */
+    pars.Layout = LAYOUT_FKT;
+    pars.ChunkSize = 0;
+    cubeChunkShape(&pars, tau_size, k_size, chunk);
+    assert(chunk[0] == 1 && chunk[1] == k_size && chunk[2] == tau_size);
+
+    /* Fill a cube with smooth functions */
+    real_t *delta = malloc(cube_size * sizeof(real_t));
+    real_t *read = malloc(cube_size * sizeof(real_t));
+    for (size_t f=0; f<n_functions; f++) {
+        for (size_t t=0; t<tau_size; t++) {
+            for (size_t k=0; k<k_size; k++) {
+                delta[f * tau_size * k_size + t * k_size + k] = (f + 1.0) * t / (1.0 + k);
+            }
+        }
+    }
+
+    /* Write a compressed dataset and read it back */
+    pars.Layout = LAYOUT_FTK;
+    pars.Chunking = CHUNK_TAU;
+    pars.ChunkSize = 8;
+    pars.Shuffle = 1;
+    pars.DeflateLevel = 6;
+
+    hid_t h_file = H5Fcreate("test_compression.hdf5", H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    assert(h_file >= 0);
+
+    hsize_t shape[3] = {n_functions, tau_size, k_size};
+    hid_t h_space = H5Screate_simple(3, shape, NULL);
+    hid_t h_prop = createCubeProperties(&pars, tau_size, k_size);
+    assert(h_prop >= 0);
+    assert(H5Pget_layout(h_prop) == H5D_CHUNKED);
+    assert(H5Pget_nfilters(h_prop) == 2);
+
+    hid_t h_data = H5Dcreate(h_file, "Transfer functions", H5T_NATIVE_REAL,
+                             h_space, H5P_DEFAULT, h_prop, H5P_DEFAULT);
+    assert(h_data >= 0);
+    assert(H5Dwrite(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, delta) >= 0);
+    assert(writeCompressionAttributes(h_data, &pars, tau_size, k_size) == 0);
+
+    /* The smooth data should compress */
+    assert(H5Dget_storage_size(h_data) < cube_size * sizeof(real_t));
+
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+    assert(memcmp(delta, read, cube_size * sizeof(real_t)) == 0);
+
+    /* Check the recorded settings */
+    int level = 0;
+    hid_t h_attr = H5Aopen(h_data, "Deflate level", H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_INT, &level) >= 0);
+    assert(level == 6);
+    H5Aclose(h_attr);
+
+    hsize_t chunk_read[3];
+    h_attr = H5Aopen(h_data, "Chunk shape", H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_HSIZE, chunk_read) >= 0);
+    assert(chunk_read[0] == 1 && chunk_read[1] == 8 && chunk_read[2] == k_size);
+    H5Aclose(h_attr);
+
+    /* Now write the same data with chunks compressed in parallel, using a
+     * chunk size that does not divide the number of times */
+    hsize_t filter_size = H5Dget_storage_size(h_data);
+    H5Dclose(h_data);
+    H5Pclose(h_prop);
+
+    pars.ChunkSize = 10;
+    h_prop = createCubeProperties(&pars, tau_size, k_size);
+    h_data = H5Dcreate(h_file, "Direct", H5T_NATIVE_REAL, h_space,
+                       H5P_DEFAULT, h_prop, H5P_DEFAULT);
+    assert(useDirectChunkWrites(h_data, &pars));
+
+    hsize_t start[3] = {0, 0, 0};
+    assert(writeChunksParallel(h_data, &pars, delta, shape, start) == 0);
+
+    memset(read, 0, cube_size * sizeof(real_t));
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+    assert(memcmp(delta, read, cube_size * sizeof(real_t)) == 0);
+    assert(H5Dget_storage_size(h_data) < cube_size * sizeof(real_t));
+    H5Dclose(h_data);
+    H5Pclose(h_prop);
+
+    /* With the same chunks, the result is identical to the HDF5 filters */
+    pars.ChunkSize = 8;
+    h_prop = createCubeProperties(&pars, tau_size, k_size);
+    h_data = H5Dcreate(h_file, "Direct same chunks", H5T_NATIVE_REAL, h_space,
+                       H5P_DEFAULT, h_prop, H5P_DEFAULT);
+    assert(writeChunksParallel(h_data, &pars, delta, shape, start) == 0);
+    assert(H5Dget_storage_size(h_data) == filter_size);
+    H5Dclose(h_data);
+    H5Pclose(h_prop);
+
+    /* Without filters, the chunks are written by HDF5 itself */
+    pars.Shuffle = 0;
+    pars.DeflateLevel = 0;
+    h_prop = createCubeProperties(&pars, tau_size, k_size);
+    h_data = H5Dcreate(h_file, "Chunked", H5T_NATIVE_REAL, h_space,
+                       H5P_DEFAULT, h_prop, H5P_DEFAULT);
+    assert(!useDirectChunkWrites(h_data, &pars));
+    H5Dclose(h_data);
+    H5Pclose(h_prop);
+
+    H5Sclose(h_space);
+    H5Fclose(h_file);
+
+    /* Test parsing the lossy modes */
+    assert(parseLossyMode("none") == LOSSY_NONE);
+    assert(parseLossyMode("Absolute") == LOSSY_ABSOLUTE);
+    assert(parseLossyMode("relative") == LOSSY_RELATIVE);
+    assert(parseLossyMode("lossy") == -1);
+
+    /* Lossy rounding respects the error bounds and reports the errors */
+    const int lossy_modes[2] = {LOSSY_ABSOLUTE, LOSSY_RELATIVE};
+    for (int m=0; m<2; m++) {
+        pars.LossyMode = lossy_modes[m];
+        pars.LossyErrorBound = 1e-5;
+
+        double max_abs, max_rel;
+        quantizeFunction(&pars, "d_cdm", delta, read, cube_size, 1, &max_abs, &max_rel);
+
+        double abs_error = 0, rel_error = 0;
+        for (size_t i=0; i<cube_size; i++) {
+            double e = fabs((double) read[i] - (double) delta[i]);
+            if (e > abs_error) abs_error = e;
+            if (delta[i] != 0 && e / fabs(delta[i]) > rel_error) rel_error = e / fabs(delta[i]);
+        }
+        assert(abs_error == max_abs);
+        assert(rel_error == max_rel);
+        assert(max_abs > 0);
+        if (pars.LossyMode == LOSSY_ABSOLUTE) {
+            assert(max_abs <= pars.LossyErrorBound);
+        } else {
+            assert(max_rel <= pars.LossyErrorBound);
+        }
+
+        /* The errors can be found without storing the values */
+        double abs_only, rel_only;
+        quantizeFunction(&pars, "d_cdm", delta, NULL, cube_size, 1, &abs_only, &rel_only);
+        assert(abs_only == max_abs && rel_only == max_rel);
+    }
+
+    /* Functions can have their own lossy settings */
+    char *bound_titles[2] = {"phi", "t_cdm"};
+    int bound_modes[2] = {LOSSY_ABSOLUTE, LOSSY_NONE};
+    double bounds[2] = {1e-2, 0.};
+    pars.LossyBoundTitles = bound_titles;
+    pars.LossyBoundModes = bound_modes;
+    pars.LossyBounds = bounds;
+    pars.NumLossyBounds = 2;
+
+    int own_mode;
+    double own_bound;
+    lossySettings(&pars, "phi", &own_mode, &own_bound);
+    assert(own_mode == LOSSY_ABSOLUTE && own_bound == 1e-2);
+    lossySettings(&pars, "d_cdm", &own_mode, &own_bound);
+    assert(own_mode == pars.LossyMode && own_bound == pars.LossyErrorBound);
+
+    double own_abs, own_rel;
+    quantizeFunction(&pars, "t_cdm", delta, read, cube_size, 1, &own_abs, &own_rel);
+    assert(memcmp(read, delta, cube_size * sizeof(real_t)) == 0);
+    assert(own_abs == 0 && own_rel == 0);
+    quantizeFunction(&pars, "phi", delta, read, cube_size, 1, &own_abs, &own_rel);
+    assert(own_abs > 1e-5 && own_abs <= 1e-2);
+
+    /* Lossy output leaves the functions themselves untouched, so writing
+     * them twice gives the same file, in every layout and output mode */
+    char *titles[3] = {"d_cdm", "phi", "t_cdm"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    memcpy(fixture.data.delta, delta, cube_size * sizeof(real_t));
+    struct perturb_data data = fixture.data;
+
+    struct params lossy_pars = fixture.pars;
+    lossy_pars.Chunking = CHUNK_TAU;
+    lossy_pars.ChunkSize = 10;
+    lossy_pars.Shuffle = 1;
+    lossy_pars.DeflateLevel = 4;
+    lossy_pars.LossyMode = LOSSY_RELATIVE;
+    lossy_pars.LossyErrorBound = 1e-3;
+    lossy_pars.LossyBoundTitles = bound_titles;
+    lossy_pars.LossyBoundModes = bound_modes;
+    lossy_pars.LossyBounds = bounds;
+    lossy_pars.NumLossyBounds = 2;
+
+    real_t *rounded = malloc(cube_size * sizeof(real_t));
+    real_t *expected = malloc(cube_size * sizeof(real_t));
+    const size_t slab_size = tau_size * k_size;
+    for (size_t f=0; f<n_functions; f++) {
+        double max_abs, max_rel;
+        quantizeFunction(&lossy_pars, titles[f], delta + f * slab_size,
+                         rounded + f * slab_size, slab_size, 1, &max_abs, &max_rel);
+    }
+
+    for (int layout=0; layout<3; layout++) {
+        for (int mode=0; mode<3; mode++) {
+            lossy_pars.Layout = layout;
+            lossy_pars.SWMR = (mode == 1);
+            lossy_pars.FunctionDatasets = (mode == 2);
+
+            for (int repeat=0; repeat<2; repeat++) {
+                assert(write_perturb(&data, &lossy_pars, &fixture.us,
+                                     "test_compression_lossy.hdf5") == 0);
+                assert(memcmp(data.delta, delta, cube_size * sizeof(real_t)) == 0);
+
+                hid_t h_lossy = H5Fopen("test_compression_lossy.hdf5", H5F_ACC_RDONLY,
+                                        H5P_DEFAULT);
+                hid_t h_cube = H5Dopen(h_lossy, "/Perturb/Transfer functions",
+                                       H5P_DEFAULT);
+                assert(H5Dread(h_cube, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL,
+                               H5P_DEFAULT, read) >= 0);
+                transposeCube(rounded, expected, layout, n_functions, tau_size, k_size);
+                assert(memcmp(read, expected, cube_size * sizeof(real_t)) == 0);
+
+                /* The settings of each function are recorded */
+                const char *expected_modes[3] = {"relative", "absolute", "none"};
+                const double expected_bounds[3] = {1e-3, 1e-2, 0.};
+                double read_bounds[3];
+                char *read_modes[3];
+                hid_t h_lossy_attr = H5Aopen(h_cube, "Lossy error bounds", H5P_DEFAULT);
+                assert(H5Aread(h_lossy_attr, H5T_NATIVE_DOUBLE, read_bounds) >= 0);
+                H5Aclose(h_lossy_attr);
+                h_lossy_attr = H5Aopen(h_cube, "Lossy modes", H5P_DEFAULT);
+                hid_t h_mode_type = H5Tcopy(H5T_C_S1);
+                H5Tset_size(h_mode_type, H5T_VARIABLE);
+                assert(H5Aread(h_lossy_attr, h_mode_type, read_modes) >= 0);
+                for (int f=0; f<n_functions; f++) {
+                    assert(read_bounds[f] == expected_bounds[f]);
+                    assert(strcmp(read_modes[f], expected_modes[f]) == 0);
+                    H5free_memory(read_modes[f]);
+                }
+                H5Tclose(h_mode_type);
+                H5Aclose(h_lossy_attr);
+                H5Dclose(h_cube);
+                H5Fclose(h_lossy);
+            }
+        }
+    }
+    remove("test_compression_lossy.hdf5");
+
+    free(rounded);
+    free(expected);
+    cleanTestData(&fixture);
+    free(delta);
+    free(read);
+
+    sucmsg("test_compression:\t SUCCESS");
+}
@@ -18,6 +18,7 @@ int main() {
     struct units us;
     struct class_titles titles;
     struct perturb_data data;
+    struct extraction_plan plan;
 
     readParams(&pars, fname);
     readUnits(&us, fname);
@@ -73,18 +74,11 @@ int main() {
     assert(pars.ClassPerturbIndices[2] == pt.index_tp_eta_prime);
     assert(pars.ClassPerturbIndices[4] == pt.index_tp_h_prime);
 
-    /* Check that only d_cdm_prime is a new derivative */
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[0]) == -1);
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[1]) == -1);
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[2]) == -1);
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[3]) == 0);
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[4]) == -1);
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[5]) == -1);
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[6]) == -1);
-    assert(isNewDerivativeTitle(&pars, pars.DesiredFunctions[7]) == 1);
+    /* Compile the extraction plan */
+    assert(compileExtractionPlan(&plan, &pars, &titles, &us, &pt) == 0);
 
     /* Read perturb data */
-    assert(readPerturbData(&data, &pars, &us, &pt, &ba) == 0);
+    assert(readPerturbData(&data, &pars, &plan, &us, &pt, &ba) == 0);
 
     printf("Successfully read primary data.\n");
 
@@ -92,8 +86,9 @@ int main() {
     assert(computeDerivatives(&data, &pars, &us) == 0);
 
     /* Checks */
-    assert(pars.MatchedFunctions == 6); //now one more, because derivative!
-    assert(data.n_functions == pars.MatchedFunctions);
+    assert(pars.MatchedFunctions == 4); //derivatives do not count as matches
+    assert(plan.n_entries == 6); //but they are part of the plan
+    assert(data.n_functions == plan.n_entries);
     assert(data.k_size > 100);
     assert(data.tau_size > 100);
 
@@ -134,6 +129,70 @@ int main() {
 
     /* Clean perturb data */
     assert(cleanPerturbData(&data) == 0);
+    assert(cleanExtractionPlan(&plan) == 0);
+
+    /* Now request a third derivative, which needs two intermediates, and a
+     * derivative with respect to ln(a) */
+    free(pars.DesiredFunctions[3]);
+    pars.DesiredFunctions[3] = malloc(strlen("d_cdm_prime_prime_prime") + 1);
+    strcpy(pars.DesiredFunctions[3], "d_cdm_prime_prime_prime");
+    free(pars.DesiredFunctions[5]);
+    pars.DesiredFunctions[5] = malloc(strlen("d_cdm_dloga") + 1);
+    strcpy(pars.DesiredFunctions[5], "d_cdm_dloga");
+    assert(matchClassTitles(&titles, &pars) == 0);
+
+    assert(compileExtractionPlan(&plan, &pars, &titles, &us, &pt) == 0);
+    assert(plan.n_class == 4);
+    assert(plan.n_entries == 7); //only the requested functions are exported
+    assert(plan.n_total == 9); //d_cdm_prime and d_cdm_prime_prime
+    assert(plan.max_depth == 3);
+    assert(strcmp(plan.entries[4].title, "d_cdm_prime_prime_prime") == 0);
+    assert(strcmp(plan.entries[5].title, "d_cdm_dloga") == 0);
+    assert(strcmp(plan.entries[6].title, "H_T_Nb_prime_prime") == 0);
+    assert(plan.entries[5].parent == 0);
+    assert(plan.entries[5].variable == TIME_LOG_A);
+    assert(plan.entries[6].parent == 1);
+    assert(plan.entries[6].variable == TIME_CONFORMAL);
+
+    /* The chain is d_cdm -> d_cdm_prime -> d_cdm_prime_prime -> (4) */
+    int second = plan.entries[4].parent;
+    int first = plan.entries[second].parent;
+    assert(second >= plan.n_entries && first >= plan.n_entries);
+    assert(strcmp(plan.entries[second].title, "d_cdm_prime_prime") == 0);
+    assert(strcmp(plan.entries[first].title, "d_cdm_prime") == 0);
+    assert(plan.entries[first].parent == 0);
+
+    assert(readPerturbData(&data, &pars, &plan, &us, &pt, &ba) == 0);
+    assert(computeDerivatives(&data, &pars, &us) == 0);
+    assert(data.n_functions == 7);
+
+    /* Compare with three explicit differentiations of d_cdm */
+    size_t slab_size = data.k_size * data.tau_size;
+    double *work1 = malloc(slab_size * sizeof(double));
+    double *work2 = malloc(slab_size * sizeof(double));
+    differentiateFunction(plan.stencil, data.delta, work1, data.k_size, NULL);
+    differentiateFunction(plan.stencil, work1, work2, data.k_size, NULL);
+    differentiateFunction(plan.stencil, work2, work1, data.k_size, NULL);
+    for (size_t i=0; i<slab_size; i++) {
+        assert(data.delta[4 * slab_size + i] == work1[i]);
+    }
+
+    /* Check that d/dln(a) = 1/(aH) d/dtau */
+    differentiateFunction(plan.stencil, data.delta, work1, data.k_size, NULL);
+    for (int j=0; j<data.tau_size; j++) {
+        double a = 1.0 / (1.0 + data.redshift[j]);
+        double H = data.Hubble_H[j];
+        for (int i=0; i<data.k_size; i++) {
+            double dloga = data.delta[5 * slab_size + data.k_size*j + i];
+            double expected = work1[data.k_size*j + i] / (a * H);
+            assert(fabs(dloga - expected) <= 1e-12 * fabs(expected));
+        }
+    }
+    free(work1);
+    free(work2);
+
+    assert(cleanPerturbData(&data) == 0);
+    assert(cleanExtractionPlan(&plan) == 0);
 
 
 
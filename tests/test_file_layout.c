@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    char fname[] = "test_file_layout.hdf5";
+    const int n_functions = 3;
+    const int tau_size = 100;
+    const int k_size = 90;
+    const size_t slab_size = tau_size * k_size;
+    const hsize_t page_size = 64 * 1024;
+
+    char *titles[3] = {"d_cdm", "phi", "t_cdm"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    struct perturb_data data = fixture.data;
+    struct units us = fixture.us;
+
+    struct params pars = fixture.pars;
+    pars.StripeSizeMB = (double) page_size / (1024 * 1024);
+    pars.BenchmarkOutput = 3;
+
+    /* Without a stripe size, the file space is allocated as usual */
+    struct params plain = pars;
+    plain.StripeSizeMB = 0;
+    hid_t h_fcpl = createFileCreationProperties(&plain);
+    H5F_fspace_strategy_t strategy;
+    H5Pget_file_space_strategy(h_fcpl, &strategy, NULL, NULL);
+    assert(strategy != H5F_FSPACE_STRATEGY_PAGE);
+    H5Pclose(h_fcpl);
+
+    /* With a stripe size, the file consists of pages of that size */
+    assert(write_perturb(&data, &pars, &us, fname) == 0);
+
+    hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    assert(h_file >= 0);
+    h_fcpl = H5Fget_create_plist(h_file);
+    hsize_t read_page_size = 0;
+    H5Pget_file_space_strategy(h_fcpl, &strategy, NULL, NULL);
+    H5Pget_file_space_page_size(h_fcpl, &read_page_size);
+    assert(strategy == H5F_FSPACE_STRATEGY_PAGE);
+    assert(read_page_size == page_size);
+    H5Pclose(h_fcpl);
+
+    /* The cube, which is larger than a page, starts on a stripe boundary */
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    haddr_t offset = H5Dget_offset(h_data);
+    assert(offset != HADDR_UNDEF && offset % page_size == 0);
+    real_t *read = malloc(n_functions * slab_size * sizeof(real_t));
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+    assert(memcmp(read, data.delta, n_functions * slab_size * sizeof(real_t)) == 0);
+    H5Dclose(h_data);
+    H5Fclose(h_file);
+
+    /* Time cold opens and reads, in both layouts */
+    assert(benchmarkOutputFile(fname, &pars) == 0);
+    assert(write_perturb(&data, &plain, &us, fname) == 0);
+    assert(benchmarkOutputFile(fname, &plain) == 0);
+
+    free(read);
+    cleanTestData(&fixture);
+
+    sucmsg("test_file_layout:\t SUCCESS");
+}
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    const int n_functions = 4;
+    const int tau_size = 23;
+    const int k_size = 17;
+    const size_t slab_size = tau_size * k_size;
+    const size_t cube_size = n_functions * slab_size;
+
+    /* Test the unit descriptions */
+    char units[DEFAULT_STRING_LENGTH];
+    formatUnits(0, 0, units, DEFAULT_STRING_LENGTH);
+    assert(strcmp(units, "dimensionless") == 0);
+    formatUnits(2, -2, units, DEFAULT_STRING_LENGTH);
+    assert(strcmp(units, "U_L^2 U_t^-2") == 0);
+    formatUnits(0, -1, units, DEFAULT_STRING_LENGTH);
+    assert(strcmp(units, "U_t^-1") == 0);
+    formatUnits(1, 0, units, DEFAULT_STRING_LENGTH);
+    assert(strcmp(units, "U_L") == 0);
+
+    /* Perturbation data with three CLASS functions and a derived function */
+    char *titles[4] = {"d_cdm", "phi", "t_cdm", "d_cdm_prime"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    fixture.entries[3].type = ENTRY_DERIVATIVE;
+    fixture.entries[3].variable = TIME_CONFORMAL;
+    fixture.entries[3].parent = 0;
+    struct perturb_data data = fixture.data;
+
+    int length_power, time_power;
+    entryUnits(&fixture.plan, 1, &length_power, &time_power);
+    assert(length_power == 2 && time_power == -2);
+    entryUnits(&fixture.plan, 3, &length_power, &time_power);
+    assert(length_power == 0 && time_power == -1);
+
+    /* The dimensions of CLASS functions follow from their titles */
+    unitPowers("t_cdm", &length_power, &time_power);
+    assert(length_power == 0 && time_power == -1);
+    unitPowers("h_prime_prime", &length_power, &time_power);
+    assert(length_power == 2 && time_power == -4);
+    unitPowers("eta", &length_power, &time_power);
+    assert(length_power == 2 && time_power == -2);
+    unitPowers("d_ncdm[0]", &length_power, &time_power);
+    assert(length_power == 0 && time_power == 0);
+    unitPowers("hubble", &length_power, &time_power);
+    assert(length_power == 0 && time_power == 0);
+    assert(unitConversionFactor("phi_prime", 3.0, 2.0) == 9.0 / 8.0);
+
+    /* Titles must name a dataset in the group of functions */
+    assert(validDatasetName("d_ncdm[0]"));
+    assert(!validDatasetName("phi/psi"));
+    assert(!validDatasetName("."));
+    assert(!validDatasetName(""));
+
+    struct params pars = fixture.pars;
+    pars.Chunking = CHUNK_TAU;
+    pars.ChunkSize = 5;
+    pars.Shuffle = 1;
+    pars.DeflateLevel = 4;
+
+    struct units us = fixture.us;
+    us.UnitTimeSeconds = 1e16;
+
+    real_t *read = malloc(cube_size * sizeof(real_t));
+    real_t *expected = malloc(cube_size * sizeof(real_t));
+
+    for (int layout=0; layout<3; layout++) {
+        pars.Layout = layout;
+
+        hid_t h_file = createOutputFile("test_function_datasets.hdf5", &pars);
+        assert(h_file >= 0);
+        hid_t h_grp = H5Gcreate(h_file, "/Perturb", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        assert(writeFunctionDatasets(h_grp, &data, &pars, &us, NULL, NULL) == 0);
+
+        /* The virtual cube holds all functions in the requested layout */
+        transposeCube(data.delta, expected, layout, n_functions, tau_size, k_size);
+        hid_t h_data = H5Dopen(h_grp, "Transfer functions", H5P_DEFAULT);
+        assert(h_data >= 0);
+        hid_t h_prop = H5Dget_create_plist(h_data);
+        assert(H5Pget_layout(h_prop) == H5D_VIRTUAL);
+        H5Pclose(h_prop);
+        assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+        assert(memcmp(read, expected, cube_size * sizeof(real_t)) == 0);
+        H5Dclose(h_data);
+
+        /* Every function can be read on its own */
+        h_data = H5Dopen(h_grp, "Functions/phi", H5P_DEFAULT);
+        assert(h_data >= 0);
+        hid_t h_space = H5Dget_space(h_data);
+        hsize_t dims[2];
+        assert(H5Sget_simple_extent_dims(h_space, dims, NULL) == 2);
+        H5Sclose(h_space);
+        if (layout == LAYOUT_FKT) {
+            assert(dims[0] == k_size && dims[1] == tau_size);
+        } else {
+            assert(dims[0] == tau_size && dims[1] == k_size);
+        }
+        assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+        transposeCube(data.delta + slab_size, expected, layout == LAYOUT_FKT ? LAYOUT_FKT : LAYOUT_FTK,
+                      1, tau_size, k_size);
+        assert(memcmp(read, expected, slab_size * sizeof(real_t)) == 0);
+
+        /* Its attributes */
+        int index = -1;
+        hid_t h_attr = H5Aopen(h_data, "Index", H5P_DEFAULT);
+        assert(H5Aread(h_attr, H5T_NATIVE_INT, &index) >= 0);
+        assert(index == 1);
+        H5Aclose(h_attr);
+
+        char units_read[DEFAULT_STRING_LENGTH] = {0};
+        h_attr = H5Aopen(h_data, "Units", H5P_DEFAULT);
+        hid_t h_type = H5Aget_type(h_attr);
+        assert(H5Aread(h_attr, h_type, units_read) >= 0);
+        assert(strcmp(units_read, "U_L^2 U_t^-2") == 0);
+        H5Tclose(h_type);
+        H5Aclose(h_attr);
+
+        double to_cgs = 0;
+        h_attr = H5Aopen(h_data, "Conversion factor to cgs", H5P_DEFAULT);
+        assert(H5Aread(h_attr, H5T_NATIVE_DOUBLE, &to_cgs) >= 0);
+        assert(fabs(to_cgs / pow(MPC_METRES * 100 / 1e16, 2) - 1) < 1e-12);
+        H5Aclose(h_attr);
+
+        h_attr = H5Aopen(h_data, "Omega", H5P_DEFAULT);
+        assert(H5Aread(h_attr, H5T_NATIVE_REAL, read) >= 0);
+        assert(memcmp(read, data.Omega + tau_size, tau_size * sizeof(real_t)) == 0);
+        H5Aclose(h_attr);
+        H5Dclose(h_data);
+
+        H5Gclose(h_grp);
+        H5Fclose(h_file);
+    }
+
+    /* A function that cannot be stored fails the write, and the incomplete
+     * file is removed */
+    fixture.entries[1].title = "phi/psi";
+    pars.Layout = LAYOUT_FTK;
+    pars.FunctionDatasets = 1;
+    assert(write_perturb(&data, &pars, &us, "test_function_datasets.hdf5") != 0);
+    assert(access("test_function_datasets.hdf5", F_OK) != 0);
+
+    free(read);
+    free(expected);
+    cleanTestData(&fixture);
+
+    sucmsg("test_function_datasets:\t SUCCESS");
+}
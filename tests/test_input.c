@@ -29,6 +29,19 @@ int main() {
     assert(strcmp(pars.DesiredFunctions[5], "test1") == 0);
     assert(strcmp(pars.DesiredFunctions[6], "test2") == 0);
 
+    /* Test the lossy settings of single functions, skipping invalid ones */
+    assert(pars.LossyMode == LOSSY_RELATIVE);
+    assert(pars.LossyErrorBound == 1e-5);
+    assert(pars.NumLossyBounds == 3);
+    assert(strcmp(pars.LossyBoundTitles[0], "t_cdm") == 0);
+    assert(pars.LossyBoundModes[0] == LOSSY_RELATIVE);
+    assert(pars.LossyBounds[0] == 1e-4);
+    assert(strcmp(pars.LossyBoundTitles[1], "phi") == 0);
+    assert(pars.LossyBoundModes[1] == LOSSY_ABSOLUTE);
+    assert(pars.LossyBounds[1] == 1e-8);
+    assert(strcmp(pars.LossyBoundTitles[2], "d_b") == 0);
+    assert(pars.LossyBoundModes[2] == LOSSY_NONE);
+
     /* Test reading units */
     struct units us;
     readUnits(&us, fname);
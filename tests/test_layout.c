@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "../include/classex.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    /* Odd sizes, so that the tiles do not divide the cube evenly */
+    const size_t n_functions = 5;
+    const size_t tau_size = 71;
+    const size_t k_size = 45;
+    const size_t cube_size = n_functions * tau_size * k_size;
+
+    /* Test parsing the layout names */
+    assert(parseLayout("ftk") == LAYOUT_FTK);
+    assert(parseLayout("FKT") == LAYOUT_FKT);
+    assert(parseLayout("tkf") == LAYOUT_TKF);
+    assert(parseLayout("kft") == -1);
+    assert(strcmp(layoutName(LAYOUT_TKF), "tkf") == 0);
+
+    /* Fill a cube [function][tau][k] with distinct values */
+    real_t *delta = malloc(cube_size * sizeof(real_t));
+    real_t *out = malloc(cube_size * sizeof(real_t));
+    for (size_t i=0; i<cube_size; i++) {
+        delta[i] = (real_t) i;
+    }
+
+    /* Test the [function][k][tau] layout */
+    size_t shape[3];
+    layoutShape(LAYOUT_FKT, n_functions, tau_size, k_size, shape);
+    assert(shape[0] == n_functions && shape[1] == k_size && shape[2] == tau_size);
+    assert(transposeCube(delta, out, LAYOUT_FKT, n_functions, tau_size, k_size) == 0);
+    for (size_t f=0; f<n_functions; f++) {
+        for (size_t t=0; t<tau_size; t++) {
+            for (size_t k=0; k<k_size; k++) {
+                real_t expected = delta[f * tau_size * k_size + t * k_size + k];
+                assert(out[f * k_size * tau_size + k * tau_size + t] == expected);
+            }
+        }
+    }
+
+    /* Test the [tau][k][function] layout */
+    layoutShape(LAYOUT_TKF, n_functions, tau_size, k_size, shape);
+    assert(shape[0] == tau_size && shape[1] == k_size && shape[2] == n_functions);
+    assert(transposeCube(delta, out, LAYOUT_TKF, n_functions, tau_size, k_size) == 0);
+    for (size_t f=0; f<n_functions; f++) {
+        for (size_t t=0; t<tau_size; t++) {
+            for (size_t k=0; k<k_size; k++) {
+                real_t expected = delta[f * tau_size * k_size + t * k_size + k];
+                assert(out[t * k_size * n_functions + k * n_functions + f] == expected);
+            }
+        }
+    }
+
+    /* The default layout is just a copy */
+    assert(transposeCube(delta, out, LAYOUT_FTK, n_functions, tau_size, k_size) == 0);
+    assert(memcmp(delta, out, cube_size * sizeof(real_t)) == 0);
+
+    free(delta);
+    free(out);
+
+    sucmsg("test_layout:\t SUCCESS");
+}
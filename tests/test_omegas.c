@@ -18,6 +18,7 @@ int main() {
     struct units us;
     struct class_titles titles;
     struct perturb_data data;
+    struct extraction_plan plan;
 
     readParams(&pars, fname);
     readUnits(&us, fname);
@@ -57,14 +58,18 @@ int main() {
     assert(initClassTitles(&titles, &pt, &ba) == 0);
     /* Match titles */
     assert(matchClassTitles(&titles, &pars) == 0);
+
+
+    /* Compile the extraction plan */
+    assert(compileExtractionPlan(&plan, &pars, &titles, &us, &pt) == 0);
     /* Clean up the dictionary */
     assert(cleanClassTitles(&titles) == 0);
 
-
     /* Read perturb data */
-    assert(readPerturbData(&data, &pars, &us, &pt, &ba) == 0);
+    assert(readPerturbData(&data, &pars, &plan, &us, &pt, &ba) == 0);
 
-    assert(data.n_functions == pars.MatchedFunctions);
+    assert(data.n_functions == plan.n_entries);
+    assert(plan.n_class == pars.MatchedFunctions);
     assert(data.k_size > 100);
     assert(data.tau_size > 100);
 
@@ -76,8 +81,9 @@ int main() {
         assert(data.log_tau[i] > data.log_tau[i-1]);
     }
 
-    /* Check that the perturbations are all non-zero */
-    for (int i=0; i<data.k_size * data.tau_size * data.n_functions; i++) {
+    /* Check that the perturbations are all non-zero (derivatives are not
+     * computed yet) */
+    for (int i=0; i<data.k_size * data.tau_size * plan.n_class; i++) {
         assert(data.delta[i] != 0);
     }
 
@@ -114,6 +120,7 @@ int main() {
 
     /* Clean perturb data */
     assert(cleanPerturbData(&data) == 0);
+    assert(cleanExtractionPlan(&plan) == 0);
 
 
 
@@ -18,6 +18,7 @@ int main() {
     struct units us;
     struct class_titles titles;
     struct perturb_data data;
+    struct extraction_plan plan;
 
     readParams(&pars, fname);
     readUnits(&us, fname);
@@ -57,11 +58,14 @@ int main() {
     assert(initClassTitles(&titles, &pt, &ba) == 0);
     /* Match titles */
     assert(matchClassTitles(&titles, &pars) == 0);
+
+    /* Compile the extraction plan */
+    assert(compileExtractionPlan(&plan, &pars, &titles, &us, &pt) == 0);
     /* Clean up the dictionary */
     assert(cleanClassTitles(&titles) == 0);
 
     /* Read perturb data */
-    assert(readPerturbData(&data, &pars, &us, &pt, &ba) == 0);
+    assert(readPerturbData(&data, &pars, &plan, &us, &pt, &ba) == 0);
 
     /* Compute derivatives */
     assert(computeDerivatives(&data, &pars, &us) == 0);
@@ -170,7 +174,7 @@ int main() {
 
     printf("We found %lld (%d) titles\n", dims[0], ndims);
     assert(ndims == 1);
-    assert(dims[0] == pars.MatchedFunctions);
+    assert(dims[0] == data.n_functions);
 
     /* Read the titles */
     h_err = H5Aread(h_attr, h_tp, read_titles);
@@ -252,6 +256,7 @@ int main() {
 
     /* Clean perturb data (both the generated and the read data)*/
     assert(cleanPerturbData(&data) == 0);
+    assert(cleanExtractionPlan(&plan) == 0);
     assert(cleanPerturbData(&read_data) == 0);
 
     printf("\nShutting CLASS down again.\n");
@@ -0,0 +1,48 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "../include/classex.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    /* Without MPI, there is a single rank */
+    assert(parallelRank() == 0);
+    assert(parallelSize() == 1);
+    assert(maxOverRanks(7) == 7);
+
+    /* The ranges of the ranks cover all functions exactly once, in order,
+     * and differ in size by at most one */
+    for (int size=1; size<=8; size++) {
+        for (int n_functions=0; n_functions<20; n_functions++) {
+            int next = 0;
+            for (int rank=0; rank<size; rank++) {
+                int first, count;
+                functionRange(n_functions, rank, size, &first, &count);
+                assert(first == next);
+                assert(count == n_functions / size || count == n_functions / size + 1);
+                next = first + count;
+            }
+            assert(next == n_functions);
+        }
+    }
+
+    /* The first ranks take the remainder */
+    int first, count;
+    functionRange(10, 0, 3, &first, &count);
+    assert(first == 0 && count == 4);
+    functionRange(10, 2, 3, &first, &count);
+    assert(first == 7 && count == 3);
+
+    /* Without MPI, the default transfer properties are used */
+    hid_t h_xfer = createTransferProperties();
+    assert(h_xfer == H5P_DEFAULT);
+    closeTransferProperties(h_xfer);
+
+    sucmsg("test_parallel:\t SUCCESS");
+}
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+#define N_BLOCKS 1000
+#define BLOCK_SIZE 64
+
+/* The consumer checks that the blocks arrive complete and in order */
+static void *consumer(void *arg) {
+    struct block_queue *q = arg;
+    double wait_time = 0;
+    int expected = 0;
+
+    while (1) {
+        struct queued_block *b = queuePeek(q, &wait_time);
+        if (b->count == 0) {
+            queueRelease(q);
+            break;
+        }
+
+        assert(b->first == expected);
+        for (int i=0; i<BLOCK_SIZE; i++) {
+            assert(b->data[i] == (real_t) (b->first * BLOCK_SIZE + i));
+        }
+
+        /* The producer can never get more than the capacity ahead */
+        size_t filled = atomic_load(&q->tail) - atomic_load(&q->head);
+        assert(filled >= 1 && filled <= q->capacity);
+
+        expected++;
+        queueRelease(q);
+    }
+
+    assert(expected == N_BLOCKS);
+    return NULL;
+}
+
+/* Read the transfer function cube of a file */
+static void readCube(const char *fname, real_t *cube) {
+    hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    assert(h_file >= 0);
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, cube) >= 0);
+    H5Dclose(h_data);
+    H5Fclose(h_file);
+}
+
+int main() {
+    const size_t capacities[3] = {1, 2, 5};
+
+    for (int c=0; c<3; c++) {
+        struct block_queue q;
+        assert(initBlockQueue(&q, capacities[c], BLOCK_SIZE) == 0);
+
+        pthread_t thread;
+        assert(pthread_create(&thread, NULL, consumer, &q) == 0);
+
+        double wait_time = 0;
+        for (int n=0; n<N_BLOCKS; n++) {
+            struct queued_block *b = queueReserve(&q, &wait_time);
+            for (int i=0; i<BLOCK_SIZE; i++) {
+                b->data[i] = n * BLOCK_SIZE + i;
+            }
+            b->first = n;
+            b->count = 1;
+            queuePublish(&q);
+        }
+
+        /* Mark the end of the stream */
+        struct queued_block *b = queueReserve(&q, &wait_time);
+        b->count = 0;
+        queuePublish(&q);
+
+        assert(pthread_join(thread, NULL) == 0);
+        assert(atomic_load(&q.head) == N_BLOCKS + 1);
+        assert(atomic_load(&q.tail) == N_BLOCKS + 1);
+        assert(atomic_load(&q.error) == 0);
+
+        cleanBlockQueue(&q);
+        assert(q.slots == NULL);
+    }
+
+    /* Streaming output, computing the functions from fake CLASS sources */
+    const int n_functions = 5;
+    const int tau_size = 37;
+    const int k_size = 11;
+    const size_t slab_size = tau_size * k_size;
+    const size_t cube_size = n_functions * slab_size;
+
+    char *titles[5] = {"d_cdm", "phi", "t_cdm", "d_b", "psi"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    free(fixture.data.delta);
+    fixture.data.delta = NULL;
+    struct perturb_data data = fixture.data;
+
+    double *sources = malloc(cube_size * sizeof(double));
+    for (size_t i=0; i<cube_size; i++) {
+        sources[i] = sin(0.01 * i) + 0.001 * i;
+    }
+    for (int i=0; i<n_functions; i++) {
+        fixture.entries[i].source = sources + i * slab_size;
+        fixture.entries[i].scale = 1.0 + 0.1 * i;
+        fixture.entries[i].ba_index = -1;
+        fixture.entries[i].offset = i * slab_size;
+    }
+    fixture.plan.n_class = n_functions;
+    fixture.plan.n_total = n_functions;
+    fixture.plan.k_size = k_size;
+    fixture.plan.tau_size = tau_size;
+    fixture.plan.k = data.k;
+
+    /* The functions as they should end up in the file, before reordering,
+     * computed in the same order as the extraction, which gives the same
+     * result with or without vectorization */
+    real_t *expected = malloc(cube_size * sizeof(real_t));
+    real_t *transposed = malloc(cube_size * sizeof(real_t));
+    real_t *sequential = malloc(cube_size * sizeof(real_t));
+    real_t *pipelined = malloc(cube_size * sizeof(real_t));
+    for (size_t i=0; i<cube_size; i++) {
+        const double k = data.k[i % k_size];
+        expected[i] = (real_t) (-sources[i] / k / k * fixture.entries[i / slab_size].scale);
+    }
+
+    /* A budget of three functions and the workspace, so that there are
+     * several blocks with and without the pipeline */
+    struct params pars = fixture.pars;
+    pars.MemoryBudgetMB = (3 * sizeof(real_t) + sizeof(double)) * slab_size
+                          / (1024. * 1024.);
+    pars.PipelineDepth = 2;
+
+    /* The pipelined file is identical to the sequential one, in every layout
+     * and with and without compression */
+    for (int deflate=0; deflate<2; deflate++) {
+        for (int layout=0; layout<3; layout++) {
+            pars.Layout = layout;
+            pars.Chunking = deflate ? CHUNK_TAU : CHUNK_NONE;
+            pars.ChunkSize = 8;
+            pars.Shuffle = deflate;
+            pars.DeflateLevel = 4 * deflate;
+
+            pars.Pipeline = 0;
+            assert(streamingBlockSize(&data, &pars) < n_functions);
+            assert(write_perturb(&data, &pars, &fixture.us, "test_pipeline_sequential.hdf5") == 0);
+            pars.Pipeline = 1;
+            assert(streamingBlockSize(&data, &pars) < n_functions);
+            assert(write_perturb(&data, &pars, &fixture.us, "test_pipeline.hdf5") == 0);
+
+            readCube("test_pipeline_sequential.hdf5", sequential);
+            readCube("test_pipeline.hdf5", pipelined);
+            transposeCube(expected, transposed, layout, n_functions, tau_size, k_size);
+            assert(memcmp(sequential, layout == LAYOUT_FTK ? expected : transposed,
+                          cube_size * sizeof(real_t)) == 0);
+            assert(memcmp(pipelined, sequential, cube_size * sizeof(real_t)) == 0);
+        }
+    }
+
+    remove("test_pipeline_sequential.hdf5");
+    remove("test_pipeline.hdf5");
+
+    free(expected);
+    free(transposed);
+    free(sequential);
+    free(pipelined);
+    free(sources);
+    cleanTestData(&fixture);
+
+    sucmsg("test_pipeline:\t SUCCESS");
+}
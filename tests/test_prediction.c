@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "../include/classex.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    const size_t n_functions = 3;
+    const size_t tau_size = 200;
+    const size_t k_size = 40;
+    const size_t cube_size = n_functions * tau_size * k_size;
+    const size_t slab_size = tau_size * k_size;
+
+    /* Test parsing the prediction modes */
+    assert(parsePrediction("none") == PREDICT_NONE);
+    assert(parsePrediction("Linear") == PREDICT_LINEAR);
+    assert(parsePrediction("quadratic") == PREDICT_QUADRATIC);
+    assert(parsePrediction("cubic") == -1);
+    assert(strcmp(predictionName(PREDICT_QUADRATIC), "quadratic") == 0);
+
+    /* Fill a cube with functions that are smooth in tau, with both signs */
+    double *delta = malloc(cube_size * sizeof(double));
+    double *read = malloc(cube_size * sizeof(double));
+    for (size_t f=0; f<n_functions; f++) {
+        for (size_t t=0; t<tau_size; t++) {
+            double tau = exp(0.01 * t);
+            for (size_t k=0; k<k_size; k++) {
+                double kk = 1e-3 * exp(0.2 * k);
+                delta[f * slab_size + t * k_size + k] = (f % 2 ? -1.0 : 1.0) * (f + 1.0)
+                    * kk * kk * tau * tau / (1.0 + kk * kk * tau);
+            }
+        }
+    }
+
+    /* Encode and decode one [tau][k] chunk directly, in both precisions */
+    const size_t nbytes = slab_size * sizeof(double);
+    const size_t bound = predictiveBound(nbytes);
+    unsigned char *encoded = malloc(bound);
+    float *single = malloc(slab_size * sizeof(float));
+    float *single_read = malloc(slab_size * sizeof(float));
+    for (size_t i=0; i<slab_size; i++) {
+        single[i] = delta[i];
+    }
+
+    unsigned int cd_values[PREDICT_CD_MAX] = {PREDICT_LINEAR, 0, 6, 8, 2, tau_size, k_size};
+    const size_t cd_nelmts = PREDICT_CD_DIMS + 2;
+
+    size_t encoded_size[3] = {0, 0, 0};
+    const int modes[2] = {PREDICT_LINEAR, PREDICT_QUADRATIC};
+    for (int m=0; m<2; m++) {
+        cd_values[PREDICT_CD_MODE] = modes[m];
+        cd_values[PREDICT_CD_SIZE] = 8;
+        size_t size = predictiveEncode(cd_nelmts, cd_values, delta, nbytes, encoded, bound);
+        assert(size > 0 && size < nbytes);
+        encoded_size[m] = size;
+
+        memset(read, 0, nbytes);
+        assert(predictiveDecode(cd_nelmts, cd_values, encoded, size, read, nbytes) == nbytes);
+        assert(memcmp(delta, read, nbytes) == 0);
+
+        cd_values[PREDICT_CD_SIZE] = 4;
+        size = predictiveEncode(cd_nelmts, cd_values, single, nbytes / 2, encoded, bound);
+        assert(size > 0 && size < nbytes / 2);
+        assert(predictiveDecode(cd_nelmts, cd_values, encoded, size, single_read,
+                                nbytes / 2) == nbytes / 2);
+        assert(memcmp(single, single_read, nbytes / 2) == 0);
+    }
+
+    /* The prediction along tau should beat plain shuffle and deflate */
+    unsigned char *shuffled = malloc(nbytes);
+    const unsigned char *bytes = (const unsigned char *) delta;
+    for (size_t j=0; j<sizeof(double); j++) {
+        for (size_t i=0; i<slab_size; i++) {
+            shuffled[j * slab_size + i] = bytes[i * sizeof(double) + j];
+        }
+    }
+    uLongf deflate_size = bound;
+    assert(compress2(encoded, &deflate_size, shuffled, nbytes, 6) == Z_OK);
+    encoded_size[2] = deflate_size;
+    printf("Chunk of %zu bytes: shuffle+deflate %zu, linear %zu, quadratic %zu.\n",
+           nbytes, encoded_size[2], encoded_size[0], encoded_size[1]);
+    assert(encoded_size[0] < 0.9 * encoded_size[2]);
+    assert(encoded_size[1] < 0.9 * encoded_size[2]);
+
+    /* Corrupt or inconsistent input is rejected */
+    assert(predictiveDecode(cd_nelmts, cd_values, shuffled, 100, read, nbytes) == 0);
+    assert(predictiveEncode(cd_nelmts, cd_values, delta, nbytes - 8, encoded, bound) == 0);
+
+    /* Now use the filter through HDF5, in all layouts and in the precision
+     * of the build */
+    struct params pars;
+    memset(&pars, 0, sizeof(struct params));
+    pars.Chunking = CHUNK_TAU;
+    pars.ChunkSize = 0;
+    pars.DeflateLevel = 6;
+    pars.Prediction = PREDICT_QUADRATIC;
+
+    hid_t h_file = H5Fcreate("test_prediction.hdf5", H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    assert(h_file >= 0);
+
+    const int layouts[3] = {LAYOUT_FTK, LAYOUT_FKT, LAYOUT_TKF};
+    const char *names[3] = {"ftk", "fkt", "tkf"};
+    real_t *cube = malloc(cube_size * sizeof(real_t));
+    real_t *transposed = malloc(cube_size * sizeof(real_t));
+    real_t *stored = malloc(cube_size * sizeof(real_t));
+    for (size_t i=0; i<cube_size; i++) {
+        cube[i] = delta[i];
+    }
+    for (int l=0; l<3; l++) {
+        pars.Layout = layouts[l];
+        transposeCube(cube, transposed, pars.Layout, n_functions, tau_size, k_size);
+
+        size_t shape_layout[3];
+        layoutShape(pars.Layout, n_functions, tau_size, k_size, shape_layout);
+        hsize_t shape[3] = {shape_layout[0], shape_layout[1], shape_layout[2]};
+        hid_t h_space = H5Screate_simple(3, shape, NULL);
+        hid_t h_prop = createCubeProperties(&pars, tau_size, k_size);
+        assert(H5Pget_nfilters(h_prop) == 1);
+
+        /* Through the HDF5 filter pipeline */
+        hid_t h_data = H5Dcreate(h_file, names[l], H5T_NATIVE_REAL, h_space,
+                                 H5P_DEFAULT, h_prop, H5P_DEFAULT);
+        assert(h_data >= 0);
+        assert(H5Dwrite(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                        transposed) >= 0);
+        hsize_t filter_size = H5Dget_storage_size(h_data);
+        assert(filter_size < cube_size * sizeof(real_t));
+
+        memset(stored, 0, cube_size * sizeof(real_t));
+        assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, stored) >= 0);
+        assert(memcmp(transposed, stored, cube_size * sizeof(real_t)) == 0);
+        H5Dclose(h_data);
+
+        /* With chunks that are encoded in parallel, the result is identical */
+        char name[20];
+        sprintf(name, "%s direct", names[l]);
+        h_data = H5Dcreate(h_file, name, H5T_NATIVE_REAL, h_space,
+                           H5P_DEFAULT, h_prop, H5P_DEFAULT);
+        assert(useDirectChunkWrites(h_data, &pars));
+        hsize_t start[3] = {0, 0, 0};
+        assert(writeChunksParallel(h_data, &pars, transposed, shape, start) == 0);
+        assert(H5Dget_storage_size(h_data) == filter_size);
+
+        memset(stored, 0, cube_size * sizeof(real_t));
+        assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, stored) >= 0);
+        assert(memcmp(transposed, stored, cube_size * sizeof(real_t)) == 0);
+        H5Dclose(h_data);
+
+        H5Pclose(h_prop);
+        H5Sclose(h_space);
+    }
+
+    /* The predictive filter replaces shuffle, even if that was requested */
+    pars.Shuffle = 1;
+    hid_t h_data = H5Dopen(h_file, "ftk", H5P_DEFAULT);
+    assert(writeCompressionAttributes(h_data, &pars, tau_size, k_size) == 0);
+    int shuffle = -1;
+    hid_t h_attr = H5Aopen(h_data, "Shuffle", H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_INT, &shuffle) >= 0);
+    assert(shuffle == 0);
+    H5Aclose(h_attr);
+    H5Dclose(h_data);
+
+    H5Fclose(h_file);
+
+    free(delta);
+    free(read);
+    free(cube);
+    free(transposed);
+    free(stored);
+    free(encoded);
+    free(shuffled);
+    free(single);
+    free(single_read);
+
+    sucmsg("test_prediction:\t SUCCESS");
+}
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+int main() {
+    const char fname[] = "test_raw.raw";
+
+    /* Odd sizes, so that the arrays are not naturally aligned */
+    const int n_functions = 3;
+    const int tau_size = 13;
+    const int k_size = 7;
+    const size_t slab_size = tau_size * k_size;
+
+    /* Test parsing the format names */
+    assert(parseOutputFormat("hdf5") == FORMAT_HDF5);
+    assert(parseOutputFormat("RAW") == FORMAT_RAW);
+    assert(parseOutputFormat("fits") == -1);
+    assert(strcmp(outputFormatName(FORMAT_RAW), "raw") == 0);
+
+    /* Perturbation data with distinct values */
+    char *titles[3] = {"d_cdm", "phi", "t_ncdm[0]_prime_prime"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    struct perturb_data data = fixture.data;
+    struct units us = fixture.us;
+
+    struct params pars = fixture.pars;
+    pars.N_ncdm = 1;
+    double M_ncdm = 0.06, T_ncdm = 0.71611;
+    pars.M_ncdm_eV = &M_ncdm;
+    pars.T_ncdm = &T_ncdm;
+
+    /* Write and map the file in every layout */
+    for (int layout=0; layout<3; layout++) {
+        pars.Layout = layout;
+        assert(write_raw(&data, &pars, &us, (char *) fname) == 0);
+
+        struct raw_perturb raw;
+        assert(openRawPerturb(&raw, fname) == 0);
+        const struct raw_header *h = raw.header;
+        assert(h->real_size == sizeof(real_t));
+        assert(h->layout == layout);
+        assert(h->n_functions == n_functions);
+        assert(h->tau_size == tau_size && h->k_size == k_size);
+        assert(h->n_ncdm == 1);
+        assert(h->h == 0.67);
+        assert(fabs(h->unit_length_cgs - MPC_METRES * 100) < 1e-6 * MPC_METRES);
+        assert(strcmp(h->name, "Test") == 0);
+
+        /* All arrays are aligned in memory */
+        for (int i=0; i<RAW_N_ARRAYS; i++) {
+            assert((uintptr_t) rawArray(&raw, i) % RAW_ALIGNMENT == 0);
+        }
+
+        /* The titles */
+        assert(h->title_length % 8 == 0);
+        for (int i=0; i<n_functions; i++) {
+            assert(strcmp(rawTitle(&raw, i), titles[i]) == 0);
+        }
+        assert(rawFindFunction(&raw, "phi") == 1);
+        assert(rawFindFunction(&raw, "psi") == -1);
+
+        /* The vectors */
+        const double *k = rawArray(&raw, RAW_K);
+        for (int i=0; i<k_size; i++) {
+            assert(k[i] == data.k[i]);
+        }
+        for (int j=0; j<9; j++) {
+            const double *v = rawArray(&raw, RAW_LOG_TAU + j);
+            for (int i=0; i<tau_size; i++) {
+                assert(v[i] == testBackground(&data, j)[i]);
+            }
+        }
+        assert(((const double *) rawArray(&raw, RAW_M_NCDM))[0] == M_ncdm);
+        assert(((const double *) rawArray(&raw, RAW_T_NCDM))[0] == T_ncdm);
+        const real_t *Omega = rawArray(&raw, RAW_OMEGA);
+        for (int i=0; i<n_functions * tau_size; i++) {
+            assert(Omega[i] == data.Omega[i]);
+        }
+
+        /* The transfer functions, in the requested layout */
+        for (int f=0; f<n_functions; f++) {
+            for (int t=0; t<tau_size; t++) {
+                for (int i=0; i<k_size; i++) {
+                    real_t T = data.delta[f * slab_size + t * k_size + i];
+                    assert(rawTransferValue(&raw, f, t, i) == T);
+                }
+            }
+        }
+
+        closeRawPerturb(&raw);
+        assert(raw.map == NULL);
+    }
+
+    /* Files that are not raw files are refused */
+    FILE *f = fopen(fname, "r+");
+    fputc('X', f);
+    fclose(f);
+    struct raw_perturb raw;
+    assert(openRawPerturb(&raw, fname) != 0);
+    assert(openRawPerturb(&raw, "does_not_exist.raw") != 0);
+
+    cleanTestData(&fixture);
+
+    sucmsg("test_raw:\t SUCCESS");
+}
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "../include/classex.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+/* A polynomial of degree n in tau, times a different amplitude for each k */
+static inline double poly(double tau, int n, double amp) {
+    return amp * (1.0 + 0.5 * pow(tau, n) - 0.25 * tau);
+}
+
+static inline double poly_prime(double tau, int n, double amp) {
+    return amp * (0.5 * n * pow(tau, n - 1) - 0.25);
+}
+
+int main() {
+    const size_t Ntau = 40;
+    const size_t Nk = 13;
+
+    /* Logarithmically spaced (non-uniform) conformal times */
+    double *tau = malloc(Ntau * sizeof(double));
+    for (size_t i=0; i<Ntau; i++) {
+        tau[i] = 0.1 * exp(i * 0.05);
+    }
+
+    double *T = malloc(Ntau * Nk * sizeof(double));
+    double *dT = malloc(Ntau * Nk * sizeof(double));
+
+    /* A stencil of order p differentiates polynomials of degree p exactly */
+    for (int order = 2; order <= 4; order += 2) {
+        struct fd_stencil st;
+        assert(initStencil(&st, tau, Ntau, order) == 0);
+        assert(st.width == order + 1);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nk; k++) {
+                T[i * Nk + k] = poly(tau[i], order, k + 1.0);
+            }
+        }
+
+        differentiateFunction(&st, T, dT, Nk, NULL);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nk; k++) {
+                double expected = poly_prime(tau[i], order, k + 1.0);
+                assert(fabs(dT[i * Nk + k] - expected) < 1e-8 * fabs(expected) + 1e-10);
+            }
+        }
+
+        assert(cleanStencil(&st) == 0);
+    }
+
+    /* Cumulative integrals of order p integrate polynomials of degree p - 1
+     * exactly. Take the derivative of a polynomial of degree p. */
+    double *I = malloc(Ntau * Nk * sizeof(double));
+    for (int order = 2; order <= 4; order += 2) {
+        struct fd_stencil st;
+        assert(initIntegralStencil(&st, tau, Ntau, order) == 0);
+        assert(st.width == order);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nk; k++) {
+                T[i * Nk + k] = poly_prime(tau[i], order, k + 1.0);
+            }
+        }
+
+        integrateFunction(&st, T, I, Nk);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nk; k++) {
+                double expected = poly(tau[i], order, k + 1.0) - poly(tau[0], order, k + 1.0);
+                assert(fabs(I[i * Nk + k] - expected) < 1e-10 * (fabs(expected) + 1.0));
+            }
+        }
+
+        assert(cleanStencil(&st) == 0);
+    }
+    free(I);
+
+    /* Logarithmic slopes along k, with stencils in x = ln(k) */
+    const size_t Nx = 30;
+    double *log_k = malloc(Nx * sizeof(double));
+    for (size_t i=0; i<Nx; i++) {
+        log_k[i] = -3.0 + 0.2 * i + 0.01 * i * i;
+    }
+
+    double *F = malloc(Ntau * Nx * sizeof(double));
+    double *slope = malloc(Ntau * Nx * sizeof(double));
+
+    for (int order = 2; order <= 4; order += 2) {
+        struct fd_stencil st;
+        assert(initStencil(&st, log_k, Nx, order) == 0);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nx; k++) {
+                F[i * Nx + k] = poly(log_k[k], order, i + 1.0);
+            }
+        }
+
+        assert(logarithmicSlope(&st, F, slope, Ntau) == 0);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nx; k++) {
+                double expected = poly_prime(log_k[k], order, i + 1.0)
+                                / poly(log_k[k], order, i + 1.0);
+                assert(fabs(slope[i * Nx + k] - expected) < 1e-8 * fabs(expected) + 1e-10);
+            }
+        }
+
+        assert(cleanStencil(&st) == 0);
+    }
+
+    /* A function that crosses zero, where the slope is set to 0 */
+    const size_t k_zero = 10;
+    for (int order = 2; order <= 4; order += 2) {
+        struct fd_stencil st;
+        assert(initStencil(&st, log_k, Nx, order) == 0);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nx; k++) {
+                F[i * Nx + k] = (i + 1.0) * (log_k[k] - log_k[k_zero]);
+            }
+        }
+
+        assert(logarithmicSlope(&st, F, slope, Ntau) == Ntau);
+
+        for (size_t i=0; i<Ntau; i++) {
+            for (size_t k=0; k<Nx; k++) {
+                if (k == k_zero) {
+                    assert(slope[i * Nx + k] == 0.);
+                } else {
+                    double expected = 1.0 / (log_k[k] - log_k[k_zero]);
+                    assert(fabs(slope[i * Nx + k] - expected) < 1e-8 * fabs(expected));
+                }
+            }
+        }
+
+        assert(cleanStencil(&st) == 0);
+    }
+
+    free(log_k);
+    free(F);
+    free(slope);
+
+    /* With too few time steps, the order is reduced */
+    struct fd_stencil st;
+    assert(initStencil(&st, tau, 3, 4) == 0);
+    assert(st.order == 2);
+    assert(cleanStencil(&st) == 0);
+
+    free(tau);
+    free(T);
+    free(dT);
+
+    sucmsg("test_stencil:\t SUCCESS");
+}
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../include/classex.h"
+#include "fixture.h"
+
+static inline void sucmsg(const char *msg) {
+    printf("%s%s%s\n\n", TXT_GREEN, msg, TXT_RESET);
+}
+
+/* The test value of function f at time t and wavenumber k */
+static inline real_t testValue(int f, int t, int k) {
+    return 1000 * f + 10 * t + 0.5 * k;
+}
+
+/* Follow the file while it is written in SWMR mode, as a reader would, and
+ * check that the announced times can be read and never go back */
+static int followFile(const char *fname, int n_functions, int tau_size, int k_size) {
+    H5Eset_auto(H5E_DEFAULT, NULL, NULL);
+    hid_t h_fapl = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_libver_bounds(h_fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+
+    /* The file can only be opened once the writer has started SWMR mode */
+    hid_t h_file = -1;
+    for (int i = 0; i < 10000 && h_file < 0; i++) {
+        h_file = H5Fopen(fname, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, h_fapl);
+        if (h_file < 0) usleep(1000);
+    }
+    H5Pclose(h_fapl);
+    if (h_file < 0) return 1;
+
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    real_t *read = malloc(n_functions * tau_size * k_size * sizeof(real_t));
+    int progress = 0, polls = 0, err = 0;
+
+    while (progress < tau_size && polls++ < 100000 && !err) {
+        int times = 0;
+        H5Drefresh(h_data);
+        hid_t h_attr = H5Aopen(h_data, SWMR_PROGRESS_ATTRIBUTE, H5P_DEFAULT);
+        err |= H5Aread(h_attr, H5T_NATIVE_INT, &times) < 0;
+        H5Aclose(h_attr);
+        err |= times < progress;
+
+        /* Read all functions at the times written so far */
+        if (times > progress && !err) {
+            hsize_t start[3] = {0, 0, 0};
+            hsize_t count[3] = {n_functions, times, k_size};
+            hid_t h_filespace = H5Dget_space(h_data);
+            H5Sselect_hyperslab(h_filespace, H5S_SELECT_SET, start, NULL, count, NULL);
+            hid_t h_memspace = H5Screate_simple(3, count, NULL);
+            err |= H5Dread(h_data, H5T_NATIVE_REAL, h_memspace, h_filespace,
+                           H5P_DEFAULT, read) < 0;
+            H5Sclose(h_memspace);
+            H5Sclose(h_filespace);
+
+            for (int f = 0; f < n_functions && !err; f++) {
+                for (int t = 0; t < times; t++) {
+                    for (int k = 0; k < k_size; k++) {
+                        err |= read[(f * times + t) * k_size + k] != testValue(f, t, k);
+                    }
+                }
+            }
+            progress = times;
+        }
+        usleep(100);
+    }
+
+    free(read);
+    H5Dclose(h_data);
+    H5Fclose(h_file);
+
+    return err || progress != tau_size;
+}
+
+/* Read the cube and its maximum errors from the file fname */
+static void readLossyCube(const char *fname, real_t *cube, double *max_abs,
+                          double *max_rel) {
+    hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    assert(h_file >= 0);
+    hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+    assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, cube) >= 0);
+    hid_t h_attr = H5Aopen(h_data, "Max absolute errors", H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_DOUBLE, max_abs) >= 0);
+    H5Aclose(h_attr);
+    h_attr = H5Aopen(h_data, "Max relative errors", H5P_DEFAULT);
+    assert(H5Aread(h_attr, H5T_NATIVE_DOUBLE, max_rel) >= 0);
+    H5Aclose(h_attr);
+    H5Dclose(h_data);
+    H5Fclose(h_file);
+}
+
+int main() {
+    char fname[] = "test_swmr.hdf5";
+    const int n_functions = 3;
+    const int tau_size = 37;
+    const int k_size = 11;
+    const size_t slab_size = tau_size * k_size;
+    const size_t cube_size = n_functions * slab_size;
+
+    char *titles[3] = {"d_cdm", "phi", "d_b"};
+    struct test_data fixture;
+    makeTestData(&fixture, titles, n_functions, tau_size, k_size);
+    struct perturb_data data = fixture.data;
+    struct units us = fixture.us;
+
+    struct params pars = fixture.pars;
+    pars.SWMR = 1;
+    pars.Chunking = CHUNK_TAU;
+    pars.ChunkSize = 8;
+
+    real_t *read = malloc(cube_size * sizeof(real_t));
+    real_t *expected = malloc(cube_size * sizeof(real_t));
+
+    /* Every layout, with and without compression */
+    for (int deflate=0; deflate<2; deflate++) {
+        for (int layout=0; layout<3; layout++) {
+            for (int f=0; f<n_functions; f++) {
+                for (int t=0; t<tau_size; t++) {
+                    for (int k=0; k<k_size; k++) {
+                        data.delta[(f * tau_size + t) * k_size + k] = testValue(f, t, k);
+                    }
+                }
+            }
+
+            pars.Layout = layout;
+            pars.Shuffle = deflate;
+            pars.DeflateLevel = 4 * deflate;
+            remove(fname);
+
+            /* Follow the first file from another process while writing it */
+            pid_t reader = -1;
+            if (layout == LAYOUT_FTK) {
+                fflush(stdout);
+                reader = fork();
+                assert(reader >= 0);
+                if (reader == 0) {
+                    _exit(followFile(fname, n_functions, tau_size, k_size));
+                }
+            }
+
+            assert(write_perturb(&data, &pars, &us, fname) == 0);
+
+            if (reader > 0) {
+                int status;
+                assert(waitpid(reader, &status, 0) == reader);
+                assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            }
+
+            /* The finished cube holds all times and can still grow */
+            hid_t h_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+            hid_t h_data = H5Dopen(h_file, "/Perturb/Transfer functions", H5P_DEFAULT);
+
+            int times = 0;
+            hid_t h_attr = H5Aopen(h_data, SWMR_PROGRESS_ATTRIBUTE, H5P_DEFAULT);
+            assert(H5Aread(h_attr, H5T_NATIVE_INT, &times) >= 0);
+            assert(times == tau_size);
+            H5Aclose(h_attr);
+
+            hsize_t dims[3], max_dims[3];
+            hid_t h_space = H5Dget_space(h_data);
+            H5Sget_simple_extent_dims(h_space, dims, max_dims);
+            H5Sclose(h_space);
+            assert(dims[tauAxis(layout)] == (hsize_t) tau_size);
+            assert(max_dims[tauAxis(layout)] == H5S_UNLIMITED);
+            assert(max_dims[(layout == LAYOUT_TKF) ? 2 : 0] == H5S_UNLIMITED);
+
+            transposeCube(data.delta, expected, layout, n_functions, tau_size, k_size);
+            assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+            assert(memcmp(read, layout == LAYOUT_FTK ? data.delta : expected,
+                          cube_size * sizeof(real_t)) == 0);
+            H5Dclose(h_data);
+
+            h_data = H5Dopen(h_file, "/Perturb/Omegas", H5P_DEFAULT);
+            assert(H5Dread(h_data, H5T_NATIVE_REAL, H5S_ALL, H5S_ALL, H5P_DEFAULT, read) >= 0);
+            assert(memcmp(read, data.Omega, n_functions * tau_size * sizeof(real_t)) == 0);
+            H5Dclose(h_data);
+
+            H5Fclose(h_file);
+        }
+    }
+
+    /* Without the cube in memory, the functions are extracted one block of
+     * times at a time, and rounded in lossy mode. The result is the same as
+     * streaming them one function at a time without SWMR. */
+    free(fixture.data.delta);
+    fixture.data.delta = NULL;
+    data.delta = NULL;
+
+    double *sources = malloc(cube_size * sizeof(double));
+    for (size_t i=0; i<cube_size; i++) {
+        sources[i] = sin(0.01 * i) + 0.001 * i;
+    }
+    for (int i=0; i<n_functions; i++) {
+        fixture.entries[i].source = sources + i * slab_size;
+        fixture.entries[i].scale = 1.0 + 0.1 * i;
+        fixture.entries[i].ba_index = -1;
+        fixture.entries[i].offset = i * slab_size;
+    }
+    fixture.plan.n_class = n_functions;
+    fixture.plan.n_total = n_functions;
+    fixture.plan.k_size = k_size;
+    fixture.plan.tau_size = tau_size;
+    fixture.plan.k = data.k;
+
+    pars.Layout = LAYOUT_FTK;
+    pars.Shuffle = 1;
+    pars.DeflateLevel = 4;
+    pars.LossyMode = LOSSY_RELATIVE;
+    pars.LossyErrorBound = 1e-4;
+    pars.MemoryBudgetMB = 1024;
+
+    double abs_swmr[3], rel_swmr[3], abs_stream[3], rel_stream[3];
+    remove(fname);
+    assert(write_perturb(&data, &pars, &us, fname) == 0);
+    readLossyCube(fname, read, abs_swmr, rel_swmr);
+    pars.SWMR = 0;
+    assert(write_perturb(&data, &pars, &us, "test_swmr_streaming.hdf5") == 0);
+    readLossyCube("test_swmr_streaming.hdf5", expected, abs_stream, rel_stream);
+
+    assert(memcmp(read, expected, cube_size * sizeof(real_t)) == 0);
+    for (int f=0; f<n_functions; f++) {
+        assert(abs_swmr[f] == abs_stream[f] && abs_swmr[f] > 0);
+        assert(rel_swmr[f] == rel_stream[f] && rel_swmr[f] <= 1e-4);
+    }
+
+    remove(fname);
+    remove("test_swmr_streaming.hdf5");
+
+    free(read);
+    free(expected);
+    free(sources);
+    cleanTestData(&fixture);
+
+    sucmsg("test_swmr:\t SUCCESS");
+}
@@ -16,9 +16,18 @@ redshift = np.array(f["Perturb/Redshifts"]);
 log_tau = np.array(f["Perturb/Log conformal times"]);
 tau = np.exp(log_tau);
 
-#Unpack the transfer functions (N_functions * N_k * N_tau)
+#Unpack the transfer functions (N_functions * N_tau * N_k)
 delta = np.array(f["Perturb/Transfer functions"]);
 
+#Bring the transfer functions back to the default [function][tau][k] layout
+layout = f["Perturb/Transfer functions"].attrs.get("Layout", "ftk");
+if (isinstance(layout, bytes)):
+    layout = layout.decode("utf-8");
+if (layout == "fkt"):
+    delta = np.transpose(delta, (0, 2, 1));
+elif (layout == "tkf"):
+    delta = np.transpose(delta, (2, 0, 1));
+
 #Unpack the background densities
 Omegas = np.array(f["Perturb/Omegas"]);
 